@@ -0,0 +1,187 @@
+#!/bin/bash
+# Uploads files of several sizes through impair-proxy, over a sweep of
+# network profiles, and writes the results as JSON: completion time,
+# throughput, retransmits, and the cpu the client and the server spent per
+# GB. The proxy and its seed are the same for every build, so the results of
+# two builds can be put side by side with --compare. Needs jq for that.
+#
+# usage: ./bench-impaired.sh [--rev git-revision] [--label name] [--sizes "MB ..."]
+#            [--modes "tcp udp ..."] [--profiles file] [--runs n] [--timeout s] > out.json
+#        ./bench-impaired.sh --compare before.json after.json
+#
+# --rev builds fclient and fserver from a commit instead of the working tree.
+# Every line of a profiles file is "name delay jitter loss reorder rate", in
+# ms, ms, %, % and Mbit/s (0 for no cap); the delay is one way. A mode is
+# tcp, udp or compress, which is the tcp upload with --compress. With more
+# than one run, the run of the median time is reported.
+
+PROFILES="loopback 0 0 0 0 0
+lan 0.2 0.05 0 0 1000
+wan 15 2 0.1 0.1 100
+lossy 25 5 2 1 50
+satellite 300 10 0.5 0 20"
+SIZES="1 16"
+MODES="tcp udp"
+RUNS=1
+TIMEOUT=300
+REV=
+LABEL=
+SEED=1
+
+if [ "$1" = "--compare" ]; then
+	[ -f "$2" ] && [ -f "$3" ] || { echo "usage: $0 --compare before.json after.json"; exit 1; }
+	echo "$(jq -r .build "$2") -> $(jq -r .build "$3")"
+	jq -r --slurpfile after "$3" '
+		[.results[] as $b | $after[0].results[] |
+			select(.profile == $b.profile and .mode == $b.mode and .size_mb == $b.size_mb) |
+			[$b.profile, $b.mode, ($b.size_mb | tostring) + "MB",
+				($b.seconds | tostring) + "s", (.seconds | tostring) + "s",
+				(if $b.completed and .completed then
+					(($b.seconds / .seconds * 100 | round) / 100 | tostring) + "x"
+				else "failed" end),
+				($b.retransmits | tostring) + " -> " + (.retransmits | tostring),
+				($b.cpu_s_per_gb.server | tostring) + " -> " + (.cpu_s_per_gb.server | tostring)]] |
+		["profile", "mode", "size", "before", "after", "speedup", "retransmits", "server cpu s/GB"],
+			.[] | @tsv' "$2" |
+		awk -F '\t' '{ printf "%-12s %-9s %-6s %9s %9s %8s %-14s %s\n", $1, $2, $3, $4, $5, $6, $7, $8 }'
+	exit $?
+fi
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+		--rev) REV=$2; shift ;;
+		--label) LABEL=$2; shift ;;
+		--sizes) SIZES=$2; shift ;;
+		--modes) MODES=$2; shift ;;
+		--profiles) PROFILES=$(grep -v '^#' "$2") || exit 1; shift ;;
+		--runs) RUNS=$2; shift ;;
+		--timeout) TIMEOUT=$2; shift ;;
+		*) sed -n '8,10p' "$0" | sed 's/^# //'; exit 1 ;;
+	esac
+	shift
+done
+
+DIR=$(mktemp -d)
+SRC=$(cd "$(dirname "$0")" && pwd)
+SERVER_PID=
+PROXY_PID=
+TICKS=$(getconf CLK_TCK)
+
+cleanup() {
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null
+	[ -n "$PROXY_PID" ] && kill $PROXY_PID 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+mkdir -p "$DIR/client" "$DIR/server" "$DIR/src"
+if [ -n "$REV" ]; then
+	COMMIT=$(git -C "$SRC" rev-parse --short "$REV") || exit 1
+	git -C "$SRC" show "$REV:file-server.c" > "$DIR/src/file-server.c" || exit 1
+	git -C "$SRC" show "$REV:file-client.c" > "$DIR/src/file-client.c" || exit 1
+else
+	COMMIT=$(git -C "$SRC" rev-parse --short HEAD 2>/dev/null)
+	git -C "$SRC" diff --quiet HEAD -- file-client.c file-server.c 2>/dev/null || COMMIT="$COMMIT+"
+	cp "$SRC/file-server.c" "$SRC/file-client.c" "$DIR/src/"
+fi
+LABEL=${LABEL:-${COMMIT:-working tree}}
+gcc -O2 -o "$DIR/server/fserver" "$DIR/src/file-server.c" -pthread >&2 || exit 1
+gcc -O2 -o "$DIR/client/fclient" "$DIR/src/file-client.c" -pthread >&2 || exit 1
+gcc -O2 -o "$DIR/impair-proxy" "$SRC/impair-proxy.c" -pthread -lm >&2 || exit 1
+
+# cpu seconds a process has spent so far
+cpu_of() {
+	awk -v ticks=$TICKS '{ printf "%.3f", ($14 + $15) / ticks }' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+# starts the proxy of a profile, its records of the flows go to proxy.json
+start_proxy() {
+	[ -n "$PROXY_PID" ] && kill $PROXY_PID 2>/dev/null && wait $PROXY_PID 2>/dev/null
+	: > "$DIR/proxy.json"
+	"$DIR/impair-proxy" --delay $1 --jitter $2 --loss $3 --reorder $4 --rate $5 --seed $SEED \
+		>> "$DIR/proxy.json" 2>/dev/null &
+	PROXY_PID=$!
+	sleep 0.2
+}
+
+# Runs one upload of bench.bin from scratch, through the proxy. Sets
+# SECONDS_TAKEN, COMPLETED, RETRANSMITS, CLIENT_CPU and SERVER_CPU.
+upload() {
+	local mode=$1 flows start end times
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null && wait $SERVER_PID 2>/dev/null
+	rm -f "$DIR/server/bench.bin" "$DIR/server/server_log" "$DIR/client/client_log"
+	(cd "$DIR/server" && exec ./fserver --port 7060 > /dev/null 2>&1) &
+	SERVER_PID=$!
+	sleep 0.3
+
+	case $mode in
+		udp) set -- --udp ;;
+		compress) set -- --compress ;;
+		*) set -- ;;
+	esac
+	flows=$(wc -l < "$DIR/proxy.json")
+	start=$(date +%s%N)
+	times=$( { TIMEFORMAT='%U %S'; time (cd "$DIR/client" && timeout $TIMEOUT ./fclient --no-local "$@" \
+		bench.bin > out.txt 2>&1); } 2>&1 )
+	end=$(date +%s%N)
+
+	SECONDS_TAKEN=$(awk -v ns=$((end - start)) 'BEGIN { printf "%.3f", ns / 1e9 }')
+	CLIENT_CPU=$(echo $times | awk '{ printf "%.3f", $1 + $2 }')
+	SERVER_CPU=$(cpu_of $SERVER_PID)
+	cmp -s "$DIR/client/bench.bin" "$DIR/server/bench.bin" && COMPLETED=true || COMPLETED=false
+	if [ $mode = udp ]; then
+		# datagrams the client sent again
+		RETRANSMITS=$(sed -n 's/.*datagrams, \([0-9]*\) sent again.*/\1/p' "$DIR/client/out.txt")
+	else
+		# every loss the proxy played on the connection is a retransmit of tcp
+		for i in 1 2 3 4 5 6 7 8 9 10; do
+			[ $(wc -l < "$DIR/proxy.json") -gt $flows ] && break
+			sleep 0.2
+		done
+		RETRANSMITS=$(tail -n +$((flows + 1)) "$DIR/proxy.json" | grep '"tcp", "port": 6060' |
+			sed -n 's/.*"up": {[^}]*"lost": \([0-9]*\).*"down": {[^}]*"lost": \([0-9]*\).*/\1 \2/p' |
+			awk '{ n += $1 + $2 } END { print n + 0 }')
+	fi
+	RETRANSMITS=${RETRANSMITS:-0}
+}
+
+echo "{"
+echo "  \"build\": \"$LABEL\","
+echo "  \"commit\": \"$COMMIT\","
+echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+echo "  \"host\": \"$(uname -n)\", \"cpus\": $(nproc), \"seed\": $SEED,"
+echo "  \"results\": ["
+first=1
+while read name delay jitter loss reorder rate; do
+	[ -z "$name" ] && continue
+	start_proxy $delay $jitter $loss $reorder $rate
+	for size in $SIZES; do
+		head -c $((size * 1024 * 1024)) /dev/urandom > "$DIR/client/bench.bin"
+		for mode in $MODES; do
+			: > "$DIR/runs"
+			for run in $(seq $RUNS); do
+				upload $mode
+				echo "$SECONDS_TAKEN $COMPLETED $RETRANSMITS $CLIENT_CPU $SERVER_CPU" >> "$DIR/runs"
+				echo "$name $mode ${size}MB: ${SECONDS_TAKEN}s completed=$COMPLETED" >&2
+			done
+			read seconds completed retransmits client_cpu server_cpu < <(sort -n "$DIR/runs" |
+				sed -n "$(( (RUNS + 1) / 2 ))p")
+			[ $first = 1 ] || echo ","
+			first=0
+			awk -v p=$name -v m=$mode -v mb=$size -v d=$delay -v j=$jitter -v l=$loss \
+				-v r=$reorder -v rate=$rate -v s=$seconds -v c=$completed -v rt=$retransmits \
+				-v cc=$client_cpu -v sc=$server_cpu 'BEGIN {
+				gb = mb / 1024
+				printf "    {\"profile\": \"%s\", \"mode\": \"%s\", \"size_mb\": %d, ", p, m, mb
+				printf "\"delay_ms\": %s, \"jitter_ms\": %s, \"loss_percent\": %s, ", d, j, l
+				printf "\"reorder_percent\": %s, \"rate_mbit\": %s, ", r, rate
+				printf "\"completed\": %s, \"seconds\": %s, \"mb_per_s\": %.2f, ", c, s, mb / s
+				printf "\"retransmits\": %d, ", rt
+				printf "\"cpu_s_per_gb\": {\"client\": %.3f, \"server\": %.3f}}", cc / gb, sc / gb
+			}'
+		done
+	done
+done <<< "$PROFILES"
+echo
+echo "  ]"
+echo "}"
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Compares transfers in clear text with transfers over kernel TLS on the
+# loopback interface: an upload, and a download, which the server sends
+# with sendfile() in both cases. Needs OpenSSL and the tls kernel module
+# (modprobe tls).
+#
+# usage: ./bench-tls.sh [size in MB] [timeout in seconds]
+
+SIZE_MB=${1:-64}
+TIMEOUT=${2:-300}
+
+DIR=$(mktemp -d)
+SRC=$(cd "$(dirname "$0")" && pwd)
+SERVER_PID=
+
+cleanup() {
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+mkdir -p "$DIR/client" "$DIR/server" "$DIR/download"
+gcc -O2 -DUSE_KTLS -o "$DIR/fserver" "$SRC/file-server.c" -pthread -lssl -lcrypto || exit 1
+gcc -O2 -DUSE_KTLS -o "$DIR/fclient" "$SRC/file-client.c" -pthread -lssl -lcrypto || exit 1
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 \
+	-subj /CN=fserver -addext subjectAltName=IP:127.0.0.1 \
+	-keyout "$DIR/key.pem" -out "$DIR/cert.pem" 2>/dev/null || exit 1
+grep -qw tls /proc/sys/net/ipv4/tcp_available_ulp ||
+	modprobe tls 2>/dev/null || echo "The tls kernel module may be missing, the tls runs will fail."
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$DIR/client/bench.bin"
+
+# starts a fresh server, with the arguments given
+restart() {
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null && wait $SERVER_PID 2>/dev/null
+	rm -f "$DIR/server/bench.bin" "$DIR/server/server_log"
+	(cd "$DIR/server" && exec "$DIR/fserver" "$@" > /dev/null 2>&1) &
+	SERVER_PID=$!
+	sleep 0.3
+}
+
+# runs the client in a directory, RESULT is the seconds taken or "failed"
+# if the file there doesn't come out the same as the one uploaded
+run() {
+	local dir=$1
+	shift
+	rm -f "$dir/client_log" "$dir/scan_index"
+	local start=$(date +%s%N)
+	(cd "$dir" && timeout $TIMEOUT "$DIR/fclient" "$@" bench.bin > /dev/null 2>&1)
+	local end=$(date +%s%N)
+	if cmp -s "$DIR/client/bench.bin" "$dir/bench.bin"; then
+		RESULT=$(awk -v ns=$((end - start)) 'BEGIN { printf "%.2f", ns / 1e9 }')
+	else
+		RESULT=failed
+	fi
+}
+
+# prints seconds and MB/s of a result
+column() {
+	if [ "$1" = "failed" ]; then
+		printf "%18s" "failed"
+	else
+		awk -v s=$1 -v mb=$SIZE_MB 'BEGIN { printf "%8.2fs %7.2fMB/s", s, mb / s }'
+	fi
+}
+
+printf "%-10s %18s %18s\n" "" "upload" "download"
+for mode in plain tls; do
+	if [ $mode = tls ]; then
+		restart --tls "$DIR/cert.pem" "$DIR/key.pem"
+		set -- --tls "$DIR/cert.pem"
+	else
+		restart
+		set --
+	fi
+	run "$DIR/client" --no-local "$@"
+	upload=$RESULT
+	# the upload is checked against the server's copy
+	cmp -s "$DIR/client/bench.bin" "$DIR/server/bench.bin" || upload=failed
+	rm -f "$DIR/download/bench.bin"
+	run "$DIR/download" --get "$@"
+	printf "%-10s %s %s\n" $mode "$(column $upload)" "$(column $RESULT)"
+done
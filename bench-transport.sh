@@ -0,0 +1,75 @@
+#!/bin/bash
+# Compares the tcp upload with the udp transport (bbr and aimd) over the
+# loopback interface, with delay and loss injected by netem. Needs root and
+# the sch_netem module.
+#
+# usage: ./bench-transport.sh [size in MB] [timeout in seconds]
+#
+# Every line of IMPAIRMENTS is "delay loss", applied in both directions, so
+# the rtt is twice the delay.
+
+SIZE_MB=${1:-4}
+TIMEOUT=${2:-300}
+IMPAIRMENTS="0ms 0%
+5ms 0%
+25ms 0%
+25ms 1%
+50ms 2%"
+
+DIR=$(mktemp -d)
+SRC=$(cd "$(dirname "$0")" && pwd)
+SERVER_PID=
+
+cleanup() {
+	tc qdisc del dev lo root 2>/dev/null
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+mkdir -p "$DIR/client" "$DIR/server"
+gcc -O2 -o "$DIR/server/fserver" "$SRC/file-server.c" -pthread || exit 1
+gcc -O2 -o "$DIR/client/fclient" "$SRC/file-client.c" -pthread || exit 1
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$DIR/client/bench.bin"
+
+# runs one upload from scratch, RESULT is the seconds taken or "failed"
+upload() {
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null && wait $SERVER_PID 2>/dev/null
+	rm -f "$DIR/server/bench.bin" "$DIR/server/server_log" "$DIR/client/client_log"
+	(cd "$DIR/server" && exec ./fserver > /dev/null 2>&1) &
+	SERVER_PID=$!
+	sleep 0.3
+
+	local start=$(date +%s%N)
+	(cd "$DIR/client" && timeout $TIMEOUT ./fclient --no-local "$@" bench.bin > /dev/null 2>&1)
+	local end=$(date +%s%N)
+	if cmp -s "$DIR/client/bench.bin" "$DIR/server/bench.bin"; then
+		RESULT=$(awk -v ns=$((end - start)) 'BEGIN { printf "%.2f", ns / 1e9 }')
+	else
+		RESULT=failed
+	fi
+}
+
+# prints seconds and MB/s of a result
+column() {
+	if [ "$1" = "failed" ]; then
+		printf "%18s" "failed"
+	else
+		awk -v s=$1 -v mb=$SIZE_MB 'BEGIN { printf "%8.2fs %7.2fMB/s", s, mb / s }'
+	fi
+}
+
+printf "%-16s %18s %18s %18s\n" "delay loss" "tcp" "udp bbr" "udp aimd"
+while read delay loss; do
+	if ! tc qdisc replace dev lo root netem delay $delay loss $loss; then
+		echo "Can't set up netem on lo."
+		exit 1
+	fi
+	upload
+	tcp=$RESULT
+	upload --udp --cc bbr
+	bbr=$RESULT
+	upload --udp --cc aimd
+	printf "%-16s %s %s %s\n" "$delay $loss" "$(column $tcp)" "$(column $bbr)" \
+		"$(column $RESULT)"
+done <<< "$IMPAIRMENTS"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* for SEEK_DATA and SEEK_HOLE */
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -6,19 +7,62 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sched.h>
+#include <limits.h>
+#include <linux/tcp.h> /* for TCP_INFO, newer than that of netinet/tcp.h */
+#include <linux/sockios.h> /* for SIOCOUTQ */
+#include <sys/ioctl.h>
+#ifdef USE_KTLS
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#endif
 
 #define PORT 6060
+#define DOWNLOAD_PORT 6061 /* port on which the server serves downloads */
+#define DOWNLOAD_BUFFER_SIZE 65536
+#define DOWNLOAD_LOG_INTERVAL (1024 * 1024) /* bytes received between log updates */
 #define SERVER_IP "127.0.0.1"
 #define BUFFER_SIZE 1400
-#define FILENAME_SIZE 72
+#define FILENAME_SIZE 256 /* path of the file, relative to the synced directory */
 #define TIMEOUT_OCCURED -2  /* a constant to signal timeout has ocurred */
-#define FILESIZE_STRING 11 /* We want atmost 9,999,999,999 Bytes of file 9.9GB*/
+#define FILESIZE_STRING 21 /* enough digits for any size which fits in a long */
 #define LOGFILE_NAME "client_log"
 #define RECEIVED_LOG "temp"
+#define SCAN_INDEX_NAME "scan_index" /* listings of the directories found by 
+the last scan, see _load_scan_index() */
+#define MAX_SCAN_THREADS 8
+#define SCAN_BUFFER_SIZE 32768 /* bytes of directory entries read at once */
+#define WATCH_DEBOUNCE_MS 200 /* a changed file is sent once it has been left
+alone this long */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+#define WATCH_EVENT_BUFFER 65536
+#define FOLLOW_BATCH_MS 50 /* appends to a followed file gathered into one */
+#define FOLLOW_CHECK_MS 1000 /* how often a followed file is looked at anyway */
 #define FILE_RECORD_LINE_NUMBER 6 /*as we are writing both, plain text and 
 structure to the same log file. Hence are storing the line number from where
 structure record entry is starting.*/
+#define LOG_VERSION "(log version 3)" /* on the first line of the log. The records
+of older builds, which wrote no version, have another size. Raised whenever
+the record changes. */
 #define FULLY_UPLOADED 100
 #define PARTIALLY_UPLOADED 50
 #define NEW_UPLOAD 0
@@ -29,10 +73,199 @@ has to be udated corresponding to a file*/
 #define UPDATE_LOG_COMPLETED 1
 #define UPDATE_LOG_TIMEOUT 2
 #define UPDATE_LOG_CONNECTION_COUNT 3
+#define UPDATE_LOG_NEW_VERSION 4 /* file changed after it was uploaded */
+#define UPDATE_LOG_APPENDED 5 /* bytes appended to the file were shipped */
+#define UPDATE_LOG_DOWNLOADED 6 /* file was downloaded from the server */
+#define UPDATE_LOG_SERVER_MTIME 7 /* a download started, from a copy of the 
+server modified at the time carried by bytes_transferred */
+
+#define HASH_SIZE 32 /* SHA-256 digest length */
+#define MERKLE_LEAF_SIZE (64 * BUFFER_SIZE) /* bytes of file covered by one leaf
+of the hash tree. It is kept a multiple of BUFFER_SIZE so that a corrupt leaf 
+maps to a whole number of segments which can be resent. */
+#define MERKLE_QUERY_MAX 256 /* max no. of tree nodes asked for in one round */
+#define MAX_HASH_THREADS 16
+#define END_OF_FILE_SEQ -1 /* seq_no of the segment which tells the server that
+every planned segment has been sent */
+
+/* flags of the metadata segment, which tell the server how the file
+is going to be sent */
+#define SEGMENT_DELTA 0x1  /* send only the differences from server's copy */
+#define SEGMENT_DEDUP 0x2  /* send the file as content defined chunks, of which
+only those missing in the server's chunk store are sent */
+#define SEGMENT_COMPRESSED 0x4 /* buffer of a data segment is compressed */
+#define SEGMENT_HOLE 0x8 /* segment describes a hole instead of carrying data */
+#define SEGMENT_APPEND 0x10 /* stream bytes appended to a complete file */
+#define SEGMENT_LOCAL 0x20 /* server on this host may copy the file from our disk */
+#define LOCAL_PATH_SIZE 1024
+#define LOCAL_COPY_TIMEOUT 600 /* seconds the server may take to copy a local file */
+#define DURABLE_ACK_TIMEOUT 120 /* seconds a server may take to store a file on
+itself and the servers it forwards to */
+#define SEGMENT_UDP 0x40 /* send the data over udp, see _send_over_udp() */
+#define SEGMENT_LONG 0x200 /* length bytes of data follow the segment, instead of
+being in its buffer, see struct tuning */
+#define TUNE_MIN_BLOCKS 8 /* BUFFER_SIZE blocks a long segment starts from */
+#define TUNE_MAX_BLOCKS 2048 /* about 2.8MB */
+#define TUNE_PROBE_TIME 3000000 /* us at the start of an upload spent on the tuning */
+#define TUNE_SAMPLE_TIME 20000 /* us a block size is measured over, at least */
+#define TUNE_SAMPLE_ROUNDS 4 /* rounds a block size is measured over, at least */
+#define TUNE_MIN_GAIN 1.1 /* a doubled block has to be this much faster to be kept */
+#define TUNE_MAX_ROUND 250000 /* us a round of one segment should take at most */
+#define TUNE_MAX_BUFFER (64 * 1024 * 1024)
+#define SEGMENT_RESUMED 0x400 /* metadata of an upload picked up again on a new
+connection of its session, see _resume_upload() */
+#define SEGMENT_FRAMED 0x800 /* length bytes of frames follow the segment, one
+per block, see struct frame */
+#define FRAME_COMPRESSED 0x1
+#define PIPELINE_DEPTH 4096 /* blocks read ahead of the sender, a power of two
+and at least two of the longest segments */
+#define PIPELINE_MAX_WORKERS 8
+#define PIPELINE_SPINS 64 /* waits of a stage spent yielding before it sleeps */
+#define PIPELINE_SLEEP 50000 /* ns */
+#define BLOCK_FREE 0 /* states of a block of the pipeline */
+#define BLOCK_READ 1
+#define BLOCK_DONE 2
+#define SESSION_TOKEN_LENGTH 32 /* hex digits of the token of a session */
+#define SESSION_NEW 1 /* what _open_session() found */
+#define SESSION_RESUMED 2
+#define RECONNECT_TIME 300 /* seconds a lost connection is tried to be made again
+for, unless told otherwise with --reconnect */
+#define RECONNECT_MIN_MS 250 /* backoff before the first attempt */
+#define RECONNECT_MAX_MS 16000
+#define MAX_SERVERS 16 /* of --servers */
+#define MAX_FILES 1024 /* uploaded at once over --servers */
+#define SERVERS_FILE_NAME "client_servers" /* the measured throughput of every server */
+#define RING_POINTS 64 /* points on the ring of a server of average weight */
+#define LOAD_BOUND 1.25 /* times its share of the bytes a server takes at most */
+#define WEIGHT_SMOOTHING 0.3 /* share of the last measured throughput in a weight */
+#define WEIGHT_MIN_BYTES (1024 * 1024) /* uploaded before a throughput tells anything */
+#define SHARD_MAGIC "FSHARD1"
+#define MAX_SHARDS MAX_SERVERS /* data and parity shards of a stripe, each on a server */
+#define STRIPE_ROWS 256 /* rows of blocks a stripe is encoded and decoded by at once */
+#define TLS_CIPHERSUITE "TLS_AES_128_GCM_SHA256" /* which kernel TLS takes over */
+#define METRICS_PREFIX "fclient_"
+#define METRICS_SAMPLE_INTERVAL 100000 /* us between samples of a connection */
+#define STALL_THRESHOLD 200000 /* us without progress which count as a stall */
+#define LATENCY_BUCKETS 20 /* by powers of two of us, up to about half a second */
+#define RECENT_TRANSFERS 16 /* transfers kept for the metrics once ended */
+#define SOCKET_QUEUE_IOCTL SIOCOUTQ
+#define SOCKET_QUEUE_HELP "Bytes sent on the connection, not acked yet."
+#define TRACE_FILE_NAME "fclient_trace"
+#define TRACE_MAGIC "FTRACE1"
+#define TRACE_RING_SIZE 16384 /* records of a thread kept, a power of two */
+#define TRACE_MAX_RINGS 64
+#define TRACE_MAX_EVENTS 16
+#define TRACE_NAME_SIZE 24
+#define TRACE_CALIBRATION_NS 10000000 /* time the tsc is measured against the clock */
+
+/* verbosity of the trace, see _trace() */
+#define TRACE_OFF 0
+#define TRACE_TRANSFERS 1 /* starts and ends of transfers, and what goes wrong */
+#define TRACE_SEGMENTS 2 /* every segment and ack */
+#define TRACE_ALL 3 /* datagrams and writes too */
+
+/* events of the trace, indices of trace_events */
+#define TRACE_TRANSFER_BEGIN 0
+#define TRACE_TRANSFER_END 1
+#define TRACE_TIMEOUT 2
+#define TRACE_TUNED 3
+#define TRACE_SEGMENT_SENT 4
+#define TRACE_ACK_RECEIVED 5
+#define TRACE_DATAGRAM_SENT 6
+#define TRACE_DOWNLOAD_WRITE 7
+#define TRACE_RECONNECT 8
+#define SEGMENT_SWARM 0x100 /* download request of a swarm, see _swarm_download() */
+#define SWARM_CHUNK_SIZE (1024 * 1024) /* grows for files of more chunks than
+the bits of a buffer */
+#define SWARM_JOIN -1 /* seq_no of a request which joins the swarm */
+#define SWARM_BITMAP -2 /* seq_no of a request for the chunks a peer has */
+#define SWARM_MAX_PEERS 64
+#define SWARM_WORKERS 4 /* chunks fetched at once */
+#define SWARM_SERVER_SLOTS 1 /* of them, fetched from the server */
+#define SWARM_REFRESH_MS 100 /* how often the peers and their bitmaps are looked at */
+#define SWARM_IDLE_MS 20 /* wait of a worker which has nothing to fetch */
+#define SWARM_TIMEOUT 10 /* seconds a peer or the server may take to answer */
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)
+#define UDP_MAX_NACKS 256 /* missing datagrams reported in one feedback */
+#define UDP_INITIAL_WINDOW (64 * BUFFER_SIZE) /* also the smallest window */
+#define UDP_INITIAL_RATE (UDP_INITIAL_WINDOW * 1000.0) /* bytes per second */
+#define UDP_INITIAL_RTO 200000 /* us, until the rtt is known */
+#define UDP_MIN_RTO 10000 /* us */
+#define UDP_MAX_BURST 1000 /* us of sending which may be made up for at once */
+#define UDP_FEEDBACK_INTERVAL 5000 /* us, the receiver reports at least this often */
+#define UDP_IDLE_TIMEOUT 10000000 /* us without feedback before giving up */
+#define DATAGRAM_DATA 0
+#define DATAGRAM_RESENT 1
+#define DATAGRAM_PARITY 2
+#define FEC_GROUP_SIZE 16 /* max. no. of data blocks covered by one set of parity blocks */
+#define FEC_MAX_PARITY 8
+#define FEC_LOSS_WINDOW 128 /* datagrams over which a loss rate is measured */
+#define FEC_MIN_LOSS 0.001 /* loss rate below which no parity is sent */
+#define FEC_MAX_PARITY_INDEX (256 - FEC_GROUP_SIZE) /* parity blocks a group can have
+at all, see _fec_coefficient() */
+#define MULTICAST_GROUP "239.255.60.60"
+#define MULTICAST_PORT 6063 /* receivers of a distribution listen here */
+#define MULTICAST_TTL 1 /* the distribution stays on the local network */
+#define MULTICAST_RATE 100 /* Mbit/s, unless told otherwise with --rate */
+#define MULTICAST_ANNOUNCE_INTERVAL 100000 /* us between announcements */
+#define MULTICAST_JOIN_WAIT 1000000 /* us receivers get to join before the data */
+#define MULTICAST_REPORT_WAIT 200000 /* us the reports of a round are waited for */
+#define MULTICAST_RECEIVER_TIMEOUT 5000000 /* us after which a silent receiver is dropped */
+#define MULTICAST_MAX_RECEIVERS 256
+#define MULTICAST_MAX_NEEDS 256 /* groups reported in one report */
+#define MULTICAST_PARITY 2 /* parity blocks sent along with each group with --fec */
+#define MULTICAST_DONE_REPEAT 3
+#define DATAGRAM_ANNOUNCE 3 /* kinds of datagrams only a distribution has */
+#define DATAGRAM_POLL 4
+#define DATAGRAM_DONE 5
+#define REPORT_JOIN 0
+#define REPORT_STATUS 1
+#define CC_BBR 0
+#define CC_AIMD 1
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+#define BBR_HIGH_GAIN 2.885 /* 2/ln(2), which doubles the rate every round */
+#define BBR_MIN_ROUND 1000 /* us, rounds aren't shorter than the feedback takes */
+#define BBR_BW_ROUNDS 10 /* rounds over which the highest delivery rate is kept */
+#define BBR_CYCLE_LENGTH 8
+#define BBR_MIN_RTT_WINDOW 10000000 /* us */
+#define BBR_LOSS_LIMIT 0.2 /* share of datagrams lost in a round which is too much */
+#define BBR_LOSSY_ROUNDS 3
+
+/* the compression of data segments. Every block is compressed on its own, 
+so that resume and retransmission still work a block at a time. Blocks whose
+sampled entropy is above ENTROPY_BYPASS (media, archives) are sent as they 
+are, and after blocks which didn't compress we stop trying for a while. */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5  /* a block always ends with some literals */
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define ENTROPY_SAMPLE 512  /* bytes of a block looked at to guess its entropy */
+#define ENTROPY_BYPASS (7 * 256)  /* 7 bits per byte, in 1/256 bits */
+#define MAX_BYPASS_BACKOFF 64  /* max no. of blocks sent without trying */
+
+/* types of the instructions which rebuild the new version of a file on the
+server out of its old copy */
+#define DELTA_COPY 1     /* copy `length` blocks of old copy starting at `block` */
+#define DELTA_LITERAL 2  /* `length` bytes of new data follow the header */
+#define DELTA_END 3      /* HASH_SIZE bytes of SHA-256 of the new file follow */
+#define DELTA_STRONG_SIZE 16 /* bytes of SHA-256 kept as strong block checksum */
+#define DELTA_LITERAL_MAX 65536 /* max literal bytes sent behind one header */
+
+/* sizes of the content defined chunks and the masks of the gear hash used
+to cut them (from the FastCDC paper, for an 8KB average) */
+#define CDC_MIN_CHUNK 2048
+#define CDC_AVG_CHUNK 8192
+#define CDC_MAX_CHUNK 65536
+#define CDC_MASK_S 0x0003590703530000ULL  /* 15 bits, before the average size */
+#define CDC_MASK_L 0x0000d90003530000ULL  /* 11 bits, after it */
 
 struct segment {
 	int seq_no;
 	int ack_no;
+	int length;  /* no. of valid bytes in buffer */
+	int flags;   /* SEGMENT_* flags */
 	char filename[FILENAME_SIZE];
 	char filesize[FILESIZE_STRING];
 	char buffer[BUFFER_SIZE];
@@ -47,10 +280,792 @@ typedef struct log {
 	unsigned short percentage_completion;
 	unsigned int connection_count;
 	unsigned int timeout_count;
+	long mtime; /* modification time of the file when its upload started,
+	which tells us whether a completed file has been changed since */
+	unsigned int block_size;  /* bytes per segment the tuning of its upload
+	settled on, 0 if it wasn't tuned */
+	unsigned int send_buffer; /* SO_SNDBUF the tuning set, 0 for the kernel's */
+	unsigned int rtt;         /* us, the smallest seen during the tuning */
+	long mtime_nsec; /* nanoseconds of mtime, as an edit in the second of the
+	upload must show too. -1 for a record converted from an older log */
 } client_log;
 
+/* a string which grows as it is appended to */
+struct string_builder {
+	char * data;
+	size_t length;
+	size_t capacity;
+};
+
+/* an entry of the hash set of completely uploaded files */
+struct completed_file {
+	char filename[FILENAME_SIZE];  /* empty for a free slot */
+	long filesize;
+	long mtime;
+	long mtime_nsec;
+};
+
+/* open addressing hash set, capacity is a power of 2 */
+struct completed_set {
+	struct completed_file * slots;
+	int capacity;
+};
+
+/* the listing of a directory, as kept in the scan index */
+struct scanned_dir {
+	char * path;
+	long mtime_sec;
+	long mtime_nsec;
+	char ** entries;
+	char * is_dir;
+	int entry_count;
+	int entry_capacity;
+};
+
+/* hash table of scanned directories by path, capacity is a power of 2 */
+struct scan_index {
+	struct scanned_dir ** slots;
+	int capacity;
+	int count;
+};
+
+/* state shared by the threads of the directory scanner */
+struct scanner {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;  /* queue has grown or a thread has gone idle */
+	char ** queue;  /* directories waiting to be scanned */
+	int queue_length;
+	int queue_capacity;
+	int busy;  /* threads scanning a directory, which may queue more */
+	char ** files;  /* files still to be uploaded */
+	int file_count;
+	int file_capacity;
+	struct completed_set completed;
+	struct scan_index old_index;  /* from the last run */
+	struct scan_index new_index;  /* built by this run */
+};
+
+/* a file waiting to be sent by the watch mode */
+struct pending_file {
+	char * path;
+	long long due_ms;  /* when it will have been quiet long enough */
+};
+
+/* state of the watch mode */
+struct watch_state {
+	int inotify_fd;
+	char ** dirs;  /* path of the directory of every watch descriptor */
+	int dir_capacity;
+	struct pending_file * pending;
+	int pending_count;
+	int pending_capacity;
+};
+
+/* a directory entry as returned by getdents64() */
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* a query for hashes of some nodes of the server's hash tree. A query with
+count 0 ends the verification. */
+struct merkle_query {
+	int count;
+	int nodes[MERKLE_QUERY_MAX];
+};
+
+/* hash tree over the first `length` bytes of a file. Nodes are stored heap 
+ordered: root is node 1, children of node i are 2i and 2i+1 and the leaves
+start at index width. Leaves beyond leaf_count are left zeroed. */
+struct merkle_tree {
+	long length;
+	int leaf_count;
+	int width;
+	unsigned char (* nodes)[HASH_SIZE];
+};
+
+/* the set of leaves hashed by one thread */
+struct hash_job {
+	int fd;
+	struct merkle_tree * tree;
+	int first_leaf;
+	int last_leaf;
+};
+
+/* the signature of one block of the server's copy of a file */
+struct delta_signature {
+	unsigned int weak;  /* rolling checksum */
+	unsigned char strong[DELTA_STRONG_SIZE];
+};
+
+/* sent by the server ahead of the signatures */
+struct delta_header {
+	int block_size;
+	int block_count;
+};
+
+/* one instruction of the delta stream */
+struct delta_op {
+	int type;
+	int block;
+	int length;
+};
+
+/* a content defined chunk of a file, as offered to the server */
+struct chunk_ref {
+	unsigned char hash[HASH_SIZE];
+	int length;
+};
+
+/* the set of chunks hashed by one thread */
+struct chunk_job {
+	const unsigned char * data;
+	long * offsets;
+	struct chunk_ref * chunks;
+	int first_chunk;
+	int last_chunk;
+};
+
+/* state of the compression stage of the send path */
+struct compressor {
+	int enabled;
+	int adaptive;     /* check the entropy and back off, or always try */
+	int skip_blocks;  /* no. of blocks still to be sent without trying */
+	int backoff;      /* what skip_blocks is set to after the next failure */
+	long raw_bytes;
+	long wire_bytes;
+	int compressed_blocks;
+	int bypassed_blocks;
+};
+
+/* how files are uploaded, as chosen on the command line */
+struct upload_options {
+	short dedup;     /* through the server's chunk store */
+	short no_local;  /* over the connection even when the server is on this host */
+	short udp;       /* the data goes over udp */
+	short fec;       /* with parity blocks, see _fec_add_block() */
+	int congestion_control;  /* CC_* of the udp transport */
+	struct compressor comp;
+	short checksum;  /* every block carries a crc32c, see struct frame */
+	int multicast_rate;      /* Mbit/s a distribution is sent at */
+	struct in_addr interface;  /* a distribution goes out of it */
+};
+
+/* The session we have with the server, which stands for the logs we 
+exchanged. An upload which loses its connection makes a new one and resumes
+the session with its token, then goes on from its last acked segment. */
+struct session {
+	struct sockaddr_in server_addr;
+	char token[SESSION_TOKEN_LENGTH + 1];  /* empty until the server gave one */
+	int reconnect_time;  /* seconds, 0 to give up on a lost connection at once */
+};
+
+/* A server of --servers. Its weight is the throughput our uploads to it
+had, in MB/s, and sets its share of the files. Every server has a log of
+its own, and a process of its own which uploads the files placed on it. */
+struct server {
+	struct sockaddr_in addr;
+	char name[32];     /* address:port */
+	double weight;     /* 0 until measured */
+	long load;         /* bytes of the files placed on it */
+	pid_t pid;
+	int report;        /* pipe its process reports its throughput on */
+};
+
+struct ring_point {
+	unsigned int hash;
+	int server;
+};
+
+/* The start of every shard of a file striped with --stripe K+M. Block i 
+of the file is block i / K of data shard i % K, and block r of parity shard
+p is the sum of the blocks r of the data shards, by the coefficients of the
+parity of the udp transport. Any K shards give the file back. */
+struct shard_header {
+	char magic[8];
+	long filesize;     /* of the striped file */
+	int data_shards, parity_shards;
+	int index;         /* the data shards first */
+};
+
+/* a datagram of the udp transport. seq_no numbers the blocks in the order
+they are sent, which isn't the order in the file on a resume. A parity 
+datagram covers group_size blocks, from seq_no and block on. */
+struct datagram {
+	int seq_no;
+	int block;      /* block of the file carried */
+	int total;      /* no. of data blocks of the transfer */
+	int length;
+	int kind;       /* DATAGRAM_* */
+	int group_size;
+	int parity_index;
+	long long sent_at;  /* sender's clock in us, echoed in the feedback */
+	char buffer[BUFFER_SIZE];
+};
+
+/* what the receiver of the udp transport reports every few datagrams */
+struct feedback {
+	int ack_no;     /* every seq_no below it has been received */
+	int highest;    /* highest seq_no received */
+	long long echo_sent_at;  /* sent_at of the latest datagram received */
+	int echo_seq;
+	int echo_delay; /* us that datagram waited for this feedback */
+	long delivered; /* no. of distinct datagrams received */
+	long lost;      /* no. of seq_nos up to highest whose first copy was lost */
+	int nack_count;
+	int nacks[UDP_MAX_NACKS];  /* seq_nos missing below highest */
+};
+
+/* parity blocks of a group of data blocks, which are consecutive in
+the file as well as in the order of sending */
+struct fec_parity {
+	int first_seq, first_block, size;
+	int parity_count;
+	int next_to_send;
+	unsigned char parity[FEC_MAX_PARITY][BUFFER_SIZE];
+};
+
+/* the buffer of a DATAGRAM_ANNOUNCE, which tells the receivers of a 
+distribution what is coming */
+struct multicast_file {
+	long filesize;
+	char filename[FILENAME_SIZE];
+};
+
+/* a group of blocks for which a receiver needs more parity blocks */
+struct repair_need {
+	int group;
+	int parity;
+};
+
+/* what a receiver of a distribution reports, unicast to the sender */
+struct multicast_report {
+	int kind;       /* REPORT_* */
+	int round;      /* of the poll answered */
+	int missing;    /* no. of blocks it still lacks */
+	int need_count;
+	struct repair_need needs[MULTICAST_MAX_NEEDS];
+};
+
+struct multicast_receiver {
+	struct sockaddr_in addr;
+	long long last_heard;
+	int round;      /* last poll answered */
+	int missing;
+	short failed;
+};
+
+/* state of the sending end of a distribution. Blocks go out in groups of
+FEC_GROUP_SIZE, and every group is repaired with parity blocks it hasn't
+had yet, so that one parity block makes up for a different lost block at
+each receiver. */
+struct multicast_sender {
+	int sock;
+	struct sockaddr_in group_addr;
+	int fd;
+	long filesize;
+	int total, group_count;
+	double rate;         /* bytes per second */
+	long long next_send;
+	long bytes_sent, parity_sent;
+	int * need;          /* parity blocks wanted, by group, in this round */
+	unsigned char * next_parity;  /* first parity index not sent, by group */
+	struct multicast_receiver receivers[MULTICAST_MAX_RECEIVERS];
+	int receiver_count;
+};
+
+#ifdef USE_KTLS
+/* traffic secrets of a TLS 1.3 connection, see _keep_tls_secret() */
+struct tls_secrets {
+	unsigned char client[EVP_MAX_MD_SIZE], server[EVP_MAX_MD_SIZE];
+	int client_length, server_length;
+};
+
+SSL_CTX * tls_context = NULL;  /* set up by --tls */
+#endif
+
+/* where a peer of a swarm takes requests for chunks */
+struct swarm_peer_address {
+	struct in_addr addr;
+	int port;
+};
+
+struct swarm_peer {
+	struct swarm_peer_address address;
+	unsigned char * bitmap;  /* the chunks it had when last asked */
+	int failed;              /* not asked again before the server lists it again */
+};
+
+/* Our part in the swarm of a file: the chunks we have and fetch, the 
+peers we know of and the SHA-256 of every chunk, as the server has them. 
+Everything which changes is guarded by the lock, as the peers are served 
+and the chunks fetched by threads of their own. */
+struct swarm_state {
+	char * filename;
+	int fd;
+	long filesize, chunk_size;
+	int chunk_count, have_count;
+	unsigned char * hashes;
+	unsigned char * have;      /* bitmap of the chunks we have */
+	unsigned char * fetching;  /* by chunk, 1 while a worker fetches it */
+	struct swarm_peer peers[SWARM_MAX_PEERS];
+	int peer_count;
+	int server_fetches;        /* chunks being fetched from the server */
+	long from_server, from_peers, to_peers;
+	int listen_sock, listen_port;
+	struct sockaddr_in server_addr;
+	pthread_mutex_t lock;
+};
+
+struct swarm_connection {
+	struct swarm_state * state;
+	int sock;
+};
+
+/* what a feedback tells the congestion controller */
+struct rate_sample {
+	long long now;
+	double delivery_rate;  /* bytes per second, 0 if unknown */
+	long rtt;              /* us, 0 if unknown */
+	long delivered;        /* bytes newly delivered */
+	long inflight;         /* bytes */
+	int lost;              /* datagrams newly found missing */
+};
+
+/* state of a rate based congestion controller. A controller sets the
+pacing rate and the bytes allowed in flight, the sender keeps to both. */
+struct congestion_state {
+	double pacing_rate; /* bytes per second */
+	long cwnd;
+	long srtt, min_rtt; /* us, kept by the sender */
+	long long min_rtt_stamp;
+	int give_up;        /* controller asks for the aimd fallback */
+	/* bbr */
+	int mode, round, full_bw_rounds, lossy_rounds, cycle_index;
+	double bw[BBR_BW_ROUNDS], max_bw, full_bw;
+	long long round_stamp, cycle_stamp;
+	long round_delivered, round_lost;
+	/* aimd */
+	long ssthresh;
+	long long last_reduction;
+};
+
+struct congestion_control {
+	const char * name;
+	void (* init)(struct congestion_state * cc);
+	void (* on_sample)(struct congestion_state * cc, struct rate_sample * rs);
+};
+
+/* state of the sending end of the udp transport */
+struct udp_sender {
+	int total;      /* no. of datagrams of the transfer */
+	int next_new;   /* first seq_no never sent */
+	int ack_no;
+	int highest;
+	long sent, delivered, lost;  /* counts of data datagrams */
+	short fec;
+	double loss_rate;      /* moving average, decides the no. of parity blocks */
+	int loss_mark_highest;
+	long loss_mark_lost, parity_sent;
+	struct fec_parity encoding, finished;  /* finished is sent before new data */
+	long long * sent_at;         /* by seq_no, of the last copy sent */
+	long * delivered_at_send;
+	unsigned char * queued;
+	int * resend;   /* ring of seq_nos to be sent again */
+	int resend_head, resend_count;
+	long long last_feedback;
+	struct congestion_state cc;
+	struct congestion_control * control;
+};
+
+/* the buffer of a SEGMENT_HOLE segment: a range of the file which reads as
+zeros and takes no space on disk */
+struct hole_range {
+	long offset;
+	long length;
+};
+
+/* the buffer of a SEGMENT_LOCAL metadata segment. The server checks that
+the path still leads to this very file before copying it. */
+struct local_source {
+	unsigned long dev;
+	unsigned long ino;
+	long size;
+	char path[LOCAL_PATH_SIZE];
+};
+
+/* a run of consecutive segments which has to be sent */
+struct block_range {
+	int first_block;
+	int block_count;
+};
+
+/* The tuning of the tcp upload to its path. It starts from what the last 
+tuned upload in the log found, and during the first seconds doubles the 
+size of the blocks sent in a segment while that makes the upload faster, 
+as every segment costs a round trip for its ack. Then it settles on the 
+fastest size, at least the bandwidth-delay product, and sizes the socket 
+buffers to match. */
+struct tuning {
+	int enabled;
+	int blocks;            /* BUFFER_SIZE blocks sent per segment */
+	int probing;
+	long long probe_end;   /* us */
+	long long sample_start;
+	long sample_bytes;
+	int sample_rounds;
+	double best_rate;      /* bytes per second, of the fastest size so far */
+	int best_blocks;
+	long rtt;              /* us, the smallest tcp has seen */
+	double bandwidth;      /* bytes per second, the highest tcp has seen */
+	int send_buffer;       /* what SO_SNDBUF was set to, 0 if left to the kernel */
+};
+
+/* the ordered list of segments to be sent to the server. On a fresh upload
+it is the whole file, on a resume it is the corrupt ranges found with the 
+hash tree followed by the part the server never got. */
+struct transfer_plan {
+	struct block_range * ranges;
+	int range_count;
+	int range_capacity;
+	int current_range;
+	int next_block;  /* index of next block inside the current range */
+};
+
+/* a block in a SEGMENT_FRAMED segment: this header, then length bytes of
+the block, compressed if the flags say so. The checksum is the crc32c of the
+block as it is in the file, so that it covers the decompression too. */
+struct frame {
+	int length;
+	int flags;     /* FRAME_* flags */
+	unsigned int checksum;
+};
+
+/* A bounded queue of ints which any no. of threads can push to and pop
+from without a lock (Vyukov's). Every cell carries a sequence no., which 
+tells a pusher whether the cell is free in this lap around the ring and a
+popper whether it is filled. */
+struct block_queue_cell {
+	unsigned long sequence;
+	int value;
+};
+
+struct block_queue {
+	struct block_queue_cell * cells;
+	unsigned long mask;
+	char padding_0[48];
+	unsigned long push_position;  /* each on its own cache line */
+	char padding_1[56];
+	unsigned long pop_position;
+	char padding_2[56];
+};
+
+/* a block on its way through the pipeline */
+struct pipeline_block {
+	int state;          /* BLOCK_* */
+	int block;          /* its seq_no */
+	int hole;           /* a hole of the file, of the blocks up to end_block */
+	int end_block;
+	long offset;
+	long raw_length;    /* bytes of the file it covers */
+	struct frame frame;
+	unsigned char raw[BUFFER_SIZE];
+	unsigned char data[BUFFER_SIZE];  /* what goes in the frame */
+};
+
+struct pipeline_worker {
+	struct pipeline * pipeline;
+	struct compressor comp;  /* statistics and backoff of its own blocks */
+	pthread_t thread;
+};
+
+/* The stages of an upload of compressed or checksummed blocks: a reader
+walks the plan and reads the blocks ahead, the workers compress and 
+checksum them, on as many cores as there are, and the sender takes them 
+in the order of the plan, which the ring of blocks keeps, into frames. */
+struct pipeline {
+	int fd;
+	long filesize;
+	struct transfer_plan plan;    /* the reader's copy */
+	struct pipeline_block * blocks;  /* a ring, in the order they were read */
+	struct block_queue queue;     /* blocks read, for the workers */
+	unsigned long produced;       /* blocks the reader put into the ring */
+	unsigned long consumed;       /* blocks the sender took out of it */
+	int reader_done;
+	int stop;
+	pthread_t reader;
+	struct pipeline_worker workers[PIPELINE_MAX_WORKERS];
+	int worker_count;
+};
+
+/* SHA-256 (FIPS 180-4). Written here so that the tool keeps needing nothing
+but libc and pthreads. */
+typedef struct {
+	unsigned int state[8];
+	unsigned long long bit_count;
+	unsigned char block[64];
+	unsigned int block_used;
+} sha256_ctx;
+
+const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void _sha256_transform(unsigned int * state, const unsigned char * block) {
+	unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	/* expand the 16 big endian words of the block into 64 words */
+	for(i = 0; i < 16; i++) {
+		w[i] = ((unsigned int)block[i * 4] << 24) | (block[i * 4 + 1] << 16) |
+			(block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+	for(i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] + 
+			(ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for(i = 0; i < 64; i++) {
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + 
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + 
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+};
+
+#if defined(__x86_64__)
+/* the SHA extensions of x86 do two rounds of SHA-256 in one instruction. This
+function is compiled for them whatever flags gcc is given, and is called only
+when the cpu has them. */
+__attribute__((target("sha,sse4.1")))
+void _sha256_blocks_shani(unsigned int * state, const unsigned char * data,
+	size_t block_count) {
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 
+		0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save, message, temp;
+	__m128i words[4];
+	int i;
+
+	/* the instructions want the state as ABEF and CDGH */
+	temp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+	state0 = _mm_alignr_epi8(temp, state1, 8);
+	state1 = _mm_blend_epi16(state1, temp, 0xF0);
+
+	while(block_count--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		/* 16 groups of 4 rounds. words[] holds the last 16 words of the
+		message schedule, which is extended 4 words at a time. */
+		for(i = 0; i < 16; i++) {
+			if(i < 4) {
+				words[i] = _mm_shuffle_epi8(
+					_mm_loadu_si128((const __m128i *)(data + 16 * i)), byte_swap);
+			}
+			message = _mm_add_epi32(words[i % 4], 
+				_mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			if(i >= 3 && i < 15) {
+				temp = _mm_alignr_epi8(words[i % 4], words[(i + 3) % 4], 4);
+				words[(i + 1) % 4] = _mm_add_epi32(words[(i + 1) % 4], temp);
+				words[(i + 1) % 4] = _mm_sha256msg2_epu32(words[(i + 1) % 4], 
+					words[i % 4]);
+			}
+			message = _mm_shuffle_epi32(message, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+			if(i >= 1 && i < 13) {
+				words[(i + 3) % 4] = _mm_sha256msg1_epu32(words[(i + 3) % 4], 
+					words[i % 4]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += 64;
+	}
+
+	/* back to ABCD and EFGH */
+	temp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(temp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, temp, 8);
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+};
+
+int _cpu_has_sha_extensions() {
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+		return 0;
+	}
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (ebx >> 29) & 1;  /* SHA bit */
+};
+#endif
+
+/* hashes whole 64 byte blocks, with the SHA extensions when the cpu has them */
+void _sha256_blocks(unsigned int * state, const unsigned char * data, 
+	size_t block_count) {
+#if defined(__x86_64__)
+	static int has_sha_extensions = -1;
+
+	if(has_sha_extensions == -1) {
+		has_sha_extensions = _cpu_has_sha_extensions();
+	}
+	if(has_sha_extensions) {
+		_sha256_blocks_shani(state, data, block_count);
+		return;
+	}
+#endif
+	while(block_count--) {
+		_sha256_transform(state, data);
+		data += 64;
+	}
+};
+
+void _sha256_init(sha256_ctx * ctx) {
+	ctx->state[0] = 0x6a09e667; ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372; ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f; ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab; ctx->state[7] = 0x5be0cd19;
+	ctx->bit_count = 0;
+	ctx->block_used = 0;
+};
+
+void _sha256_update(sha256_ctx * ctx, const unsigned char * data, size_t len) {
+	ctx->bit_count += (unsigned long long)len * 8;
+
+	/* fill up a partially filled block first */
+	while(len > 0 && ctx->block_used != 0) {
+		ctx->block[ctx->block_used++] = *data++;
+		len--;
+		if(ctx->block_used == 64) {
+			_sha256_transform(ctx->state, ctx->block);
+			ctx->block_used = 0;
+		}
+	}
+	/* then hash whole blocks straight out of the caller's buffer */
+	_sha256_blocks(ctx->state, data, len / 64);
+	data += len & ~(size_t)63;
+	len &= 63;
+	memcpy(ctx->block, data, len);
+	ctx->block_used = len;
+};
+
+void _sha256_final(sha256_ctx * ctx, unsigned char * digest) {
+	unsigned long long bit_count = ctx->bit_count;
+	int i;
+
+	/* pad with a single 1 bit, zeros and the message length in bits */
+	ctx->block[ctx->block_used++] = 0x80;
+	if(ctx->block_used > 56) {
+		memset(ctx->block + ctx->block_used, 0, 64 - ctx->block_used);
+		_sha256_transform(ctx->state, ctx->block);
+		ctx->block_used = 0;
+	}
+	memset(ctx->block + ctx->block_used, 0, 56 - ctx->block_used);
+	for(i = 0; i < 8; i++) {
+		ctx->block[63 - i] = bit_count >> (i * 8);
+	}
+	_sha256_transform(ctx->state, ctx->block);
+
+	for(i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+};
+
+void _sha256(const unsigned char * data, size_t len, unsigned char * digest) {
+	sha256_ctx ctx;
+	_sha256_init(&ctx);
+	_sha256_update(&ctx, data, len);
+	_sha256_final(&ctx, digest);
+};
+
+/* CRC-32C (Castagnoli), the checksum of a block in a frame. The cpu does it
+eight bytes at a time with SSE4.2, the table is for those without. */
+unsigned int crc32c_table[256];
+int crc32c_has_sse42 = 0;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int _crc32c_sse42(unsigned int crc, const unsigned char * data, size_t length) {
+	unsigned long long crc64 = crc, word;
+
+	for(; length >= 8; data += 8, length -= 8) {
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+	for(; length > 0; data++, length--) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+};
+#endif
+
+/* called before there are threads to checksum with */
+void _crc32c_init() {
+	unsigned int crc;
+	int i, bit;
+
+	for(i = 0; i < 256; i++) {
+		crc = i;
+		for(bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	crc32c_has_sse42 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+};
+
+unsigned int _crc32c(const unsigned char * data, size_t length) {
+	unsigned int crc = 0xffffffff;
+
+#if defined(__x86_64__)
+	if(crc32c_has_sse42) return ~_crc32c_sse42(crc, data, length);
+#endif
+	for(; length > 0; data++, length--) {
+		crc = crc32c_table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+};
+
 char * _get_current_date_time() {
-	char date_time[18];
+	static char date_time[18]; /* static, as we return it to the caller */
 
 	time_t time_now = time(NULL); /* get the no. of second since epoch in time_now */  
 	/* now get struct tm pointer from localtime based on seconds since epoch */
@@ -84,11 +1099,14 @@ void sendlog(FILE * log, int sock_fd, int filesize) {
 /* A wrapper to receive log file from server */
 void recvlog(FILE * log, int sock_fd, int filesize) {
 	char buffer[BUFFER_SIZE];
-	int wrote_bytes, recvd_bytes;
+	int wrote_bytes, recvd_bytes = 0;
 	int remaining_bytes = filesize;
 
 	while(remaining_bytes > 0) {
-		recvd_bytes = recv(sock_fd, buffer, sizeof(buffer), 0);
+		/* no more than the log, as what follows it may have come too */
+		recvd_bytes = recv(sock_fd, buffer, (remaining_bytes < (int)sizeof(buffer)) ? 
+			remaining_bytes : (int)sizeof(buffer), 0);
+		if(recvd_bytes <= 0) break;
 		wrote_bytes = fwrite(buffer, sizeof(char), recvd_bytes, log);
 
 		remaining_bytes -= wrote_bytes;
@@ -105,7 +1123,7 @@ void _goto_line_num_in_file(FILE * fp, int linenum) {
 	fseek(fp, 0, SEEK_SET);  /* reset the files seek to beginning */
 	int linecount = 1;
 	long char_count = 0;
-	char ch;
+	int ch;
 	/* loop through the file content until we reach the desired line or EOF*/
 	while(linecount != linenum && ((ch = getc(fp)) != EOF)) {
 		char_count++;  /*keeps record of bytes being read so that we can seek 
@@ -118,13 +1136,20 @@ void _goto_line_num_in_file(FILE * fp, int linenum) {
 	which is the starting byte of our desired line number*/
 };
 
+/* The log of the server we upload to, and the files that come with it. 
+Each server of --servers has a log of its own, named after it. */
+char log_name[64] = LOGFILE_NAME;
+char received_log_name[72] = RECEIVED_LOG;
+char log_tmp_name[72] = "tmp";
+
 /* this functions helps to replace the content  of a specifed line number
- which a provided string or stream of characters */
-void _replace_line(FILE *fp, int linenum, char * new_content) {
+ which a provided string or stream of characters. As the log file is 
+ replaced by a new one, the caller must use the returned file pointer. */
+FILE * _replace_line(FILE *fp, int linenum, char * new_content) {
 	fseek(fp, 0, SEEK_SET); /*seek to beginning of file*/
-	FILE * temp = fopen("tmp", "w"); /* create a temporary file*/
+	FILE * temp = fopen(log_tmp_name, "w"); /* create a temporary file*/
 	int linecount = 1;
-	char ch;
+	int ch; /* an int, so that a 0xff byte in a record isn't mistaken for EOF */
 	while((ch = getc(fp)) != EOF) {  /* we copy the entire content of original
 	file to this temp file, except for the line where replacement has to be done */
 		putc(ch, temp);
@@ -144,10 +1169,10 @@ void _replace_line(FILE *fp, int linenum, char * new_content) {
 	}
 	fclose(temp);
 	fclose(fp);
-	remove(LOGFILE_NAME);   /* delete the original file */
-	rename("tmp", LOGFILE_NAME); /* rename the temp file to the name of 
+	remove(log_name);   /* delete the original file */
+	rename(log_tmp_name, log_name); /* rename the temp file to the name of 
 	original file. now this is our updated original file*/
-	fp = fopen(LOGFILE_NAME, "r+"); /*we reopen this updated original file 
+	return fopen(log_name, "r+"); /*we reopen this updated original file 
 	so that we can further manipulate it */
 }
 
@@ -156,7 +1181,7 @@ char * _get_line_as_string(FILE * file, int linenum) {
 	_goto_line_num_in_file(file, linenum);  /* bring sek to the specified linenum*/
 	
 	char * linestring;
-	char ch;
+	int ch;
 	int line_length = 0; /* for storing number of character in line 2*/
 	while((ch = getc(file)) != '\n') { /* read line till the end of line */
 		line_length++;
@@ -164,333 +1189,6018 @@ char * _get_line_as_string(FILE * file, int linenum) {
 	/* now we have no. of character in the line. So we can allocate a memory
 	sufficient to hold this line and then store the line in a string */
 
-	linestring = (char *)malloc(line_length);
+	linestring = (char *)malloc(line_length + 1); /* one more for '\0' */
 	_goto_line_num_in_file(file, linenum);  /* we again position the seek to the
 	beginning of the specified */
-	fgets(linestring, line_length, file); /*we store line content into linestring*/
+	fgets(linestring, line_length + 1, file); /*we store line content into linestring*/
 
 	return linestring;
 }
 
-int _check_uploaded(char * filename, FILE * log) {
-	int uploaded = 0;
-	//TODO
-	client_log log_entry;
-	/* let's move to line from which structure entries start */
-	_goto_line_num_in_file(log, FILE_RECORD_LINE_NUMBER);
+/* whether a file still has the modification time which was logged. The
+nanoseconds are compared too unless the log had none (-1). */
+int _is_same_mtime(struct stat * file_stat, long mtime, long mtime_nsec) {
+	return file_stat->st_mtim.tv_sec == mtime && 
+		(mtime_nsec < 0 || file_stat->st_mtim.tv_nsec == mtime_nsec);
+};
 
-	/* then we iterate through each record and search 
-	for entry with the provided file name */
-	while(fread(&log_entry, sizeof(client_log), 1, log)) {
-		if(strcmp(log_entry.filename, filename) == 0 && 
-			log_entry.percentage_completion == 100) {
-			/* if file found and percentage completion is 100
-			 that means file is completely uploaded */
-			uploaded = 1;
-			break;
-		}
+/* tells whether the file has been changed since its upload was started, 
+judging by its size and modification time */
+int _is_modified_since_upload(client_log * log_entry, char * filename) {
+	struct stat file_stat;
+
+	if(stat(filename, &file_stat) < 0) {
+		return 0;
 	}
+	return file_stat.st_size != atol(log_entry->filesize) ||
+		!_is_same_mtime(&file_stat, log_entry->mtime, log_entry->mtime_nsec);
+};
 
-	return uploaded;
-}
+/* appends to a string builder, doubling its capacity when it is full so that
+long lists are built in linear time */
+void _append_to_string(struct string_builder * sb, const char * string) {
+	size_t length = strlen(string);
 
-/* This utility function scans the current client directory 
-to get all the files available for upload as a formatted string*/
-char * _get_files_to_be_uploaded(FILE * log) {
-	char *list = "\0", * buf; /*list will contain final string*/
-	char * temp; /* holds the formatted filename string */
-	struct dirent *dir;
-	DIR *dd = opendir(".");  /*Open the current directory*/
-	if(dd) {
-		while((dir = readdir(dd)) != NULL) { /*get all files in current dir*/
- 			/*we filter out some of the filenames.*/
-			if((strcmp(dir->d_name, "fclient") != 0) && 
-					(strcmp(dir->d_name, ".") != 0)  && 
-					(strcmp(dir->d_name, "..") != 0) &&
-					(strcmp(dir->d_name, LOGFILE_NAME) != 0) &&
-					(_check_uploaded(dir->d_name, log)) == 0) {  /* if the file is 
-					uploaded succesfully it must not appear in the list*/
-				
-				/*We hold the formatted string of filename in temp*/
-				temp = (char *)malloc(strlen(dir->d_name) + 4);
-				sprintf(temp, "'%s'\t", dir->d_name);
-
-				/*We allocate enough memory to the buffer */
-				buf = (char *)malloc(strlen(temp) + strlen(list) + 1);
-				/* we put the list into buffer. List contains the string creted 
-				till now */
-				strcpy(buf, list);
-				/* Then we concat the temporray formatted string which contains
-				the current filename, to the buf. Hence buf contain the latest
-				full filename list */
-				strcat(buf, temp);
-
-				/* We put back the buf into the list */
-				list = buf;
-				
-			}
-		}
-		/* return the prepared string of files to be uploaded */
-		return list;
+	if(sb->length + length + 1 > sb->capacity) {
+		while(sb->length + length + 1 > sb->capacity) {
+			sb->capacity = sb->capacity ? 2 * sb->capacity : 256;
+		}
+		sb->data = realloc(sb->data, sb->capacity);
+		if(sb->data == NULL) {
+			perror("Memory");
+			exit(EXIT_FAILURE);
+		}
 	}
+	memcpy(sb->data + sb->length, string, length + 1);
+	sb->length += length;
 };
 
-FILE * _initialise_log() {
-	FILE * fp = fopen(LOGFILE_NAME, "r+");  /*try reading the log file */
-	if(fp != NULL) {    /* if opened then return file pointer
-	 but, just update the files to be uploaded as there could be new files
-	  in the directory */
-		/* List of files to be sent is at line 2 of the file. 
-		  We replace this line with a new list of files. */
-		_replace_line(fp, 2, _get_files_to_be_uploaded(fp)); 
+/* FNV-1a hash of a string, used by the hash tables of the scanner */
+unsigned int _hash_string(const char * string) {
+	unsigned int hash = 2166136261U;
 
-		fseek(fp, 0L, SEEK_SET); /* Reset the seek to start */
-		return fp;
+	while(*string) {
+		hash ^= (unsigned char)*string++;
+		hash *= 16777619U;
 	}
-    // else log file doesnot exist. Hence, create it.
-	fp = fopen(LOGFILE_NAME, "w+");  /* mode is w+. we want to read and write both */ 
-		
-	/* Now we initialise the content of log file */
-	fprintf(fp, "File(s) to be sent:\n");
-	/* we get and print all the files to be uploaded*/ 
-	fprintf(fp, _get_files_to_be_uploaded(fp));
-	fprintf(fp, "\n---------------------------------------------------------");
-	fprintf(fp, "---------------------------------------------------------\n");
-	fprintf(fp, "Filename \t\t\t\t Filesize \t Start Time \t\t"); 
-	fprintf(fp, " Bytes Transferred \t %% Completed \t End Time \t\t"); 
-	fprintf(fp, " No. of Connections \t No. of Timeouts");
-	fprintf(fp, "\n---------------------------------------------------------");
-	fprintf(fp, "---------------------------------------------------------\n");
-	fflush(fp);
-	return fp;
+	return hash;
 };
 
-/* A wrapper function for recv() in order to wait for data until timer 
-	expires */
-int recv_with_timeout(int sock_fd, struct segment *buffer, size_t size, int timeout) {
-	fd_set fds;  /* create the FD set for select() */
-	int return_val;
-	struct timeval to;  /* timer initialisation */
+/* Reads the log once and puts every completely uploaded file into a hash 
+set, with the size and modification time it had, so that the scanner can 
+look a file up instead of reading the whole log again for each one. */
+void _load_completed_set(FILE * log, struct completed_set * set) {
+	client_log log_entry;
+	int count = 0, slot;
 
-	FD_ZERO(&fds);   /* set the fd set to zero */
-	FD_SET(sock_fd, &fds); /*add the sock_fd(the connected client socket) to fd set*/
+	set->capacity = 64;
+	set->slots = calloc(set->capacity, sizeof(struct completed_file));
 
-	to.tv_sec = timeout;   /* set the timeout value */
-	to.tv_usec = 0;
+	_goto_line_num_in_file(log, FILE_RECORD_LINE_NUMBER);
+	while(fread(&log_entry, sizeof(client_log), 1, log)) {
+		if(log_entry.percentage_completion != 100) continue;
 
-	return_val = select(sock_fd + 1, &fds, NULL, NULL, &to);   
-	/* wait until timeout occurs or data is received */
+		/* keep the table at most half full */
+		if(2 * (count + 1) > set->capacity) {
+			struct completed_set bigger;
+			bigger.capacity = 2 * set->capacity;
+			bigger.slots = calloc(bigger.capacity, sizeof(struct completed_file));
+			for(slot = 0; slot < set->capacity; slot++) {
+				if(set->slots[slot].filename[0] != '\0') {
+					int i = _hash_string(set->slots[slot].filename) & (bigger.capacity - 1);
+					while(bigger.slots[i].filename[0] != '\0') i = (i + 1) & (bigger.capacity - 1);
+					bigger.slots[i] = set->slots[slot];
+				}
+			}
+			free(set->slots);
+			*set = bigger;
+		}
 
-	if(return_val == -1) return -1;
-	if(return_val == 0) return TIMEOUT_OCCURED;
+		slot = _hash_string(log_entry.filename) & (set->capacity - 1);
+		while(set->slots[slot].filename[0] != '\0' && 
+			strcmp(set->slots[slot].filename, log_entry.filename) != 0) {
+			slot = (slot + 1) & (set->capacity - 1);
+		}
+		if(set->slots[slot].filename[0] == '\0') count++;
+		strcpy(set->slots[slot].filename, log_entry.filename);
+		set->slots[slot].filesize = atol(log_entry.filesize);
+		set->slots[slot].mtime = log_entry.mtime;
+		set->slots[slot].mtime_nsec = log_entry.mtime_nsec;
+	}
+};
+
+/* tells whether the file is uploaded completely and hasn't changed since */
+int _is_completed(struct completed_set * set, const char * filename, 
+	struct stat * file_stat) {
+	int slot = _hash_string(filename) & (set->capacity - 1);
 
-	return recv(sock_fd, buffer, size, 0);
+	while(set->slots[slot].filename[0] != '\0') {
+		if(strcmp(set->slots[slot].filename, filename) == 0) {
+			return set->slots[slot].filesize == file_stat->st_size &&
+				_is_same_mtime(file_stat, set->slots[slot].mtime, 
+				set->slots[slot].mtime_nsec);
+		}
+		slot = (slot + 1) & (set->capacity - 1);
+	}
+	return 0;
 };
 
-/*utility function to get file size */
-int _get_file_size(FILE * fp) {
-	int size;
-	fseek(fp, 0L, SEEK_END);
-	size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	return size;
+/* finds the record of a directory in the scan index, or NULL */
+struct scanned_dir * _find_in_scan_index(struct scan_index * index, const char * path) {
+	int slot;
+
+	if(index->capacity == 0) return NULL;
+	slot = _hash_string(path) & (index->capacity - 1);
+	while(index->slots[slot] != NULL) {
+		if(strcmp(index->slots[slot]->path, path) == 0) {
+			return index->slots[slot];
+		}
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	return NULL;
 };
 
-void _update_transfer_progress_in_log(client_log * log_entry, char * f_name,
-	unsigned int bytes_transferred, short percentage, FILE * log_file,
-	short flag) {
-	
-	client_log temp;
+/* adds the record of a directory to the scan index. Called with the lock of 
+the scanner held. */
+void _add_to_scan_index(struct scan_index * index, struct scanned_dir * dir) {
+	int slot, i;
 
-	/*first we move to part from where structure entry has to start */
+	if(2 * (index->count + 1) > index->capacity) {
+		struct scanned_dir ** old = index->slots;
+		int old_capacity = index->capacity;
+
+		index->capacity = old_capacity ? 2 * old_capacity : 64;
+		index->slots = calloc(index->capacity, sizeof(struct scanned_dir *));
+		for(i = 0; i < old_capacity; i++) {
+			if(old[i] == NULL) continue;
+			slot = _hash_string(old[i]->path) & (index->capacity - 1);
+			while(index->slots[slot] != NULL) slot = (slot + 1) & (index->capacity - 1);
+			index->slots[slot] = old[i];
+		}
+		free(old);
+	}
+	slot = _hash_string(dir->path) & (index->capacity - 1);
+	while(index->slots[slot] != NULL) slot = (slot + 1) & (index->capacity - 1);
+	index->slots[slot] = dir;
+	index->count++;
+};
+
+/* appends an entry to the listing of a directory */
+void _add_dir_entry(struct scanned_dir * dir, const char * name, int is_dir) {
+	if(dir->entry_count == dir->entry_capacity) {
+		dir->entry_capacity = dir->entry_capacity ? 2 * dir->entry_capacity : 16;
+		dir->entries = realloc(dir->entries, dir->entry_capacity * sizeof(char *));
+		dir->is_dir = realloc(dir->is_dir, dir->entry_capacity);
+	}
+	dir->entries[dir->entry_count] = strdup(name);
+	dir->is_dir[dir->entry_count] = is_dir;
+	dir->entry_count++;
+};
+
+void _free_scan_index(struct scan_index * index) {
+	int slot, i;
+
+	for(slot = 0; slot < index->capacity; slot++) {
+		struct scanned_dir * dir = index->slots[slot];
+		if(dir == NULL) continue;
+		for(i = 0; i < dir->entry_count; i++) free(dir->entries[i]);
+		free(dir->entries);
+		free(dir->is_dir);
+		free(dir->path);
+		free(dir);
+	}
+	free(index->slots);
+};
+
+/* Loads the scan index of the last run. It holds, for every directory, its
+modification time and its entries, one per line:
+	D <seconds> <nanoseconds> <path>
+	d <name>   (a subdirectory)
+	f <name>   (a regular file)
+A directory whose modification time is unchanged still has the same 
+entries, so it needn't be read again. */
+void _load_scan_index(struct scan_index * index) {
+	FILE * fp = fopen(SCAN_INDEX_NAME, "r");
+	char * line = NULL;
+	size_t line_capacity = 0;
+	ssize_t length;
+	struct scanned_dir * dir = NULL;
+
+	memset(index, 0, sizeof(*index));
+	if(fp == NULL) return;
+
+	while((length = getline(&line, &line_capacity, fp)) > 0) {
+		if(line[length - 1] == '\n') line[--length] = '\0';
+		if(line[0] == 'D') {
+			int path_start = 0;
+			dir = calloc(1, sizeof(struct scanned_dir));
+			if(sscanf(line, "D %ld %ld %n", &dir->mtime_sec, &dir->mtime_nsec, 
+				&path_start) != 2 || path_start == 0) {
+				free(dir);
+				dir = NULL;
+				continue;
+			}
+			dir->path = strdup(line + path_start);
+			_add_to_scan_index(index, dir);
+		}
+		else if(dir != NULL && length > 2 && (line[0] == 'd' || line[0] == 'f')) {
+			_add_dir_entry(dir, line + 2, line[0] == 'd');
+		}
+	}
+	free(line);
+	fclose(fp);
+};
+
+/* writes the index of this run, to a temporary file renamed over the old one
+so that an interrupted run leaves a usable index */
+void _save_scan_index(struct scan_index * index) {
+	FILE * fp = fopen(SCAN_INDEX_NAME ".tmp", "w");
+	int slot, i;
+
+	if(fp == NULL) return;
+	for(slot = 0; slot < index->capacity; slot++) {
+		struct scanned_dir * dir = index->slots[slot];
+		if(dir == NULL) continue;
+		fprintf(fp, "D %ld %ld %s\n", dir->mtime_sec, dir->mtime_nsec, dir->path);
+		for(i = 0; i < dir->entry_count; i++) {
+			fprintf(fp, "%c %s\n", dir->is_dir[i] ? 'd' : 'f', dir->entries[i]);
+		}
+	}
+	fclose(fp);
+	rename(SCAN_INDEX_NAME ".tmp", SCAN_INDEX_NAME);
+};
+
+
+/* the files of the client itself, which are never uploaded */
+int _is_own_file(const char * name) {
+	return strcmp(name, "fclient") == 0 || strcmp(name, LOGFILE_NAME) == 0 ||
+		strncmp(name, LOGFILE_NAME ".", strlen(LOGFILE_NAME ".")) == 0 ||
+		strcmp(name, SERVERS_FILE_NAME) == 0 ||
+		strcmp(name, RECEIVED_LOG) == 0 || strcmp(name, "tmp") == 0 ||
+		strcmp(name, SCAN_INDEX_NAME) == 0 || strcmp(name, SCAN_INDEX_NAME ".tmp") == 0 ||
+		strcmp(name, TRACE_FILE_NAME) == 0;
+};
+
+/* Reads the entries of a directory with getdents64(), which returns many of
+them per system call. Names with a newline can't be kept in the index or the log,
+so such entries are left out. */
+void _read_dir_entries(int dir_fd, struct scanned_dir * dir) {
+	char buffer[SCAN_BUFFER_SIZE];
+	struct linux_dirent64 * entry;
+	struct stat entry_stat;
+	long read_bytes, position;
+	int is_dir;
+
+	while((read_bytes = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer))) > 0) {
+		for(position = 0; position < read_bytes; position += entry->d_reclen) {
+			entry = (struct linux_dirent64 *)(buffer + position);
+			if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+				strchr(entry->d_name, '\n') != NULL) {
+				continue;
+			}
+			if(entry->d_type == DT_UNKNOWN) {
+				/* some filesystems don't fill in the type */
+				if(fstatat(dir_fd, entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+					continue;
+				}
+				if(S_ISDIR(entry_stat.st_mode)) is_dir = 1;
+				else if(S_ISREG(entry_stat.st_mode)) is_dir = 0;
+				else continue;
+			}
+			else if(entry->d_type == DT_DIR) is_dir = 1;
+			else if(entry->d_type == DT_REG) is_dir = 0;
+			else continue;  /* symbolic links, devices, sockets ... */
+
+			_add_dir_entry(dir, entry->d_name, is_dir);
+		}
+	}
+};
+
+/* Thread routine of the scanner. Takes directories off the queue, lists 
+them (from the index of the last run if they haven't changed), queues their
+subdirectories and collects the files which are still to be uploaded. */
+void * _scan_directories(void * arg) {
+	struct scanner * scanner = (struct scanner *)arg;
+	struct scanned_dir * dir, * old_dir;
+	struct stat dir_stat, file_stat;
+	char * path, * child;
+	int dir_fd, i;
+
+	while(1) {
+		pthread_mutex_lock(&scanner->lock);
+		while(scanner->queue_length == 0 && scanner->busy > 0) {
+			pthread_cond_wait(&scanner->changed, &scanner->lock);
+		}
+		if(scanner->queue_length == 0) {
+			/* nothing queued and nobody who could queue more */
+			pthread_mutex_unlock(&scanner->lock);
+			return NULL;
+		}
+		path = scanner->queue[--scanner->queue_length];
+		scanner->busy++;
+		pthread_mutex_unlock(&scanner->lock);
+
+		dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+		if(dir_fd >= 0 && fstat(dir_fd, &dir_stat) == 0) {
+			dir = calloc(1, sizeof(struct scanned_dir));
+			dir->path = path;
+			dir->mtime_sec = dir_stat.st_mtim.tv_sec;
+			dir->mtime_nsec = dir_stat.st_mtim.tv_nsec;
+
+			old_dir = _find_in_scan_index(&scanner->old_index, path);
+			if(old_dir != NULL && old_dir->mtime_sec == dir->mtime_sec && 
+				old_dir->mtime_nsec == dir->mtime_nsec) {
+				/* unchanged since the last run, so are its entries */
+				for(i = 0; i < old_dir->entry_count; i++) {
+					_add_dir_entry(dir, old_dir->entries[i], old_dir->is_dir[i]);
+				}
+			}
+			else {
+				_read_dir_entries(dir_fd, dir);
+			}
+
+			for(i = 0; i < dir->entry_count; i++) {
+				if(strcmp(path, ".") == 0) {
+					if(_is_own_file(dir->entries[i])) continue;
+					child = strdup(dir->entries[i]);
+				}
+				else {
+					child = malloc(strlen(path) + strlen(dir->entries[i]) + 2);
+					sprintf(child, "%s/%s", path, dir->entries[i]);
+				}
+
+				if(dir->is_dir[i]) {
+					pthread_mutex_lock(&scanner->lock);
+					if(scanner->queue_length == scanner->queue_capacity) {
+						scanner->queue_capacity *= 2;
+						scanner->queue = realloc(scanner->queue, 
+							scanner->queue_capacity * sizeof(char *));
+					}
+					scanner->queue[scanner->queue_length++] = child;
+					pthread_cond_signal(&scanner->changed);
+					pthread_mutex_unlock(&scanner->lock);
+				}
+				else if(fstatat(dir_fd, dir->entries[i], &file_stat, 0) == 0 &&
+					!_is_completed(&scanner->completed, child, &file_stat)) {
+					pthread_mutex_lock(&scanner->lock);
+					if(scanner->file_count == scanner->file_capacity) {
+						scanner->file_capacity = scanner->file_capacity ? 
+							2 * scanner->file_capacity : 64;
+						scanner->files = realloc(scanner->files, 
+							scanner->file_capacity * sizeof(char *));
+					}
+					scanner->files[scanner->file_count++] = child;
+					pthread_mutex_unlock(&scanner->lock);
+				}
+				else {
+					free(child);
+				}
+			}
+
+			pthread_mutex_lock(&scanner->lock);
+			_add_to_scan_index(&scanner->new_index, dir);
+			pthread_mutex_unlock(&scanner->lock);
+		}
+		else {
+			free(path);
+		}
+		if(dir_fd >= 0) close(dir_fd);
+
+		pthread_mutex_lock(&scanner->lock);
+		scanner->busy--;
+		pthread_cond_broadcast(&scanner->changed);
+		pthread_mutex_unlock(&scanner->lock);
+	}
+};
+
+int _compare_strings(const void * a, const void * b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+};
+
+/* This utility function scans the client directory and everything below it
+to get all the files available for upload as a formatted string. The tree
+is walked by a pool of threads, as on large trees the time goes into the
+stat() of every file. */
+char * _get_files_to_be_uploaded(FILE * log) {
+	struct scanner scanner;
+	struct string_builder list = {0};
+	pthread_t threads[MAX_SCAN_THREADS];
+	int thread_count, i;
+
+	memset(&scanner, 0, sizeof(scanner));
+	pthread_mutex_init(&scanner.lock, NULL);
+	pthread_cond_init(&scanner.changed, NULL);
+	_load_completed_set(log, &scanner.completed);
+	_load_scan_index(&scanner.old_index);
+
+	scanner.queue_capacity = 64;
+	scanner.queue = malloc(scanner.queue_capacity * sizeof(char *));
+	scanner.queue[scanner.queue_length++] = strdup(".");
+
+	thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if(thread_count > MAX_SCAN_THREADS) thread_count = MAX_SCAN_THREADS;
+	if(thread_count < 1) thread_count = 1;
+	for(i = 0; i < thread_count; i++) {
+		if(pthread_create(&threads[i], NULL, _scan_directories, &scanner) != 0) {
+			perror("Scanning thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	_save_scan_index(&scanner.new_index);
+
+	/* the threads find files in no particular order */
+	qsort(scanner.files, scanner.file_count, sizeof(char *), _compare_strings);
+	_append_to_string(&list, "");
+	for(i = 0; i < scanner.file_count; i++) {
+		_append_to_string(&list, "'");
+		_append_to_string(&list, scanner.files[i]);
+		_append_to_string(&list, "'\t");
+		free(scanner.files[i]);
+	}
+
+	free(scanner.files);
+	free(scanner.queue);
+	free(scanner.completed.slots);
+	_free_scan_index(&scanner.old_index);
+	_free_scan_index(&scanner.new_index);
+	/* return the prepared string of files to be uploaded */
+	return list.data;
+};
+
+/* whether a log has records of the layout we write, as its first line tells */
+int _is_current_log(FILE * fp) {
+	char line[BUFFER_SIZE];
+	int current;
+
+	fseek(fp, 0L, SEEK_SET);
+	current = fgets(line, sizeof(line), fp) != NULL && strstr(line, LOG_VERSION) != NULL;
+	fseek(fp, 0L, SEEK_SET);
+	return current;
+};
+
+/* Records of the logs of older builds. Those which wrote no version had 
+no mtime at first, sizes of 11 digits before sparse files were sent and
+names of 72 bytes before subdirectories were synced. The builds which tuned
+the block size wrote the record of version 2, still without a version at
+first, and only whole seconds of mtime. */
+struct log_record_v2 {
+	char filename[256];
+	char filesize[21];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+	long mtime;
+	unsigned int block_size;
+	unsigned int send_buffer;
+	unsigned int rtt;
+};
+
+struct log_record_v0 {
+	char filename[72];
+	char filesize[11];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+};
+
+struct log_record_v0_mtime {
+	char filename[72];
+	char filesize[11];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+	long mtime;
+};
+
+struct log_record_v0_long_sizes {
+	char filename[72];
+	char filesize[21];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+	long mtime;
+};
+
+struct log_record_v0_long_names {
+	char filename[256];
+	char filesize[21];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+	long mtime;
+};
+
+#define OLD_LOG_LAYOUTS 5
+
+/* Takes the fields of an old record into one of ours. Returns 0 if they 
+don't look like a record, which tells the layouts apart where their sizes 
+don't. */
+int _take_old_record(client_log * record, const char * filename, int filename_size, 
+	const char * filesize, int filesize_size, const char * start_time, 
+	const char * end_time, unsigned long bytes_transferred, 
+	unsigned short percentage_completion, unsigned int connection_count,
+	unsigned int timeout_count, long mtime) {
+	if(filename[0] == '\0' || memchr(filename, '\0', filename_size) == NULL ||
+		memchr(filesize, '\0', filesize_size) == NULL || 
+		strspn(filesize, "0123456789") != strlen(filesize) ||
+		memchr(start_time, '\0', 18) == NULL || memchr(end_time, '\0', 18) == NULL ||
+		percentage_completion > 100) {
+		return 0;
+	}
+	memset(record, 0, sizeof(client_log));
+	strcpy(record->filename, filename);
+	strcpy(record->filesize, filesize);
+	strcpy(record->start_time, start_time);
+	strcpy(record->end_time, end_time);
+	record->bytes_transferred = bytes_transferred;
+	record->percentage_completion = percentage_completion;
+	record->connection_count = connection_count;
+	record->timeout_count = timeout_count;
+	record->mtime = mtime;
+	record->mtime_nsec = -1;
+	return 1;
+};
+
+/* Converts the old record at data, of the given layout, returning 0 if it
+isn't a record of that layout. A record of the first layout gets mtime 0, so
+its file is sent again as changed, which the delta keeps short. */
+int _convert_old_record(int layout, const unsigned char * data, client_log * record) {
+	struct log_record_v0 v0;
+	struct log_record_v0_mtime with_mtime;
+	struct log_record_v0_long_sizes long_sizes;
+	struct log_record_v0_long_names long_names;
+	struct log_record_v2 v2;
+
+	switch(layout) {
+		case 0:
+			memcpy(&v2, data, sizeof(v2));
+			if(!_take_old_record(record, v2.filename, sizeof(v2.filename), 
+				v2.filesize, sizeof(v2.filesize), v2.start_time, v2.end_time, 
+				v2.bytes_transferred, v2.percentage_completion, v2.connection_count, 
+				v2.timeout_count, v2.mtime)) {
+				return 0;
+			}
+			record->block_size = v2.block_size;
+			record->send_buffer = v2.send_buffer;
+			record->rtt = v2.rtt;
+			return 1;
+		case 1:
+			memcpy(&long_names, data, sizeof(long_names));
+			return _take_old_record(record, long_names.filename, sizeof(long_names.filename), 
+				long_names.filesize, sizeof(long_names.filesize), long_names.start_time,
+				long_names.end_time, long_names.bytes_transferred, 
+				long_names.percentage_completion, long_names.connection_count, 
+				long_names.timeout_count, long_names.mtime);
+		case 2:
+			memcpy(&long_sizes, data, sizeof(long_sizes));
+			return _take_old_record(record, long_sizes.filename, sizeof(long_sizes.filename), 
+				long_sizes.filesize, sizeof(long_sizes.filesize), long_sizes.start_time,
+				long_sizes.end_time, long_sizes.bytes_transferred, 
+				long_sizes.percentage_completion, long_sizes.connection_count, 
+				long_sizes.timeout_count, long_sizes.mtime);
+		case 3:
+			memcpy(&with_mtime, data, sizeof(with_mtime));
+			return _take_old_record(record, with_mtime.filename, sizeof(with_mtime.filename), 
+				with_mtime.filesize, sizeof(with_mtime.filesize), with_mtime.start_time,
+				with_mtime.end_time, with_mtime.bytes_transferred, 
+				with_mtime.percentage_completion, with_mtime.connection_count, 
+				with_mtime.timeout_count, with_mtime.mtime);
+		default:
+			memcpy(&v0, data, sizeof(v0));
+			return _take_old_record(record, v0.filename, sizeof(v0.filename), 
+				v0.filesize, sizeof(v0.filesize), v0.start_time, v0.end_time, 
+				v0.bytes_transferred, v0.percentage_completion, v0.connection_count, 
+				v0.timeout_count, 0);
+	}
+};
+
+void _write_log_header(FILE * fp, const char * files) {
+	fprintf(fp, "File(s) to be sent: " LOG_VERSION "\n");
+	fputs(files, fp);
+	fprintf(fp, "\n---------------------------------------------------------");
+	fprintf(fp, "---------------------------------------------------------\n");
+	fprintf(fp, "Filename \t\t\t\t Filesize \t Start Time \t\t"); 
+	fprintf(fp, " Bytes Transferred \t %% Completed \t End Time \t\t"); 
+	fprintf(fp, " No. of Connections \t No. of Timeouts \t Block Size \t RTT (us)");
+	fprintf(fp, "\n---------------------------------------------------------");
+	fprintf(fp, "---------------------------------------------------------\n");
+};
+
+/* Converts the log of an older build into a new one, finding its layout by which of them its records fit. A log of a
+layout we don't know is only set aside, with a warning, as the uploads in
+it are then started afresh. The old log is kept beside the new one, whose
+list of files is left for _initialise_log() to fill in. */
+FILE * _migrate_old_log(FILE * fp, const char * name) {
+	size_t sizes[OLD_LOG_LAYOUTS] = {sizeof(struct log_record_v2), 
+		sizeof(struct log_record_v0_long_names), sizeof(struct log_record_v0_long_sizes),
+		sizeof(struct log_record_v0_mtime), sizeof(struct log_record_v0)};
+	char old_name[sizeof(log_name) + 8];
+	unsigned char * data;
+	client_log * records;
+	long start, length, count = -1, i;
+	int layout, lines = 0, ch;
+
+	fseek(fp, 0L, SEEK_SET);
+	while(lines < FILE_RECORD_LINE_NUMBER - 1 && (ch = getc(fp)) != EOF) {
+		if(ch == '\n') lines++;
+	}
+	start = ftell(fp);
+	fseek(fp, 0L, SEEK_END);
+	length = ftell(fp) - start;
+	data = (unsigned char *)malloc(length + 1);
+	fseek(fp, start, SEEK_SET);
+	length = fread(data, 1, length, fp);
+	fclose(fp);
+
+	records = (client_log *)malloc((length / sizeof(struct log_record_v0) + 1) * 
+		sizeof(client_log));
+	for(layout = 0; layout < OLD_LOG_LAYOUTS && count < 0; layout++) {
+		if(length % sizes[layout] != 0) continue;
+		count = length / sizes[layout];
+		for(i = 0; i < count; i++) {
+			if(!_convert_old_record(layout, data + i * sizes[layout], &records[i])) {
+				count = -1;
+				break;
+			}
+		}
+	}
+	free(data);
+
+	snprintf(old_name, sizeof(old_name), "%s.old", name);
+	rename(name, old_name);
+	if(count < 0) {
+		printf("\n%s was written by an older fclient, in a layout we can't read. It was "
+			"kept as %s, and a new log is started.\n", name, old_name);
+		count = 0;
+	}
+	else {
+		printf("\nConverted %ld record(s) of %s, written by an older fclient. The old log "
+			"was kept as %s.\n", count, name, old_name);
+	}
+	fp = fopen(name, "w+");
+	if(fp == NULL) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	_write_log_header(fp, "");
+	fwrite(records, sizeof(client_log), count, fp);
+	fflush(fp);
+	free(records);
+	return fp;
+};
+
+FILE * _initialise_log() {
+	FILE * fp = fopen(log_name, "r+");  /*try reading the log file */
+	if(fp != NULL) {    /* if opened then return file pointer
+	 but, just update the files to be uploaded as there could be new files
+	  in the directory */
+		if(!_is_current_log(fp)) fp = _migrate_old_log(fp, log_name);
+		/* List of files to be sent is at line 2 of the file. 
+		  We replace this line with a new list of files. */
+		fp = _replace_line(fp, 2, _get_files_to_be_uploaded(fp)); 
+
+		fseek(fp, 0L, SEEK_SET); /* Reset the seek to start */
+		return fp;
+	}
+    // else log file doesnot exist. Hence, create it.
+	fp = fopen(log_name, "w+");  /* mode is w+. we want to read and write both */ 
+		
+	/* Now we initialise the content of log file, with all the files to be 
+	uploaded */
+	_write_log_header(fp, _get_files_to_be_uploaded(fp));
+	fflush(fp);
+	return fp;
+};
+
+/* A wrapper function for recv() in order to wait for data until timer 
+	expires */
+int recv_with_timeout(int sock_fd, struct segment *buffer, size_t size, int timeout) {
+	fd_set fds;  /* create the FD set for select() */
+	int return_val;
+	struct timeval to;  /* timer initialisation */
+
+	FD_ZERO(&fds);   /* set the fd set to zero */
+	FD_SET(sock_fd, &fds); /*add the sock_fd(the connected client socket) to fd set*/
+
+	to.tv_sec = timeout;   /* set the timeout value */
+	to.tv_usec = 0;
+
+	return_val = select(sock_fd + 1, &fds, NULL, NULL, &to);   
+	/* wait until timeout occurs or data is received */
+
+	if(return_val == -1) return -1;
+	if(return_val == 0) return TIMEOUT_OCCURED;
+
+	/* MSG_WAITALL as a segment can arrive split across several tcp reads */
+	return recv(sock_fd, buffer, size, MSG_WAITALL);
+};
+
+/*utility function to get file size */
+long _get_file_size(FILE * fp) {
+	long size;
+	fseek(fp, 0L, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0L, SEEK_SET);
+	return size;
+};
+
+/* A wrapper for send() which doesn't return until all of the data is sent */
+void send_all(int sock_fd, void * data, size_t size) {
+	char * position = data;
+	ssize_t sent_bytes;
+
+	while(size > 0) {
+		sent_bytes = send(sock_fd, position, size, 0);
+		if(sent_bytes < 0) {
+			perror("Sending");
+			exit(EXIT_FAILURE);
+		}
+		position += sent_bytes;
+		size -= sent_bytes;
+	}
+};
+
+#ifdef USE_KTLS
+/* Keeps the traffic secrets of a TLS 1.3 connection, which OpenSSL hands 
+to its key log callback, so that the keys for the kernel can be derived 
+from them once the handshake is done. */
+void _keep_tls_secret(const SSL * ssl, const char * line) {
+	struct tls_secrets * secrets = (struct tls_secrets *)SSL_get_app_data(ssl);
+	char label[64], hex[2 * EVP_MAX_MD_SIZE + 1];
+	unsigned char * secret;
+	int * length, i;
+
+	if(secrets == NULL || sscanf(line, "%63s %*s %128s", label, hex) != 2) return;
+	if(strcmp(label, "CLIENT_TRAFFIC_SECRET_0") == 0) {
+		secret = secrets->client;
+		length = &secrets->client_length;
+	}
+	else if(strcmp(label, "SERVER_TRAFFIC_SECRET_0") == 0) {
+		secret = secrets->server;
+		length = &secrets->server_length;
+	}
+	else return;
+
+	*length = strlen(hex) / 2;
+	for(i = 0; i < *length; i++) sscanf(hex + 2 * i, "%2hhx", &secret[i]);
+	OPENSSL_cleanse(hex, sizeof(hex));
+};
+
+/* HKDF-Expand-Label of TLS 1.3 with SHA-256 and no context, for no more 
+than one hash of output */
+void _tls13_expand_label(const unsigned char * secret, int secret_length, 
+	const char * label, unsigned char * out, int length) {
+	unsigned char info[64], block[EVP_MAX_MD_SIZE];
+	unsigned int block_length;
+	int label_length = strlen(label), n = 0;
+
+	info[n++] = length >> 8;
+	info[n++] = length & 0xff;
+	info[n++] = 6 + label_length;
+	memcpy(info + n, "tls13 ", 6);
+	n += 6;
+	memcpy(info + n, label, label_length);
+	n += label_length;
+	info[n++] = 0;  /* empty context */
+	info[n++] = 1;  /* the first block of HKDF-Expand is all we need */
+	HMAC(EVP_sha256(), secret, secret_length, info, n, block, &block_length);
+	memcpy(out, block, length);
+	OPENSSL_cleanse(block, sizeof(block));
+};
+
+/* puts the key of one direction into the kernel, record numbers from 0 */
+int _install_tls_key(int sock_fd, int direction, const unsigned char * secret, int length) {
+	struct tls12_crypto_info_aes_gcm_128 info;
+	unsigned char iv[TLS_CIPHER_AES_GCM_128_SALT_SIZE + TLS_CIPHER_AES_GCM_128_IV_SIZE];
+	int result;
+
+	memset(&info, 0, sizeof(info));
+	info.info.version = TLS_1_3_VERSION;
+	info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+	_tls13_expand_label(secret, length, "key", info.key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+	_tls13_expand_label(secret, length, "iv", iv, sizeof(iv));
+	memcpy(info.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+	memcpy(info.iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+
+	result = setsockopt(sock_fd, SOL_TLS, direction, &info, sizeof(info));
+	OPENSSL_cleanse(&info, sizeof(info));
+	OPENSSL_cleanse(iv, sizeof(iv));
+	return result;
+};
+
+/* Hands the connection over to kernel TLS once the handshake is done. The
+kernel then encrypts and decrypts every record with AES-GCM (AES-NI where 
+the cpu has it), and send(), recv() and sendfile() keep working on the 
+socket as they do in clear text. Returns 0 if the kernel can't. */
+int _enter_kernel_tls(int sock_fd, struct tls_secrets * secrets, int is_client) {
+	int ok;
+
+	if(secrets->client_length == 0 || secrets->server_length == 0) return 0;
+	ok = setsockopt(sock_fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 &&
+		_install_tls_key(sock_fd, TLS_TX, is_client ? secrets->client : secrets->server,
+			is_client ? secrets->client_length : secrets->server_length) == 0 &&
+		_install_tls_key(sock_fd, TLS_RX, is_client ? secrets->server : secrets->client,
+			is_client ? secrets->server_length : secrets->client_length) == 0;
+	OPENSSL_cleanse(secrets, sizeof(struct tls_secrets));
+	return ok;
+};
+
+/* Creates the context of our TLS connections, which trust the server only
+with the given certificate, or one signed by it. Only TLS 1.3 with 
+AES-128-GCM is offered, as the kernel takes that over. */
+void _create_tls_context(char * certificate) {
+	tls_context = SSL_CTX_new(TLS_client_method());
+	if(tls_context == NULL ||
+		!SSL_CTX_set_min_proto_version(tls_context, TLS1_3_VERSION) ||
+		!SSL_CTX_set_ciphersuites(tls_context, TLS_CIPHERSUITE) ||
+		SSL_CTX_load_verify_locations(tls_context, certificate, NULL) != 1) {
+		ERR_print_errors_fp(stderr);
+		printf("\nCan't set up TLS with %s.\n", certificate);
+		exit(EXIT_FAILURE);
+	}
+	SSL_CTX_clear_options(tls_context, SSL_OP_ENABLE_MIDDLEBOX_COMPAT);
+	SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_keylog_callback(tls_context, _keep_tls_secret);
+};
+
+/* Does a TLS 1.3 handshake with the server on a new connection, in user 
+space, and leaves the encryption of the connection to the kernel from then
+on. Nothing happens without --tls. */
+void _start_tls(int sock_fd) {
+	struct tls_secrets secrets = {0};
+	SSL * ssl;
+
+	if(tls_context == NULL) return;
+	ssl = SSL_new(tls_context);
+	SSL_set_app_data(ssl, &secrets);
+	SSL_set_fd(ssl, sock_fd);
+	/* the certificate has to be for the address we connect to */
+	struct sockaddr_in server_addr;
+	socklen_t len = sizeof(server_addr);
+	char address[INET_ADDRSTRLEN] = SERVER_IP;
+	if(getpeername(sock_fd, (struct sockaddr *)&server_addr, &len) == 0) {
+		inet_ntop(AF_INET, &server_addr.sin_addr, address, sizeof(address));
+	}
+	X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), address);
+	if(SSL_connect(ssl) != 1) {
+		ERR_print_errors_fp(stderr);
+		printf("\nTLS handshake with the server failed.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(!_enter_kernel_tls(sock_fd, &secrets, 1)) {
+		perror("Kernel TLS (is the tls module loaded?)");
+		exit(EXIT_FAILURE);
+	}
+	/* the socket isn't closed with it */
+	SSL_free(ssl);
+};
+#else
+void _start_tls(int sock_fd) {
+	/* built without kernel TLS, connections are in clear text */
+	(void)sock_fd;
+};
+#endif
+
+/* utility function which tells on how many threads the hashing of 
+a file should be spread */
+int _get_hashing_thread_count(int leaf_count) {
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(threads > MAX_HASH_THREADS) threads = MAX_HASH_THREADS;
+	if(threads > leaf_count) threads = leaf_count;
+	if(threads < 1) threads = 1;
+	return threads;
+};
+
+/* Returns where the hole of a sparse file which starts at `offset` ends,
+limited to `limit`. If there is data at `offset` that is `offset` itself.
+Filesystems without SEEK_DATA report the whole file as data. */
+/* tells whether the server is on this host, that is, whether the connection
+leads back to our own address */
+int _is_same_host(int sock_fd) {
+	struct sockaddr_in peer, own;
+	socklen_t len = sizeof(peer);
+
+	if(getpeername(sock_fd, (struct sockaddr *)&peer, &len) < 0) return 0;
+	len = sizeof(own);
+	if(getsockname(sock_fd, (struct sockaddr *)&own, &len) < 0) return 0;
+	return peer.sin_family == AF_INET && peer.sin_addr.s_addr == own.sin_addr.s_addr;
+};
+
+/* fills in where the server finds the open file on this host. Returns 0
+if the file can't be described. */
+int _describe_local_source(FILE * file, char * filename, struct local_source * source) {
+	struct stat file_stat;
+	char * path = realpath(filename, NULL);
+
+	if(path == NULL) return 0;
+	if(strlen(path) >= LOCAL_PATH_SIZE || fstat(fileno(file), &file_stat) < 0) {
+		free(path);
+		return 0;
+	}
+	strcpy(source->path, path);
+	source->dev = file_stat.st_dev;
+	source->ino = file_stat.st_ino;
+	source->size = file_stat.st_size;
+	free(path);
+	return 1;
+};
+
+long _get_hole_end(int fd, long offset, long limit) {
+	off_t data = lseek(fd, offset, SEEK_DATA);
+
+	if(data < 0 || data > limit) {
+		/* ENXIO means there is no data after offset at all */
+		return (data < 0 && errno != ENXIO) ? offset : limit;
+	}
+	return data;
+};
+
+/* thread routine which hashes a contiguous set of leaves of the tree */
+void * _hash_leaves(void * arg) {
+	struct hash_job * job = (struct hash_job *)arg;
+	struct merkle_tree * tree = job->tree;
+	unsigned char * leaf_data = (unsigned char *)malloc(MERKLE_LEAF_SIZE);
+	long offset, leaf_length;
+	ssize_t read_bytes, got;
+	unsigned char zero_hash[HASH_SIZE];
+	int leaf, have_zero_hash = 0;
+
+	for(leaf = job->first_leaf; leaf < job->last_leaf; leaf++) {
+		offset = (long)leaf * MERKLE_LEAF_SIZE;
+		leaf_length = tree->length - offset;
+		if(leaf_length > MERKLE_LEAF_SIZE) leaf_length = MERKLE_LEAF_SIZE;
+
+		/* a leaf inside a hole of a sparse file reads as zeros, and every 
+		full one of them has the same hash, so it is only computed once */
+		if(_get_hole_end(job->fd, offset, offset + leaf_length) == offset + leaf_length) {
+			if(leaf_length == MERKLE_LEAF_SIZE && have_zero_hash) {
+				memcpy(tree->nodes[tree->width + leaf], zero_hash, HASH_SIZE);
+				continue;
+			}
+			memset(leaf_data, 0, leaf_length);
+			_sha256(leaf_data, leaf_length, tree->nodes[tree->width + leaf]);
+			if(leaf_length == MERKLE_LEAF_SIZE) {
+				memcpy(zero_hash, tree->nodes[tree->width + leaf], HASH_SIZE);
+				have_zero_hash = 1;
+			}
+			continue;
+		}
+
+		/* pread() as all the threads share the same file descriptor. If
+		the file is shorter than expected we hash whatever is there and the 
+		leaf will simply not match. */
+		got = 0;
+		while(got < leaf_length) {
+			read_bytes = pread(job->fd, leaf_data + got, leaf_length - got,
+				offset + got);
+			if(read_bytes <= 0) break;
+			got += read_bytes;
+		}
+		_sha256(leaf_data, got, tree->nodes[tree->width + leaf]);
+	}
+
+	free(leaf_data);
+	return NULL;
+};
+
+/* builds the hash tree over the first `length` bytes of the file. Leaves are
+hashed in parallel on all cores, inner nodes are cheap and are done here. */
+void _build_merkle_tree(int fd, long length, struct merkle_tree * tree) {
+	pthread_t threads[MAX_HASH_THREADS];
+	struct hash_job jobs[MAX_HASH_THREADS];
+	unsigned char pair[2 * HASH_SIZE];
+	int thread_count, i, node;
+
+	tree->length = length;
+	tree->leaf_count = (length + MERKLE_LEAF_SIZE - 1) / MERKLE_LEAF_SIZE;
+	tree->width = 1;
+	while(tree->width < tree->leaf_count) tree->width *= 2;
+	tree->nodes = calloc(2 * tree->width, HASH_SIZE);
+	if(tree->nodes == NULL) {
+		perror("Hash tree");
+		exit(EXIT_FAILURE);
+	}
+
+	thread_count = _get_hashing_thread_count(tree->leaf_count);
+	for(i = 0; i < thread_count; i++) {
+		jobs[i].fd = fd;
+		jobs[i].tree = tree;
+		jobs[i].first_leaf = (long)tree->leaf_count * i / thread_count;
+		jobs[i].last_leaf = (long)tree->leaf_count * (i + 1) / thread_count;
+		if(pthread_create(&threads[i], NULL, _hash_leaves, &jobs[i]) != 0) {
+			perror("Hashing thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* every inner node is the hash of its two children */
+	for(node = tree->width - 1; node >= 1; node--) {
+		memcpy(pair, tree->nodes[2 * node], HASH_SIZE);
+		memcpy(pair + HASH_SIZE, tree->nodes[2 * node + 1], HASH_SIZE);
+		_sha256(pair, sizeof(pair), tree->nodes[node]);
+	}
+};
+
+/* Walks down the server's hash tree starting at the root, only descending 
+into subtrees whose hash differs from ours. Returns the no. of leaves which 
+didn't match and stores their index in corrupt_leaves. */
+int _find_corrupt_leaves(int sock_fd, struct merkle_tree * tree,
+	int * corrupt_leaves) {
+	struct merkle_query query;
+	unsigned char (* hashes)[HASH_SIZE] = malloc(MERKLE_QUERY_MAX * HASH_SIZE);
+	int * level = (int *)malloc(2 * tree->width * sizeof(int));
+	int * next_level = (int *)malloc(2 * tree->width * sizeof(int));
+	int * swap;
+	int level_count = 1, next_count, corrupt_count = 0;
+	int done, i, node;
+
+	level[0] = 1; /* we start at the root */
+
+	while(level_count > 0) {
+		next_count = 0;
+		/* ask for the hashes of this level in batches of MERKLE_QUERY_MAX */
+		for(done = 0; done < level_count; done += query.count) {
+			query.count = level_count - done;
+			if(query.count > MERKLE_QUERY_MAX) query.count = MERKLE_QUERY_MAX;
+			memcpy(query.nodes, level + done, query.count * sizeof(int));
+
+			send_all(sock_fd, &query, sizeof(query));
+			if(recv(sock_fd, hashes, query.count * HASH_SIZE, MSG_WAITALL) !=
+				query.count * HASH_SIZE) {
+				printf("\nConnection lost while verifying the partial upload.\n");
+				exit(EXIT_FAILURE);
+			}
+
+			for(i = 0; i < query.count; i++) {
+				node = query.nodes[i];
+				if(memcmp(hashes[i], tree->nodes[node], HASH_SIZE) == 0) {
+					continue;  /* whole subtree is intact */
+				}
+				if(node >= tree->width) {
+					corrupt_leaves[corrupt_count++] = node - tree->width;
+				}
+				else {
+					next_level[next_count++] = 2 * node;
+					next_level[next_count++] = 2 * node + 1;
+				}
+			}
+		}
+		swap = level;
+		level = next_level;
+		next_level = swap;
+		level_count = next_count;
+	}
+
+	/* a query with no nodes tells the server that we are done */
+	query.count = 0;
+	send_all(sock_fd, &query, sizeof(query));
+
+	free(hashes);
+	free(level);
+	free(next_level);
+	return corrupt_count;
+};
+
+/* appends a run of blocks to the plan, merging it with the last run if 
+they touch or overlap. Blocks must be added in increasing order. */
+void _add_to_plan(struct transfer_plan * plan, int first_block, int block_count) {
+	struct block_range * last;
+
+	if(block_count <= 0) return;
+
+	if(plan->range_count > 0) {
+		last = &plan->ranges[plan->range_count - 1];
+		if(first_block <= last->first_block + last->block_count) {
+			if(first_block + block_count > last->first_block + last->block_count) {
+				last->block_count = first_block + block_count - last->first_block;
+			}
+			return;
+		}
+	}
+	if(plan->range_count == plan->range_capacity) {
+		plan->range_capacity = plan->range_capacity ? 2 * plan->range_capacity : 8;
+		plan->ranges = realloc(plan->ranges, 
+			plan->range_capacity * sizeof(struct block_range));
+	}
+	plan->ranges[plan->range_count].first_block = first_block;
+	plan->ranges[plan->range_count].block_count = block_count;
+	plan->range_count++;
+};
+
+/* returns the next block to be sent, or -1 once the plan is exhausted */
+int _next_block_in_plan(struct transfer_plan * plan) {
+	while(plan->current_range < plan->range_count) {
+		struct block_range * range = &plan->ranges[plan->current_range];
+		if(plan->next_block < range->block_count) {
+			return range->first_block + plan->next_block++;
+		}
+		plan->current_range++;
+		plan->next_block = 0;
+	}
+	return -1;
+};
+
+/* skips the blocks of the current run of the plan before `end_block`, once
+the last block returned by _next_block_in_plan() has covered them as well */
+void _skip_in_plan(struct transfer_plan * plan, int end_block) {
+	struct block_range * range;
+
+	if(plan->current_range >= plan->range_count) return;
+	range = &plan->ranges[plan->current_range];
+	if(end_block > range->first_block + range->block_count) {
+		end_block = range->first_block + range->block_count;
+	}
+	if(end_block - range->first_block > plan->next_block) {
+		plan->next_block = end_block - range->first_block;
+	}
+};
+
+/* takes the blocks of the current run of the plan after the one last 
+returned by _next_block_in_plan(), up to `end_block`, to be sent along with
+it. Returns the block after the last one taken. */
+int _extend_in_plan(struct transfer_plan * plan, int end_block) {
+	struct block_range * range = &plan->ranges[plan->current_range];
+
+	if(end_block > range->first_block + range->block_count) {
+		end_block = range->first_block + range->block_count;
+	}
+	_skip_in_plan(plan, end_block);
+	return end_block;
+};
+
+/* no. of bytes of a file of size `filesize` which the plan will send */
+long _get_plan_size(struct transfer_plan * plan, long filesize) {
+	long bytes = 0, start, end;
+	int i;
+
+	for(i = 0; i < plan->range_count; i++) {
+		start = (long)plan->ranges[i].first_block * BUFFER_SIZE;
+		end = start + (long)plan->ranges[i].block_count * BUFFER_SIZE;
+		if(end > filesize) end = filesize;
+		if(end > start) bytes += end - start;
+	}
+	return bytes;
+};
+
+/* writes the part of a length above 15 as a run of 255s and a last byte */
+unsigned char * _lz_write_length(unsigned char * out, int length) {
+	while(length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+};
+
+/* A small LZ77 compressor in the style of LZ4: a sequence is a token with 
+the no. of literals and the match length in its two halves, the literals,
+and a 2 byte offset back to the match. Matches are found through a hash 
+table of the last position of every 4 byte sequence. Returns the compressed
+size, or 0 if it wouldn't fit in dst_capacity. */
+int _lz_compress(const unsigned char * src, int src_length, unsigned char * dst,
+	int dst_capacity) {
+	int table[1 << LZ_HASH_BITS];
+	const unsigned char * ip = src, * anchor = src, * end = src + src_length;
+	const unsigned char * match;
+	unsigned char * op = dst, * op_end = dst + dst_capacity;
+	unsigned int sequence, hash;
+	int literal_length, match_length, candidate, offset;
+
+	memset(table, -1, sizeof(table));
+
+	while(ip + LZ_MIN_MATCH <= end - LZ_LAST_LITERALS) {
+		memcpy(&sequence, ip, sizeof(sequence));
+		hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+		candidate = table[hash];
+		table[hash] = ip - src;
+
+		if(candidate < 0 || (ip - src) - candidate > LZ_MAX_OFFSET || 
+			memcmp(src + candidate, ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		match = src + candidate;
+		match_length = LZ_MIN_MATCH;
+		while(ip + match_length < end - LZ_LAST_LITERALS && 
+			match[match_length] == ip[match_length]) {
+			match_length++;
+		}
+
+		literal_length = ip - anchor;
+		/* token, literals, offset and the worst case of both lengths */
+		if(op + 1 + literal_length + 2 + (literal_length + match_length) / 255 + 2 > op_end) {
+			return 0;
+		}
+		*op++ = ((literal_length < 15 ? literal_length : 15) << 4) |
+			(match_length - LZ_MIN_MATCH < 15 ? match_length - LZ_MIN_MATCH : 15);
+		if(literal_length >= 15) op = _lz_write_length(op, literal_length - 15);
+		memcpy(op, anchor, literal_length);
+		op += literal_length;
+
+		offset = ip - match;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		if(match_length - LZ_MIN_MATCH >= 15) {
+			op = _lz_write_length(op, match_length - LZ_MIN_MATCH - 15);
+		}
+
+		ip += match_length;
+		anchor = ip;
+	}
+
+	/* the last sequence has only literals */
+	literal_length = end - anchor;
+	if(op + 1 + literal_length / 255 + 1 + literal_length > op_end) {
+		return 0;
+	}
+	*op++ = (literal_length < 15 ? literal_length : 15) << 4;
+	if(literal_length >= 15) op = _lz_write_length(op, literal_length - 15);
+	memcpy(op, anchor, literal_length);
+	op += literal_length;
+
+	return op - dst;
+};
+
+/* reads the part of a length written by _lz_write_length() */
+const unsigned char * _lz_read_length(const unsigned char * in, 
+	const unsigned char * end, int * length) {
+	unsigned char byte;
+
+	do {
+		if(in >= end) return NULL;
+		byte = *in++;
+		*length += byte;
+	} while(byte == 255);
+	return in;
+};
+
+/* The decompressor of _lz_compress(). Every length and offset is checked,
+as the input comes from the network. Returns the decompressed size or -1. */
+int _lz_decompress(const unsigned char * src, int src_length, unsigned char * dst,
+	int dst_capacity) {
+	const unsigned char * ip = src, * end = src + src_length;
+	unsigned char * op = dst, * op_end = dst + dst_capacity;
+	int token, length, offset;
+
+	while(ip < end) {
+		token = *ip++;
+
+		length = token >> 4;
+		if(length == 15 && (ip = _lz_read_length(ip, end, &length)) == NULL) return -1;
+		if(length > end - ip || length > op_end - op) return -1;
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+
+		if(ip == end) break;  /* the last sequence has no match */
+
+		if(end - ip < 2) return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op - dst) return -1;
+
+		length = token & 15;
+		if(length == 15 && (ip = _lz_read_length(ip, end, &length)) == NULL) return -1;
+		length += LZ_MIN_MATCH;
+		if(length > op_end - op) return -1;
+		while(length-- > 0) {  /* byte by byte, as the match may overlap */
+			*op = *(op - offset);
+			op++;
+		}
+	}
+	return op - dst;
+};
+
+/* log2(x) in 1/256ths, interpolating linearly between powers of two */
+unsigned int _log2_fixed(unsigned int x) {
+	int msb = 31 - __builtin_clz(x);
+	unsigned int fraction = (msb >= 8) ? (x >> (msb - 8)) : (x << (8 - msb));
+	return msb * 256 + (fraction & 255);
+};
+
+/* guesses the entropy of a block, in 1/256 bits per byte, from the byte 
+histogram of at most ENTROPY_SAMPLE bytes spread over it */
+int _estimate_entropy(const unsigned char * data, int length) {
+	unsigned int counts[256] = {0};
+	int stride = (length > ENTROPY_SAMPLE) ? length / ENTROPY_SAMPLE : 1;
+	int samples = 0, i;
+	long sum = 0;
+
+	for(i = 0; i < length; i += stride) {
+		counts[data[i]]++;
+		samples++;
+	}
+	if(samples == 0) return 0;
+	/* H = log2(n) - (1/n) * sum of c * log2(c) */
+	for(i = 0; i < 256; i++) {
+		if(counts[i]) sum += counts[i] * _log2_fixed(counts[i]);
+	}
+	return _log2_fixed(samples) - sum / samples;
+};
+
+/* The compression stage of the send path. Puts the block into the segment
+buffer, compressed if that is worth it, and returns the no. of bytes to be
+sent. *compressed tells which way it went. */
+int _compress_block(struct compressor * comp, const unsigned char * block, 
+	int length, unsigned char * out, int * compressed) {
+	int out_length = 0;
+
+	*compressed = 0;
+	comp->raw_bytes += length;
+
+	if(comp->adaptive && comp->skip_blocks > 0) {
+		comp->skip_blocks--;
+	}
+	else if(comp->enabled && (!comp->adaptive || 
+		_estimate_entropy(block, length) < ENTROPY_BYPASS)) {
+		/* worth a try. It has to save at least 1/8th to be kept. */
+		out_length = _lz_compress(block, length, out, length - length / 8);
+		if(out_length > 0) {
+			*compressed = 1;
+			comp->backoff = 1;
+		}
+		else {
+			/* it didn't compress, so skip a growing no. of blocks before
+			trying again */
+			comp->skip_blocks = comp->backoff;
+			if(comp->backoff < MAX_BYPASS_BACKOFF) comp->backoff *= 2;
+		}
+	}
+
+	if(*compressed) {
+		comp->compressed_blocks++;
+	}
+	else {
+		memcpy(out, block, length);
+		out_length = length;
+		if(comp->enabled) comp->bypassed_blocks++;
+	}
+	comp->wire_bytes += out_length;
+	return out_length;
+};
+
+/* Reads the file a block at a time through the compression stage, the same
+way the upload does, and reports what compression would buy on links of 
+different speed against what it costs in cpu time. Blocks are compressed 
+with and without the bypass, and decompressed to check the round trip. */
+void _benchmark_compression(char * filename) {
+	FILE * file = fopen(filename, "r");
+	unsigned char block[BUFFER_SIZE], packed[BUFFER_SIZE], unpacked[BUFFER_SIZE];
+	struct compressor comp;
+	struct timespec start, finish;
+	double cpu_seconds, decompress_seconds, link, seconds;
+	double links[3] = {100e6 / 8, 1e9 / 8, 10e9 / 8};  /* bytes per second */
+	int read_bytes, out_length, compressed, pass, i;
+
+	if(file == NULL) {
+		perror("File");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("\n%-9s %6s %8s %7s %9s %9s | effective MB/s on a link of\n", 
+		"", "", "", "", "compress", "");
+	printf("%-9s %6s %8s %7s %9s %9s | %7s %7s %7s\n", "mode", "ratio", 
+		"wire MB", "cpu s", "MB/s", "bypassed", "100Mbit", "1Gbit", "10Gbit");
+
+	/* pass 0 sends raw, pass 1 always compresses, pass 2 is adaptive */
+	for(pass = 0; pass < 3; pass++) {
+		memset(&comp, 0, sizeof(comp));
+		comp.enabled = (pass > 0);
+		comp.adaptive = (pass == 2);
+		comp.backoff = 1;
+		decompress_seconds = 0;
+		fseek(file, 0, SEEK_SET);
+
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+		while((read_bytes = fread(block, sizeof(char), sizeof(block), file)) > 0) {
+			out_length = _compress_block(&comp, block, read_bytes, packed, &compressed);
+			if(compressed) {
+				struct timespec d_start, d_finish;
+				clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &d_start);
+				if(_lz_decompress(packed, out_length, unpacked, sizeof(unpacked)) != read_bytes ||
+					memcmp(block, unpacked, read_bytes) != 0) {
+					printf("\nRound trip of a block failed.\n");
+					exit(EXIT_FAILURE);
+				}
+				clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &d_finish);
+				decompress_seconds += (d_finish.tv_sec - d_start.tv_sec) + 
+					(d_finish.tv_nsec - d_start.tv_nsec) / 1e9;
+			}
+		}
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &finish);
+		cpu_seconds = (finish.tv_sec - start.tv_sec) + 
+			(finish.tv_nsec - start.tv_nsec) / 1e9 - decompress_seconds;
+		if(pass == 0) cpu_seconds = 0;  /* reading the file isn't counted */
+
+		printf("%-9s %6.3f %8.2f %7.3f %9.1f %9d |",
+			(pass == 0) ? "raw" : (pass == 1) ? "always" : "adaptive",
+			comp.raw_bytes ? (double)comp.wire_bytes / comp.raw_bytes : 1.0,
+			comp.wire_bytes / 1e6, cpu_seconds,
+			cpu_seconds > 0 ? comp.raw_bytes / 1e6 / cpu_seconds : 0.0,
+			comp.bypassed_blocks);
+		/* compression overlaps with sending, so a transfer takes as long as 
+		the slower of the two */
+		for(i = 0; i < 3; i++) {
+			link = links[i];
+			seconds = comp.wire_bytes / link;
+			if(cpu_seconds > seconds) seconds = cpu_seconds;
+			printf(" %7.1f", seconds > 0 ? comp.raw_bytes / 1e6 / seconds : 0.0);
+		}
+		printf("\n");
+		if(pass == 1 && decompress_seconds > 0) {
+			printf("%-9s decompression: %.1f MB/s\n", "", 
+				comp.raw_bytes / 1e6 / decompress_seconds);
+		}
+	}
+	fclose(file);
+};
+
+/* rsync's rolling checksum of a block: `a` is the sum of its bytes and `b` 
+the sum of the running sums, both modulo 2^16 */
+unsigned int _weak_checksum(const unsigned char * data, int length) {
+	unsigned int a = 0, b = 0;
+	int i;
+
+	for(i = 0; i < length; i++) {
+		a += data[i];
+		b += (unsigned int)(length - i) * data[i];
+	}
+	return (a & 0xffff) | ((b & 0xffff) << 16);
+};
+
+/* sends new data of the file, in pieces of at most DELTA_LITERAL_MAX bytes */
+void _send_literal(int sock_fd, const unsigned char * data, long length) {
+	struct delta_op op;
+
+	while(length > 0) {
+		op.type = DELTA_LITERAL;
+		op.block = 0;
+		op.length = (length > DELTA_LITERAL_MAX) ? DELTA_LITERAL_MAX : length;
+		send_all(sock_fd, &op, sizeof(op));
+		send_all(sock_fd, (void *)data, op.length);
+		data += op.length;
+		length -= op.length;
+	}
+};
+
+/* sends a reference to `count` consecutive blocks of server's copy */
+void _flush_copy(int sock_fd, int first_block, int count) {
+	struct delta_op op;
+
+	if(count <= 0) return;
+	op.type = DELTA_COPY;
+	op.block = first_block;
+	op.length = count;
+	send_all(sock_fd, &op, sizeof(op));
+};
+
+/* Receives the signatures of the blocks of server's copy, finds those blocks 
+anywhere in our version of the file by rolling a checksum over it one byte at
+a time, and sends the server references to the blocks it already has together
+with the bytes it doesn't. Returns 1 if the server rebuilt the file. */
+int _send_delta(int sock_fd, FILE * file, long filesize) {
+	struct delta_header header;
+	struct delta_signature * signatures;
+	struct delta_op op;
+	struct segment result;
+	unsigned char strong[HASH_SIZE], digest[HASH_SIZE];
+	unsigned char * data;
+	int * buckets, * next_in_bucket;
+	int table_size = 1, i, block, matched;
+	int copy_block = 0, copy_count = 0; /* run of copies not yet sent */
+	long position = 0, literal_start = 0, matched_bytes = 0;
+	unsigned int a = 0, b = 0, weak;
+
+	if(recv(sock_fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+		header.block_size <= 0 || header.block_count < 0) {
+		printf("\nCouldn't receive the block signatures. Exiting.\n");
+		exit(EXIT_FAILURE);
+	}
+	signatures = malloc((header.block_count + 1) * sizeof(struct delta_signature));
+	if(recv(sock_fd, signatures, header.block_count * sizeof(struct delta_signature),
+		MSG_WAITALL) != header.block_count * sizeof(struct delta_signature)) {
+		printf("\nCouldn't receive the block signatures. Exiting.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* hash table from weak checksum to the blocks having it */
+	while(table_size < 2 * header.block_count) table_size *= 2;
+	buckets = (int *)malloc(table_size * sizeof(int));
+	next_in_bucket = (int *)malloc((header.block_count + 1) * sizeof(int));
+	memset(buckets, -1, table_size * sizeof(int));
+	for(i = 0; i < header.block_count; i++) {
+		weak = signatures[i].weak;
+		next_in_bucket[i] = buckets[(weak ^ (weak >> 16)) & (table_size - 1)];
+		buckets[(weak ^ (weak >> 16)) & (table_size - 1)] = i;
+	}
+
+	data = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if(data == MAP_FAILED) {
+		perror("Mapping file");
+		exit(EXIT_FAILURE);
+	}
+	madvise(data, filesize, MADV_SEQUENTIAL);
+
+	if(filesize >= header.block_size) {
+		weak = _weak_checksum(data, header.block_size);
+		a = weak & 0xffff;
+		b = weak >> 16;
+	}
+
+	while(position + header.block_size <= filesize) {
+		weak = (a & 0xffff) | ((b & 0xffff) << 16);
+		matched = -1;
+
+		/* the strong checksum is computed only when a weak one matches */
+		for(block = buckets[(weak ^ (weak >> 16)) & (table_size - 1)]; 
+			block != -1; block = next_in_bucket[block]) {
+			if(signatures[block].weak != weak) continue;
+			if(matched == -1) {
+				_sha256(data + position, header.block_size, strong);
+				matched = -2;
+			}
+			if(memcmp(strong, signatures[block].strong, DELTA_STRONG_SIZE) == 0) {
+				matched = block;
+				break;
+			}
+		}
+
+		if(matched >= 0) {
+			/* send the new bytes seen before this block, then remember the 
+			block. Consecutive blocks are sent as a single copy. */
+			if(position > literal_start || copy_block + copy_count != matched) {
+				_flush_copy(sock_fd, copy_block, copy_count);
+				_send_literal(sock_fd, data + literal_start, position - literal_start);
+				copy_block = matched;
+				copy_count = 0;
+			}
+			copy_count++;
+
+			matched_bytes += header.block_size;
+			position += header.block_size;
+			literal_start = position;
+			if(position + header.block_size <= filesize) {
+				weak = _weak_checksum(data + position, header.block_size);
+				a = weak & 0xffff;
+				b = weak >> 16;
+			}
+		}
+		else {
+			/* roll the checksum one byte forward */
+			if(position + header.block_size == filesize) break;
+			a = a - data[position] + data[position + header.block_size];
+			b = b - (unsigned int)header.block_size * data[position] + a;
+			position++;
+		}
+	}
+	_flush_copy(sock_fd, copy_block, copy_count);
+	_send_literal(sock_fd, data + literal_start, filesize - literal_start);
+
+	/* the server checks the rebuilt file against the hash of our copy */
+	_sha256(data, filesize, digest);
+	op.type = DELTA_END;
+	op.block = 0;
+	op.length = HASH_SIZE;
+	send_all(sock_fd, &op, sizeof(op));
+	send_all(sock_fd, digest, HASH_SIZE);
+
+	printf("\nDelta sent: %ld Bytes matched server's copy, %ld Bytes sent.\n",
+		matched_bytes, filesize - matched_bytes);
+
+	munmap(data, filesize);
+	free(signatures);
+	free(buckets);
+	free(next_in_bucket);
+
+	if(recv_with_timeout(sock_fd, &result, sizeof(struct segment), DURABLE_ACK_TIMEOUT) <= 0) {
+		return 0;
+	}
+	return result.seq_no == END_OF_FILE_SEQ && result.ack_no == 1;
+};
+
+/* random values for each byte, which make up the gear hash. gear_shifted is
+the same table shifted left by one, for rolling two bytes at a time. */
+unsigned long long gear[256], gear_shifted[256];
+
+void _init_gear_table() {
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL, z;
+	int i;
+
+	/* splitmix64, so that every client cuts the same chunks */
+	for(i = 0; i < 256; i++) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+		gear_shifted[i] = gear[i] << 1;
+	}
+};
+
+/* FastCDC: returns the length of the chunk starting at data. Cut points 
+depend only on the content, so an insertion moves the chunk boundaries along
+with it and the chunks after it stay the same. The gear hash is rolled two 
+bytes per iteration, and a harder mask before the average size and an easier
+one after it keep the chunk sizes close to the average. */
+long _next_chunk_length(const unsigned char * data, long length) {
+	unsigned long long hash = 0;
+	long i, normal_size = CDC_AVG_CHUNK;
+
+	if(length <= CDC_MIN_CHUNK) return length;
+	if(length > CDC_MAX_CHUNK) length = CDC_MAX_CHUNK;
+	if(normal_size > length) normal_size = length;
+
+	for(i = CDC_MIN_CHUNK; i + 1 < normal_size; i += 2) {
+		hash = (hash << 2) + gear_shifted[data[i]];
+		if(!(hash & (CDC_MASK_S << 1))) return i;
+		hash += gear[data[i + 1]];
+		if(!(hash & CDC_MASK_S)) return i + 1;
+	}
+	for(; i + 1 < length; i += 2) {
+		hash = (hash << 2) + gear_shifted[data[i]];
+		if(!(hash & (CDC_MASK_L << 1))) return i;
+		hash += gear[data[i + 1]];
+		if(!(hash & CDC_MASK_L)) return i + 1;
+	}
+	return length;
+};
+
+/* thread routine which hashes a set of chunks */
+void * _hash_chunks(void * arg) {
+	struct chunk_job * job = (struct chunk_job *)arg;
+	int chunk;
+
+	for(chunk = job->first_chunk; chunk < job->last_chunk; chunk++) {
+		_sha256(job->data + job->offsets[chunk], job->chunks[chunk].length,
+			job->chunks[chunk].hash);
+	}
+	return NULL;
+};
+
+/* Cuts the file into content defined chunks and offers their hashes to the
+server, which answers with a bitmap of the chunks missing in its store. Only
+those are sent. Returns 1 if the server assembled the file. */
+int _send_deduplicated(int sock_fd, FILE * file, long filesize) {
+	pthread_t threads[MAX_HASH_THREADS];
+	struct chunk_job jobs[MAX_HASH_THREADS];
+	struct segment result;
+	unsigned char * data, * needed;
+	long * offsets = NULL;
+	struct chunk_ref * chunks = NULL;
+	long position = 0, sent = 0, length;
+	int chunk_count = 0, capacity = 0, needed_count = 0;
+	int thread_count, i;
+
+	data = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if(data == MAP_FAILED) {
+		perror("Mapping file");
+		exit(EXIT_FAILURE);
+	}
+	madvise(data, filesize, MADV_SEQUENTIAL);
+
+	/* chunking is sequential by nature ... */
+	_init_gear_table();
+	while(position < filesize) {
+		if(chunk_count == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			offsets = realloc(offsets, capacity * sizeof(long));
+			chunks = realloc(chunks, capacity * sizeof(struct chunk_ref));
+		}
+		length = _next_chunk_length(data + position, filesize - position);
+		offsets[chunk_count] = position;
+		chunks[chunk_count].length = length;
+		chunk_count++;
+		position += length;
+	}
+
+	/* ... but the chunks are hashed on all cores */
+	thread_count = _get_hashing_thread_count(chunk_count);
+	for(i = 0; i < thread_count; i++) {
+		jobs[i].data = data;
+		jobs[i].offsets = offsets;
+		jobs[i].chunks = chunks;
+		jobs[i].first_chunk = (long)chunk_count * i / thread_count;
+		jobs[i].last_chunk = (long)chunk_count * (i + 1) / thread_count;
+		if(pthread_create(&threads[i], NULL, _hash_chunks, &jobs[i]) != 0) {
+			perror("Hashing thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	send_all(sock_fd, &chunk_count, sizeof(int));
+	send_all(sock_fd, chunks, chunk_count * sizeof(struct chunk_ref));
+
+	needed = (unsigned char *)malloc((chunk_count + 7) / 8);
+	if(recv(sock_fd, needed, (chunk_count + 7) / 8, MSG_WAITALL) != (chunk_count + 7) / 8) {
+		printf("\nServer didn't tell which chunks it needs. Exiting.\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < chunk_count; i++) {
+		if(needed[i / 8] & (1 << (i % 8))) {
+			send_all(sock_fd, data + offsets[i], chunks[i].length);
+			sent += chunks[i].length;
+			needed_count++;
+		}
+	}
+
+	printf("\n%d chunks, %d of them new to the server. %ld of %ld Bytes sent.\n",
+		chunk_count, needed_count, sent, filesize);
+
+	munmap(data, filesize);
+	free(offsets);
+	free(chunks);
+	free(needed);
+
+	if(recv_with_timeout(sock_fd, &result, sizeof(struct segment), DURABLE_ACK_TIMEOUT) <= 0) {
+		return 0;
+	}
+	return result.seq_no == END_OF_FILE_SEQ && result.ack_no == 1;
+};
+
+void _update_transfer_progress_in_log(client_log * log_entry, char * f_name,
+	unsigned long bytes_transferred, short percentage, FILE * log_file,
+	short flag) {
+	
+	client_log temp;
+
+	/*first we move to part from where structure entry has to start */
+	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+	
+	while(fread(&temp, sizeof(client_log), 1, log_file)) {
+		if(strcmp(temp.filename, f_name) == 0) {
+			/* first collect and store all the 
+			entries already in the logfile */ 
+			strcpy(log_entry->filename, temp.filename);
+			strcpy(log_entry->filesize, temp.filesize);
+			strcpy(log_entry->start_time, temp.start_time);
+			log_entry->connection_count = temp.connection_count;
+			log_entry->bytes_transferred = temp.bytes_transferred;
+			log_entry->percentage_completion = temp.percentage_completion;
+			strcpy(log_entry->end_time, temp.end_time);
+			log_entry->timeout_count = temp.timeout_count;	
+			log_entry->mtime = temp.mtime;
+			log_entry->mtime_nsec = temp.mtime_nsec;
+			log_entry->block_size = temp.block_size;
+			log_entry->send_buffer = temp.send_buffer;
+			log_entry->rtt = temp.rtt;
+
+			/* then we update particular entries bvased on flag*/
+			if(flag == UPDATE_LOG_TIMEOUT) {
+				log_entry->timeout_count = temp.timeout_count + 1;	
+			}
+			else if(flag == UPDATE_LOG_COMPLETED) {
+				log_entry->bytes_transferred = bytes_transferred;
+				log_entry->percentage_completion = percentage;
+				strcpy(log_entry->end_time, _get_current_date_time());	
+			}
+			else if (flag == UPDATE_LOG_PROGRESS){
+				/* 100 is left for the end of the file being acked, as
+				every byte of it can be acked and it still fail to be stored */
+				log_entry->bytes_transferred = bytes_transferred;
+				log_entry->percentage_completion = (percentage < 100) ? percentage : 99;
+			}
+			else if(flag == UPDATE_LOG_CONNECTION_COUNT) {
+				log_entry->connection_count = temp.connection_count + 1;
+			}
+			else if(flag == UPDATE_LOG_NEW_VERSION) {
+				/* a new version of the file is being uploaded. Here
+				bytes_transferred carries the new size of the file.*/
+				struct stat file_stat;
+				sprintf(log_entry->filesize, "%lu", bytes_transferred);
+				strcpy(log_entry->start_time, _get_current_date_time());
+				strcpy(log_entry->end_time, "\0");
+				log_entry->bytes_transferred = 0;
+				log_entry->percentage_completion = 0;
+				log_entry->connection_count = 1;
+				log_entry->timeout_count = 0;
+				if(stat(f_name, &file_stat) == 0) {
+					log_entry->mtime = file_stat.st_mtim.tv_sec;
+					log_entry->mtime_nsec = file_stat.st_mtim.tv_nsec;
+				}
+			}
+			else if(flag == UPDATE_LOG_APPENDED || flag == UPDATE_LOG_DOWNLOADED) {
+				/* the file is complete (again), at the size carried by
+				bytes_transferred */
+				struct stat file_stat;
+				sprintf(log_entry->filesize, "%lu", bytes_transferred);
+				log_entry->bytes_transferred = bytes_transferred;
+				log_entry->percentage_completion = 100;
+				strcpy(log_entry->end_time, _get_current_date_time());
+				if(stat(f_name, &file_stat) == 0) {
+					log_entry->mtime = file_stat.st_mtim.tv_sec;
+					log_entry->mtime_nsec = file_stat.st_mtim.tv_nsec;
+				}
+			}
+			else if(flag == UPDATE_LOG_SERVER_MTIME) {
+				/* until the download completes, mtime is that of the
+				server's copy, which a resumed download must come from. The
+				server tells whole seconds only. */
+				log_entry->mtime = bytes_transferred;
+				log_entry->mtime_nsec = -1;
+			}
+			
+			/* seek to the beginning of record */
+			fseek(log_file, -1 * sizeof(client_log), SEEK_CUR);
+			/*update the record*/
+			fwrite(log_entry, sizeof(client_log), 1, log_file);
+
+			/* escape from loop once updation is done */
+			break;
+		}
+	}
+};
+
+/* the function initialises all fields of server log structure with initial
+information about file being received*/
+/*THIS DEFINITION IS SLIGHTLY DIFFERENT FROM SERVER COUNTER PART 
+as we also have to check whether the upload was interrupted earlier */
+short _initialise_log_entry_for_file(client_log * log_entry, char * f_name, 
+	char * f_size, FILE * log_file) {
+
+	/*first we move to part from where structure entry has to start */
+	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+
+	/*initialise log_entry only when it is not present in log */
+	while(fread(log_entry, sizeof(client_log), 1, log_file)) {
+		/* if filename already present in file structure 
+		then do not initialise */
+		if(strcmp(log_entry->filename, f_name) == 0) {
+
+			/* if filename is entered in log, that means already an attempt
+			to upload has taken place. 
+			*/
+			/* if file is completly uploaded return the signal 
+			of fully uploaded, else signal a partial upload. How much of it
+			the server really has is told by the server itself and verified
+			with the hash tree, once we are connected. */
+			if(log_entry->percentage_completion == 100) {
+				return FULLY_UPLOADED;
+			}
+			return PARTIALLY_UPLOADED;
+		}
+	}
+	strcpy(log_entry->filename, f_name);
+	strcpy(log_entry->filesize, f_size);
+	strcpy(log_entry->start_time, _get_current_date_time());
+	strcpy(log_entry->end_time, "\0");
+	log_entry->bytes_transferred = 0;
+	log_entry->percentage_completion = 0;
+	log_entry->connection_count = 1;
+	log_entry->timeout_count = 0;
+	struct stat file_stat;
+	if(stat(f_name, &file_stat) == 0) {
+		log_entry->mtime = file_stat.st_mtim.tv_sec;
+		log_entry->mtime_nsec = file_stat.st_mtim.tv_nsec;
+	}
+	else {
+		log_entry->mtime = 0;
+		log_entry->mtime_nsec = -1;
+	}
+	log_entry->block_size = 0;
+	log_entry->send_buffer = 0;
+	log_entry->rtt = 0;
+
+	/* seek log file to the last */
+	fseek(log_file, 0, SEEK_END);
+	/* make the entry */
+	fwrite(log_entry, sizeof(client_log), 1, log_file);
+
+	return NEW_UPLOAD;
+};
+
+
+/* an utility function to remove a substring from string. (Just one ocurrance) 
+used when we have to remove the successfully uploaded file from the list
+of files to be uploaded.*/
+char * _remove_from_string(char * string, char *substring) {
+	int len = strlen(substring);
+	char * temp; 
+
+	if(len > 0) {
+		temp = strstr(string, substring);
+
+		if(temp != NULL) {
+			memmove(temp, temp + len, strlen(len + temp) + 1);
+		}
+	}
+	return string;
+};
+
+FILE * _update_file_to_be_received_list(FILE * client_log, char * filename) {
+	/*we will first read line 2 as string and remove the 
+		current filename from this string. then we will replace line 2 of the 
+		server log file with this new string.*/
+	char * line = _get_line_as_string(client_log, 2);
+	char * entry = malloc(strlen(filename) + 4);
+	char * updated_line;
+
+	/* the list holds 'name'<TAB> entries. Removing the whole entry leaves
+	no empty quotes behind and doesn't match inside a longer name. */
+	sprintf(entry, "'%s'\t", filename);
+	updated_line = _remove_from_string(line, entry);
+	free(entry);
+
+	client_log = _replace_line(client_log, 2, updated_line);
+	free(line);
+	return client_log;
+};
+
+void printlog(FILE * log_file) {
+	int ch;
+	int linenum = 1;
+	fseek(log_file, 0 ,SEEK_SET);
+
+	while((ch = getc(log_file)) != EOF) {
+		if(ch == '\n') {
+			linenum++;
+		}
+		printf("%c", ch);
+		if(linenum == FILE_RECORD_LINE_NUMBER) {
+			break;
+		}
+	}
+	client_log log_entry;
+	char * endtime;
+	while(fread((&log_entry), sizeof(client_log), 1, log_file)) {
+		if(strcmp(log_entry.end_time, "\0") == 0) {
+			endtime = "NA";
+		}
+		else {
+			endtime = log_entry.end_time;
+		}
+		printf("%-35s\t%-15s\t%-20s\t%-20lu\t%i%%\t%20s\t%20lu\t%20lu\t%12u\t%10u\n", 
+			log_entry.filename,
+			log_entry.filesize,
+			log_entry.start_time,
+			log_entry.bytes_transferred,
+			log_entry.percentage_completion,
+			endtime,
+			log_entry.connection_count,
+			log_entry.timeout_count,
+			log_entry.block_size,
+			log_entry.rtt);
+	}
+};
+
+/* prints a string as a JSON string */
+void _print_json_string(const char * string) {
+	putchar('"');
+	for(; *string; string++) {
+		if(*string == '"' || *string == '\\') printf("\\%c", *string);
+		else if((unsigned char)*string < 0x20) printf("\\u%04x", *string);
+		else putchar(*string);
+	}
+	putchar('"');
+};
+
+/* prints the 'name'<TAB> entries of the list at line 2 of the log as a 
+JSON array */
+void _print_json_file_list(FILE * log_file) {
+	char * line = _get_line_as_string(log_file, 2), * name, * end;
+	int first = 1;
+
+	putchar('[');
+	for(name = strchr(line, '\''); name != NULL && (end = strstr(name + 1, "'\t")) != NULL;
+		name = strchr(end + 2, '\'')) {
+		*end = '\0';
+		if(!first) printf(", ");
+		_print_json_string(name + 1);
+		first = 0;
+	}
+	putchar(']');
+	free(line);
+};
+
+/* Prints the log as JSON, for our monitoring: the files still to be sent and 
+the record of every file. */
+void printlog_json(FILE * log_file) {
+	client_log log_entry;
+	int first = 1;
+
+	printf("{\"to_be_sent\": ");
+	_print_json_file_list(log_file);
+	printf(", \"files\": [");
+	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+	while(fread(&log_entry, sizeof(client_log), 1, log_file)) {
+		printf("%s\n  {\"filename\": ", first ? "" : ",");
+		_print_json_string(log_entry.filename);
+		printf(", \"filesize\": %ld, \"start_time\": ", atol(log_entry.filesize));
+		_print_json_string(log_entry.start_time);
+		printf(", \"end_time\": ");
+		if(log_entry.end_time[0] == '\0') printf("null");
+		else _print_json_string(log_entry.end_time);
+		printf(", \"bytes_transferred\": %lu, \"percentage_completed\": %u, "
+			"\"connections\": %u, \"timeouts\": %u", log_entry.bytes_transferred, 
+			log_entry.percentage_completion, log_entry.connection_count, 
+			log_entry.timeout_count);
+		printf(", \"block_size\": %u, \"send_buffer\": %u, \"rtt_us\": %u", 
+			log_entry.block_size, log_entry.send_buffer, log_entry.rtt);
+		printf("}");
+		first = 0;
+	}
+	printf("\n]}\n");
+};
+
+
+/* arithmetic in GF(2^8), with the polynomial 0x11d, for the reed-solomon
+parity of the udp transport */
+unsigned char gf_exp[512], gf_log[256];
+
+void _gf_init() {
+	static int initialised = 0;
+	int i, x = 1;
+
+	if(initialised) return;
+	for(i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if(x & 0x100) x ^= 0x11d;
+	}
+	initialised = 1;
+};
+
+unsigned char _gf_mul(unsigned char a, unsigned char b) {
+	if(a == 0 || b == 0) return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+};
+
+unsigned char _gf_inv(unsigned char a) {
+	return gf_exp[255 - gf_log[a]];
+};
+
+/* Coefficient of data block i of a group in its parity block j. They form a
+cauchy matrix, of which every square submatrix can be inverted, so that any
+as many parity blocks as there are blocks missing give those back. */
+unsigned char _fec_coefficient(int parity_index, int data_index) {
+	return _gf_inv((FEC_GROUP_SIZE + parity_index) ^ data_index);
+};
+
+#if defined(__x86_64__)
+/* PSHUFB looks up 16 bytes at once in a table of 16. A product in GF(2^8)
+is the sum of the products of the low and of the high nibble, so it takes
+two lookups in tables made for the coefficient. Returns the bytes done. */
+__attribute__((target("ssse3")))
+int _gf_mul_add_ssse3(unsigned char * dst, const unsigned char * src, 
+	unsigned char coef, int length) {
+	unsigned char low[16], high[16];
+	__m128i low_table, high_table, data, product;
+	__m128i mask = _mm_set1_epi8(0x0f);
+	int i;
+
+	for(i = 0; i < 16; i++) {
+		low[i] = _gf_mul(coef, i);
+		high[i] = _gf_mul(coef, i << 4);
+	}
+	low_table = _mm_loadu_si128((__m128i *)low);
+	high_table = _mm_loadu_si128((__m128i *)high);
+	for(i = 0; i + 16 <= length; i += 16) {
+		data = _mm_loadu_si128((__m128i *)(src + i));
+		product = _mm_xor_si128(
+			_mm_shuffle_epi8(low_table, _mm_and_si128(data, mask)),
+			_mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(data, 4), mask)));
+		_mm_storeu_si128((__m128i *)(dst + i), 
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(dst + i)), product));
+	}
+	return i;
+};
+
+int _cpu_has_ssse3() {
+	unsigned int eax, ebx, ecx, edx;
+
+	return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3);
+};
+#endif
+
+/* dst += coef * src in GF(2^8), with PSHUFB when the cpu has it */
+void _gf_mul_add(unsigned char * dst, const unsigned char * src, 
+	unsigned char coef, int length) {
+	int i = 0;
+
+	if(coef == 0) return;
+#if defined(__x86_64__)
+	static int has_ssse3 = -1;
+
+	if(has_ssse3 == -1) {
+		has_ssse3 = _cpu_has_ssse3();
+	}
+	if(has_ssse3) {
+		i = _gf_mul_add_ssse3(dst, src, coef, length);
+	}
+#endif
+	for(; i < length; i++) {
+		dst[i] ^= _gf_mul(coef, src[i]);
+	}
+};
+
+/* inverts the n x n matrix a, which is destroyed on the way, by gauss-jordan
+elimination. Returns 0 if it can't be inverted. */
+int _gf_invert_matrix(unsigned char * a, unsigned char * inverse, int n) {
+	int row, col, pivot, k;
+	unsigned char factor, temp;
+
+	memset(inverse, 0, n * n);
+	for(k = 0; k < n; k++) inverse[k * n + k] = 1;
+
+	for(col = 0; col < n; col++) {
+		for(pivot = col; pivot < n && a[pivot * n + col] == 0; pivot++);
+		if(pivot == n) return 0;
+		for(k = 0; k < n && pivot != col; k++) {
+			temp = a[pivot * n + k]; a[pivot * n + k] = a[col * n + k]; a[col * n + k] = temp;
+			temp = inverse[pivot * n + k]; inverse[pivot * n + k] = inverse[col * n + k]; 
+			inverse[col * n + k] = temp;
+		}
+		factor = _gf_inv(a[col * n + col]);
+		for(k = 0; k < n; k++) {
+			a[col * n + k] = _gf_mul(a[col * n + k], factor);
+			inverse[col * n + k] = _gf_mul(inverse[col * n + k], factor);
+		}
+		for(row = 0; row < n; row++) {
+			factor = a[row * n + col];
+			if(row == col || factor == 0) continue;
+			for(k = 0; k < n; k++) {
+				a[row * n + k] ^= _gf_mul(factor, a[col * n + k]);
+				inverse[row * n + k] ^= _gf_mul(factor, inverse[col * n + k]);
+			}
+		}
+	}
+	return 1;
+};
+
+/* microseconds on the monotonic clock */
+long long _now_us() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+};
+
+/* The trace of a process is a file which every thread tracing maps a ring
+of its own from, so that a record costs a few stores and nothing is lost
+if the process dies. The file describes its events, see trace-decode.c. */
+struct trace_record {
+	unsigned long long tsc;
+	int event;
+	int thread;
+	long a, b;  /* arguments, named by the event */
+};
+
+struct trace_event {
+	int level;  /* lowest verbosity the event is recorded at */
+	char name[TRACE_NAME_SIZE];
+	char a[TRACE_NAME_SIZE], b[TRACE_NAME_SIZE];  /* names of the arguments */
+};
+
+struct trace_header {
+	char magic[8];
+	double tsc_per_us;
+	unsigned long long start_tsc;
+	long long start_time;  /* us since the epoch, at start_tsc */
+	int ring_size, ring_count, event_count;
+	struct trace_event events[TRACE_MAX_EVENTS];
+};
+
+struct trace_ring {
+	unsigned long long head;  /* records ever written, only its thread writes it */
+	int thread;
+	int in_use;
+	char padding[48];  /* the head is kept off the cache line of another ring */
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+const struct trace_event trace_events[] = {
+	{TRACE_TRANSFERS, "transfer_begin", "filesize", ""},
+	{TRACE_TRANSFERS, "transfer_end", "completed", "bytes"},
+	{TRACE_TRANSFERS, "timeout", "seq", "rto"},
+	{TRACE_TRANSFERS, "tuned", "blocks", "send_buffer"},
+	{TRACE_SEGMENTS, "segment_sent", "seq", "length"},
+	{TRACE_SEGMENTS, "ack_received", "seq", "ack"},
+	{TRACE_ALL, "datagram_sent", "seq", "kind"},
+	{TRACE_ALL, "download_write", "offset", "length"},
+	{TRACE_TRANSFERS, "reconnect", "attempts", "resumed"}
+};
+
+int trace_level = TRACE_OFF;
+struct trace_header * trace_file = NULL;  /* mapped in full, the file grows by a ring at a time */
+int trace_fd = -1;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t trace_key;
+__thread struct trace_ring * trace_ring = NULL;
+__thread int trace_detached = 0;  /* no ring was left for the thread */
+
+unsigned long long _read_tsc() {
+#if defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+};
+
+struct trace_ring * _get_trace_ring(int index) {
+	return (struct trace_ring *)((char *)trace_file + sizeof(struct trace_header) +
+		(long)index * sizeof(struct trace_ring));
+};
+
+/* the ring of a thread which ends is left to be taken over */
+void _release_trace_ring(void * ring) {
+	__atomic_store_n(&((struct trace_ring *)ring)->in_use, 0, __ATOMIC_RELEASE);
+};
+
+/* Gives the thread a ring: a new one while there are any, then the one 
+released longest ago. Only the first record of a thread comes here. */
+void _attach_trace_ring() {
+	struct trace_ring * ring, * oldest = NULL;
+	int i;
+
+	pthread_mutex_lock(&trace_lock);
+	if(trace_file->ring_count < TRACE_MAX_RINGS) {
+		if(ftruncate(trace_fd, sizeof(struct trace_header) + 
+			(long)(trace_file->ring_count + 1) * sizeof(struct trace_ring)) == 0) {
+			oldest = _get_trace_ring(trace_file->ring_count++);
+		}
+	}
+	else {
+		for(i = 0; i < TRACE_MAX_RINGS; i++) {
+			ring = _get_trace_ring(i);
+			if(!ring->in_use && (oldest == NULL || ring->head == 0 ||
+				ring->records[(ring->head - 1) % TRACE_RING_SIZE].tsc < 
+				oldest->records[(oldest->head - 1) % TRACE_RING_SIZE].tsc)) {
+				oldest = ring;
+			}
+		}
+	}
+	if(oldest != NULL) {
+		oldest->in_use = 1;
+		oldest->thread = syscall(SYS_gettid);
+		pthread_setspecific(trace_key, oldest);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	trace_ring = oldest;
+	trace_detached = (oldest == NULL);
+};
+
+void _write_trace_record(int event, long a, long b) {
+	struct trace_record * record;
+
+	if(trace_ring == NULL) {
+		if(trace_detached) return;
+		_attach_trace_ring();
+		if(trace_ring == NULL) return;
+	}
+	record = &trace_ring->records[trace_ring->head % TRACE_RING_SIZE];
+	record->tsc = _read_tsc();
+	record->event = event;
+	record->thread = trace_ring->thread;
+	record->a = a;
+	record->b = b;
+	/* a decoder reading the file meanwhile sees the record whole */
+	__atomic_store_n(&trace_ring->head, trace_ring->head + 1, __ATOMIC_RELEASE);
+};
+
+/* Records an event, if the verbosity asks for it. This is all a hot path 
+pays for an event which isn't recorded. */
+static inline void _trace(int event, long a, long b) {
+	if(trace_level >= trace_events[event].level) _write_trace_record(event, a, b);
+};
+
+/* Creates the trace file and starts recording the events of the level 
+and below. How fast the tsc runs is measured here, over a few ms. */
+void _start_trace(int level) {
+	long size = sizeof(struct trace_header) + (long)TRACE_MAX_RINGS * sizeof(struct trace_ring);
+	struct timespec pause = {0, TRACE_CALIBRATION_NS}, now;
+	unsigned long long tsc;
+	long long started;
+
+	trace_fd = open(TRACE_FILE_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(trace_fd < 0 || ftruncate(trace_fd, sizeof(struct trace_header)) < 0) {
+		perror("Trace");
+		exit(EXIT_FAILURE);
+	}
+	trace_file = (struct trace_header *)mmap(NULL, size, PROT_READ | PROT_WRITE, 
+		MAP_SHARED, trace_fd, 0);
+	if(trace_file == MAP_FAILED) {
+		perror("Trace");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(trace_file->magic, TRACE_MAGIC, sizeof(trace_file->magic));
+	trace_file->ring_size = TRACE_RING_SIZE;
+	trace_file->event_count = sizeof(trace_events) / sizeof(trace_events[0]);
+	memcpy(trace_file->events, trace_events, sizeof(trace_events));
+
+	started = _now_us();
+	tsc = _read_tsc();
+	nanosleep(&pause, NULL);
+	trace_file->tsc_per_us = (_read_tsc() - tsc) / (double)(_now_us() - started);
+	clock_gettime(CLOCK_REALTIME, &now);
+	trace_file->start_tsc = _read_tsc();
+	trace_file->start_time = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	pthread_key_create(&trace_key, _release_trace_ring);
+	trace_level = level;
+	printf("Tracing at level %d to %s\n", level, TRACE_FILE_NAME);
+};
+
+/* latencies, in buckets by powers of two of us, the last for the rest */
+struct latency_histogram {
+	unsigned long counts[LATENCY_BUCKETS + 1];
+	unsigned long count;
+	double sum;  /* seconds */
+};
+
+struct recent_transfer {
+	char filename[FILENAME_SIZE];
+	long bytes;
+	double seconds, stall_seconds;
+	int completed;
+};
+
+/* What is known of the transfer going on and of the ones before it, for 
+the metrics endpoint. Everything is guarded by the lock, as the endpoint 
+is served by a thread of its own. */
+struct transfer_metrics {
+	pthread_mutex_t lock;
+	int active;
+	char filename[FILENAME_SIZE];
+	long filesize, bytes;
+	long long started, last_progress, last_sample;  /* us */
+	long sample_bytes;
+	double throughput;       /* bytes per second, over the last sample */
+	long long stall_time;    /* us */
+	struct tcp_info tcp;     /* as last sampled */
+	int queued;              /* bytes in the queue of the socket */
+	struct latency_histogram disk_writes;
+	unsigned long transfers_completed, transfers_failed, bytes_total;
+	struct recent_transfer recent[RECENT_TRANSFERS];
+	int recent_count, next_recent;
+	unsigned long reconnects;
+};
+
+struct transfer_metrics metrics = {0}; /* its lock is set up first thing in main() */
+
+/* counts a latency into its bucket, the first above it */
+void _observe_latency(struct latency_histogram * histogram, long long us) {
+	int bucket = 0;
+
+	while(bucket < LATENCY_BUCKETS && us > (1LL << bucket)) bucket++;
+	histogram->counts[bucket]++;
+	histogram->count++;
+	histogram->sum += us / 1000000.0;
+};
+
+/* times a write to the disk which started at `started` us */
+void _time_disk_write(long long started) {
+	long long now = _now_us();
+
+	pthread_mutex_lock(&metrics.lock);
+	_observe_latency(&metrics.disk_writes, now - started);
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* ends the transfer going on, which is kept among the recent ones */
+void _end_transfer(int completed) {
+	long long now = _now_us();
+	struct recent_transfer * recent;
+
+	pthread_mutex_lock(&metrics.lock);
+	if(metrics.active) {
+		_trace(TRACE_TRANSFER_END, completed, metrics.bytes);
+		metrics.active = 0;
+		if(completed) metrics.transfers_completed++;
+		else metrics.transfers_failed++;
+		recent = &metrics.recent[metrics.next_recent];
+		metrics.next_recent = (metrics.next_recent + 1) % RECENT_TRANSFERS;
+		if(metrics.recent_count < RECENT_TRANSFERS) metrics.recent_count++;
+		strcpy(recent->filename, metrics.filename);
+		recent->bytes = metrics.bytes;
+		recent->seconds = (now - metrics.started) / 1000000.0;
+		recent->stall_seconds = metrics.stall_time / 1000000.0;
+		recent->completed = completed;
+	}
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* Starts the metrics of a transfer. One left active by a transfer which 
+gave up halfway is counted as failed, by _end_transfer(), which looks 
+at active under the lock. */
+void _begin_transfer(char * filename, long filesize) {
+	_end_transfer(0);
+	_trace(TRACE_TRANSFER_BEGIN, filesize, 0);
+	pthread_mutex_lock(&metrics.lock);
+	metrics.active = 1;
+	strcpy(metrics.filename, filename);
+	metrics.filesize = filesize;
+	metrics.bytes = metrics.sample_bytes = 0;
+	metrics.started = metrics.last_progress = metrics.last_sample = _now_us();
+	metrics.throughput = 0;
+	metrics.stall_time = 0;
+	memset(&metrics.tcp, 0, sizeof(metrics.tcp));
+	metrics.queued = 0;
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* Counts bytes of the transfer going on. A gap since the last progress 
+longer than STALL_THRESHOLD counts as stalled. Every METRICS_SAMPLE_INTERVAL
+the throughput is worked out, and what tcp knows of the connection and the
+bytes in its queue are sampled, unless there is no connection (-1). */
+void _count_transfer(int sock_fd, long bytes) {
+	long long now = _now_us();
+	socklen_t len = sizeof(metrics.tcp);
+
+	pthread_mutex_lock(&metrics.lock);
+	if(now - metrics.last_progress > STALL_THRESHOLD) {
+		metrics.stall_time += now - metrics.last_progress;
+	}
+	metrics.last_progress = now;
+	metrics.bytes += bytes;
+	metrics.bytes_total += bytes;
+	metrics.sample_bytes += bytes;
+	if(now - metrics.last_sample >= METRICS_SAMPLE_INTERVAL) {
+		metrics.throughput = metrics.sample_bytes * 1000000.0 / (now - metrics.last_sample);
+		metrics.sample_bytes = 0;
+		metrics.last_sample = now;
+		if(sock_fd >= 0) {
+			getsockopt(sock_fd, IPPROTO_TCP, TCP_INFO, &metrics.tcp, &len);
+			ioctl(sock_fd, SOCKET_QUEUE_IOCTL, &metrics.queued);
+		}
+	}
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* writes a label value, escaped as the text format wants it */
+void _write_label_value(FILE * out, const char * value) {
+	for(; *value; value++) {
+		if(*value == '\\' || *value == '"') fprintf(out, "\\%c", *value);
+		else if(*value == '\n') fprintf(out, "\\n");
+		else fputc(*value, out);
+	}
+};
+
+/* writes the HELP and TYPE lines of a metric */
+void _write_metric_header(FILE * out, const char * name, const char * type, const char * help) {
+	fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", 
+		name, help, name, type);
+};
+
+/* writes a sample of a metric of the transfer going on */
+void _write_transfer_metric(FILE * out, const char * name, const char * type, 
+	const char * help, double value) {
+	_write_metric_header(out, name, type, help);
+	fprintf(out, METRICS_PREFIX "%s{file=\"", name);
+	_write_label_value(out, metrics.filename);
+	fprintf(out, "\"} %.9g\n", value);
+};
+
+void _write_histogram(FILE * out, const char * name, const char * help, 
+	struct latency_histogram * histogram) {
+	unsigned long cumulative = 0;
+	int bucket;
+
+	_write_metric_header(out, name, "histogram", help);
+	for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		cumulative += histogram->counts[bucket];
+		fprintf(out, METRICS_PREFIX "%s_bucket{le=\"%.9g\"} %lu\n", name, 
+			(1LL << bucket) / 1000000.0, cumulative);
+	}
+	fprintf(out, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %lu\n", name, histogram->count);
+	fprintf(out, METRICS_PREFIX "%s_sum %.9g\n" METRICS_PREFIX "%s_count %lu\n", 
+		name, histogram->sum, name, histogram->count);
+};
+
+/* Writes the metrics which both sides have, in the Prometheus text format,
+with the lock held: the transfer going on, if any, with what tcp knows of
+its connection, the recent transfers and the latency of the disk writes. */
+void _write_transfer_metrics(FILE * out) {
+	int i;
+	struct recent_transfer * recent;
+
+	_write_metric_header(out, "transfers_total", "counter", "Transfers ended, by result.");
+	fprintf(out, METRICS_PREFIX "transfers_total{result=\"completed\"} %lu\n", 
+		metrics.transfers_completed);
+	fprintf(out, METRICS_PREFIX "transfers_total{result=\"failed\"} %lu\n", 
+		metrics.transfers_failed);
+	_write_metric_header(out, "transfer_bytes_total", "counter", "Bytes of files transferred.");
+	fprintf(out, METRICS_PREFIX "transfer_bytes_total %lu\n", metrics.bytes_total);
+	_write_metric_header(out, "transfer_active", "gauge", "Whether a transfer is going on.");
+	fprintf(out, METRICS_PREFIX "transfer_active %d\n", metrics.active);
+
+	if(metrics.active) {
+		_write_transfer_metric(out, "transfer_size_bytes", "gauge", 
+			"Size of the file being transferred.", metrics.filesize);
+		_write_transfer_metric(out, "transfer_bytes", "gauge", 
+			"Bytes of the file transferred so far.", metrics.bytes);
+		_write_transfer_metric(out, "transfer_seconds", "gauge", 
+			"Time since the transfer started.", (_now_us() - metrics.started) / 1000000.0);
+		_write_transfer_metric(out, "transfer_throughput_bytes_per_second", "gauge", 
+			"Throughput over the last sample.", metrics.throughput);
+		_write_transfer_metric(out, "transfer_stall_seconds", "gauge", 
+			"Time the transfer made no progress.", metrics.stall_time / 1000000.0);
+		_write_transfer_metric(out, "tcp_rtt_seconds", "gauge", 
+			"Smoothed rtt of the connection.", metrics.tcp.tcpi_rtt / 1000000.0);
+		_write_transfer_metric(out, "tcp_rtt_variance_seconds", "gauge", 
+			"Variance of the rtt of the connection.", metrics.tcp.tcpi_rttvar / 1000000.0);
+		_write_transfer_metric(out, "tcp_cwnd_segments", "gauge", 
+			"Congestion window of the connection.", metrics.tcp.tcpi_snd_cwnd);
+		_write_transfer_metric(out, "tcp_retransmits_total", "counter", 
+			"Segments retransmitted on the connection.", metrics.tcp.tcpi_total_retrans);
+		_write_transfer_metric(out, "tcp_delivery_rate_bytes_per_second", "gauge", 
+			"Delivery rate tcp measured last.", metrics.tcp.tcpi_delivery_rate);
+		_write_transfer_metric(out, "socket_queue_bytes", "gauge", 
+			SOCKET_QUEUE_HELP, metrics.queued);
+	}
+
+	_write_metric_header(out, "recent_transfer_seconds", "gauge", 
+		"How long each of the recent transfers took.");
+	for(i = 0; i < metrics.recent_count; i++) {
+		recent = &metrics.recent[i];
+		fprintf(out, METRICS_PREFIX "recent_transfer_seconds{file=\"");
+		_write_label_value(out, recent->filename);
+		fprintf(out, "\",result=\"%s\"} %.6f\n", recent->completed ? "completed" : "failed", 
+			recent->seconds);
+	}
+	_write_metric_header(out, "recent_transfer_bytes", "gauge", 
+		"Bytes each of the recent transfers moved.");
+	for(i = 0; i < metrics.recent_count; i++) {
+		recent = &metrics.recent[i];
+		fprintf(out, METRICS_PREFIX "recent_transfer_bytes{file=\"");
+		_write_label_value(out, recent->filename);
+		fprintf(out, "\",result=\"%s\"} %ld\n", recent->completed ? "completed" : "failed", 
+			recent->bytes);
+	}
+	_write_metric_header(out, "recent_transfer_stall_seconds", "gauge", 
+		"Time each of the recent transfers made no progress.");
+	for(i = 0; i < metrics.recent_count; i++) {
+		recent = &metrics.recent[i];
+		fprintf(out, METRICS_PREFIX "recent_transfer_stall_seconds{file=\"");
+		_write_label_value(out, recent->filename);
+		fprintf(out, "\",result=\"%s\"} %.6f\n", recent->completed ? "completed" : "failed", 
+			recent->stall_seconds);
+	}
+	_write_histogram(out, "disk_write_seconds", "Latency of the writes of received data.", 
+		&metrics.disk_writes);
+};
+
+/* writes all our metrics, with the lock held */
+void _write_metrics(FILE * out) {
+	_write_transfer_metrics(out);
+	_write_metric_header(out, "reconnects_total", "counter", 
+		"Connections to the server made again after one was lost.");
+	fprintf(out, METRICS_PREFIX "reconnects_total %lu\n", metrics.reconnects);
+	if(metrics.active) {
+		_write_transfer_metric(out, "tcp_notsent_bytes", "gauge", 
+			"Bytes queued on the connection, not sent yet.", metrics.tcp.tcpi_notsent_bytes);
+	}
+};
+
+/* Serves the metrics over http to whoever asks, on a connection each. 
+The request itself doesn't matter. */
+void * _serve_metrics(void * arg) {
+	int listen_sock = (int)(long)arg, sock_fd;
+	struct timeval timeout = {1, 0};
+	char request[4096], * body;
+	char header[128];
+	size_t length;
+	FILE * out;
+
+	while((sock_fd = accept(listen_sock, NULL, NULL)) >= 0) {
+		setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		recv(sock_fd, request, sizeof(request), 0);
+
+		out = open_memstream(&body, &length);
+		pthread_mutex_lock(&metrics.lock);
+		_write_metrics(out);
+		pthread_mutex_unlock(&metrics.lock);
+		fclose(out);
+
+		sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", length);
+		send(sock_fd, header, strlen(header), MSG_NOSIGNAL);
+		send(sock_fd, body, length, MSG_NOSIGNAL);
+		free(body);
+		close(sock_fd);
+	}
+	return NULL;
+};
+
+/* starts serving the metrics on a port of this host only */
+void _start_metrics_endpoint(int port) {
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int listen_sock = socket(AF_INET, SOCK_STREAM, 0), yes = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if(listen_sock < 0 || bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listen_sock, 8) < 0) {
+		perror("Metrics endpoint");
+		exit(EXIT_FAILURE);
+	}
+	pthread_create(&thread, NULL, _serve_metrics, (void *)(long)listen_sock);
+	pthread_detach(thread);
+	printf("Metrics on http://127.0.0.1:%d/metrics\n", port);
+};
+
+
+/* Bbr keeps a model of the path: the highest delivery rate seen over the
+last rounds and the lowest rtt. It paces at that rate, above it while 
+probing for more and below it while draining the queue it built. */
+void _bbr_init(struct congestion_state * cc) {
+	cc->mode = BBR_STARTUP;
+	cc->pacing_rate = UDP_INITIAL_RATE;
+	cc->cwnd = UDP_INITIAL_WINDOW;
+};
+
+void _bbr_on_sample(struct congestion_state * cc, struct rate_sample * rs) {
+	static const double probe_gains[BBR_CYCLE_LENGTH] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+	double pacing_gain, cwnd_gain = 2, bdp;
+	long round_length = (cc->min_rtt > BBR_MIN_ROUND) ? cc->min_rtt : BBR_MIN_ROUND;
+	int i;
+
+	if(rs->now - cc->round_stamp >= round_length) {
+		/* a round has passed */
+		long sent = cc->round_delivered + cc->round_lost;
+		if(sent > 0 && cc->round_lost > BBR_LOSS_LIMIT * sent) {
+			cc->lossy_rounds++;
+		}
+		else {
+			cc->lossy_rounds = 0;
+		}
+		if(cc->lossy_rounds >= BBR_LOSSY_ROUNDS) {
+			/* the path drops a lot, even at the rate we measured. It might
+			be a policer, which bbr would keep running into. */
+			cc->give_up = 1;
+		}
+		if(cc->mode == BBR_STARTUP) {
+			/* startup ends once the rate stopped growing for a few rounds */
+			if(cc->max_bw >= cc->full_bw * 1.25) {
+				cc->full_bw = cc->max_bw;
+				cc->full_bw_rounds = 0;
+			}
+			else if(++cc->full_bw_rounds >= 3) {
+				cc->mode = BBR_DRAIN;
+			}
+		}
+		cc->round++;
+		cc->bw[cc->round % BBR_BW_ROUNDS] = 0;
+		cc->round_stamp = rs->now;
+		cc->round_delivered = cc->round_lost = 0;
+	}
+	cc->round_delivered += rs->delivered / BUFFER_SIZE;
+	cc->round_lost += rs->lost;
+
+	if(rs->delivery_rate > cc->bw[cc->round % BBR_BW_ROUNDS]) {
+		cc->bw[cc->round % BBR_BW_ROUNDS] = rs->delivery_rate;
+	}
+	cc->max_bw = 0;
+	for(i = 0; i < BBR_BW_ROUNDS; i++) {
+		if(cc->bw[i] > cc->max_bw) cc->max_bw = cc->bw[i];
+	}
+	if(cc->max_bw == 0) return;
+	bdp = cc->max_bw * round_length / 1000000.0;
+
+	if(cc->mode == BBR_DRAIN && rs->inflight <= bdp) {
+		cc->mode = BBR_PROBE_BW;
+		cc->cycle_index = 2;
+		cc->cycle_stamp = rs->now;
+	}
+	if(cc->mode == BBR_PROBE_BW && rs->now - cc->cycle_stamp >= round_length) {
+		cc->cycle_index = (cc->cycle_index + 1) % BBR_CYCLE_LENGTH;
+		cc->cycle_stamp = rs->now;
+	}
+
+	if(cc->mode == BBR_STARTUP) {
+		pacing_gain = cwnd_gain = BBR_HIGH_GAIN;
+	}
+	else if(cc->mode == BBR_DRAIN) {
+		pacing_gain = 1 / BBR_HIGH_GAIN;
+		cwnd_gain = BBR_HIGH_GAIN;
+	}
+	else {
+		pacing_gain = probe_gains[cc->cycle_index];
+	}
+
+	/* in startup the rate only grows, as the first samples are taken
+	before there was much data in flight */
+	if(cc->mode != BBR_STARTUP || pacing_gain * cc->max_bw > cc->pacing_rate) {
+		cc->pacing_rate = pacing_gain * cc->max_bw;
+	}
+	cc->cwnd = cwnd_gain * bdp;
+	if(cc->cwnd < UDP_INITIAL_WINDOW) cc->cwnd = UDP_INITIAL_WINDOW;
+};
+
+/* Aimd is tcp reno's window, paced out over the smoothed rtt: it grows by
+a datagram every rtt and is halved on loss, at most once every rtt. */
+void _aimd_init(struct congestion_state * cc) {
+	if(cc->cwnd > UDP_INITIAL_WINDOW) {
+		/* taking over from bbr, which gave up on a lossy path */
+		cc->ssthresh = cc->cwnd / 2;
+		cc->cwnd = cc->ssthresh;
+	}
+	else {
+		cc->ssthresh = LONG_MAX;
+		cc->cwnd = UDP_INITIAL_WINDOW;
+	}
+	cc->pacing_rate = UDP_INITIAL_RATE;
+};
+
+void _aimd_on_sample(struct congestion_state * cc, struct rate_sample * rs) {
+	if(rs->lost > 0) {
+		if(rs->now - cc->last_reduction > cc->srtt) {
+			cc->ssthresh = cc->cwnd / 2;
+			if(cc->ssthresh < UDP_INITIAL_WINDOW / 2) cc->ssthresh = UDP_INITIAL_WINDOW / 2;
+			cc->cwnd = cc->ssthresh;
+			cc->last_reduction = rs->now;
+		}
+	}
+	else if(cc->cwnd < cc->ssthresh) {
+		cc->cwnd += rs->delivered;
+	}
+	else {
+		cc->cwnd += (long)BUFFER_SIZE * rs->delivered / cc->cwnd;
+	}
+	if(cc->srtt > 0) {
+		cc->pacing_rate = 1.25 * cc->cwnd * 1000000.0 / cc->srtt;
+	}
+};
+
+/* the congestion controllers which can be chosen with --cc */
+struct congestion_control congestion_controls[] = {
+	{"bbr", _bbr_init, _bbr_on_sample},
+	{"aimd", _aimd_init, _aimd_on_sample},
+};
+
+/* no. of parity blocks for a group of data blocks at a loss rate. There
+are about twice as many as blocks expected to be lost, plus some for bursts. */
+int _fec_parity_count(double loss_rate) {
+	int count;
+
+	if(loss_rate < FEC_MIN_LOSS) return 0;
+	count = (int)(loss_rate * FEC_GROUP_SIZE * 2) + 2;
+	return (count > FEC_MAX_PARITY) ? FEC_MAX_PARITY : count;
+};
+
+/* hands the parity of the group being encoded over to be sent */
+void _fec_finish_group(struct udp_sender * sender) {
+	sender->finished = sender->encoding;
+	sender->finished.next_to_send = 0;
+	sender->encoding.size = 0;
+};
+
+/* adds a data block being sent for the first time to the parity of its 
+group. A group ends after FEC_GROUP_SIZE blocks or where the next block
+doesn't follow in the file, so that the receiver knows which blocks it
+rebuilds. */
+void _fec_add_block(struct udp_sender * sender, struct datagram * datagram) {
+	struct fec_parity * group = &sender->encoding;
+	int i;
+
+	if(group->size > 0 && datagram->block != group->first_block + group->size) {
+		_fec_finish_group(sender);
+	}
+	if(group->size == 0) {
+		group->first_seq = datagram->seq_no;
+		group->first_block = datagram->block;
+		group->parity_count = _fec_parity_count(sender->loss_rate);
+		memset(group->parity, 0, sizeof(group->parity));
+	}
+	for(i = 0; i < group->parity_count; i++) {
+		_gf_mul_add(group->parity[i], (unsigned char *)datagram->buffer, 
+			_fec_coefficient(i, group->size), datagram->length);
+	}
+	group->size++;
+	if(group->size == FEC_GROUP_SIZE || datagram->seq_no == sender->total - 1) {
+		_fec_finish_group(sender);
+	}
+};
+
+/* queues a datagram to be sent again, unless it is queued already */
+void _queue_resend(struct udp_sender * sender, int seq_no) {
+	if(sender->queued[seq_no]) return;
+	sender->queued[seq_no] = 1;
+	sender->resend[(sender->resend_head + sender->resend_count++) % sender->total] = seq_no;
+};
+
+/* takes in a feedback of the receiver: moves the window, queues the 
+datagrams reported missing and feeds a sample to the congestion controller */
+void _process_feedback(struct udp_sender * sender, struct feedback * fb, int length) {
+	struct rate_sample rs = {0};
+	long long now = _now_us();
+	long rtt, rto;
+	int i, seq_no;
+
+	if(length < (int)offsetof(struct feedback, nacks) || fb->nack_count < 0 || 
+		fb->nack_count > UDP_MAX_NACKS || fb->ack_no < 0 || fb->ack_no > sender->total ||
+		fb->echo_seq < 0 || fb->echo_seq >= sender->total) {
+		return;
+	}
+	sender->last_feedback = now;
+	rs.now = now;
+	if(fb->ack_no > sender->ack_no) sender->ack_no = fb->ack_no;
+	if(fb->highest > sender->highest) sender->highest = fb->highest;
+	if(fb->delivered > sender->delivered) {
+		rs.delivered = (fb->delivered - sender->delivered) * BUFFER_SIZE;
+		sender->delivered = fb->delivered;
+	}
+	/* losses as the receiver counts them, which includes those repaired
+	by parity blocks */
+	if(fb->lost > sender->lost) {
+		rs.lost = fb->lost - sender->lost;
+		sender->lost = fb->lost;
+	}
+	if(fb->highest - sender->loss_mark_highest >= FEC_LOSS_WINDOW) {
+		sender->loss_rate = 0.75 * sender->loss_rate + 0.25 * 
+			(fb->lost - sender->loss_mark_lost) / (fb->highest - sender->loss_mark_highest);
+		sender->loss_mark_highest = fb->highest;
+		sender->loss_mark_lost = fb->lost;
+	}
+
+	/* the rtt of the echoed datagram, without the time it was held back */
+	rtt = now - fb->echo_sent_at - fb->echo_delay;
+	if(rtt > 0 && fb->echo_sent_at == sender->sent_at[fb->echo_seq]) {
+		rs.rtt = rtt;
+		sender->cc.srtt = sender->cc.srtt ? (7 * sender->cc.srtt + rtt) / 8 : rtt;
+		if(sender->cc.min_rtt == 0 || rtt <= sender->cc.min_rtt || 
+			now - sender->cc.min_rtt_stamp > BBR_MIN_RTT_WINDOW) {
+			sender->cc.min_rtt = rtt;
+			sender->cc.min_rtt_stamp = now;
+		}
+		/* delivered since the echoed datagram was sent, over the time taken */
+		if(now > fb->echo_sent_at) {
+			rs.delivery_rate = (double)(sender->delivered - 
+				sender->delivered_at_send[fb->echo_seq]) * BUFFER_SIZE * 
+				1000000.0 / (now - fb->echo_sent_at);
+		}
+	}
+
+	/* a datagram reported missing is sent again, unless its last copy may
+	still be on the way */
+	rto = sender->cc.srtt ? sender->cc.srtt + sender->cc.srtt / 4 : UDP_INITIAL_RTO;
+	for(i = 0; i < fb->nack_count; i++) {
+		seq_no = fb->nacks[i];
+		if(seq_no < sender->ack_no || seq_no >= sender->total || 
+			sender->queued[seq_no] || now - sender->sent_at[seq_no] < rto) {
+			continue;
+		}
+		_queue_resend(sender, seq_no);
+	}
+
+	rs.inflight = (long)(sender->next_new - 1 - sender->highest) * BUFFER_SIZE;
+	sender->control->on_sample(&sender->cc, &rs);
+	if(sender->cc.give_up && sender->control != &congestion_controls[CC_AIMD]) {
+		printf("\nHeavy loss, falling back to aimd.\n");
+		sender->control = &congestion_controls[CC_AIMD];
+		sender->control->init(&sender->cc);
+	}
+};
+
+/* Sends the planned blocks of the file as datagrams to the udp port the 
+server opened for them, paced at the rate of the congestion controller. 
+The receiver reports the datagrams it misses, and these are sent again. 
+Once it has them all, the server says so over the connection. Returns 1
+then, or 0 if the transfer failed. */
+int _send_over_udp(int sock_fd, int udp_port, int fd, struct transfer_plan * plan,
+	long filesize, struct upload_options * options) {
+	struct udp_sender sender = {0};
+	struct datagram datagram;
+	struct feedback fb;
+	struct segment result;
+	struct sockaddr_in server_addr;
+	socklen_t len = sizeof(server_addr);
+	struct pollfd fds[2];
+	struct timespec wait;
+	long long now, next_send, wait_us, last_tail_check = 0, started;
+	int * blocks = NULL, capacity = 0, block, seq_no, length, buffer_size = UDP_SOCKET_BUFFER;
+	long rto;
+	int done = 0, window_full;
+
+	/* the datagrams are numbered in the order of the plan */
+	while((block = _next_block_in_plan(plan)) != -1) {
+		if(sender.total == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			blocks = (int *)realloc(blocks, capacity * sizeof(int));
+		}
+		blocks[sender.total++] = block;
+	}
+
+	int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(udp_sock < 0) {
+		perror("Udp socket");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(udp_sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+	setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+	/* connected, so that only the server's datagrams are taken in */
+	getpeername(sock_fd, (struct sockaddr *)&server_addr, &len);
+	server_addr.sin_port = htons(udp_port);
+	if(connect(udp_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+		perror("Udp connect");
+		exit(EXIT_FAILURE);
+	}
+
+	sender.sent_at = (long long *)calloc(sender.total, sizeof(long long));
+	sender.delivered_at_send = (long *)calloc(sender.total, sizeof(long));
+	sender.queued = (unsigned char *)calloc(sender.total, 1);
+	sender.resend = (int *)malloc(sender.total * sizeof(int));
+	sender.highest = sender.loss_mark_highest = -1;
+	sender.fec = options->fec;
+	sender.control = &congestion_controls[options->congestion_control];
+	sender.control->init(&sender.cc);
+	_gf_init();
+	printf("\nSending %d blocks over udp, congestion control: %s%s\n", 
+		sender.total, sender.control->name, sender.fec ? ", with parity" : "");
+
+	fds[0].fd = udp_sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = sock_fd;
+	fds[1].events = POLLIN;
+	started = next_send = sender.last_feedback = _now_us();
+
+	while(!done) {
+		now = _now_us();
+		if(now - sender.last_feedback > UDP_IDLE_TIMEOUT) {
+			printf("\nNo feedback from the server.\n");
+			break;
+		}
+		while((length = recv(udp_sock, &fb, sizeof(fb), MSG_DONTWAIT)) > 0) {
+			_process_feedback(&sender, &fb, length);
+		}
+
+		rto = sender.cc.srtt ? 2 * sender.cc.srtt + UDP_MIN_RTO : UDP_INITIAL_RTO;
+		if(now - last_tail_check > rto) {
+			/* datagrams beyond the highest one received can't be reported
+			missing. Those which should have arrived by now are sent again. */
+			last_tail_check = now;
+			for(seq_no = (sender.highest + 1 > sender.ack_no) ? sender.highest + 1 : 
+				sender.ack_no; seq_no < sender.next_new; seq_no++) {
+				if(!sender.queued[seq_no] && now - sender.sent_at[seq_no] > rto) {
+					_queue_resend(&sender, seq_no);
+				}
+			}
+		}
+
+		/* never more than a millisecond of sending is made up for at once */
+		if(next_send < now - UDP_MAX_BURST) next_send = now - UDP_MAX_BURST;
+		window_full = 0;
+		while(next_send <= now) {
+			/* what was lost goes first. It left the window already, which
+			only holds the datagrams beyond the highest one received. */
+			seq_no = -1;
+			while(sender.resend_count > 0 && seq_no == -1) {
+				seq_no = sender.resend[sender.resend_head];
+				sender.resend_head = (sender.resend_head + 1) % sender.total;
+				sender.resend_count--;
+				sender.queued[seq_no] = 0;
+				if(seq_no < sender.ack_no) seq_no = -1;
+			}
+			datagram.total = sender.total;
+			datagram.kind = DATAGRAM_RESENT;
+			if(seq_no == -1 && sender.finished.next_to_send < sender.finished.parity_count) {
+				/* then the parity of the group just finished */
+				datagram.kind = DATAGRAM_PARITY;
+				datagram.seq_no = sender.finished.first_seq;
+				datagram.block = sender.finished.first_block;
+				datagram.group_size = sender.finished.size;
+				datagram.parity_index = sender.finished.next_to_send;
+				datagram.length = BUFFER_SIZE;
+				memcpy(datagram.buffer, sender.finished.parity[sender.finished.next_to_send++],
+					BUFFER_SIZE);
+				sender.parity_sent++;
+			}
+			else if(seq_no == -1) {
+				if((long)(sender.next_new - 1 - sender.highest) * BUFFER_SIZE >= sender.cc.cwnd) {
+					window_full = 1;
+					break;
+				}
+				if(sender.next_new == sender.total) break;
+				seq_no = sender.next_new++;
+				datagram.kind = DATAGRAM_DATA;
+			}
+
+			if(datagram.kind != DATAGRAM_PARITY) {
+				datagram.seq_no = seq_no;
+				datagram.block = blocks[seq_no];
+				datagram.length = pread(fd, datagram.buffer, BUFFER_SIZE, 
+					(long)blocks[seq_no] * BUFFER_SIZE);
+				if(datagram.length < 0) {
+					perror("File read");
+					exit(EXIT_FAILURE);
+				}
+				if(sender.fec && datagram.kind == DATAGRAM_DATA) {
+					_fec_add_block(&sender, &datagram);
+				}
+				datagram.sent_at = sender.sent_at[seq_no] = _now_us();
+				sender.delivered_at_send[seq_no] = sender.delivered;
+				sender.sent++;
+			}
+			length = offsetof(struct datagram, buffer) + datagram.length;
+			_trace(TRACE_DATAGRAM_SENT, datagram.seq_no, datagram.kind);
+			if(send(udp_sock, &datagram, length, 0) < 0) {
+				if(errno != ENOBUFS && errno != EAGAIN && errno != ECONNREFUSED) {
+					perror("Udp send");
+					exit(EXIT_FAILURE);
+				}
+			}
+			next_send += length * 1000000.0 / sender.cc.pacing_rate;
+		}
+
+		/* sleep until the next datagram is due, or something comes in */
+		wait_us = next_send - _now_us();
+		if(window_full || (sender.next_new == sender.total && sender.resend_count == 0 &&
+			sender.finished.next_to_send == sender.finished.parity_count)) {
+			/* nothing can be sent before the next feedback */
+			wait_us = rto;
+		}
+		if(wait_us < 0) wait_us = 0;
+		if(wait_us > UDP_FEEDBACK_INTERVAL) wait_us = UDP_FEEDBACK_INTERVAL;
+		wait.tv_sec = 0;
+		wait.tv_nsec = wait_us * 1000;
+		if(ppoll(fds, 2, &wait, NULL) > 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+			/* the server speaks up on the connection only when it is done */
+			done = (recv(sock_fd, &result, sizeof(result), MSG_WAITALL) == sizeof(result) &&
+				result.seq_no == END_OF_FILE_SEQ && result.ack_no == sender.total) ? 1 : -1;
+		}
+	}
+
+	if(done == 1) {
+		now = _now_us();
+		printf("\nSent %ld Bytes in %.2f s over udp: %ld datagrams, %ld sent again, "
+			"%ld parity, rtt %.1f ms.\n", _get_plan_size(plan, filesize), 
+			(now - started) / 1000000.0, (long)sender.total, sender.sent - sender.total, 
+			sender.parity_sent, sender.cc.min_rtt / 1000.0);
+	}
+	close(udp_sock);
+	free(blocks);
+	free(sender.sent_at);
+	free(sender.delivered_at_send);
+	free(sender.queued);
+	free(sender.resend);
+	return done == 1;
+};
+
+/* takes what tcp knows about the path of the connection into the tuning */
+void _sample_path(int sock_fd, struct tuning * tuning) {
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	memset(&info, 0, sizeof(info));
+	if(getsockopt(sock_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return;
+	if(info.tcpi_min_rtt > 0 && (tuning->rtt == 0 || info.tcpi_min_rtt < tuning->rtt)) {
+		tuning->rtt = info.tcpi_min_rtt;
+	}
+	if(info.tcpi_delivery_rate > tuning->bandwidth) {
+		tuning->bandwidth = info.tcpi_delivery_rate;
+	}
+};
+
+/* Starts the tuning of an upload from what the last tuned upload in the 
+log found, which most likely went over the same path. */
+void _start_tuning(struct tuning * tuning, int sock_fd, FILE * log_file) {
+	client_log entry;
+
+	memset(tuning, 0, sizeof(struct tuning));
+	tuning->enabled = 1;
+	tuning->blocks = TUNE_MIN_BLOCKS;
+	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+	while(fread(&entry, sizeof(client_log), 1, log_file)) {
+		if(entry.block_size > 0) {
+			tuning->blocks = entry.block_size / BUFFER_SIZE;
+			tuning->send_buffer = entry.send_buffer;
+		}
+	}
+	if(tuning->blocks < TUNE_MIN_BLOCKS) tuning->blocks = TUNE_MIN_BLOCKS;
+	if(tuning->blocks > TUNE_MAX_BLOCKS) tuning->blocks = TUNE_MAX_BLOCKS;
+	if(tuning->send_buffer > 0) {
+		setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &tuning->send_buffer, sizeof(int));
+	}
+	tuning->probing = 1;
+	tuning->probe_end = _now_us() + TUNE_PROBE_TIME;
+	tuning->sample_start = _now_us();
+};
+
+/* Settles the tuning on the fastest block size found, or the bandwidth-
+delay product if that is larger, as the path should be full while we wait
+for the ack of a segment. The socket gets a send buffer which holds a 
+block and what is in flight, if the kernel's is smaller; and as soon as 
+what is left unsent of it is less than a block, the next can be queued. */
+void _finish_tuning(struct tuning * tuning, int sock_fd) {
+	int buffer, current, lowat;
+	socklen_t len = sizeof(current);
+	long bdp;
+
+	tuning->probing = 0;
+	if(tuning->best_blocks > 0) tuning->blocks = tuning->best_blocks;
+	_sample_path(sock_fd, tuning);
+	if(tuning->best_rate > tuning->bandwidth) tuning->bandwidth = tuning->best_rate;
+	bdp = tuning->bandwidth * tuning->rtt / 1000000;
+	if(bdp / BUFFER_SIZE > tuning->blocks) {
+		tuning->blocks = (bdp / BUFFER_SIZE < TUNE_MAX_BLOCKS) ? bdp / BUFFER_SIZE : TUNE_MAX_BLOCKS;
+	}
+
+	buffer = 2 * ((long)tuning->blocks * BUFFER_SIZE + bdp);
+	if(buffer > TUNE_MAX_BUFFER) buffer = TUNE_MAX_BUFFER;
+	/* the kernel tunes its buffers on its own, which setting them stops */
+	if(getsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &current, &len) == 0 && buffer > current) {
+		setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+		tuning->send_buffer = buffer;
+	}
+	lowat = tuning->blocks * BUFFER_SIZE;
+	setsockopt(sock_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+	printf("\nTuned to segments of %d Bytes: rtt %ld us, %.2f MB/s, bdp %ld Bytes, "
+		"send buffer %s.\n", tuning->blocks * BUFFER_SIZE, tuning->rtt, 
+		tuning->bandwidth / (1024 * 1024), bdp, tuning->send_buffer ? "set" : "the kernel's");
+};
+
+/* Counts a round of the upload, from sending a segment to its ack, of 
+`bytes` of the file. While probing, a block size is measured over a few 
+rounds and doubled as long as that makes the upload TUNE_MIN_GAIN faster;
+one which makes the rounds too long is halved. Returns 1 when the tuning 
+has just settled. */
+int _tune(struct tuning * tuning, int sock_fd, long bytes) {
+	long long now = _now_us(), elapsed;
+	double rate;
+
+	if(!tuning->enabled || !tuning->probing) return 0;
+	tuning->sample_bytes += bytes;
+	tuning->sample_rounds++;
+	elapsed = now - tuning->sample_start;
+	if(now > tuning->probe_end) {
+		_finish_tuning(tuning, sock_fd);
+		return 1;
+	}
+	if(tuning->sample_rounds < TUNE_SAMPLE_ROUNDS || elapsed < TUNE_SAMPLE_TIME) return 0;
+
+	_sample_path(sock_fd, tuning);
+	rate = tuning->sample_bytes * 1000000.0 / elapsed;
+	if(elapsed / tuning->sample_rounds > TUNE_MAX_ROUND) {
+		/* a block carried over from a faster path */
+		if(tuning->best_blocks > 0 || tuning->blocks <= TUNE_MIN_BLOCKS) {
+			_finish_tuning(tuning, sock_fd);
+			return 1;
+		}
+		tuning->blocks /= 2;
+	}
+	else if(rate > tuning->best_rate * TUNE_MIN_GAIN) {
+		tuning->best_rate = rate;
+		tuning->best_blocks = tuning->blocks;
+		if(tuning->blocks >= TUNE_MAX_BLOCKS) {
+			_finish_tuning(tuning, sock_fd);
+			return 1;
+		}
+		tuning->blocks = (2 * tuning->blocks < TUNE_MAX_BLOCKS) ? 2 * tuning->blocks : TUNE_MAX_BLOCKS;
+	}
+	else {
+		_finish_tuning(tuning, sock_fd);
+		return 1;
+	}
+	tuning->sample_start = now;
+	tuning->sample_bytes = 0;
+	tuning->sample_rounds = 0;
+	return 0;
+};
+
+/* keeps what the tuning settled on in the record of the file, for the 
+next uploads to start from */
+void _record_tuning_in_log(FILE * log_file, char * f_name, struct tuning * tuning) {
+	client_log temp;
+
+	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+	while(fread(&temp, sizeof(client_log), 1, log_file)) {
+		if(strcmp(temp.filename, f_name) == 0) {
+			temp.block_size = tuning->blocks * BUFFER_SIZE;
+			temp.send_buffer = tuning->send_buffer;
+			temp.rtt = tuning->rtt;
+			fseek(log_file, -1 * sizeof(client_log), SEEK_CUR);
+			fwrite(&temp, sizeof(client_log), 1, log_file);
+			break;
+		}
+	}
+};
+
+/* end of the data of a file which starts at offset, where its next hole
+begins */
+long _get_data_end(int fd, long offset, long limit) {
+	off_t hole = lseek(fd, offset, SEEK_HOLE);
+
+	return (hole < 0 || hole > limit) ? limit : hole;
+};
+
+struct session session = {{0}, "", RECONNECT_TIME};
+
+/* Opens a session on a new connection. The server greets us with the size 
+of its log and a token, which stands for the session once the logs are 
+exchanged. A session we had is resumed with its token instead, which spares
+the exchange of the logs. Returns SESSION_NEW or SESSION_RESUMED, or 0 if 
+the connection was lost meanwhile. */
+int _open_session(int client_sock, FILE * log_file) {
+	char buffer[BUFFER_SIZE] = {0};
+	char token[SESSION_TOKEN_LENGTH + 1] = {0};
+	int logfile_size, temp_log_file_size;
+	FILE * temp_log;
+
+	if(session.token[0]) {
+		/* told before the greeting is read, so that a server which still
+		serves our old connection can cut it */
+		snprintf(buffer, sizeof(buffer), "RESUME %s", session.token);
+		if(send(client_sock, buffer, sizeof(buffer), MSG_NOSIGNAL) != sizeof(buffer)) return 0;
+	}
+
+	/* First we receive the file size of server log as we will be
+	first receiving the log from server */
+	if(recv(client_sock, buffer, sizeof(buffer), MSG_WAITALL) != sizeof(buffer)) return 0;
+	temp_log_file_size = atoi(buffer);
+	sscanf(buffer, "%*d %32s", token);
+
+	if(session.token[0]) {
+		if(recv(client_sock, buffer, sizeof(buffer), MSG_WAITALL) != sizeof(buffer)) return 0;
+		if(strcmp(buffer, "RESUMED") == 0) return SESSION_RESUMED;
+		/* the server was restarted and doesn't know us any more */
+	}
+
+		/* Once connected we exchange the log files. Recieved log file from server 
+	is saved as temp.txt*/
+	temp_log = fopen(received_log_name, "w+");
+	if(temp_log == NULL) {
+		printf("File error");
+		exit(EXIT_FAILURE);
+	}
+
+	/*getting the filesize of client log and sending it*/
+	logfile_size = _get_file_size(log_file);
+	sprintf(buffer, "%d", logfile_size);
+	if(send(client_sock, buffer, sizeof(buffer), MSG_NOSIGNAL) != sizeof(buffer)) {
+		fclose(temp_log);
+		return 0;
+	}
+
+	/*Now we start receiving the log file from server*/
+	recvlog(temp_log, client_sock, temp_log_file_size);
+	sendlog(log_file, client_sock, logfile_size);
+	fclose(temp_log);
+
+	strcpy(session.token, token);
+	return SESSION_NEW;
+};
+
+/* Makes a new connection to the server after the one on client_sock was 
+lost, and takes its place on client_sock, so that whoever holds it goes on
+as if nothing happened. Attempts back off exponentially, by a random half 
+of the backoff, so that clients cut off together don't come back together.
+Returns what _open_session() found, or 0 once reconnect_time has passed. */
+int _reconnect(int client_sock, FILE * log_file) {
+	long long give_up = _now_us() + session.reconnect_time * 1000000LL;
+	int backoff = RECONNECT_MIN_MS, wait, attempts = 0, sock, result;
+
+	if(session.reconnect_time <= 0) return 0;
+	while(1) {
+		wait = backoff / 2 + rand() % (backoff / 2 + 1);
+		if(_now_us() + wait * 1000LL > give_up) break;
+		printf("\nReconnecting in %d ms ...\n", wait);
+		fflush(stdout);
+		usleep(wait * 1000);
+		backoff = (2 * backoff < RECONNECT_MAX_MS) ? 2 * backoff : RECONNECT_MAX_MS;
+		attempts++;
+
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		if(sock < 0) {
+			perror("Socket");
+			exit(EXIT_FAILURE);
+		}
+		if(connect(sock, (struct sockaddr *)&session.server_addr, 
+			sizeof(session.server_addr)) < 0) {
+			close(sock);
+			continue;
+		}
+		_start_tls(sock);
+		/* the old connection is closed by this */
+		if(dup2(sock, client_sock) < 0) {
+			perror("Reconnecting");
+			exit(EXIT_FAILURE);
+		}
+		close(sock);
+
+		result = _open_session(client_sock, log_file);
+		if(result) {
+			printf("\nReconnected, %s.\n", (result == SESSION_RESUMED) ? 
+				"session resumed" : "logs exchanged again");
+			pthread_mutex_lock(&metrics.lock);
+			metrics.reconnects++;
+			pthread_mutex_unlock(&metrics.lock);
+			_trace(TRACE_RECONNECT, attempts, result == SESSION_RESUMED);
+			return result;
+		}
+	}
+	printf("\nCouldn't reconnect to the server.\n");
+	return 0;
+};
+
+/* Picks an upload which lost its connection up again on a new one. If the
+session is resumed, the server still has what we sent and we go on from the
+segment which wasn't acked, without the file being verified: returns 
+SESSION_RESUMED. SESSION_NEW means the server forgot us, or what we sent
+since its last checkpoint, and the upload has to start over. 0 if the 
+server can't be reached. */
+int _resume_upload(int client_sock, char * filename, long filesize, FILE * log_file) {
+	struct segment segment;
+	int result;
+
+	while((result = _reconnect(client_sock, log_file)) == SESSION_RESUMED) {
+		memset(&segment, 0, sizeof(segment));
+		strcpy(segment.filename, filename);
+		sprintf(segment.filesize, "%ld", filesize);
+		segment.flags = SEGMENT_RESUMED;
+		if(send(client_sock, &segment, sizeof(segment), MSG_NOSIGNAL) == sizeof(segment) &&
+			recv_with_timeout(client_sock, &segment, sizeof(segment), 12) > 0) {
+			/* the flag in the answer tells that the server lost what we
+			sent since its last checkpoint, as one writing to a bucket keeps
+			the part it fills only in memory */
+			if(segment.flags & SEGMENT_RESUMED) result = SESSION_NEW;
+			break;
+		}
+	}
+	return result;
+};
+
+/* Sends a data segment, and the data or frames of a long one behind it. 
+Returns 0 if the connection is lost. */
+int _send_segment(int sock_fd, struct segment * segment, unsigned char * long_block) {
+	int is_long = (segment->flags & (SEGMENT_LONG | SEGMENT_FRAMED)) != 0;
+	long sent = 0, sent_bytes;
+
+	/* The data of a long segment follows, and tcp must not wait for an ack
+	of the header before sending it, or every long segment stalls for the 
+	server's delayed ack. */
+	if(send(sock_fd, segment, sizeof(struct segment), 
+		is_long ? MSG_MORE | MSG_NOSIGNAL : MSG_NOSIGNAL) < 0) {
+		return 0;
+	}
+	while(is_long && sent < segment->length) {
+		sent_bytes = send(sock_fd, long_block + sent, segment->length - sent, MSG_NOSIGNAL);
+		if(sent_bytes < 0) return 0;
+		sent += sent_bytes;
+	}
+	return 1;
+};
+
+void _init_block_queue(struct block_queue * queue, unsigned long size) {
+	unsigned long i;
+
+	memset(queue, 0, sizeof(struct block_queue));
+	queue->cells = (struct block_queue_cell *)malloc(size * sizeof(struct block_queue_cell));
+	queue->mask = size - 1;
+	for(i = 0; i < size; i++) {
+		queue->cells[i].sequence = i;
+	}
+};
+
+/* returns 0 if the queue is full */
+int _push_to_queue(struct block_queue * queue, int value) {
+	unsigned long position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+	struct block_queue_cell * cell;
+	long lap;
+
+	while(1) {
+		cell = &queue->cells[position & queue->mask];
+		lap = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position);
+		if(lap == 0) {
+			if(__atomic_compare_exchange_n(&queue->push_position, &position, position + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		}
+		else if(lap < 0) {
+			return 0;
+		}
+		else {
+			position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+		}
+	}
+	cell->value = value;
+	__atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+	return 1;
+};
+
+/* returns 0 if the queue is empty */
+int _pop_from_queue(struct block_queue * queue, int * value) {
+	unsigned long position = __atomic_load_n(&queue->pop_position, __ATOMIC_RELAXED);
+	struct block_queue_cell * cell;
+	long lap;
+
+	while(1) {
+		cell = &queue->cells[position & queue->mask];
+		lap = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (position + 1));
+		if(lap == 0) {
+			if(__atomic_compare_exchange_n(&queue->pop_position, &position, position + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		}
+		else if(lap < 0) {
+			return 0;
+		}
+		else {
+			position = __atomic_load_n(&queue->pop_position, __ATOMIC_RELAXED);
+		}
+	}
+	*value = cell->value;
+	__atomic_store_n(&cell->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+	return 1;
+};
+
+/* what a stage does while the one before it hasn't got anything for it:
+yield the cpu at first, then sleep, so that waiting costs nothing */
+void _pipeline_wait(int spins) {
+	struct timespec pause = {0, PIPELINE_SLEEP};
+
+	if(spins < PIPELINE_SPINS) sched_yield();
+	else nanosleep(&pause, NULL);
+};
+
+/* The reader stage. Holes are passed on as they are, the workers have 
+nothing to do with them. */
+void * _read_blocks(void * arg) {
+	struct pipeline * pipeline = arg;
+	struct pipeline_block * slot;
+	long block_end, hole_end;
+	int block, spins;
+
+	while((block = _next_block_in_plan(&pipeline->plan)) != -1) {
+		slot = &pipeline->blocks[pipeline->produced & (PIPELINE_DEPTH - 1)];
+		/* the slot is free once the sender has taken what was in it */
+		for(spins = 0; __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != BLOCK_FREE; spins++) {
+			if(__atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED)) return NULL;
+			_pipeline_wait(spins);
+		}
+
+		slot->block = block;
+		slot->offset = (long)block * BUFFER_SIZE;
+		block_end = slot->offset + BUFFER_SIZE;
+		if(block_end > pipeline->filesize) block_end = pipeline->filesize;
+		hole_end = _get_hole_end(pipeline->fd, slot->offset, pipeline->filesize);
+		slot->hole = (hole_end >= block_end);
+		if(slot->hole) {
+			/* stretched over the following blocks of the plan in it too */
+			slot->end_block = (hole_end == pipeline->filesize) ? 
+				(pipeline->filesize + BUFFER_SIZE - 1) / BUFFER_SIZE : hole_end / BUFFER_SIZE;
+			_skip_in_plan(&pipeline->plan, slot->end_block);
+			slot->raw_length = ((long)slot->end_block * BUFFER_SIZE < pipeline->filesize) ? 
+				(long)slot->end_block * BUFFER_SIZE - slot->offset : pipeline->filesize - slot->offset;
+			__atomic_store_n(&slot->state, BLOCK_DONE, __ATOMIC_RELEASE);
+		}
+		else {
+			slot->raw_length = pread(pipeline->fd, slot->raw, block_end - slot->offset, slot->offset);
+			if(slot->raw_length != block_end - slot->offset) {
+				perror("File read");
+				exit(EXIT_FAILURE);
+			}
+			__atomic_store_n(&slot->state, BLOCK_READ, __ATOMIC_RELEASE);
+			/* the queue has room for the whole ring */
+			_push_to_queue(&pipeline->queue, pipeline->produced & (PIPELINE_DEPTH - 1));
+		}
+		__atomic_store_n(&pipeline->produced, pipeline->produced + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&pipeline->reader_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+};
+
+/* a worker stage, of which there is one per core */
+void * _frame_blocks(void * arg) {
+	struct pipeline_worker * worker = arg;
+	struct pipeline * pipeline = worker->pipeline;
+	struct pipeline_block * slot;
+	int index, compressed, spins = 0;
+
+	while(1) {
+		if(_pop_from_queue(&pipeline->queue, &index)) {
+			slot = &pipeline->blocks[index];
+			slot->frame.length = _compress_block(&worker->comp, slot->raw, slot->raw_length,
+				slot->data, &compressed);
+			slot->frame.flags = compressed ? FRAME_COMPRESSED : 0;
+			slot->frame.checksum = _crc32c(slot->raw, slot->raw_length);
+			__atomic_store_n(&slot->state, BLOCK_DONE, __ATOMIC_RELEASE);
+			spins = 0;
+		}
+		else if(__atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED)) {
+			break;
+		}
+		else {
+			_pipeline_wait(spins++);
+		}
+	}
+	return NULL;
+};
+
+/* Starts the pipeline of an upload over its plan. Every worker compresses
+as comp says, keeping statistics of its own. */
+struct pipeline * _start_pipeline(int fd, long filesize, struct transfer_plan * plan,
+	struct compressor * comp) {
+	struct pipeline * pipeline = (struct pipeline *)calloc(1, sizeof(struct pipeline));
+	int i;
+
+	_crc32c_init();
+	pipeline->fd = fd;
+	pipeline->filesize = filesize;
+	pipeline->plan = *plan;
+	pipeline->blocks = (struct pipeline_block *)calloc(PIPELINE_DEPTH, 
+		sizeof(struct pipeline_block));
+	_init_block_queue(&pipeline->queue, PIPELINE_DEPTH);
+
+	/* the reader and the sender mostly wait, the rest of the cores work */
+	pipeline->worker_count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if(pipeline->worker_count < 1) pipeline->worker_count = 1;
+	if(pipeline->worker_count > PIPELINE_MAX_WORKERS) pipeline->worker_count = PIPELINE_MAX_WORKERS;
+	pthread_create(&pipeline->reader, NULL, _read_blocks, pipeline);
+	for(i = 0; i < pipeline->worker_count; i++) {
+		pipeline->workers[i].pipeline = pipeline;
+		pipeline->workers[i].comp = *comp;
+		pthread_create(&pipeline->workers[i].thread, NULL, _frame_blocks, &pipeline->workers[i]);
+	}
+	return pipeline;
+};
+
+/* stops the stages, wherever they are, and adds up the statistics of the
+workers into comp */
+void _stop_pipeline(struct pipeline * pipeline, struct compressor * comp) {
+	int i;
+
+	__atomic_store_n(&pipeline->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(pipeline->reader, NULL);
+	for(i = 0; i < pipeline->worker_count; i++) {
+		pthread_join(pipeline->workers[i].thread, NULL);
+		comp->raw_bytes += pipeline->workers[i].comp.raw_bytes;
+		comp->wire_bytes += pipeline->workers[i].comp.wire_bytes;
+		comp->compressed_blocks += pipeline->workers[i].comp.compressed_blocks;
+		comp->bypassed_blocks += pipeline->workers[i].comp.bypassed_blocks;
+	}
+	free(pipeline->queue.cells);
+	free(pipeline->blocks);
+	free(pipeline);
+};
+
+/* The sender stage. Takes the next blocks of the plan out of the pipeline,
+up to max_blocks of them which follow each other in the file, into the 
+frames of a segment in out; a hole goes into a segment of its own. Returns
+the bytes of the file the segment covers, 0 once the plan is done. */
+long _take_from_pipeline(struct pipeline * pipeline, struct segment * segment, 
+	unsigned char * out, int max_blocks) {
+	struct pipeline_block * slot;
+	struct hole_range hole;
+	long raw_bytes = 0;
+	int count = 0, length = 0, spins;
+
+	while(count < max_blocks) {
+		slot = &pipeline->blocks[pipeline->consumed & (PIPELINE_DEPTH - 1)];
+		for(spins = 0; __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != BLOCK_DONE; spins++) {
+			if(__atomic_load_n(&pipeline->reader_done, __ATOMIC_ACQUIRE) && 
+				pipeline->consumed == __atomic_load_n(&pipeline->produced, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			_pipeline_wait(spins);
+		}
+		if(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != BLOCK_DONE) break;
+		if(count > 0 && (slot->hole || slot->block != segment->seq_no + count)) break;
+
+		if(slot->hole) {
+			hole.offset = slot->offset;
+			hole.length = slot->raw_length;
+			memcpy(segment->buffer, &hole, sizeof(hole));
+			segment->seq_no = slot->block;
+			segment->length = sizeof(hole);
+			segment->flags = SEGMENT_HOLE;
+			raw_bytes = slot->raw_length;
+			__atomic_store_n(&slot->state, BLOCK_FREE, __ATOMIC_RELEASE);
+			pipeline->consumed++;
+			return raw_bytes;
+		}
+
+		if(count == 0) segment->seq_no = slot->block;
+		memcpy(out + length, &slot->frame, sizeof(struct frame));
+		memcpy(out + length + sizeof(struct frame), slot->data, slot->frame.length);
+		length += sizeof(struct frame) + slot->frame.length;
+		raw_bytes += slot->raw_length;
+		count++;
+		/* the frame is kept in out until it is acked */
+		__atomic_store_n(&slot->state, BLOCK_FREE, __ATOMIC_RELEASE);
+		pipeline->consumed++;
+	}
+	segment->length = length;
+	segment->flags = SEGMENT_FRAMED;
+	return raw_bytes;
+};
+
+/* Uploads one file over a connection on which the logs have already been 
+exchanged: resumed, as a delta or through the chunk store, whichever fits.
+Returns 1 once the server has the whole file. */
+int _upload_file(int client_sock, char * file_argument, FILE ** log_file_ptr,
+	struct upload_options * options) {
+	FILE * file_to_send, * log_file = *log_file_ptr;
+
+	/* We are initialsing two segments one corresponding to what we send
+	and other one we receive. */
+	struct segment client_segment = {0};
+	struct segment recvd_segment = {0};
+
+	char filename[BUFFER_SIZE];
+	long int filesize;
+	long remaining_bytes;
+	long read_bytes;  /* bytes of the file covered by the current segment */
+	int sent_bytes, recvd_bytes;  
+	short completed = 0;
+	int resumed, restart = 0;
+
+	//Retransmission timeout value
+	short RTO;   /* initial value will be 3 sec which will be doubled each retry */
+	short retry;   /* sender will retry sending acc to this value */
+
+	/* the compression statistics are kept per file */
+	struct compressor comp = options->comp;
+	short dedup = options->dedup;
+	unsigned char raw_block[BUFFER_SIZE];
+	int compressed;
+	struct hole_range hole;
+	long block_end, hole_end, data_end;
+	int end_block;
+	struct tuning tuning = {0};
+	unsigned char * long_block = NULL;
+	struct pipeline * pipeline = NULL;
+	int unacked = 0;  /* whether the segment taken from the pipeline is acked */
+
+	//opening the file to be sent
+	strcpy(client_segment.filename, file_argument);
+	strcpy(filename, file_argument); /* storing for convenience */
+	file_to_send = fopen(client_segment.filename, "r");
+	if(file_to_send == NULL) {
+		perror("File");
+		return 0;
+	}
+
+	//getting size of file by seeking to the end of file
+	filesize = _get_file_size(file_to_send);
+	if(filesize == 0) {
+		/* the server takes a size of 0 for a broken metadata segment */
+		printf("\n%s is empty. Nothing to send.\n", filename);
+		fclose(file_to_send);
+		return 0;
+	}
+
+	//storing and printing filesize
+	sprintf(client_segment.filesize, "%ld", filesize);
+	printf("\nFile Size: %s Bytes \n", client_segment.filesize);
+
+	/* these are few variables being used in loop for collecting
+	qunatitative data about transfer and also control the loop*/
+	recvd_bytes = 1;   /* setting just to start the loop */
+	unsigned long bytes_transferred = 0;
+	unsigned short percentage = 0;
+
+	client_log initial_log_entry, log_entry;   /* creating instances of 
+	server log for initialising and updating*/
+
+	/* we now initialise the client log entry for the provided file 
+	and also check whether the file is already uploaded or partially
+	uploaded */
+	short init_result = _initialise_log_entry_for_file(&initial_log_entry, 
+		filename, client_segment.filesize, log_file);
+
+	if(init_result == FULLY_UPLOADED) {
+		if(!_is_modified_since_upload(&initial_log_entry, filename)) {
+			printf("\nFile is already uploaded. Check logs for more detail.\n");
+			fclose(file_to_send);
+			return 1;
+		}
+		/* the file has changed after it was uploaded. We ask the server to
+		let us send just the differences from its copy. */
+		printf("\nFile has changed since it was uploaded.\n");
+		client_segment.flags = dedup ? SEGMENT_DEDUP : SEGMENT_DELTA;
+		_update_transfer_progress_in_log(&log_entry, filename, 
+						filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+	}
+	else if(init_result == PARTIALLY_UPLOADED) {
+		/* we update the connection count in log file */
+		_update_transfer_progress_in_log(&log_entry, filename, 
+						0, 0, log_file, UPDATE_LOG_CONNECTION_COUNT);
+	}
+
+	if(dedup) {
+		client_segment.flags = SEGMENT_DEDUP;
+	}
+	else if(!options->no_local && _is_same_host(client_sock) && 
+		_describe_local_source(file_to_send, filename, 
+			(struct local_source *)client_segment.buffer)) {
+		/* the server may copy the file straight from our disk. If it can't,
+		it goes on as the other flags ask for. */
+		client_segment.flags |= SEGMENT_LOCAL;
+	}
+	if(options->udp && !dedup) {
+		client_segment.flags |= SEGMENT_UDP;
+	}
+
+	/* sending file name & size to server. The server answers with the no. 
+	of bytes of this file it already has on its disk. We can't trust those 
+	bytes blindly, as either copy might have been changed or damaged since 
+	the upload was interrupted. If the connection is lost, the metadata is
+	sent again on a new one. */
+	while(1) {
+		sent_bytes = send(client_sock, (void *)&client_segment, 
+			sizeof(struct segment), MSG_NOSIGNAL); 
+		if(sent_bytes < 0) {
+			perror("Sending file metadata");
+		}
+		else {
+			recvd_bytes = recv_with_timeout(client_sock, &recvd_segment, 
+				sizeof(struct segment), 12);
+			if(recvd_bytes > 0) break;
+			printf("\nServer didn't answer the file metadata.\n");
+		}
+		if(!_reconnect(client_sock, log_file)) exit(EXIT_FAILURE);
+	}
+	_begin_transfer(filename, filesize);
+	if(recvd_segment.flags & SEGMENT_LOCAL) {
+		/* nothing to send, we just wait until the copy is done */
+		printf("\nServer is copying the file from this host ...\n");
+		recvd_bytes = recv_with_timeout(client_sock, &recvd_segment, 
+			sizeof(struct segment), LOCAL_COPY_TIMEOUT);
+		if(recvd_bytes <= 0 || recvd_segment.seq_no != END_OF_FILE_SEQ || 
+			recvd_segment.ack_no != 1) {
+			printf("\nServer couldn't copy the file.\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("\nFile sending Completed.\n");
+		_end_transfer(1);
+
+		_update_transfer_progress_in_log(&log_entry, filename, 
+						filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+		log_file = _update_file_to_be_received_list(log_file, filename);
+
+		fclose(file_to_send);
+		*log_file_ptr = log_file;
+		return 1;
+	}
+	if(recvd_segment.flags & (SEGMENT_DELTA | SEGMENT_DEDUP)) {
+		/* server has a complete old copy and is ready for the delta, or
+		is ready to take the file as chunks */
+		int rebuilt = (recvd_segment.flags & SEGMENT_DELTA) ? 
+			_send_delta(client_sock, file_to_send, filesize) :
+			_send_deduplicated(client_sock, file_to_send, filesize);
+		if(rebuilt == 0) {
+			printf("\nServer couldn't rebuild the file.\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("\nFile sending Completed.\n");
+		_end_transfer(1);
+
+		_update_transfer_progress_in_log(&log_entry, filename, 
+						filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+		log_file = _update_file_to_be_received_list(log_file, filename);
+
+		fclose(file_to_send);
+		*log_file_ptr = log_file;
+		return 1;
+	}
+	/* otherwise the server has no complete copy to take a delta against,
+	and the file is sent as a plain, possibly resumed, upload */
+
+	/* the server opened a udp port if it takes the data over udp */
+	int udp_port = (recvd_segment.flags & SEGMENT_UDP) ? atoi(recvd_segment.buffer) : 0;
+	long amount_uploaded = atol(recvd_segment.filesize);
+	if(amount_uploaded > filesize) amount_uploaded = filesize;
+
+	struct transfer_plan plan = {0};
+	int next_block = 0; /* first block which the server hasn't got at all */
+
+	if(amount_uploaded > 0 && (recvd_segment.flags & SEGMENT_RESUMED)) {
+		/* a server writing to a bucket can't read what it has back, to
+		verify it. What it has is whole parts, which we go on after. */
+		printf("\nServer has %ld Bytes in its bucket, going on after them.\n", amount_uploaded);
+		next_block = amount_uploaded / BUFFER_SIZE;
+	}
+	else if(amount_uploaded > 0) {
+		/* NOW WE TRY TO RESUME THE UPLOAD PROCESS */
+
+		/* both sides build a hash tree over the bytes the server claims to
+		have and we walk down the server's tree to find which leaves differ.
+		Only those, and the part never uploaded, will be sent again. */
+		struct merkle_tree tree;
+		printf("\nServer has %ld Bytes. Verifying them ...\n", amount_uploaded);
+		_build_merkle_tree(fileno(file_to_send), amount_uploaded, &tree);
+
+		int * corrupt_leaves = (int *)malloc(tree.width * sizeof(int));
+		int corrupt_count = _find_corrupt_leaves(client_sock, &tree, corrupt_leaves);
+		int i;
+
+		for(i = 0; i < corrupt_count; i++) {
+			_add_to_plan(&plan, corrupt_leaves[i] * (MERKLE_LEAF_SIZE / BUFFER_SIZE),
+				MERKLE_LEAF_SIZE / BUFFER_SIZE);
+		}
+		printf("%d corrupt range(s) of %d Bytes found.\n", corrupt_count, 
+			MERKLE_LEAF_SIZE);
+
+		/* a partial last block has to be sent again in full */
+		next_block = amount_uploaded / BUFFER_SIZE;
+
+		free(corrupt_leaves);
+		free(tree.nodes);
+	}
+	_add_to_plan(&plan, next_block, 
+		(filesize + BUFFER_SIZE - 1) / BUFFER_SIZE - next_block);
+
+	/* update the various loop variables to reflect correct value 
+	after resuming*/
+	remaining_bytes = _get_plan_size(&plan, filesize);
+	bytes_transferred = filesize - remaining_bytes;
+	percentage = (filesize > 0) ? (bytes_transferred/(float)filesize)*100 : 0;
+
+	/* we update the progress of file according to verified server 
+	record in client log */
+	_update_transfer_progress_in_log(&log_entry, filename, 
+					bytes_transferred, percentage, log_file, 
+					UPDATE_LOG_PROGRESS);
+
+	if(udp_port > 0) {
+		/* the whole plan goes over udp. What follows only tells the server
+		that everything has been sent. */
+		if(!_send_over_udp(client_sock, udp_port, fileno(file_to_send), &plan, 
+			filesize, options)) {
+			printf("\nUdp transfer failed.\n");
+			exit(EXIT_FAILURE);
+		}
+		_count_transfer(client_sock, remaining_bytes);
+	}
+
+	comp.backoff = 1;
+	_start_tuning(&tuning, client_sock, log_file);
+	long_block = (unsigned char *)malloc(TUNE_MAX_BLOCKS * (BUFFER_SIZE + sizeof(struct frame)));
+	if((comp.enabled || options->checksum) && udp_port == 0) {
+		/* compression and checksums work on a block at a time. The blocks
+		are prepared by a pipeline of threads ahead of the sender, and go 
+		as frames in long segments. */
+		pipeline = _start_pipeline(fileno(file_to_send), filesize, &plan, &comp);
+		client_segment.seq_no = 0; /* until the first segment is taken */
+	}
+	else {
+		client_segment.seq_no = _next_block_in_plan(&plan);
+	}
+	
+	while(client_segment.seq_no != -1 && recvd_bytes > 0 && !restart) {
+		retry = 3;
+		RTO = 3;
+		if(pipeline != NULL) {
+			/* a segment not acked before the connection was lost is sent
+			again on the new one */
+			if(!unacked) {
+				read_bytes = _take_from_pipeline(pipeline, &client_segment, long_block, tuning.blocks);
+				if(read_bytes == 0) {
+					client_segment.seq_no = -1;
+					continue;
+				}
+				unacked = 1;
+			}
+			goto send_segment;
+		}
+		hole.offset = (long)client_segment.seq_no * BUFFER_SIZE;
+		block_end = hole.offset + BUFFER_SIZE;
+		if(block_end > filesize) block_end = filesize;
+		hole_end = _get_hole_end(fileno(file_to_send), hole.offset, filesize);
+
+		if(hole_end >= block_end) {
+			/* The block lies in a hole of a sparse file. Instead of its
+			zeros we describe the hole, stretched over the following 
+			blocks of the plan which are in it too. */
+			end_block = (hole_end == filesize) ? 
+				(filesize + BUFFER_SIZE - 1) / BUFFER_SIZE : hole_end / BUFFER_SIZE;
+			_skip_in_plan(&plan, end_block);
+			hole.length = ((long)end_block * BUFFER_SIZE < filesize) ? 
+				(long)end_block * BUFFER_SIZE - hole.offset : filesize - hole.offset;
+			/* only the size of the range was read */
+			read_bytes = hole.length;
+
+			memcpy(client_segment.buffer, &hole, sizeof(hole));
+			client_segment.length = sizeof(hole);
+			client_segment.flags = SEGMENT_HOLE;
+		}
+		else if(tuning.enabled && tuning.blocks > 1 && 
+			(data_end = _get_data_end(fileno(file_to_send), hole.offset, filesize)) > block_end) {
+			/* as many blocks of the plan as the tuning asks for go in one
+			long segment, up to the next hole */
+			end_block = client_segment.seq_no + tuning.blocks;
+			if((long)end_block * BUFFER_SIZE > data_end) {
+				end_block = (data_end + BUFFER_SIZE - 1) / BUFFER_SIZE;
+			}
+			end_block = _extend_in_plan(&plan, end_block);
+			block_end = ((long)end_block * BUFFER_SIZE < filesize) ? 
+				(long)end_block * BUFFER_SIZE : filesize;
+			read_bytes = block_end - hole.offset;
+			if(pread(fileno(file_to_send), long_block, read_bytes, hole.offset) != read_bytes) {
+				perror("File read");
+				exit(EXIT_FAILURE);
+			}
+			client_segment.length = read_bytes;
+			client_segment.flags = SEGMENT_LONG;
+		}
+		else {
+			//Setting the file pointer at right position acc to seq no.
+			fseek(file_to_send, hole.offset, SEEK_SET);
+
+			//read buffersize amount of bytes from file into the segment buffer
+			read_bytes = fread(raw_block, sizeof(char), sizeof(raw_block), file_to_send);
+			if(read_bytes < 0) {
+				perror("File read");
+				exit(EXIT_FAILURE);
+			}
+
+			/* pass the block through the compression stage into the segment */
+			client_segment.length = _compress_block(&comp, raw_block, read_bytes,
+				(unsigned char *)client_segment.buffer, &compressed);
+			client_segment.flags = compressed ? SEGMENT_COMPRESSED : 0;
+		}
+
+send_segment:
+		while(retry > 0) {
+			_trace(TRACE_SEGMENT_SENT, client_segment.seq_no, client_segment.length);
+			// send the segment to server
+			if(!_send_segment(client_sock, &client_segment, long_block)) {
+				perror("Sending File");
+				retry = 0;
+				break;
+			}
+
+			// now we wait for acknowledge from the receiver
+			recvd_bytes = recv_with_timeout(client_sock, 
+				(struct segment *)&recvd_segment, 
+				sizeof(struct segment), RTO);
+			/* using sizeof r_segment as recvd_segment is a pointer */
+
+			if(recvd_bytes == 0) {
+				printf("\nConnection closed.\n");
+				retry = 0;
+				break;
+			}
+			else if(recvd_bytes == -1) {
+				perror("Timeout");
+				retry = 0;
+				break;
+			}
+			else if(recvd_bytes == TIMEOUT_OCCURED) {
+				printf("\nTimeout ocurred. Retrying ...\n");
+				_trace(TRACE_TIMEOUT, client_segment.seq_no, RTO);
+				retry--;
+				RTO *= 2; 
+
+				/*as the timeout has ocurred we will update the corresponding
+				record in log file*/
+				_update_transfer_progress_in_log(&log_entry, filename, 
+						0, 0, log_file, UPDATE_LOG_TIMEOUT);
+				/* we provide the timeout argument of the function as 1 
+				so that function gets to know only timeout has to be updated */
+			}
+			else if(client_segment.seq_no == recvd_segment.seq_no && 
+				(client_segment.flags & SEGMENT_FRAMED) && recvd_segment.ack_no == recvd_segment.seq_no) {
+				/* the server took none of it, as a block didn't match its
+				checksum */
+				printf("\nServer got a corrupt block in segment %d. Resending ...\n", 
+					client_segment.seq_no);
+				retry--;
+			}
+			else if(client_segment.seq_no == recvd_segment.seq_no) {
+				/* Now we have got the acknowledgement from server*/
+				_trace(TRACE_ACK_RECEIVED, recvd_segment.seq_no, recvd_segment.ack_no);
+
+				/* as new segment has been sent, we will update
+					the records in corresponding log file*/
+				remaining_bytes -= read_bytes;
+				bytes_transferred += read_bytes;
+				if((unsigned short)((bytes_transferred/(float)filesize)*100) != percentage) {
+					/* progress is shown by the percent, segments are 
+					only traced */
+					percentage = (bytes_transferred/(float)filesize)*100;
+					printf("\nRemaining: %ld Bytes", remaining_bytes);
+				}
+				_update_transfer_progress_in_log(&log_entry, filename, 
+						bytes_transferred, percentage, log_file, 
+						UPDATE_LOG_PROGRESS);
+				_count_transfer(client_sock, read_bytes);
+				if(_tune(&tuning, client_sock, read_bytes)) {
+					_trace(TRACE_TUNED, tuning.blocks, tuning.send_buffer);
+					_record_tuning_in_log(log_file, filename, &tuning);
+				}
+
+				/* the next segment is the next block of the plan, which need
+				not follow this one when corrupt ranges are being repaired */
+				if(pipeline == NULL) client_segment.seq_no = _next_block_in_plan(&plan);
+				unacked = 0;
+				client_segment.ack_no = recvd_segment.ack_no;
+				break; /* now no need to retry for this segment */
+			}
+		}
+
+		if(retry == 0) {
+			printf("\nConnection Lost\n");
+			resumed = _resume_upload(client_sock, filename, filesize, log_file);
+			if(!resumed) exit(EXIT_FAILURE);
+			restart = (resumed == SESSION_NEW);
+			recvd_bytes = 1;
+			_update_transfer_progress_in_log(&log_entry, filename, 
+				0, 0, log_file, UPDATE_LOG_CONNECTION_COUNT);
+			if(tuning.enabled && !restart) {
+				/* the new connection may take another path */
+				_start_tuning(&tuning, client_sock, log_file);
+			}
+		}
+	}
+	if(tuning.probing && tuning.best_blocks > 0) {
+		/* the file ended before the tuning did, what it found so far is
+		still worth keeping */
+		_finish_tuning(&tuning, client_sock);
+		_record_tuning_in_log(log_file, filename, &tuning);
+	}
+	free(long_block);
+	if(pipeline != NULL) _stop_pipeline(pipeline, &comp);
+
+	if(client_segment.seq_no == -1) {
+		/* every planned segment is acknowledged. We tell the server so, in
+		order to let it truncate and close its copy, and wait for its ack. */
+		client_segment.seq_no = END_OF_FILE_SEQ;
+		client_segment.length = 0;
+		client_segment.flags = 0;
+		while(1) {
+			recvd_bytes = 0;
+			if(send(client_sock, &client_segment, sizeof(struct segment), MSG_NOSIGNAL) == 
+				sizeof(struct segment)) {
+				recvd_bytes = recv_with_timeout(client_sock, &recvd_segment,
+					sizeof(struct segment), DURABLE_ACK_TIMEOUT);
+			}
+			if(recvd_bytes > 0) break;
+			printf("\nServer didn't ack the end of the file.\n");
+			resumed = _resume_upload(client_sock, filename, filesize, log_file);
+			if(resumed != SESSION_RESUMED) {
+				restart = (resumed == SESSION_NEW);
+				break;
+			}
+		}
+
+		if(recvd_bytes > 0 && recvd_segment.seq_no == END_OF_FILE_SEQ && 
+			recvd_segment.ack_no != 1) {
+			/* a server forwarding to others got the file, but not all of 
+			them stored it */
+			printf("\nServer couldn't store the file, or pass it on to its replicas.\n");
+		}
+		else if(recvd_bytes > 0 && recvd_segment.seq_no == END_OF_FILE_SEQ) {
+			printf("\nFile sending Completed.\n");
+			if(comp.enabled && comp.raw_bytes > 0) {
+				printf("Compression: %ld Bytes sent for %ld (%d blocks compressed, "
+					"%d sent as they were).\n", comp.wire_bytes, comp.raw_bytes, 
+					comp.compressed_blocks, comp.bypassed_blocks);
+			}
+
+			/* update the log record on completion of file transfer */
+			_update_transfer_progress_in_log(&log_entry, filename, 
+							filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+
+			/* now, we also need to remove the file entry from line 2 as the
+			list should contain the files which are not completely received*/
+			log_file = _update_file_to_be_received_list(log_file, filename);
+			completed = 1;
+		}
+	}
+
+	if(restart) {
+		/* the server forgot our session, and what we know it has of the
+		file with it. The upload starts over, from what it has verified. */
+		printf("\nServer lost the session, starting the upload over.\n");
+		_end_transfer(0);
+		free(plan.ranges);
+		fclose(file_to_send);
+		*log_file_ptr = log_file;
+		return _upload_file(client_sock, file_argument, log_file_ptr, options);
+	}
+
+	_end_transfer(completed);
+	fclose(file_to_send);
+	*log_file_ptr = log_file;
+	return completed;
+};
+
+/* milliseconds on the monotonic clock */
+long long _now_ms() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+};
+
+/* queues a file to be sent once it has been quiet for WATCH_DEBOUNCE_MS. A 
+file already queued has its time pushed back, so a burst of writes ends in
+a single upload. */
+void _queue_file(struct watch_state * state, const char * path) {
+	int i;
+
+	for(i = 0; i < state->pending_count; i++) {
+		if(strcmp(state->pending[i].path, path) == 0) {
+			state->pending[i].due_ms = _now_ms() + WATCH_DEBOUNCE_MS;
+			return;
+		}
+	}
+	if(state->pending_count == state->pending_capacity) {
+		state->pending_capacity = state->pending_capacity ? 2 * state->pending_capacity : 16;
+		state->pending = realloc(state->pending, 
+			state->pending_capacity * sizeof(struct pending_file));
+	}
+	state->pending[state->pending_count].path = strdup(path);
+	state->pending[state->pending_count].due_ms = _now_ms() + WATCH_DEBOUNCE_MS;
+	state->pending_count++;
+};
+
+/* queues every file of a list in the format of line 2 of the log */
+void _queue_listed_files(struct watch_state * state, char * list) {
+	char * start = list, * end;
+
+	while((start = strchr(start, '\'')) != NULL && 
+		(end = strstr(start + 1, "'\t")) != NULL) {
+		*end = '\0';
+		if(end > start + 1) _queue_file(state, start + 1);
+		*end = '\'';
+		start = end + 2;
+	}
+};
+
+/* Watches a directory and, unless it is watched already, everything below
+it. With queue_files set the files found are queued too, as they may have 
+been written before the watch was in place. */
+void _watch_tree(struct watch_state * state, const char * path, int queue_files) {
+	struct scanned_dir dir = {0};
+	char * child;
+	int wd, dir_fd, i;
+
+	wd = inotify_add_watch(state->inotify_fd, path, WATCH_EVENTS);
+	if(wd < 0) {
+		perror("Watching directory");
+		return;
+	}
+	if(wd >= state->dir_capacity) {
+		int old_capacity = state->dir_capacity;
+		while(wd >= state->dir_capacity) {
+			state->dir_capacity = state->dir_capacity ? 2 * state->dir_capacity : 64;
+		}
+		state->dirs = realloc(state->dirs, state->dir_capacity * sizeof(char *));
+		memset(state->dirs + old_capacity, 0, 
+			(state->dir_capacity - old_capacity) * sizeof(char *));
+	}
+	if(state->dirs[wd] == NULL) {
+		state->dirs[wd] = strdup(path);
+	}
+
+	dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+	if(dir_fd < 0) return;
+	_read_dir_entries(dir_fd, &dir);
+	close(dir_fd);
+
+	for(i = 0; i < dir.entry_count; i++) {
+		if(strcmp(path, ".") == 0) {
+			if(_is_own_file(dir.entries[i])) continue;
+			child = strdup(dir.entries[i]);
+		}
+		else {
+			child = malloc(strlen(path) + strlen(dir.entries[i]) + 2);
+			sprintf(child, "%s/%s", path, dir.entries[i]);
+		}
+		if(dir.is_dir[i]) _watch_tree(state, child, queue_files);
+		else if(queue_files) _queue_file(state, child);
+		free(child);
+		free(dir.entries[i]);
+	}
+	free(dir.entries);
+	free(dir.is_dir);
+};
+
+/* handles the events read from inotify */
+void _handle_watch_events(struct watch_state * state, char * events, 
+	ssize_t length, FILE * log_file) {
+	struct inotify_event * event;
+	char * position, * path, * list;
+
+	for(position = events; position < events + length; 
+		position += sizeof(struct inotify_event) + event->len) {
+		event = (struct inotify_event *)position;
+
+		if(event->mask & IN_Q_OVERFLOW) {
+			/* events were lost. Only now the tree is scanned again, to
+			find whatever changed meanwhile. */
+			printf("\nToo many changes at once. Scanning the directory ...\n");
+			_watch_tree(state, ".", 0);
+			list = _get_files_to_be_uploaded(log_file);
+			_queue_listed_files(state, list);
+			free(list);
+			continue;
+		}
+		if(event->wd < 0 || event->wd >= state->dir_capacity || 
+			state->dirs[event->wd] == NULL) {
+			continue;
+		}
+		if(event->mask & IN_IGNORED) {
+			/* the directory is gone */
+			free(state->dirs[event->wd]);
+			state->dirs[event->wd] = NULL;
+			continue;
+		}
+		if(event->len == 0 || strchr(event->name, '\n') != NULL) continue;
+
+		if(strcmp(state->dirs[event->wd], ".") == 0) {
+			if(_is_own_file(event->name)) continue;
+			path = strdup(event->name);
+		}
+		else {
+			path = malloc(strlen(state->dirs[event->wd]) + strlen(event->name) + 2);
+			sprintf(path, "%s/%s", state->dirs[event->wd], event->name);
+		}
+
+		if(event->mask & IN_ISDIR) {
+			/* a new directory, or one moved in with its files */
+			if(event->mask & (IN_CREATE | IN_MOVED_TO)) _watch_tree(state, path, 1);
+		}
+		else if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+			_queue_file(state, path);
+		}
+		free(path);
+	}
+};
+
+/* Runs as a daemon: the files still to be uploaded are sent, and then every
+file written in the tree is sent as soon as it has been closed and left 
+alone for WATCH_DEBOUNCE_MS, over the connection which is kept open. There
+are no periodic scans. */
+void _watch_and_sync(int client_sock, FILE ** log_file, 
+	struct upload_options * options) {
+	struct watch_state state = {0};
+	char events[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd watch_fd;
+	long long now, next_due;
+	ssize_t length;
+	char * list;
+	int i, timeout;
+
+	state.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(state.inotify_fd < 0) {
+		perror("inotify");
+		exit(EXIT_FAILURE);
+	}
+	_watch_tree(&state, ".", 0);
+
+	/* what the scan at startup found still to be sent */
+	list = _get_line_as_string(*log_file, 2);
+	_queue_listed_files(&state, list);
+	free(list);
+
+	printf("\nWatching for changes ...\n");
+	fflush(stdout);
+
+	watch_fd.fd = state.inotify_fd;
+	watch_fd.events = POLLIN;
+	while(1) {
+		/* sleep until an event comes or the earliest queued file is due */
+		timeout = -1;
+		if(state.pending_count > 0) {
+			next_due = state.pending[0].due_ms;
+			for(i = 1; i < state.pending_count; i++) {
+				if(state.pending[i].due_ms < next_due) next_due = state.pending[i].due_ms;
+			}
+			now = _now_ms();
+			timeout = (next_due > now) ? (int)(next_due - now) : 0;
+		}
+
+		if(poll(&watch_fd, 1, timeout) < 0) {
+			if(errno == EINTR) continue;
+			perror("Waiting for changes");
+			exit(EXIT_FAILURE);
+		}
+		while((length = read(state.inotify_fd, events, sizeof(events))) > 0) {
+			_handle_watch_events(&state, events, length, *log_file);
+		}
+
+		/* send the files which have been quiet long enough */
+		now = _now_ms();
+		for(i = 0; i < state.pending_count; ) {
+			if(state.pending[i].due_ms > now) {
+				i++;
+				continue;
+			}
+			if(access(state.pending[i].path, R_OK) == 0) {
+				_upload_file(client_sock, state.pending[i].path, log_file, options);
+				fflush(stdout);
+			}
+			free(state.pending[i].path);
+			state.pending[i] = state.pending[--state.pending_count];
+		}
+	}
+};
+
+/* looks up the log record of a file. Returns 1 if there is one. */
+int _find_log_entry(FILE * log_file, char * filename, client_log * log_entry) {
 	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
-	
-	while(fread(&temp, sizeof(client_log), 1, log_file)) {
-		if(strcmp(temp.filename, f_name) == 0) {
-			/* first collect and store all the 
-			entries already in the logfile */ 
-			strcpy(log_entry->filename, temp.filename);
-			strcpy(log_entry->filesize, temp.filesize);
-			strcpy(log_entry->start_time, temp.start_time);
-			log_entry->connection_count = temp.connection_count;
-			log_entry->bytes_transferred = temp.bytes_transferred;
-			log_entry->percentage_completion = temp.percentage_completion;
-			strcpy(log_entry->end_time, temp.end_time);
-			log_entry->timeout_count = temp.timeout_count;	
+	while(fread(log_entry, sizeof(client_log), 1, log_file)) {
+		if(strcmp(log_entry->filename, filename) == 0) return 1;
+	}
+	return 0;
+};
+
+/* Sends the bytes of the file between offset and filesize, in order, after
+the server has agreed to append them to its copy. Returns 1 once the server
+has them on its disk. */
+int _send_appended(int sock_fd, int fd, long offset, long filesize, 
+	struct compressor * comp) {
+	struct segment segment = {0}, reply;
+	unsigned char block[BUFFER_SIZE];
+	ssize_t read_bytes;
+	int compressed;
+
+	while(offset < filesize) {
+		read_bytes = pread(fd, block, (filesize - offset > BUFFER_SIZE) ? 
+			BUFFER_SIZE : filesize - offset, offset);
+		if(read_bytes <= 0) {
+			perror("File read");
+			return 0;
+		}
+		segment.length = _compress_block(comp, block, read_bytes, 
+			(unsigned char *)segment.buffer, &compressed);
+		segment.flags = compressed ? SEGMENT_COMPRESSED : 0;
+		send_all(sock_fd, &segment, sizeof(segment));
+
+		if(recv_with_timeout(sock_fd, &reply, sizeof(reply), 12) <= 0 ||
+			reply.seq_no != segment.seq_no) {
+			printf("\nServer didn't acknowledge the appended bytes.\n");
+			return 0;
+		}
+		offset += read_bytes;
+		segment.seq_no++;
+	}
+
+	segment.seq_no = END_OF_FILE_SEQ;
+	segment.length = 0;
+	segment.flags = 0;
+	send_all(sock_fd, &segment, sizeof(segment));
+	return recv_with_timeout(sock_fd, &reply, sizeof(reply), DURABLE_ACK_TIMEOUT) > 0 &&
+		reply.seq_no == END_OF_FILE_SEQ && reply.ack_no == 1;
+};
+
+/* Ships the bytes appended to a file since it was last shipped, under its
+existing log record. The new size is checkpointed in the log, on the disk,
+once the server has acknowledged it. Returns 0 if the server refused, in 
+which case the file has to be uploaded normally. */
+int _ship_appended_bytes(int sock_fd, int fd, char * filename, long shipped,
+	long filesize, FILE ** log_file, struct compressor * comp) {
+	struct segment metadata = {0}, reply;
+	client_log log_entry;
+	int shipped_ok;
+
+	strcpy(metadata.filename, filename);
+	sprintf(metadata.filesize, "%ld", filesize);
+	metadata.flags = SEGMENT_APPEND;
+	send_all(sock_fd, &metadata, sizeof(metadata));
+
+	if(recv_with_timeout(sock_fd, &reply, sizeof(reply), 12) <= 0) {
+		printf("\nServer didn't answer. Exiting.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(!(reply.flags & SEGMENT_APPEND) || atol(reply.filesize) != shipped) {
+		/* the server's copy isn't what we shipped. Its answer was the 
+		final ack already. */
+		return 0;
+	}
+
+	shipped_ok = _send_appended(sock_fd, fd, shipped, filesize, comp);
+	if(shipped_ok) {
+		_update_transfer_progress_in_log(&log_entry, filename, filesize, 100, 
+			*log_file, UPDATE_LOG_APPENDED);
+		fflush(*log_file);
+		fdatasync(fileno(*log_file));
+		printf("\nShipped %ld Bytes of %s, now at %ld Bytes.\n", 
+			filesize - shipped, filename, filesize);
+	}
+	return shipped_ok;
+};
+
+/* Follows a growing file, like tail -f: the file is uploaded, and from then
+on whatever is appended to it is streamed to the server, which appends it to
+its copy. Appends are gathered for FOLLOW_BATCH_MS after the first one is 
+noticed. A file which shrinks or is replaced is uploaded again. */
+void _follow_file(int client_sock, char * filename, FILE ** log_file, 
+	struct upload_options * options) {
+	char events[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd watch_fd;
+	struct stat file_stat, path_stat;
+	client_log log_entry;
+	long shipped;
+	long long batch_end, wait;
+	int fd, inotify_fd, wd, ready;
+
+	if(!_upload_file(client_sock, filename, log_file, options) ||
+		!_find_log_entry(*log_file, filename, &log_entry)) {
+		printf("\nCouldn't upload %s. Exiting.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	shipped = atol(log_entry.filesize);
+
+	fd = open(filename, O_RDONLY);
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0 || inotify_fd < 0) {
+		perror("Following file");
+		exit(EXIT_FAILURE);
+	}
+	wd = inotify_add_watch(inotify_fd, filename, IN_MODIFY);
+	watch_fd.fd = inotify_fd;
+	watch_fd.events = POLLIN;
+
+	printf("\nFollowing %s from %ld Bytes ...\n", filename, shipped);
+	fflush(stdout);
+
+	while(1) {
+		/* without events we still look every FOLLOW_CHECK_MS, to notice 
+		the file being replaced */
+		ready = poll(&watch_fd, 1, FOLLOW_CHECK_MS);
+		if(ready < 0 && errno != EINTR) {
+			perror("Following file");
+			exit(EXIT_FAILURE);
+		}
+		if(ready > 0) {
+			/* let the writer finish its burst, then take it all at once. 
+			The batch ends FOLLOW_BATCH_MS after its first event, however 
+			often the file is written, or a busy file would never ship. */
+			batch_end = _now_us() + FOLLOW_BATCH_MS * 1000LL;
+			while((wait = (batch_end - _now_us()) / 1000) > 0 && 
+				poll(&watch_fd, 1, wait) > 0) {
+				while(read(inotify_fd, events, sizeof(events)) > 0);
+			}
+			while(read(inotify_fd, events, sizeof(events)) > 0);
+		}
+
+		if(stat(filename, &path_stat) < 0) continue;  /* being rotated */
+		fstat(fd, &file_stat);
+		if(path_stat.st_ino != file_stat.st_ino || path_stat.st_dev != file_stat.st_dev) {
+			/* a new file under the same name */
+			printf("\n%s has been replaced.\n", filename);
+			close(fd);
+			fd = open(filename, O_RDONLY);
+			if(fd < 0) continue;
+			inotify_rm_watch(inotify_fd, wd);
+			wd = inotify_add_watch(inotify_fd, filename, IN_MODIFY);
+			fstat(fd, &file_stat);
+			shipped = -1;
+		}
+
+		if(file_stat.st_size == shipped) continue;
+		if(shipped < 0 || file_stat.st_size < shipped ||
+			!_ship_appended_bytes(client_sock, fd, filename, shipped, 
+				file_stat.st_size, log_file, &options->comp)) {
+			/* not an append of what the server has, so the whole file is
+			uploaded again (as a delta where possible) */
+			if(_upload_file(client_sock, filename, log_file, options) &&
+				_find_log_entry(*log_file, filename, &log_entry)) {
+				shipped = atol(log_entry.filesize);
+			}
+		}
+		else {
+			shipped = file_stat.st_size;
+		}
+		fflush(stdout);
+	}
+};
+
+/* creates the directories on the path of a file which don't exist yet */
+void _make_parent_dirs(const char * path) {
+	char dir[FILENAME_SIZE];
+	char * slash;
+
+	strcpy(dir, path);
+	for(slash = strchr(dir, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			perror("Creating directory");
+			exit(EXIT_FAILURE);
+		}
+		*slash = '/';
+	}
+};
+
+/* Downloads a file from the server, after the bytes we already have. The
+download is recorded in our log like an upload: an interrupted one resumes
+from its record, and a completed one leaves the file known to be in sync,
+so that it isn't uploaded back. Returns 1 once we have the whole file. */
+int _download_file(char * filename, FILE ** log_file, struct sockaddr_in * server_addr) {
+	struct segment request = {0}, header;
+	client_log log_entry;
+	struct stat file_stat;
+	char * buffer = malloc(DOWNLOAD_BUFFER_SIZE);
+	long offset = 0, filesize, logged = 0, server_mtime = 0;
+	ssize_t recvd_bytes;
+	int sock_fd, fd, found;
+	long long write_started;
+
+	found = _find_log_entry(*log_file, filename, &log_entry);
+	if(found && log_entry.percentage_completion < 100 && 
+		stat(filename, &file_stat) == 0) {
+		/* resume, but not beyond what is really on our disk */
+		offset = log_entry.bytes_transferred;
+		if(offset > file_stat.st_size) offset = file_stat.st_size;
+	}
+
+	sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(sock_fd < 0 || connect(sock_fd, (struct sockaddr *)server_addr, 
+		sizeof(struct sockaddr_in)) < 0) {
+		perror("Connection");
+		exit(EXIT_FAILURE);
+	}
+	_start_tls(sock_fd);
+
+	/* the server starts from 0 if its copy isn't the one we had the first
+	part from anymore */
+	strcpy(request.filename, filename);
+	sprintf(request.filesize, "%ld", offset);
+	if(offset > 0) sprintf(request.buffer, "%s %ld", log_entry.filesize, log_entry.mtime);
+	send_all(sock_fd, &request, sizeof(request));
+
+	if(recv(sock_fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+		header.ack_no != 1) {
+		printf("\nServer can't send %s.\n", filename);
+		close(sock_fd);
+		return 0;
+	}
+	filesize = atol(header.filesize);
+	header.buffer[BUFFER_SIZE - 1] = '\0';
+	/* where the server starts from, and when its copy was modified */
+	sscanf(header.buffer, "%ld %ld", &offset, &server_mtime);
+	printf("\nFile Size: %ld Bytes, receiving from %ld\n", filesize, offset);
+
+	_make_parent_dirs(filename);
+	fd = open(filename, O_WRONLY | O_CREAT, 0644);
+	if(fd < 0) {
+		perror("File");
+		exit(EXIT_FAILURE);
+	}
+
+	if(!found || offset == 0) {
+		if(!found) {
+			_initialise_log_entry_for_file(&log_entry, filename, header.filesize, *log_file);
+		}
+		else {
+			_update_transfer_progress_in_log(&log_entry, filename, 
+				filesize, 0, *log_file, UPDATE_LOG_NEW_VERSION);
+		}
+		_update_transfer_progress_in_log(&log_entry, filename, 
+			server_mtime, 0, *log_file, UPDATE_LOG_SERVER_MTIME);
+	}
+	else {
+		_update_transfer_progress_in_log(&log_entry, filename, 
+			0, 0, *log_file, UPDATE_LOG_CONNECTION_COUNT);
+	}
+
+	_begin_transfer(filename, filesize);
+	while(offset < filesize && 
+		(recvd_bytes = recv(sock_fd, buffer, DOWNLOAD_BUFFER_SIZE, 0)) > 0) {
+		if(recvd_bytes > filesize - offset) recvd_bytes = filesize - offset;
+		write_started = _now_us();
+		if(pwrite(fd, buffer, recvd_bytes, offset) != recvd_bytes) {
+			perror("Writing file");
+			exit(EXIT_FAILURE);
+		}
+		_time_disk_write(write_started);
+		_trace(TRACE_DOWNLOAD_WRITE, offset, recvd_bytes);
+		_count_transfer(sock_fd, recvd_bytes);
+		offset += recvd_bytes;
+
+		/* the log is brought up to date every so often, not on every recv */
+		if(offset - logged >= DOWNLOAD_LOG_INTERVAL) {
+			_update_transfer_progress_in_log(&log_entry, filename, offset, 
+				(offset / (float)filesize) * 100, *log_file, UPDATE_LOG_PROGRESS);
+			logged = offset;
+		}
+	}
+	close(sock_fd);
+	free(buffer);
+
+	if(offset < filesize) {
+		_update_transfer_progress_in_log(&log_entry, filename, offset, 
+			(offset / (float)filesize) * 100, *log_file, UPDATE_LOG_PROGRESS);
+		close(fd);
+		_end_transfer(0);
+		printf("\nConnection closed at %ld Bytes. Run again to resume.\n", offset);
+		return 0;
+	}
+
+	/* an older, longer version of the file may have been here */
+	if(ftruncate(fd, filesize) < 0) {
+		perror("Truncating file");
+	}
+	close(fd);
+	_update_transfer_progress_in_log(&log_entry, filename, filesize, 100, 
+		*log_file, UPDATE_LOG_DOWNLOADED);
+	*log_file = _update_file_to_be_received_list(*log_file, filename);
+	_end_transfer(1);
+	printf("\nFile receiving Completed.\n");
+	return 1;
+};
+
+/* Size of the chunks a file is split into for a swarm, as the server has
+it. Our bitmap of them has to fit into the buffer of a segment. */
+long _get_swarm_chunk_size(long filesize) {
+	long chunk_count = (filesize + SWARM_CHUNK_SIZE - 1) / SWARM_CHUNK_SIZE;
+	long bits = BUFFER_SIZE * 8;
+
+	return SWARM_CHUNK_SIZE * ((chunk_count + bits - 1) / bits > 1 ? 
+		(chunk_count + bits - 1) / bits : 1);
+};
+
+/* bitmaps of the chunks of a swarm, as they are sent around */
+int _has_chunk(unsigned char * bitmap, int chunk) {
+	return (bitmap[chunk / 8] >> (chunk % 8)) & 1;
+};
+
+void _set_chunk(unsigned char * bitmap, int chunk, int value) {
+	if(value) bitmap[chunk / 8] |= 1 << (chunk % 8);
+	else bitmap[chunk / 8] &= ~(1 << (chunk % 8));
+};
+
+/* Sends a request of the swarm and reads the header of the answer. 
+Returns the connection, on which whatever follows the header comes, or 
+-1 if the other side can't be reached or doesn't answer. */
+int _swarm_request(struct sockaddr_in * addr, struct segment * request, struct segment * reply) {
+	int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(sock_fd < 0) return -1;
+	if(connect(sock_fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+		send(sock_fd, request, sizeof(struct segment), MSG_NOSIGNAL) != sizeof(struct segment) ||
+		recv_with_timeout(sock_fd, reply, sizeof(struct segment), SWARM_TIMEOUT) != 
+		sizeof(struct segment)) {
+		close(sock_fd);
+		return -1;
+	}
+	return sock_fd;
+};
+
+/* Joins the swarm of the file at the server, which answers with the other
+peers and, the first time, with the hashes of the chunks. Returns 0 if the
+server can't serve the file. */
+int _swarm_join(struct swarm_state * state) {
+	struct segment request = {0}, reply;
+	struct swarm_peer_address * listed = (struct swarm_peer_address *)reply.buffer;
+	int sock_fd, i, j, want_hashes = (state->hashes == NULL);
+
+	strcpy(request.filename, state->filename);
+	request.flags = SEGMENT_SWARM;
+	request.seq_no = SWARM_JOIN;
+	request.ack_no = want_hashes;
+	sprintf(request.buffer, "%d", state->listen_port);
+	sock_fd = _swarm_request(&state->server_addr, &request, &reply);
+	if(sock_fd < 0) return 0;
+	if(reply.ack_no != 1 || reply.length < 0 || 
+		reply.length > BUFFER_SIZE / (int)sizeof(struct swarm_peer_address)) {
+		close(sock_fd);
+		return 0;
+	}
+
+	if(want_hashes) {
+		state->filesize = atol(reply.filesize);
+		state->chunk_size = _get_swarm_chunk_size(state->filesize);
+		state->chunk_count = (state->filesize + state->chunk_size - 1) / state->chunk_size;
+		state->hashes = (unsigned char *)malloc(state->chunk_count * HASH_SIZE + 1);
+		if(recv_with_timeout(sock_fd, (struct segment *)state->hashes, 
+			state->chunk_count * HASH_SIZE, SWARM_TIMEOUT) != state->chunk_count * HASH_SIZE) {
+			close(sock_fd);
+			free(state->hashes);
+			state->hashes = NULL;
+			return 0;
+		}
+	}
+	close(sock_fd);
+
+	pthread_mutex_lock(&state->lock);
+	for(i = 0; i < reply.length; i++) {
+		for(j = 0; j < state->peer_count; j++) {
+			if(state->peers[j].address.addr.s_addr == listed[i].addr.s_addr &&
+				state->peers[j].address.port == listed[i].port) {
+				break;
+			}
+		}
+		if(j == state->peer_count && state->peer_count < SWARM_MAX_PEERS) {
+			state->peers[j].address = listed[i];
+			state->peers[j].bitmap = (unsigned char *)calloc((state->chunk_count + 7) / 8, 1);
+			state->peers[j].failed = 0;
+			state->peer_count++;
+		}
+		else if(j < state->peer_count) {
+			/* a peer which failed us may have been restarted */
+			state->peers[j].failed = 0;
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+	return 1;
+};
+
+void _peer_to_sockaddr(struct swarm_peer_address * peer, struct sockaddr_in * addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr = peer->addr;
+	addr->sin_port = htons(peer->port);
+};
+
+/* asks every peer which chunks it has */
+void _swarm_refresh_bitmaps(struct swarm_state * state) {
+	struct segment request = {0}, reply;
+	struct sockaddr_in addr;
+	int i, sock_fd, peer_count, bitmap_size = (state->chunk_count + 7) / 8;
+
+	strcpy(request.filename, state->filename);
+	request.flags = SEGMENT_SWARM;
+	request.seq_no = SWARM_BITMAP;
+	pthread_mutex_lock(&state->lock);
+	peer_count = state->peer_count;
+	pthread_mutex_unlock(&state->lock);
+
+	for(i = 0; i < peer_count; i++) {
+		if(state->peers[i].failed) continue;
+		_peer_to_sockaddr(&state->peers[i].address, &addr);
+		sock_fd = _swarm_request(&addr, &request, &reply);
+		pthread_mutex_lock(&state->lock);
+		if(sock_fd < 0 || reply.ack_no != 1 || reply.length != bitmap_size) {
+			state->peers[i].failed = 1;
+		}
+		else {
+			memcpy(state->peers[i].bitmap, reply.buffer, bitmap_size);
+		}
+		pthread_mutex_unlock(&state->lock);
+		if(sock_fd >= 0) close(sock_fd);
+	}
+};
+
+/* Serves the requests of another peer on one connection: our bitmap, or a
+chunk we have, which goes from the page cache to the socket. */
+void * _serve_peer(void * arg) {
+	struct swarm_connection * connection = (struct swarm_connection *)arg;
+	struct swarm_state * state = connection->state;
+	struct segment request, reply;
+	off_t offset;
+	long end;
+
+	while(recv_with_timeout(connection->sock, &request, sizeof(request), SWARM_TIMEOUT) == 
+		sizeof(request)) {
+		memset(&reply, 0, sizeof(reply));
+		reply.seq_no = request.seq_no;
+		request.filename[FILENAME_SIZE - 1] = '\0';
+		if(!(request.flags & SEGMENT_SWARM) || strcmp(request.filename, state->filename) != 0) {
+			break;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		if(request.seq_no == SWARM_BITMAP) {
+			reply.ack_no = 1;
+			reply.length = (state->chunk_count + 7) / 8;
+			memcpy(reply.buffer, state->have, reply.length);
+		}
+		else if(request.seq_no >= 0 && request.seq_no < state->chunk_count &&
+			_has_chunk(state->have, request.seq_no)) {
+			reply.ack_no = 1;
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		offset = (off_t)request.seq_no * state->chunk_size;
+		end = (offset + state->chunk_size < state->filesize) ? 
+			offset + state->chunk_size : state->filesize;
+		if(request.seq_no >= 0 && reply.ack_no) reply.length = end - offset;
+		if(send(connection->sock, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)) break;
+		if(request.seq_no < 0 || !reply.ack_no) continue;
+		while(offset < end) {
+			if(sendfile(connection->sock, state->fd, &offset, end - offset) <= 0) break;
+		}
+		if(offset < end) break;
+		pthread_mutex_lock(&state->lock);
+		state->to_peers += reply.length;
+		pthread_mutex_unlock(&state->lock);
+	}
+	close(connection->sock);
+	free(connection);
+	return NULL;
+};
+
+void * _accept_peers(void * arg) {
+	struct swarm_state * state = (struct swarm_state *)arg;
+	struct swarm_connection * connection;
+	pthread_t thread;
+	int sock_fd;
+
+	while((sock_fd = accept(state->listen_sock, NULL, NULL)) >= 0) {
+		connection = (struct swarm_connection *)malloc(sizeof(struct swarm_connection));
+		connection->state = state;
+		connection->sock = sock_fd;
+		if(pthread_create(&thread, NULL, _serve_peer, connection) != 0) {
+			close(sock_fd);
+			free(connection);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+};
+
+/* Picks the next chunk to fetch, with the lock held. A chunk no peer has
+comes from the server, as long as the server isn't busy with another of 
+ours. Else the rarest chunk among the peers is taken, from any peer which
+has it, so that every chunk spreads as fast as possible. Returns -1 if
+there is nothing to fetch for now, with *peer -1 for the server. */
+int _pick_chunk(struct swarm_state * state, int * peer) {
+	int chunk, i, holders, rarest = INT_MAX, candidates = 0, fresh = 0, picked = -1;
+
+	for(chunk = 0; chunk < state->chunk_count; chunk++) {
+		if(_has_chunk(state->have, chunk) || state->fetching[chunk]) continue;
+		holders = 0;
+		for(i = 0; i < state->peer_count; i++) {
+			if(!state->peers[i].failed && _has_chunk(state->peers[i].bitmap, chunk)) holders++;
+		}
+		if(holders == 0) {
+			/* one of these, at random, in case the server is free */
+			if(rand() % ++fresh == 0 && state->server_fetches < SWARM_SERVER_SLOTS) picked = chunk;
+			continue;
+		}
+		if(holders < rarest) {
+			rarest = holders;
+			candidates = 0;
+		}
+		if(holders == rarest && rand() % ++candidates == 0) {
+			*peer = chunk; /* kept here until the server had its chance */
+		}
+	}
+	if(picked >= 0) {
+		*peer = -1;
+		return picked;
+	}
+	if(rarest == INT_MAX) return -1;
+
+	chunk = *peer;
+	candidates = 0;
+	for(i = 0; i < state->peer_count; i++) {
+		if(!state->peers[i].failed && _has_chunk(state->peers[i].bitmap, chunk) &&
+			rand() % ++candidates == 0) {
+			*peer = i;
+		}
+	}
+	return chunk;
+};
+
+/* Fetches a chunk from a peer or the server and keeps it, if it matches 
+its hash. Returns the bytes got, or 0. */
+long _fetch_chunk(struct swarm_state * state, struct sockaddr_in * addr, int chunk, 
+	unsigned char * buffer) {
+	struct segment request = {0}, reply;
+	unsigned char hash[HASH_SIZE];
+	long offset = (long)chunk * state->chunk_size, length;
+	int sock_fd;
+
+	length = (offset + state->chunk_size < state->filesize) ? 
+		state->chunk_size : state->filesize - offset;
+	strcpy(request.filename, state->filename);
+	request.flags = SEGMENT_SWARM;
+	request.seq_no = chunk;
+	sock_fd = _swarm_request(addr, &request, &reply);
+	if(sock_fd < 0) return 0;
+	if(reply.ack_no != 1 || reply.seq_no != chunk || reply.length != length ||
+		recv_with_timeout(sock_fd, (struct segment *)buffer, length, SWARM_TIMEOUT) != length) {
+		close(sock_fd);
+		return 0;
+	}
+	close(sock_fd);
+
+	_sha256(buffer, length, hash);
+	if(memcmp(hash, state->hashes + chunk * HASH_SIZE, HASH_SIZE) != 0) {
+		printf("\nChunk %d didn't match its hash, fetching it again.\n", chunk);
+		return 0;
+	}
+	if(pwrite(state->fd, buffer, length, offset) != length) {
+		perror("Writing file");
+		exit(EXIT_FAILURE);
+	}
+	return length;
+};
+
+/* a thread fetching chunks until we have them all */
+void * _fetch_chunks(void * arg) {
+	struct swarm_state * state = (struct swarm_state *)arg;
+	unsigned char * buffer = (unsigned char *)malloc(state->chunk_size);
+	struct sockaddr_in addr;
+	int chunk, peer;
+	long got;
+
+	pthread_mutex_lock(&state->lock);
+	while(state->have_count < state->chunk_count) {
+		chunk = _pick_chunk(state, &peer);
+		if(chunk < 0) {
+			/* what is left is being fetched, or no one has it yet */
+			pthread_mutex_unlock(&state->lock);
+			usleep(SWARM_IDLE_MS * 1000);
+			pthread_mutex_lock(&state->lock);
+			continue;
+		}
+		state->fetching[chunk] = 1;
+		if(peer < 0) {
+			state->server_fetches++;
+			addr = state->server_addr;
+		}
+		else {
+			_peer_to_sockaddr(&state->peers[peer].address, &addr);
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		got = _fetch_chunk(state, &addr, chunk, buffer);
+
+		pthread_mutex_lock(&state->lock);
+		state->fetching[chunk] = 0;
+		if(peer < 0) state->server_fetches--;
+		if(got > 0) {
+			_set_chunk(state->have, chunk, 1);
+			state->have_count++;
+			if(peer < 0) state->from_server += got;
+			else state->from_peers += got;
+		}
+		else if(peer >= 0) {
+			/* not asked for it again before it tells us it has it */
+			_set_chunk(state->peers[peer].bitmap, chunk, 0);
+		}
+		else {
+			pthread_mutex_unlock(&state->lock);
+			usleep(SWARM_IDLE_MS * 1000);
+			pthread_mutex_lock(&state->lock);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+	free(buffer);
+	return NULL;
+};
+
+/* Fetches a file the server has together with the other clients fetching
+it, as a swarm. The file is split into chunks; every peer serves the 
+chunks it has to the others and tells which those are with a bitmap. The
+server tracks the peers and serves chunks no peer has yet, so what it 
+sends stays near the size of the file however many peers there are, and
+the peers share the rest among themselves. Chunks already in our copy of
+the file are kept if they match their hashes. With seed, we go on serving 
+chunks once we have them all, until killed. Returns 1 once we have the 
+whole file. */
+int _swarm_download(char * filename, FILE ** log_file, int seed) {
+	struct swarm_state state = {0};
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	client_log log_entry;
+	pthread_t accepting, workers[SWARM_WORKERS];
+	unsigned char * buffer;
+	unsigned char hash[HASH_SIZE];
+	char filesize_string[FILESIZE_STRING];
+	long long started;
+	long length;
+	int chunk, i;
+
+	state.filename = filename;
+	pthread_mutex_init(&state.lock, NULL);
+	state.server_addr.sin_family = AF_INET;
+	state.server_addr.sin_port = htons(DOWNLOAD_PORT);
+	inet_pton(AF_INET, SERVER_IP, &state.server_addr.sin_addr);
+	srand(getpid() ^ time(NULL));
+
+	/* where the other peers fetch chunks from us */
+	state.listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if(state.listen_sock < 0 || bind(state.listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(state.listen_sock, SWARM_MAX_PEERS) < 0 ||
+		getsockname(state.listen_sock, (struct sockaddr *)&addr, &len) < 0) {
+		perror("Listening for peers");
+		exit(EXIT_FAILURE);
+	}
+	state.listen_port = ntohs(addr.sin_port);
+
+	started = _now_us();
+	if(!_swarm_join(&state)) {
+		printf("\nServer can't send %s.\n", filename);
+		return 0;
+	}
+	printf("\nFile Size: %ld Bytes in %d chunks of %ld, serving peers on port %d\n",
+		state.filesize, state.chunk_count, state.chunk_size, state.listen_port);
+
+	_make_parent_dirs(filename);
+	state.fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if(state.fd < 0) {
+		perror("File");
+		exit(EXIT_FAILURE);
+	}
+	state.have = (unsigned char *)calloc((state.chunk_count + 7) / 8, 1);
+	state.fetching = (unsigned char *)calloc(state.chunk_count, 1);
+
+	/* what we have of the file already counts, if it is right */
+	buffer = (unsigned char *)malloc(state.chunk_size);
+	for(chunk = 0; chunk < state.chunk_count; chunk++) {
+		length = pread(state.fd, buffer, state.chunk_size, (long)chunk * state.chunk_size);
+		if(length <= 0) break;
+		_sha256(buffer, length, hash);
+		if(memcmp(hash, state.hashes + chunk * HASH_SIZE, HASH_SIZE) == 0 &&
+			length == ((chunk == state.chunk_count - 1) ? 
+			state.filesize - (long)chunk * state.chunk_size : state.chunk_size)) {
+			_set_chunk(state.have, chunk, 1);
+			state.have_count++;
+		}
+	}
+	free(buffer);
+	if(state.have_count > 0) {
+		printf("\n%d chunks are here already.\n", state.have_count);
+	}
+	if(ftruncate(state.fd, state.filesize) < 0) {
+		perror("Truncating file");
+	}
+
+	if(!_find_log_entry(*log_file, filename, &log_entry)) {
+		sprintf(filesize_string, "%ld", state.filesize);
+		_initialise_log_entry_for_file(&log_entry, filename, filesize_string, *log_file);
+	}
+	else {
+		_update_transfer_progress_in_log(&log_entry, filename, 
+			state.filesize, 0, *log_file, UPDATE_LOG_NEW_VERSION);
+	}
+
+	pthread_create(&accepting, NULL, _accept_peers, &state);
+	for(i = 0; i < SWARM_WORKERS; i++) {
+		pthread_create(&workers[i], NULL, _fetch_chunks, &state);
+	}
+
+	/* the peers and what they have are looked at again and again, until 
+	we have everything */
+	while(1) {
+		pthread_mutex_lock(&state.lock);
+		i = (state.have_count == state.chunk_count);
+		pthread_mutex_unlock(&state.lock);
+		if(i) break;
+		usleep(SWARM_REFRESH_MS * 1000);
+		_swarm_join(&state);
+		_swarm_refresh_bitmaps(&state);
+	}
+	for(i = 0; i < SWARM_WORKERS; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	fsync(state.fd);
+
+	_update_transfer_progress_in_log(&log_entry, filename, state.filesize, 100, 
+		*log_file, UPDATE_LOG_DOWNLOADED);
+	*log_file = _update_file_to_be_received_list(*log_file, filename);
+	printf("\nFile receiving Completed in %.2f s: %ld Bytes from the server, %ld from "
+		"peers, %ld sent to peers.\n", (_now_us() - started) / 1000000.0, state.from_server, 
+		state.from_peers, state.to_peers);
+	fflush(stdout);
+
+	while(seed) {
+		/* stay known to the server, so that the others find us */
+		usleep(SWARM_REFRESH_MS * 1000);
+		_swarm_join(&state);
+	}
+	close(state.listen_sock);
+	return 1;
+};
+
+/* Sends a datagram of a distribution to the group, paced at the rate of 
+the distribution. A datagram the socket has no room for is just lost, the
+repair rounds make up for it. */
+void _multicast_send(struct multicast_sender * sender, struct datagram * datagram) {
+	int length = offsetof(struct datagram, buffer) + datagram->length;
+	long long now = _now_us();
+
+	if(sender->next_send > now) {
+		usleep(sender->next_send - now);
+	}
+	else if(sender->next_send < now - UDP_MAX_BURST) {
+		sender->next_send = now - UDP_MAX_BURST;
+	}
+	if(sendto(sender->sock, datagram, length, 0, (struct sockaddr *)&sender->group_addr,
+		sizeof(sender->group_addr)) < 0 && errno != ENOBUFS && errno != EAGAIN) {
+		perror("Multicast send");
+		exit(EXIT_FAILURE);
+	}
+	sender->bytes_sent += length;
+	sender->next_send += length * 1000000.0 / sender->rate;
+};
 
-			/* then we update particular entries bvased on flag*/
-			if(flag == UPDATE_LOG_TIMEOUT) {
-				log_entry->timeout_count = temp.timeout_count + 1;	
+/* sends the next count parity blocks of a group, which are new to every
+receiver */
+void _multicast_send_parity(struct multicast_sender * sender, int group, int count) {
+	unsigned char blocks[FEC_GROUP_SIZE][BUFFER_SIZE];
+	struct datagram datagram = {0};
+	int first_block = group * FEC_GROUP_SIZE, size, i, j, length;
+
+	size = (sender->total - first_block > FEC_GROUP_SIZE) ? 
+		FEC_GROUP_SIZE : sender->total - first_block;
+	memset(blocks, 0, sizeof(blocks));
+	for(i = 0; i < size; i++) {
+		length = pread(sender->fd, blocks[i], BUFFER_SIZE, 
+			(long)(first_block + i) * BUFFER_SIZE);
+		if(length < 0) {
+			perror("File read");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	datagram.kind = DATAGRAM_PARITY;
+	datagram.seq_no = datagram.block = first_block;
+	datagram.total = sender->total;
+	datagram.group_size = size;
+	datagram.length = BUFFER_SIZE;
+	for(j = 0; j < count; j++) {
+		datagram.parity_index = sender->next_parity[group]++;
+		memset(datagram.buffer, 0, BUFFER_SIZE);
+		for(i = 0; i < size; i++) {
+			_gf_mul_add((unsigned char *)datagram.buffer, blocks[i],
+				_fec_coefficient(datagram.parity_index, i), BUFFER_SIZE);
+		}
+		_multicast_send(sender, &datagram);
+		sender->parity_sent++;
+	}
+};
+
+void _multicast_announce(struct multicast_sender * sender, struct multicast_file * file) {
+	struct datagram datagram = {0};
+
+	datagram.kind = DATAGRAM_ANNOUNCE;
+	datagram.total = sender->total;
+	datagram.length = sizeof(struct multicast_file);
+	memcpy(datagram.buffer, file, sizeof(struct multicast_file));
+	_multicast_send(sender, &datagram);
+};
+
+/* a poll, or the end of the distribution, carries the round in seq_no */
+void _multicast_control(struct multicast_sender * sender, int kind, int round) {
+	struct datagram datagram = {0};
+
+	datagram.kind = kind;
+	datagram.seq_no = round;
+	datagram.total = sender->total;
+	_multicast_send(sender, &datagram);
+};
+
+/* Takes in the reports of the receivers until the deadline, or until 
+every receiver known has answered the poll of the round. Those already in
+are taken in any case. A receiver we 
+hear from for the first time joins. What the receivers need is gathered 
+in need[], where each group gets the most any one receiver asks for. */
+void _take_reports(struct multicast_sender * sender, int round, long long deadline) {
+	struct multicast_report report;
+	struct multicast_receiver * receiver;
+	struct sockaddr_in from;
+	socklen_t len = sizeof(from);
+	struct pollfd pfd;
+	char address[INET_ADDRSTRLEN];
+	int length, i, answered;
+	long long now;
+
+	pfd.fd = sender->sock;
+	pfd.events = POLLIN;
+	while(1) {
+		now = _now_us();
+		while((length = recvfrom(sender->sock, &report, sizeof(report), MSG_DONTWAIT,
+			(struct sockaddr *)&from, &len)) > 0) {
+			len = sizeof(from);
+			if(length < (int)offsetof(struct multicast_report, needs) ||
+				report.need_count < 0 || report.need_count > MULTICAST_MAX_NEEDS ||
+				length < (int)offsetof(struct multicast_report, needs) + 
+				report.need_count * (int)sizeof(struct repair_need)) {
+				continue;
 			}
-			else if(flag == UPDATE_LOG_COMPLETED) {
-				log_entry->bytes_transferred = bytes_transferred;
-				log_entry->percentage_completion = percentage;
-				strcpy(log_entry->end_time, _get_current_date_time());	
+			receiver = NULL;
+			for(i = 0; i < sender->receiver_count; i++) {
+				if(sender->receivers[i].addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+					sender->receivers[i].addr.sin_port == from.sin_port) {
+					receiver = &sender->receivers[i];
+				}
 			}
-			else if (flag == UPDATE_LOG_PROGRESS){
-				log_entry->bytes_transferred = bytes_transferred;
-				log_entry->percentage_completion = percentage;
+			if(receiver == NULL) {
+				if(sender->receiver_count == MULTICAST_MAX_RECEIVERS) continue;
+				receiver = &sender->receivers[sender->receiver_count++];
+				memset(receiver, 0, sizeof(struct multicast_receiver));
+				receiver->addr = from;
+				receiver->round = -1;
+				receiver->missing = sender->total;
+				inet_ntop(AF_INET, &from.sin_addr, address, INET_ADDRSTRLEN);
+				printf("Receiver %s:%d joined.\n", address, ntohs(from.sin_port));
 			}
-			else if(flag == UPDATE_LOG_CONNECTION_COUNT) {
-				log_entry->connection_count = temp.connection_count + 1;
+			receiver->last_heard = now;
+			if(report.kind != REPORT_STATUS || report.round != round || receiver->failed) {
+				continue;
 			}
-			
-			/* seek to the beginning of record */
-			fseek(log_file, -1 * sizeof(client_log), SEEK_CUR);
-			/*update the record*/
-			fwrite(log_entry, sizeof(client_log), 1, log_file);
+			receiver->round = round;
+			receiver->missing = report.missing;
+			for(i = 0; i < report.need_count; i++) {
+				struct repair_need * need = &report.needs[i];
 
-			/* escape from loop once updation is done */
-			break;
+				if(need->group < 0 || need->group >= sender->group_count ||
+					need->parity <= 0 || need->parity > FEC_GROUP_SIZE) {
+					continue;
+				}
+				if(sender->next_parity[need->group] + need->parity > FEC_MAX_PARITY_INDEX) {
+					/* the group has run out of parity blocks, which takes
+					losing nearly all of them */
+					inet_ntop(AF_INET, &from.sin_addr, address, INET_ADDRSTRLEN);
+					printf("Receiver %s:%d lost too much, dropping it.\n", address, 
+						ntohs(from.sin_port));
+					receiver->failed = 1;
+					break;
+				}
+				if(need->parity > sender->need[need->group]) {
+					sender->need[need->group] = need->parity;
+				}
+			}
+		}
+
+		answered = (sender->receiver_count > 0);
+		for(i = 0; i < sender->receiver_count; i++) {
+			if(!sender->receivers[i].failed && sender->receivers[i].round != round) {
+				answered = 0;
+			}
 		}
+		if((round > 0 && answered) || now >= deadline) return;
+		poll(&pfd, 1, (deadline - now) / 1000 + 1);
 	}
 };
 
-/* the function initialises all fields of server log structure with initial
-information about file being received*/
-/*THIS DEFINITION IS SLIGHTLY DIFFERENT FROM SERVER COUNTER PART 
-as we also have to check whether the upload was interrupted earlier */
-short _initialise_log_entry_for_file(client_log * log_entry, char * f_name, 
-	char * f_size, FILE * log_file, 
-	FILE* serv_log,
-	long int * bytes_uploaded) {
+/* Distributes a file to every receiver listening on the multicast group.
+The file is sent once to all of them: it is announced, sent paced at the
+rate given, then repaired in rounds. A round polls the receivers, which 
+answer with the parity blocks they need for each group, and sends each 
+group as many new parity blocks as the receiver worst off needs. So what 
+is sent stays close to the size of the file however many receivers there 
+are. Returns 1 once every receiver has the whole file. */
+int _distribute_file(char * filename, struct upload_options * options) {
+	struct multicast_sender sender = {0};
+	struct multicast_file announce = {0};
+	struct multicast_receiver * receiver;
+	struct datagram datagram = {0};
+	struct stat file_stat;
+	unsigned char ttl = MULTICAST_TTL, loop = 1;
+	int buffer_size = UDP_SOCKET_BUFFER, block, group, round = 0, i;
+	int completed, active, repairing;
+	long long started, now, last_announce = 0;
 
-	/*first we move to part from where structure entry has to start */
-	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+	sender.fd = open(filename, O_RDONLY);
+	if(sender.fd < 0) {
+		perror("File");
+		exit(EXIT_FAILURE);
+	}
+	fstat(sender.fd, &file_stat);
+	sender.filesize = file_stat.st_size;
+	if(sender.filesize == 0) {
+		printf("\nNothing to send, %s is empty.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	sender.total = (sender.filesize + BUFFER_SIZE - 1) / BUFFER_SIZE;
+	sender.group_count = (sender.total + FEC_GROUP_SIZE - 1) / FEC_GROUP_SIZE;
+	sender.need = (int *)calloc(sender.group_count, sizeof(int));
+	sender.next_parity = (unsigned char *)calloc(sender.group_count, 1);
+	sender.rate = (options->multicast_rate ? options->multicast_rate : MULTICAST_RATE) * 125000.0;
+	announce.filesize = sender.filesize;
+	strcpy(announce.filename, filename);
 
-	/*initialise log_entry only when it is not present in log */
-	while(fread(log_entry, sizeof(client_log), 1, log_file)) {
-		/* if filename already present in file structure 
-		then do not initialise */
-		if(strcmp(log_entry->filename, f_name) == 0) {
+	sender.sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sender.sock < 0) {
+		perror("Udp socket");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(sender.sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+	setsockopt(sender.sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+	setsockopt(sender.sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	/* receivers on this host get the distribution too */
+	setsockopt(sender.sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	if(options->interface.s_addr != INADDR_ANY && setsockopt(sender.sock, IPPROTO_IP, 
+		IP_MULTICAST_IF, &options->interface, sizeof(options->interface)) < 0) {
+		perror("Multicast interface");
+		exit(EXIT_FAILURE);
+	}
+	sender.group_addr.sin_family = AF_INET;
+	sender.group_addr.sin_port = htons(MULTICAST_PORT);
+	inet_pton(AF_INET, MULTICAST_GROUP, &sender.group_addr.sin_addr);
+	_gf_init();
 
-			/* if filename is entered in log, that means already an attempt
-			to upload has taken place. 
-			*/
-			/* if file is completly uploaded return the signal 
-			of fully uploaded, else read the server log for how much 
-			bytes have been succesfully transferred. */
-			if(log_entry->percentage_completion == 100) {
-				return FULLY_UPLOADED;
+	printf("Distributing %s, %ld Bytes in %d blocks, to %s:%d\n\n", filename, 
+		sender.filesize, sender.total, MULTICAST_GROUP, MULTICAST_PORT);
+	started = sender.next_send = _now_us();
+
+	/* the receivers join when they hear the announcement */
+	while(_now_us() - started < MULTICAST_JOIN_WAIT) {
+		_multicast_announce(&sender, &announce);
+		_take_reports(&sender, 0, _now_us() + MULTICAST_ANNOUNCE_INTERVAL);
+	}
+	last_announce = _now_us();
+
+	/* the file goes out once. The announcement is repeated for those 
+	which come late, they get what they missed in the repair rounds. */
+	datagram.kind = DATAGRAM_DATA;
+	datagram.total = sender.total;
+	for(block = 0; block < sender.total; block++) {
+		datagram.seq_no = datagram.block = block;
+		datagram.length = pread(sender.fd, datagram.buffer, BUFFER_SIZE, 
+			(long)block * BUFFER_SIZE);
+		if(datagram.length < 0) {
+			perror("File read");
+			exit(EXIT_FAILURE);
+		}
+		_multicast_send(&sender, &datagram);
+		if(options->fec && (block % FEC_GROUP_SIZE == FEC_GROUP_SIZE - 1 || 
+			block == sender.total - 1)) {
+			_multicast_send_parity(&sender, block / FEC_GROUP_SIZE, MULTICAST_PARITY);
+		}
+		if(_now_us() - last_announce > MULTICAST_ANNOUNCE_INTERVAL) {
+			_multicast_announce(&sender, &announce);
+			_take_reports(&sender, 0, 0);
+			last_announce = _now_us();
+		}
+	}
+
+	while(1) {
+		round++;
+		memset(sender.need, 0, sender.group_count * sizeof(int));
+		_multicast_control(&sender, DATAGRAM_POLL, round);
+		_take_reports(&sender, round, _now_us() + MULTICAST_REPORT_WAIT);
+
+		now = _now_us();
+		completed = active = 0;
+		for(i = 0; i < sender.receiver_count; i++) {
+			receiver = &sender.receivers[i];
+			if(!receiver->failed && now - receiver->last_heard > MULTICAST_RECEIVER_TIMEOUT) {
+				printf("A receiver stopped answering, dropping it.\n");
+				receiver->failed = 1;
+			}
+			if(receiver->failed) continue;
+			active++;
+			if(receiver->round == round && receiver->missing == 0) completed++;
+		}
+		if(active == 0 && (sender.receiver_count > 0 || 
+			now - started > MULTICAST_RECEIVER_TIMEOUT)) {
+			break;
+		}
+		if(active > 0 && completed == active) break;
+
+		repairing = 0;
+		for(group = 0; group < sender.group_count; group++) {
+			if(sender.need[group] > 0) {
+				_multicast_send_parity(&sender, group, sender.need[group]);
+				repairing++;
 			}
+		}
+		if(repairing) {
+			printf("Round %d: repairing %d groups, %d of %d receivers done.\n", 
+				round, repairing, completed, active);
+		}
+	}
 
-			client_log temp_log_entry;
+	for(i = 0; i < MULTICAST_DONE_REPEAT; i++) {
+		_multicast_control(&sender, DATAGRAM_DONE, round);
+	}
+	now = _now_us();
+	printf("\n%d of %d receivers have the file. Sent %ld Bytes for %ld in %.2f s "
+		"(%.3fx), %ld parity blocks, %d rounds.\n", completed, sender.receiver_count,
+		sender.bytes_sent, sender.filesize, (now - started) / 1000000.0, 
+		(double)sender.bytes_sent / sender.filesize, sender.parity_sent, round);
 
-			_goto_line_num_in_file(serv_log, FILE_RECORD_LINE_NUMBER);
-			while(fread(&temp_log_entry, sizeof(client_log), 1, serv_log)) {
-				if(strcmp(temp_log_entry.filename, f_name) == 0) {
-					/* found the entry in server log*/
-					/* now store the no. of bytes uploaded */
-					*bytes_uploaded = temp_log_entry.bytes_transferred;
-					return PARTIALLY_UPLOADED;
-				}
+	close(sender.sock);
+	close(sender.fd);
+	free(sender.need);
+	free(sender.next_parity);
+	return sender.receiver_count > 0 && completed == sender.receiver_count;
+};
+
+/* Takes an address:port of --servers, the port being PORT if left out.
+Returns 0 if it isn't one. */
+int _parse_server(char * argument, struct server * server) {
+	char address[INET_ADDRSTRLEN] = {0};
+	int port = PORT;
+
+	memset(server, 0, sizeof(struct server));
+	if(sscanf(argument, "%15[0-9.]:%d", address, &port) < 1 || port <= 0 || port > 65535) {
+		return 0;
+	}
+	server->addr.sin_family = AF_INET;
+	server->addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, address, &server->addr.sin_addr) != 1) return 0;
+	snprintf(server->name, sizeof(server->name), "%s:%d", address, port);
+	return 1;
+};
+
+/* the weights the uploads of earlier runs measured, one "address:port MB/s"
+a line */
+void _load_server_weights(struct server * servers, int server_count) {
+	FILE * fp = fopen(SERVERS_FILE_NAME, "r");
+	char name[32];
+	double weight;
+	int i;
+
+	if(fp == NULL) return;
+	while(fscanf(fp, "%31s %lf", name, &weight) == 2) {
+		for(i = 0; i < server_count; i++) {
+			if(strcmp(servers[i].name, name) == 0 && weight > 0) servers[i].weight = weight;
+		}
+	}
+	fclose(fp);
+};
+
+/* Keeps the weights of the servers, with those of servers we didn't use
+this time. A new throughput only moves a weight by WEIGHT_SMOOTHING of the
+difference, so one slow upload doesn't take a server's share away. */
+void _save_server_weights(struct server * servers, int server_count) {
+	FILE * fp = fopen(SERVERS_FILE_NAME, "r"), * tmp;
+	char name[32];
+	double weight;
+	int i, ours;
+
+	tmp = fopen(SERVERS_FILE_NAME ".tmp", "w");
+	if(tmp == NULL) {
+		perror("Saving server weights");
+		if(fp != NULL) fclose(fp);
+		return;
+	}
+	while(fp != NULL && fscanf(fp, "%31s %lf", name, &weight) == 2) {
+		for(ours = 0, i = 0; i < server_count; i++) {
+			if(strcmp(servers[i].name, name) == 0) ours = 1;
+		}
+		if(!ours) fprintf(tmp, "%s %.3f\n", name, weight);
+	}
+	for(i = 0; i < server_count; i++) {
+		if(servers[i].weight > 0) fprintf(tmp, "%s %.3f\n", servers[i].name, servers[i].weight);
+	}
+	if(fp != NULL) fclose(fp);
+	fclose(tmp);
+	rename(SERVERS_FILE_NAME ".tmp", SERVERS_FILE_NAME);
+};
+
+/* points on the ring from FNV-1a, which alone leaves similar names close */
+unsigned int _ring_hash(const char * string) {
+	unsigned int hash = _hash_string(string);
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+};
+
+int _compare_ring_points(const void * first, const void * second) {
+	const struct ring_point * a = first, * b = second;
+
+	if(a->hash != b->hash) return a->hash < b->hash ? -1 : 1;
+	return a->server - b->server;
+};
+
+/* the logs are named after their server */
+void _use_server_log(struct server * server) {
+	snprintf(log_name, sizeof(log_name), "%s.%s", LOGFILE_NAME, server->name);
+	snprintf(received_log_name, sizeof(received_log_name), "%s.temp", log_name);
+	snprintf(log_tmp_name, sizeof(log_tmp_name), "%s.tmp", log_name);
+};
+
+/* whether the log of a server has a record of the file, which is then on
+that server, completely or in part */
+int _is_on_server(struct server * server, char * filename) {
+	client_log log_entry;
+	FILE * fp;
+	int found;
+
+	_use_server_log(server);
+	fp = fopen(log_name, "r");
+	if(fp == NULL) return 0;
+	if(!_is_current_log(fp)) fp = _migrate_old_log(fp, log_name);
+	found = _find_log_entry(fp, filename, &log_entry);
+	fclose(fp);
+	return found;
+};
+
+/* whether a file of the group is placed on the server already */
+int _holds_group(int * placement, int * groups, int file_count, int group, int server) {
+	int f;
+
+	if(group == -1) return 0;
+	for(f = 0; f < file_count; f++) {
+		if(groups[f] == group && placement[f] == server) return 1;
+	}
+	return 0;
+};
+
+/* Places every file on a server by consistent hashing with bounded load.
+The servers have points on a ring in proportion to their weight, servers
+not measured yet counting as the average, and a file goes to the first 
+server after the hash of its name which stays under LOAD_BOUND times its 
+share of the bytes. Adding a server moves only the files that land on its
+points. A file the log of a server has a record of stays with that server,
+so that its upload is resumed, or its changes sent, where it is. Files of
+the same group, the shards of a stripe, go to different servers. */
+void _place_files(struct server * servers, int server_count, char ** files, 
+	long * sizes, int * groups, int file_count, int * placement) {
+	struct ring_point * ring;
+	double known = 0, total_weight = 0, weights[MAX_SERVERS];
+	long total_bytes = 0;
+	int measured = 0, point_count = 0, points, i, j, f, start, best;
+	char key[64];
+
+	for(i = 0; i < server_count; i++) {
+		if(servers[i].weight > 0) {
+			known += servers[i].weight;
+			measured++;
+		}
+	}
+	ring = (struct ring_point *)malloc(server_count * RING_POINTS * 4 * sizeof(struct ring_point));
+	for(i = 0; i < server_count; i++) {
+		weights[i] = servers[i].weight > 0 ? servers[i].weight : (measured ? known / measured : 1);
+		total_weight += weights[i];
+	}
+	for(i = 0; i < server_count; i++) {
+		/* between a quarter and four times the points of the average */
+		points = RING_POINTS * weights[i] * server_count / total_weight;
+		if(points < RING_POINTS / 4) points = RING_POINTS / 4;
+		if(points > RING_POINTS * 4) points = RING_POINTS * 4;
+		for(j = 0; j < points; j++) {
+			snprintf(key, sizeof(key), "%s#%d", servers[i].name, j);
+			ring[point_count].hash = _ring_hash(key);
+			ring[point_count++].server = i;
+		}
+	}
+	qsort(ring, point_count, sizeof(struct ring_point), _compare_ring_points);
+
+	for(f = 0; f < file_count; f++) {
+		total_bytes += sizes[f];
+		placement[f] = -1;
+		for(i = 0; i < server_count && placement[f] == -1; i++) {
+			if(_is_on_server(&servers[i], files[f])) placement[f] = i;
+		}
+		if(placement[f] != -1) servers[placement[f]].load += sizes[f];
+	}
+	for(f = 0; f < file_count; f++) {
+		if(placement[f] != -1) continue;
+		/* the first point at or after the hash of the name */
+		unsigned int hash = _ring_hash(files[f]);
+		for(start = 0; start < point_count && ring[start].hash < hash; start++);
+		best = -1;
+		for(j = 0; j < point_count; j++) {
+			i = ring[(start + j) % point_count].server;
+			if(groups != NULL && _holds_group(placement, groups, file_count, groups[f], i)) continue;
+			if(servers[i].load + sizes[f] <= LOAD_BOUND * total_bytes * weights[i] / total_weight) {
+				placement[f] = i;
+				break;
+			}
+			if(best == -1 || servers[i].load / weights[i] < servers[best].load / weights[best]) {
+				best = i;
 			}
 		}
+		/* a file too large for any share goes to the least loaded */
+		if(placement[f] == -1) placement[f] = best;
+		servers[placement[f]].load += sizes[f];
 	}
-	strcpy(log_entry->filename, f_name);
-	strcpy(log_entry->filesize, f_size);
-	strcpy(log_entry->start_time, _get_current_date_time());
-	strcpy(log_entry->end_time, "\0");
-	log_entry->bytes_transferred = 0;
-	log_entry->percentage_completion = 0;
-	log_entry->connection_count = 1;
-	log_entry->timeout_count = 0;
+	free(ring);
+};
 
-	/* seek log file to the last */
-	fseek(log_file, 0, SEEK_END);
-	/* make the entry */
-	fwrite(log_entry, sizeof(client_log), 1, log_file);
+/* What the process of a server does: uploads the files placed on it over 
+a session of its own, then reports the throughput it had on its pipe. 
+Returns whether every file was uploaded. */
+int _upload_to_server(struct server * server, char ** files, int * placement, 
+	int file_count, int index, struct upload_options * options) {
+	FILE * log_file;
+	int client_sock, f, uploaded = 1;
+	long long started;
+	double throughput;
 
-	return NEW_UPLOAD;
+	_use_server_log(server);
+	log_file = fopen(log_name, "r+");
+	client_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(log_file == NULL || client_sock < 0 || 
+		connect(client_sock, (struct sockaddr *)&server->addr, sizeof(server->addr)) < 0) {
+		perror(server->name);
+		return 0;
+	}
+	_start_tls(client_sock);
+	printf("Connected to server %s.\n", server->name);
+
+	session.server_addr = server->addr;
+	srand(getpid() ^ time(NULL));
+	if(!_open_session(client_sock, log_file)) {
+		printf("\nServer %s closed the connection.\n", server->name);
+		return 0;
+	}
+	started = _now_us();
+	for(f = 0; f < file_count; f++) {
+		if(placement[f] != index) continue;
+		if(!_upload_file(client_sock, files[f], &log_file, options)) uploaded = 0;
+	}
+	throughput = metrics.bytes_total / (double)(_now_us() - started);
+	if(metrics.bytes_total < WEIGHT_MIN_BYTES) throughput = 0;
+	if(write(server->report, &throughput, sizeof(throughput)) != sizeof(throughput)) {
+		perror("Reporting throughput");
+	}
+	close(client_sock);
+	fclose(log_file);
+	return uploaded;
 };
 
+/* Uploads the files over the servers of --servers, in parallel, every 
+server by a process of its own. Their logs are brought up to date here 
+before, as the processes would otherwise scan the directory all at once.
+Returns whether every file was uploaded. */
+int _upload_sharded(struct server * servers, int server_count, char ** files, 
+	int * groups, int file_count, struct upload_options * options) {
+	long sizes[MAX_FILES];
+	int placement[MAX_FILES], pipes[2], i, f, status, uploaded = 1;
+	double throughput;
+	struct stat st;
+	FILE * log_file;
 
-/* an utility function to remove a substring from string. (Just one ocurrance) 
-used when we have to remove the successfully uploaded file from the list
-of files to be uploaded.*/
-char * _remove_from_string(char * string, char *substring) {
-	int len = strlen(substring);
-	char * temp; 
+	for(f = 0; f < file_count; f++) {
+		if(stat(files[f], &st) < 0) {
+			perror(files[f]);
+			return 0;
+		}
+		sizes[f] = st.st_size;
+	}
+	_load_server_weights(servers, server_count);
+	_place_files(servers, server_count, files, sizes, groups, file_count, placement);
+	for(f = 0; f < file_count; f++) {
+		printf("%s goes to %s\n", files[f], servers[placement[f]].name);
+	}
 
-	if(len > 0) {
-		temp = strstr(string, substring);
+	fflush(stdout);
+	for(i = 0; i < server_count; i++) {
+		servers[i].pid = 0;
+		for(f = 0; f < file_count && placement[f] != i; f++);
+		if(f == file_count) continue;
+		_use_server_log(&servers[i]);
+		log_file = _initialise_log();
+		fclose(log_file);
+		if(pipe(pipes) < 0) {
+			perror("Pipe");
+			exit(EXIT_FAILURE);
+		}
+		servers[i].report = pipes[1];
+		servers[i].pid = fork();
+		if(servers[i].pid < 0) {
+			perror("Fork");
+			exit(EXIT_FAILURE);
+		}
+		if(servers[i].pid == 0) {
+			close(pipes[0]);
+			exit(_upload_to_server(&servers[i], files, placement, file_count, i, options) ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		close(pipes[1]);
+		servers[i].report = pipes[0];
+	}
 
-		if(temp != NULL) {
-			memmove(temp, temp + len, strlen(len + temp) + 1);
+	for(i = 0; i < server_count; i++) {
+		if(servers[i].pid == 0) continue;
+		if(read(servers[i].report, &throughput, sizeof(throughput)) == sizeof(throughput) &&
+			throughput > 0) {
+			/* in MB/s, bytes per us being just that */
+			servers[i].weight = (servers[i].weight > 0) ? 
+				servers[i].weight + WEIGHT_SMOOTHING * (throughput - servers[i].weight) : throughput;
+			printf("%s: %.2f MB/s\n", servers[i].name, throughput);
+		}
+		close(servers[i].report);
+		if(waitpid(servers[i].pid, &status, 0) < 0 || !WIFEXITED(status) || 
+			WEXITSTATUS(status) != EXIT_SUCCESS) {
+			printf("\nNot every file reached %s.\n", servers[i].name);
+			uploaded = 0;
 		}
 	}
-	return string;
+	_save_server_weights(servers, server_count);
+	return uploaded;
 };
 
-void _update_file_to_be_received_list(FILE * client_log, char * filename) {
-	/*we will first read line 2 as string and remove the 
-		current filename from this string. then we will replace line 2 of the 
-		server log file with this new string.*/
-	char * line = _get_line_as_string(client_log, 2);
-	char * updated_line = _remove_from_string(line, filename);
+void _shard_name(char * name, char * filename, int index) {
+	snprintf(name, FILENAME_SIZE, "%s.shard%d", filename, index);
+};
+
+/* Cuts a file into its data and parity shards, next to it, STRIPE_ROWS
+rows of blocks at a time. The shards get the file's modification time, so
+that shards cut again for a later run are taken for those uploaded, which
+they are. Returns 0 if the file can't be read. */
+int _stripe_file(char * filename, int data_shards, int parity_shards) {
+	struct shard_header header = {0};
+	unsigned char * rows, * shards[MAX_SHARDS];
+	char name[FILENAME_SIZE];
+	int fds[MAX_SHARDS], fd, shard_count = data_shards + parity_shards, i, j, p;
+	long row, row_count, batch, b, length;
+	struct stat st;
+	struct timespec times[2];
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror(filename);
+		if(fd >= 0) close(fd);
+		return 0;
+	}
+	_gf_init();
+	memcpy(header.magic, SHARD_MAGIC, sizeof(header.magic));
+	header.filesize = st.st_size;
+	header.data_shards = data_shards;
+	header.parity_shards = parity_shards;
+	row_count = ((st.st_size + BUFFER_SIZE - 1) / BUFFER_SIZE + data_shards - 1) / data_shards;
+	rows = (unsigned char *)malloc((long)STRIPE_ROWS * data_shards * BUFFER_SIZE);
+	for(i = 0; i < shard_count; i++) {
+		shards[i] = (unsigned char *)malloc((long)STRIPE_ROWS * BUFFER_SIZE);
+		_shard_name(name, filename, i);
+		header.index = i;
+		fds[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fds[i] < 0 || write(fds[i], &header, sizeof(header)) != sizeof(header)) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(row = 0; row < row_count; row += batch) {
+		batch = (row_count - row > STRIPE_ROWS) ? STRIPE_ROWS : row_count - row;
+		length = batch * data_shards * BUFFER_SIZE;
+		memset(rows, 0, length);  /* the last row is padded with zeros */
+		if(pread(fd, rows, length, row * data_shards * BUFFER_SIZE) < 0) {
+			perror("File read");
+			exit(EXIT_FAILURE);
+		}
+		for(b = 0; b < batch; b++) {
+			for(j = 0; j < data_shards; j++) {
+				memcpy(shards[j] + b * BUFFER_SIZE, 
+					rows + (b * data_shards + j) * BUFFER_SIZE, BUFFER_SIZE);
+			}
+		}
+		for(p = 0; p < parity_shards; p++) {
+			memset(shards[data_shards + p], 0, batch * BUFFER_SIZE);
+			for(j = 0; j < data_shards; j++) {
+				_gf_mul_add(shards[data_shards + p], shards[j], _fec_coefficient(p, j), 
+					batch * BUFFER_SIZE);
+			}
+		}
+		for(i = 0; i < shard_count; i++) {
+			if(pwrite(fds[i], shards[i], batch * BUFFER_SIZE, 
+				sizeof(header) + row * BUFFER_SIZE) != batch * BUFFER_SIZE) {
+				perror("Writing shard");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
 
-	_replace_line(client_log, 2, updated_line);	
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	for(i = 0; i < shard_count; i++) {
+		futimens(fds[i], times);
+		close(fds[i]);
+		free(shards[i]);
+	}
+	free(rows);
+	close(fd);
+	return 1;
 };
 
-void printlog(FILE * log_file) {
-	char ch;
-	int linenum = 1;
-	fseek(log_file, 0 ,SEEK_SET);
+/* Puts a file back together from the shards of it we have, at least as 
+many as it has data shards. A missing data shard is rebuilt from parity
+shards: their blocks, with the share of the data shards we have taken out,
+are sums of the missing blocks alone, which the inverse of the matrix of
+their coefficients turns back into those. Returns whether it worked. */
+int _join_stripe(char * filename, int * have, int data_shards, int parity_shards) {
+	struct shard_header header;
+	unsigned char * rows = NULL, * shards[MAX_SHARDS] = {0};
+	unsigned char matrix[MAX_SHARDS * MAX_SHARDS], inverse[MAX_SHARDS * MAX_SHARDS];
+	int fds[MAX_SHARDS], missing[MAX_SHARDS], parity[MAX_SHARDS];
+	int missing_count = 0, parity_count = 0, shard_count = data_shards + parity_shards;
+	int i, j, r, c, fd = -1, joined = 0;
+	long filesize = -1, row_count, row, batch, b, length;
+	char name[FILENAME_SIZE];
 
-	while((ch = getc(log_file)) != EOF) {
-		if(ch == '\n') {
-			linenum++;
+	_gf_init();
+	for(i = 0; i < shard_count; i++) {
+		fds[i] = -1;
+		if(!have[i]) {
+			if(i < data_shards) missing[missing_count++] = i;
+			continue;
 		}
-		printf("%c", ch);
-		if(linenum == FILE_RECORD_LINE_NUMBER) {
-			break;
+		/* only as many parity shards as there are data shards missing */
+		if(i >= data_shards && parity_count == missing_count) continue;
+		_shard_name(name, filename, i);
+		fds[i] = open(name, O_RDONLY);
+		if(fds[i] < 0 || read(fds[i], &header, sizeof(header)) != sizeof(header) ||
+			memcmp(header.magic, SHARD_MAGIC, sizeof(header.magic)) != 0 ||
+			header.data_shards != data_shards || header.parity_shards != parity_shards ||
+			header.index != i || (filesize != -1 && header.filesize != filesize)) {
+			printf("\n%s isn't a shard of this stripe.\n", name);
+			goto done;
+		}
+		filesize = header.filesize;
+		shards[i] = (unsigned char *)malloc((long)STRIPE_ROWS * BUFFER_SIZE);
+		if(i >= data_shards) parity[parity_count++] = i - data_shards;
+	}
+	if(filesize == -1 || parity_count < missing_count) {
+		printf("\nToo few shards of %s.\n", filename);
+		goto done;
+	}
+	for(r = 0; r < missing_count; r++) {
+		for(c = 0; c < missing_count; c++) {
+			matrix[r * missing_count + c] = _fec_coefficient(parity[r], missing[c]);
+		}
+	}
+	if(missing_count > 0 && !_gf_invert_matrix(matrix, inverse, missing_count)) goto done;
+	for(c = 0; c < missing_count; c++) {
+		shards[missing[c]] = (unsigned char *)malloc((long)STRIPE_ROWS * BUFFER_SIZE);
+	}
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		perror(filename);
+		goto done;
+	}
+	rows = (unsigned char *)malloc((long)STRIPE_ROWS * data_shards * BUFFER_SIZE);
+	row_count = ((filesize + BUFFER_SIZE - 1) / BUFFER_SIZE + data_shards - 1) / data_shards;
+	for(row = 0; row < row_count; row += batch) {
+		batch = (row_count - row > STRIPE_ROWS) ? STRIPE_ROWS : row_count - row;
+		length = batch * BUFFER_SIZE;
+		for(i = 0; i < shard_count; i++) {
+			if(fds[i] >= 0 && pread(fds[i], shards[i], length, 
+				sizeof(header) + row * BUFFER_SIZE) != length) {
+				printf("\nA shard of %s is short.\n", filename);
+				goto done;
+			}
+		}
+		for(r = 0; r < missing_count; r++) {
+			for(j = 0; j < data_shards; j++) {
+				if(fds[j] < 0) continue;
+				_gf_mul_add(shards[data_shards + parity[r]], shards[j], 
+					_fec_coefficient(parity[r], j), length);
+			}
+		}
+		for(c = 0; c < missing_count; c++) {
+			memset(shards[missing[c]], 0, length);
+			for(r = 0; r < missing_count; r++) {
+				_gf_mul_add(shards[missing[c]], shards[data_shards + parity[r]], 
+					inverse[c * missing_count + r], length);
+			}
+		}
+
+		for(b = 0; b < batch; b++) {
+			for(j = 0; j < data_shards; j++) {
+				memcpy(rows + (b * data_shards + j) * BUFFER_SIZE, 
+					shards[j] + b * BUFFER_SIZE, BUFFER_SIZE);
+			}
+		}
+		length = batch * data_shards * BUFFER_SIZE;
+		if(row * data_shards * BUFFER_SIZE + length > filesize) {
+			length = filesize - row * data_shards * BUFFER_SIZE;
+		}
+		if(pwrite(fd, rows, length, row * data_shards * BUFFER_SIZE) != length) {
+			perror("Writing file");
+			goto done;
+		}
+	}
+	joined = 1;
+
+done:
+	for(i = 0; i < shard_count; i++) {
+		if(fds[i] >= 0) close(fds[i]);
+		free(shards[i]);
+	}
+	if(fd >= 0) close(fd);
+	free(rows);
+	return joined;
+};
+
+/* Uploads the files striped over the servers: every file is cut into its
+shards, which are uploaded as files of their own, no two of a file to the
+same server, and removed once uploaded. Returns whether every shard was. */
+int _upload_striped(struct server * servers, int server_count, char ** files, 
+	int file_count, int data_shards, int parity_shards, struct upload_options * options) {
+	int shard_count = data_shards + parity_shards, groups[MAX_FILES], f, i, n = 0, uploaded;
+	char * shards[MAX_FILES];
+
+	if(file_count * shard_count > MAX_FILES) {
+		printf("\nNo more than %d shards at once.\n", MAX_FILES);
+		return 0;
+	}
+	for(f = 0; f < file_count; f++) {
+		if(strlen(files[f]) + strlen(".shard00") >= FILENAME_SIZE) {
+			printf("\nFile name too long.\n");
+			return 0;
+		}
+		if(!_stripe_file(files[f], data_shards, parity_shards)) return 0;
+		for(i = 0; i < shard_count; i++) {
+			shards[n] = (char *)malloc(FILENAME_SIZE);
+			_shard_name(shards[n], files[f], i);
+			groups[n++] = f;
+		}
+	}
+	uploaded = _upload_sharded(servers, server_count, shards, groups, n, options);
+	for(i = 0; i < n; i++) {
+		unlink(shards[i]);
+		free(shards[i]);
+	}
+	return uploaded;
+};
+
+/* Fetches a striped file: every shard from the server whose log has it,
+all at once, each by a process of its own. The file is put together from 
+the first data_shards to arrive, the slower ones are stopped. Returns 
+whether the file was put together. */
+int _get_striped(struct server * servers, int server_count, char * filename, 
+	int data_shards, int parity_shards) {
+	int shard_count = data_shards + parity_shards, have[MAX_SHARDS] = {0};
+	int i, s, arrived = 0, running = 0, status, joined;
+	pid_t pids[MAX_SHARDS], pid;
+	char name[FILENAME_SIZE];
+	struct sockaddr_in addr;
+	FILE * log_file;
+
+	fflush(stdout);
+	for(i = 0; i < shard_count; i++) {
+		pids[i] = 0;
+		_shard_name(name, filename, i);
+		for(s = 0; s < server_count && !_is_on_server(&servers[s], name); s++);
+		if(s == server_count) {
+			printf("\nNo server is known to have %s.\n", name);
+			continue;
+		}
+		pids[i] = fork();
+		if(pids[i] < 0) {
+			perror("Fork");
+			exit(EXIT_FAILURE);
+		}
+		if(pids[i] == 0) {
+			_use_server_log(&servers[s]);
+			log_file = fopen(log_name, "r+");
+			if(log_file != NULL && !_is_current_log(log_file)) {
+				log_file = _migrate_old_log(log_file, log_name);
+			}
+			addr = servers[s].addr;
+			addr.sin_port = htons(ntohs(addr.sin_port) + DOWNLOAD_PORT - PORT);
+			exit(log_file != NULL && _download_file(name, &log_file, &addr) ? 
+				EXIT_SUCCESS : EXIT_FAILURE);
 		}
+		running++;
 	}
-	client_log log_entry;
-	char * endtime;
-	while(fread((&log_entry), sizeof(client_log), 1, log_file)) {
-		if(strcmp(log_entry.end_time, "\0") == 0) {
-			endtime = "NA";
+
+	while(running > 0 && arrived < data_shards && (pid = wait(&status)) > 0) {
+		for(i = 0; i < shard_count && pids[i] != pid; i++);
+		if(i == shard_count) continue;
+		pids[i] = 0;
+		running--;
+		if(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+			have[i] = 1;
+			arrived++;
 		}
-		else {
-			endtime = log_entry.end_time;
+	}
+	/* the slowest aren't waited for */
+	for(i = 0; i < shard_count; i++) {
+		if(pids[i] > 0) {
+			kill(pids[i], SIGTERM);
+			waitpid(pids[i], NULL, 0);
 		}
-		printf("%-35s\t%-15s\t%-20s\t%-20lu\t%i%%\t%20s\t%20lu\t%20lu\n", 
-			log_entry.filename,
-			log_entry.filesize,
-			log_entry.start_time,
-			log_entry.bytes_transferred,
-			log_entry.percentage_completion,
-			endtime,
-			log_entry.connection_count,
-			log_entry.timeout_count);
 	}
-};
 
+	joined = arrived >= data_shards && _join_stripe(filename, have, data_shards, parity_shards);
+	for(i = 0; i < shard_count; i++) {
+		_shard_name(name, filename, i);
+		unlink(name);
+	}
+	if(joined) {
+		printf("\n%s put together from %d of its %d shards.\n", filename, data_shards, shard_count);
+	}
+	else {
+		printf("\nCouldn't get %d shards of %s.\n", data_shards, filename);
+	}
+	return joined;
+};
 
 int main(int argc, char * argv[]) {
 	int client_sock;
 	struct sockaddr_in server_addr;
 
-	FILE * file_to_send, *log_file;
-
-	/* We are initialsing two segments one corresponding to what we send
-	and other one we receive. */
-	struct segment client_segment = {0};
-	struct segment recvd_segment = {0};
-
-	char filename[BUFFER_SIZE];
-	long int filesize;
-	char filesize_to_send[BUFFER_SIZE];
-	char buffer[BUFFER_SIZE] = {0};
-	int remaining_bytes, read_bytes;
-	int sent_bytes, recvd_bytes;  
-	int logfile_size, temp_log_file_size;
-
-	//Retransmission timeout value
-	short RTO;   /* initial value will be 3 sec which will be doubled each retry */
-	short retry;   /* sender will retry sending acc to this value */
+	FILE * log_file;
 
+	pthread_mutex_init(&metrics.lock, NULL);
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_port = htons(PORT);
 	
@@ -501,22 +7211,254 @@ int main(int argc, char * argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
+	/* if command line has some argument process that */
+	char * file_argument = NULL;
+	short watch = 0, follow = 0, get = 0, multicast = 0, swarm = 0, seed = 0, tls = 0;
+	short show_log = 0, json = 0;
+	int metrics_port = 0, trace = TRACE_OFF;
+	struct upload_options options = {0};
+	int arg;
+	struct server servers[MAX_SERVERS];
+	char * files[MAX_FILES], * next;
+	int server_count = 0, file_count = 0, f, i;
+	int data_shards = 0, parity_shards = 0;
+
+	for(arg = 1; arg < argc; arg++) {
+		if(strcmp("--log",argv[arg]) == 0) { 
+			show_log = 1;
+		}
+		else if(strcmp("--json", argv[arg]) == 0) {
+			json = 1;
+		}
+		else if(strcmp("--metrics", argv[arg]) == 0 && arg + 1 < argc) {
+			metrics_port = atoi(argv[++arg]);
+			if(metrics_port <= 0 || metrics_port > 65535) {
+				printf("\nNot a port: %s\n", argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--trace", argv[arg]) == 0 && arg + 1 < argc) {
+			trace = atoi(argv[++arg]);
+			if(trace < TRACE_OFF || trace > TRACE_ALL) {
+				printf("\nThe trace level is %d to %d.\n", TRACE_OFF, TRACE_ALL);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--reconnect", argv[arg]) == 0 && arg + 1 < argc) {
+			session.reconnect_time = atoi(argv[++arg]);
+			if(session.reconnect_time < 0) {
+				printf("\nThe reconnect time is in seconds, 0 not to reconnect.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--dedup", argv[arg]) == 0) {
+			options.dedup = 1;
+		}
+		else if(strcmp("--no-local", argv[arg]) == 0) {
+			options.no_local = 1;
+		}
+		else if(strcmp("--udp", argv[arg]) == 0) {
+			options.udp = 1;
+		}
+		else if(strcmp("--fec", argv[arg]) == 0) {
+			options.fec = 1;
+		}
+		else if(strcmp("--cc", argv[arg]) == 0 && arg + 1 < argc) {
+			arg++;
+			if(strcmp("aimd", argv[arg]) == 0) {
+				options.congestion_control = CC_AIMD;
+			}
+			else if(strcmp("bbr", argv[arg]) == 0) {
+				options.congestion_control = CC_BBR;
+			}
+			else {
+				printf("\nUnknown congestion control: %s\n", argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--watch", argv[arg]) == 0) {
+			watch = 1;
+		}
+		else if(strcmp("--follow", argv[arg]) == 0) {
+			follow = 1;
+		}
+		else if(strcmp("--get", argv[arg]) == 0) {
+			get = 1;
+		}
+		else if(strcmp("--tls", argv[arg]) == 0 && arg + 1 < argc) {
+			/* the certificate of the server, or of who signed it */
+#ifdef USE_KTLS
+			_create_tls_context(argv[++arg]);
+			tls = 1;
+#else
+			printf("\nfclient was built without kernel TLS, build it with -DUSE_KTLS -lssl -lcrypto.\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+		else if(strcmp("--swarm", argv[arg]) == 0) {
+			swarm = 1;
+		}
+		else if(strcmp("--seed", argv[arg]) == 0) {
+			seed = 1;
+		}
+		else if(strcmp("--multicast", argv[arg]) == 0) {
+			multicast = 1;
+		}
+		else if(strcmp("--rate", argv[arg]) == 0 && arg + 1 < argc) {
+			options.multicast_rate = atoi(argv[++arg]);
+			if(options.multicast_rate <= 0) {
+				printf("\nThe rate is in Mbit/s and must be positive.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--interface", argv[arg]) == 0 && arg + 1 < argc) {
+			if(inet_pton(AF_INET, argv[++arg], &options.interface) != 1) {
+				printf("\nNot an IPv4 address: %s\n", argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--compress", argv[arg]) == 0) {
+			options.comp.enabled = 1;
+			options.comp.adaptive = 1;
+			options.comp.backoff = 1;
+		}
+		else if(strcmp("--checksum", argv[arg]) == 0) {
+			options.checksum = 1;
+		}
+		else if(strcmp("--bench-compress", argv[arg]) == 0 && arg + 1 < argc) {
+			_benchmark_compression(argv[arg + 1]);
+			exit(EXIT_SUCCESS);
+		}
+		else if(strcmp("--stripe", argv[arg]) == 0 && arg + 1 < argc) {
+			if(sscanf(argv[++arg], "%d+%d", &data_shards, &parity_shards) != 2 ||
+				data_shards < 1 || data_shards > FEC_GROUP_SIZE || parity_shards < 1 ||
+				data_shards + parity_shards > MAX_SHARDS) {
+				printf("\nNot a stripe: %s (K+M, K up to %d, K+M up to %d)\n", argv[arg],
+					FEC_GROUP_SIZE, MAX_SHARDS);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--servers", argv[arg]) == 0 && arg + 1 < argc) {
+			for(next = strtok(argv[++arg], ","); next != NULL; next = strtok(NULL, ",")) {
+				if(server_count == MAX_SERVERS || !_parse_server(next, &servers[server_count])) {
+					printf("\nNot a server (or more than %d): %s\n", MAX_SERVERS, next);
+					exit(EXIT_FAILURE);
+				}
+				server_count++;
+			}
+		}
+		else {
+			file_argument = argv[arg];
+			if(file_count == MAX_FILES) {
+				printf("\nNo more than %d files at once: %s\n", MAX_FILES, argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+			files[file_count++] = argv[arg];
+		}
+	}
+
+	if(show_log && server_count > 0) {
+		/* every server has a log of its own */
+		for(i = 0; i < server_count; i++) {
+			_use_server_log(&servers[i]);
+			log_file = fopen(log_name, "r");
+			if(!json) printf("\n%s:\n", servers[i].name);
+			if(log_file == NULL) {
+				printf(json ? "{}\n" : "\nNothing uploaded yet.\n");
+				continue;
+			}
+			if(!_is_current_log(log_file)) log_file = _migrate_old_log(log_file, log_name);
+			if(json) printlog_json(log_file);
+			else printlog(log_file);
+			fclose(log_file);
+		}
+		exit(EXIT_SUCCESS);
+	}
+	if(show_log) {
+		/*if --log flag is used show logs on STDOUT. Only the log is
+		read, the directory isn't scanned for this. */
+		log_file = fopen(LOGFILE_NAME, "r");
+		if(log_file == NULL) {
+			printf(json ? "{}\n" : "\nNo log yet. Nothing has been uploaded.\n");
+			exit(EXIT_SUCCESS);
+		}
+		if(!_is_current_log(log_file)) log_file = _migrate_old_log(log_file, LOGFILE_NAME);
+		if(json) printlog_json(log_file);
+		else printlog(log_file);
+		exit(EXIT_SUCCESS);
+	}
+
+	if(file_argument == NULL && (!watch || multicast)) {
+		printf("\nNo filename or flag provided.\n");
+		printf("\nUSAGE: ./fclient [--dedup | --compress] [--checksum] [--no-local] [--udp [--fec] [--cc bbr | aimd] | --tls certificate] [--metrics port] [--trace level] [--reconnect s] [[--follow | --get] filename | --watch | Flag]\n"
+			"       ./fclient --servers address[:port],... [--stripe K+M] [upload flags] filename ...\n"
+			"       ./fclient --servers address[:port],... --stripe K+M --get filename\n"
+			"       ./fclient --swarm [--seed] filename\n"
+			"       ./fclient --multicast [--fec] [--rate Mbit/s] [--interface address] filename\n"
+			"       ./fclient --log [--json]\n\n");
+		exit(EXIT_SUCCESS);
+	}
+	for(f = 0; f < file_count; f++) {
+		if(strlen(files[f]) >= FILENAME_SIZE) {
+			printf("\nFile name too long.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(tls && (options.udp || multicast || swarm)) {
+		printf("\n--tls only covers uploads and downloads over tcp.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(data_shards > 0 && server_count < data_shards + parity_shards) {
+		printf("\n--stripe %d+%d needs as many --servers.\n", data_shards, parity_shards);
+		exit(EXIT_FAILURE);
+	}
+	if(server_count > 0) {
+		/* every server has a process of its own, which an endpoint or a 
+		trace of this one wouldn't see */
+		if(watch || follow || (get && data_shards == 0) || swarm || multicast || 
+			metrics_port > 0 || trace > TRACE_OFF) {
+			printf("\n--servers only takes files to upload, or to get with --stripe.\n");
+			exit(EXIT_FAILURE);
+		}
+		if(get) {
+			exit(_get_striped(servers, server_count, file_argument, data_shards, parity_shards) ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		if(data_shards > 0) {
+			exit(_upload_striped(servers, server_count, files, file_count, data_shards, 
+				parity_shards, &options) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		exit(_upload_sharded(servers, server_count, files, NULL, file_count, &options) ? 
+			EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if(metrics_port > 0) {
+		_start_metrics_endpoint(metrics_port);
+	}
+	if(trace > TRACE_OFF) {
+		_start_trace(trace);
+	}
+
+	if(multicast) {
+		/* a distribution goes to whoever listens, not to our server */
+		exit(_distribute_file(file_argument, &options) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
 	log_file = _initialise_log(); /* create log file if it doesn't exist 
 	and scan the directory to collect all files which are to be uploaded, 
 	and add that to the log. If created then simply return the 
 	file for reading/writing.*/
 
-	/* if command line has some argument process that */
-	if(argc < 2) {
-		printf("\nNo filename or flag provided.\n");
-		printf("\nUSAGE: ./fclient [filename | Flag]\n\n");
-		exit(EXIT_SUCCESS);
+	if(get) {
+		/* downloads go to a port of their own, without the log exchange */
+		server_addr.sin_port = htons(DOWNLOAD_PORT);
+		exit(_download_file(file_argument, &log_file, &server_addr) ? EXIT_SUCCESS : EXIT_FAILURE);
 	}
-
-	if(strcmp("--log",argv[1]) == 0) { 
-		/*if --log flag is used show logs on STDOUT.*/
-		printlog(log_file);
-		exit(EXIT_SUCCESS);
+	if(swarm) {
+		/* fetched from the server and the other peers of the file */
+		exit(_swarm_download(file_argument, &log_file, seed) ? EXIT_SUCCESS : EXIT_FAILURE);
 	}
 
 
@@ -535,209 +7477,33 @@ int main(int argc, char * argv[]) {
 		perror("Connection");
 		exit(EXIT_FAILURE);
 	}
+	_start_tls(client_sock);
 
-	printf("Connected to server %s at port %d.\n", SERVER_IP, PORT);
-
-		/* Once connected we exchange the log files. Recieved log file from server 
-	is saved as temp.txt*/
-	FILE * temp_log = fopen(RECEIVED_LOG, "w+");
-	if(temp_log == NULL) {
-		printf("File error");
-		exit(EXIT_FAILURE);
-	}
+	printf("Connected to server %s at port %d%s.\n", SERVER_IP, PORT, tls ? " over TLS" : "");
 
 	/*We will first receive the log file size from server and then 
 	send the size of client log file. This will help us to decide when 
-	to stop receiving from the tcp stream while exchanging the log file*/
-
-	/* First we receive the file size of server log as we will be
-	first receiving the log from server */
-	recv(client_sock, buffer, sizeof(buffer), 0);
-	temp_log_file_size = atoi(buffer);
-
-	/*getting the filesize of client log and sending it*/
-	logfile_size = _get_file_size(log_file);
-	sprintf(buffer, "%d", logfile_size);
-	send(client_sock, buffer, sizeof(buffer), 0);
-
-	/*Now we start receiving the log file from server*/
-	recvlog(temp_log, client_sock, temp_log_file_size);
-	sendlog(log_file, client_sock, logfile_size);
-
-	
-	//opening the file to be sent
-	strcpy(client_segment.filename, argv[1]);
-	strcpy(filename, argv[1]); /* storing for convenience */
-	file_to_send = fopen(client_segment.filename, "r");
-	if(file_to_send == NULL) {
-		perror("File");
-		exit(EXIT_FAILURE);
-	}
-
-	//getting size of file by seeking to the end of file
-	filesize = _get_file_size(file_to_send);
-
-	//storing and printing filesize
-	sprintf(client_segment.filesize, "%d", filesize);
-	printf("\nFile Size: %s Bytes \n", client_segment.filesize);
-
-	//sending file name & size to server
-	sent_bytes = send(client_sock, (void *)&client_segment, 
-		sizeof(struct segment), 0); 
-		
-	if(sent_bytes < 0) {
-		perror("Sending file metadata");
+	to stop receiving from the tcp stream while exchanging the log file.
+	The session this opens lets us reconnect without doing it again. */
+	session.server_addr = server_addr;
+	srand(getpid() ^ time(NULL));
+	if(!_open_session(client_sock, log_file)) {
+		printf("\nServer closed the connection.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	/* these are few variables being used in loop for collecting
-	qunatitative data about transfer and also control the loop*/
-	remaining_bytes = filesize;
-	recvd_bytes = 1;   /* setting just to start the loop */
-	unsigned long bytes_transferred = 0;
-	unsigned short percentage = 0;
-
-	client_log initial_log_entry, log_entry;   /* creating instances of 
-	server log for initialising and updating*/
-
-	/* we now initialise the server_log_entry for the provided file 
-	and also check whether the file is already uploaded or partially
-	uploaded */
-	long int amount_uploaded = -1;
-	short init_result = _initialise_log_entry_for_file(&initial_log_entry, 
-		filename, client_segment.filesize, log_file, temp_log, 
-		&amount_uploaded);
-
-	if(init_result == FULLY_UPLOADED) {
-		printf("\nFile is already uploaded. Check logs for more detail.\n");
-		exit(EXIT_SUCCESS);
+	
+	if(watch) {
+		_watch_and_sync(client_sock, &log_file, &options);
 	}
-	else if(init_result == PARTIALLY_UPLOADED) {
-		if(amount_uploaded == -1) {
-			printf("\nSome error ocurred. Exiting.\n");
-			exit(EXIT_FAILURE);
-		}
-
-		/* NOW WE TRY TO RESUME THE UPLOAD PROCESS */
-
-		/*now we have the amount uploaded. We will use to 
-		set the sequence number and according to that, file will be
-		seeked at correct position.*/
-
-		client_segment.seq_no = (amount_uploaded/BUFFER_SIZE);
-		client_segment.ack_no = client_segment.seq_no;
-		/* We will resume reading file at psoition indicated by
-		the updated seq_no. We will also update the connection count
-		in client_log*/
-
-		/* update the various loop variables to reflect correct value 
-		after resuming*/
-		bytes_transferred = amount_uploaded;
-		remaining_bytes = filesize - amount_uploaded;
-		percentage = (bytes_transferred/(float)filesize)*100;
-
-		/* we update the connection count in log file and also 
-		update the progress of file according to server record in
-		client log*/
-
-		_update_transfer_progress_in_log(&log_entry, filename, 
-						0, 0, log_file, UPDATE_LOG_CONNECTION_COUNT);
-
-		_update_transfer_progress_in_log(&log_entry, filename, 
-						bytes_transferred, percentage, log_file, 
-						UPDATE_LOG_PROGRESS);	
+	else if(follow) {
+		_follow_file(client_sock, file_argument, &log_file, &options);
 	}
-	
-	while(remaining_bytes > 0 && recvd_bytes > 0) {
-		retry = 3;
-		RTO = 3;
-		//Setting the file pointer at right position acc to seq no.
-		fseek(file_to_send, ((client_segment.seq_no)*BUFFER_SIZE), SEEK_SET);
-
-		//read buffersize amount of bytes from file into the segment buffer
-		read_bytes = fread(client_segment.buffer, sizeof(char), 
-			sizeof(client_segment.buffer), file_to_send);
-		if(read_bytes < 0) {
-			perror("File read");
-			exit(EXIT_FAILURE);
-		}
-		while(retry > 0) {
-			// send the segment to server
-			sent_bytes = send(client_sock, (void *)&client_segment, 
-				sizeof(struct segment), 0);
-			if(sent_bytes < 0) {
-				perror("Sending File");
-				exit(EXIT_FAILURE);
-			}
-
-			printf("\nSent Sequence no: %d", client_segment.seq_no);
-
-			// now we wait for acknowledge from the receiver
-			recvd_bytes = recv_with_timeout(client_sock, 
-				(struct segment *)&recvd_segment, 
-				sizeof(struct segment), RTO);
-			/* using sizeof r_segment as recvd_segment is a pointer */
-
-			if(recvd_bytes == 0) {
-				printf("\nConnection closed.\n");
-				break;
-			}
-			else if(recvd_bytes == -1) {
-				perror("Timeout");
-				exit(EXIT_FAILURE);
-			}
-			else if(recvd_bytes == TIMEOUT_OCCURED) {
-				printf("\nTimeout ocurred. Retrying ...\n");
-				retry--;
-				RTO *= 2; 
-
-				/*as the timeout has ocurred we will update the corresponding
-				record in log file*/
-				_update_transfer_progress_in_log(&log_entry, filename, 
-						0, 0, log_file, UPDATE_LOG_TIMEOUT);
-				/* we provide the timeout argument of the function as 1 
-				so that function gets to know only timeout has to be updated */
-			}
-			else { /* Now we have got the acknowledgement from server*/
-				if(client_segment.seq_no == recvd_segment.seq_no) {
-
-					client_segment.seq_no = recvd_segment.ack_no;
-					client_segment.ack_no = recvd_segment.ack_no;
-				}
-				printf("\nReceived Acknowledgement for sequence no: %d", 
-					recvd_segment.seq_no);
-				printf("\nReceived Acknowledgement no: %d\n", recvd_segment.ack_no);
-
-				/* as new segment has been sent, we will update
-					the records in corresponding log file*/
-
-				bytes_transferred += read_bytes;
-				percentage = (bytes_transferred/(float)filesize)*100;
-				_update_transfer_progress_in_log(&log_entry, filename, 
-						bytes_transferred, percentage, log_file, 
-						UPDATE_LOG_PROGRESS);
-
-				break; /* now no need to retry for this segment */
-			}
-		}
-
-		remaining_bytes = remaining_bytes - read_bytes;
-		printf("\nRemaining: %d Bytes", remaining_bytes);
+	else {
+		_upload_file(client_sock, file_argument, &log_file, &options);
 	}
-	if(remaining_bytes <= 0) {
-		printf("\nFile sending Completed.\n");
-
-		/* update the log record on completion of file transfer */
-		_update_transfer_progress_in_log(&log_entry, filename, 
-						filesize, 100, log_file, UPDATE_LOG_COMPLETED);
 
-		/* now, we also need to remove the file entry from line 2 as the
-		list should contain the files which are not completely received*/
-		_update_file_to_be_received_list(log_file, filename);
-	}
-	
-	fclose(file_to_send);
 	close(client_sock);
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* for copy_file_range() and fallocate() */
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,18 +9,51 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> /* for FICLONE */
+#include <linux/tcp.h> /* for TCP_INFO, newer than that of netinet/tcp.h */
+#include <linux/sockios.h> /* for SIOCINQ */
+#ifdef USE_KTLS
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
 #define PORT 6060
+#define DOWNLOAD_PORT 6061 /* clients fetching files connect here */
+#define DOWNLOAD_BACKLOG 128
+#define MAX_EVENTS 64 /* no. of epoll events handled per wakeup */
 #define BUFFER_SIZE 1400
-#define FILENAME_SIZE 72
+#define FILENAME_SIZE 256 /* path of the file, relative to the synced directory */
 #define BACKLOG 3
 #define TIMEOUT_OCCURED -2  /* a constant to signal timeout has ocurred */
-#define FILESIZE_STRING 11 /* We want atmost 9,999,999,999 Bytes of file 9.9GB*/
+#define FILESIZE_STRING 21 /* enough digits for any size which fits in a long */
 #define LOGFILE_NAME "server_log"
 #define RECEIVED_LOG "temp"
+#define CONNECTION_CLOSED -1 /* returned by _receive_file() */
 #define FILE_RECORD_LINE_NUMBER 6 /*as we are writing both, plain text and 
 structure to the same log file. Hence we need to store the line number from where
 structure entry is starting.*/
+#define LOG_VERSION "(log version 2)" /* on the first line of the log. The records
+of older builds, which wrote no version, have another size. Raised whenever
+the record changes. */
 
 /* These constants will be used as flag to decide what data in the logfile
 has to be udated corresponding to a file*/
@@ -27,13 +61,145 @@ has to be udated corresponding to a file*/
 #define UPDATE_LOG_COMPLETED 1
 #define UPDATE_LOG_TIMEOUT 2
 #define UPDATE_LOG_CONNECTION_COUNT 3
+#define UPDATE_LOG_NEW_VERSION 4 /* client is sending a changed file */
+#define UPDATE_LOG_APPENDED 5 /* bytes were appended to a complete file */
 
 #define FRESH_UPLOAD 100
 #define REATTEMPT_UPLOAD 50
 
+#define HASH_SIZE 32 /* SHA-256 digest length */
+#define MERKLE_LEAF_SIZE (64 * BUFFER_SIZE) /* bytes of file covered by one leaf
+of the hash tree. Must be the same as in the client. */
+#define MERKLE_QUERY_MAX 256 /* max no. of tree nodes asked for in one round */
+#define MAX_HASH_THREADS 16
+#define END_OF_FILE_SEQ -1 /* seq_no of the segment which tells that the client
+has sent every segment it planned to send */
+
+/* flags of the metadata segment */
+#define SEGMENT_DELTA 0x1  /* client wants to send only the differences */
+#define SEGMENT_DEDUP 0x2  /* client sends the file as content defined chunks */
+#define SEGMENT_COMPRESSED 0x4 /* buffer of a data segment is compressed */
+#define SEGMENT_HOLE 0x8 /* segment describes a hole instead of carrying data */
+#define SEGMENT_APPEND 0x10 /* client streams bytes appended to a complete file */
+#define SEGMENT_LOCAL 0x20 /* client on this host offers the path of its file */
+#define LOCAL_PATH_SIZE 1024
+#define SEGMENT_UDP 0x40 /* client sends the data over udp */
+#define SEGMENT_REPLICA 0x80 /* a copy forwarded down a chain of servers, 
+see _forward_begin() */
+#define DURABLE_ACK_TIMEOUT 120 /* seconds the rest of the chain may take to
+store a file */
+#define TLS_CIPHERSUITE "TLS_AES_128_GCM_SHA256" /* which kernel TLS takes over */
+#define TLS_HANDSHAKE_TIMEOUT 10 /* seconds a client may take for it */
+#define SEGMENT_LONG 0x200 /* length bytes of data follow the segment, instead of
+being in its buffer, as the client's tuning asks for */
+#define LONG_SEGMENT_MAX (2048 * BUFFER_SIZE)
+#define SEGMENT_RESUMED 0x400 /* metadata of an upload picked up again on a new
+connection of its session, whose client knows what we have of the file. In 
+our answer, when writing to a bucket, it tells what we have can't be verified */
+#define SEGMENT_FRAMED 0x800 /* length bytes of frames follow the segment, one
+per block, see struct frame */
+#define FRAME_COMPRESSED 0x1
+#define MAX_FRAMES (LONG_SEGMENT_MAX / BUFFER_SIZE)
+#define FRAMED_SEGMENT_MAX (LONG_SEGMENT_MAX + MAX_FRAMES * sizeof(struct frame))
+#define FRAMES_CORRUPT -2 /* returned by _decode_frames() */
+#define PIPELINE_MAX_WORKERS 8
+#define WRITE_QUEUE_DEPTH 4 /* decoded segments waiting to be written */
+#define SESSION_TOKEN_LENGTH 32 /* hex digits of the token of a session */
+#define MAX_SESSIONS 64
+#define SESSION_PEEK_INTERVAL 100000 /* us between looks for a resuming client
+while an upload waits for its turn */
+#define METRICS_PREFIX "fserver_"
+#define METRICS_SAMPLE_INTERVAL 100000 /* us between samples of a connection */
+#define STALL_THRESHOLD 200000 /* us without progress which count as a stall */
+#define LATENCY_BUCKETS 20 /* by powers of two of us, up to about half a second */
+#define RECENT_TRANSFERS 16 /* transfers kept for the metrics once ended */
+#define SOCKET_QUEUE_IOCTL SIOCINQ
+#define SOCKET_QUEUE_HELP "Bytes received on the connection, not read yet."
+#define TRACE_FILE_NAME "fserver_trace"
+#define TRACE_MAGIC "FTRACE1"
+#define TRACE_RING_SIZE 16384 /* records of a thread kept, a power of two */
+#define TRACE_MAX_RINGS 64
+#define TRACE_MAX_EVENTS 16
+#define TRACE_NAME_SIZE 24
+#define TRACE_CALIBRATION_NS 10000000 /* time the tsc is measured against the clock */
+
+/* verbosity of the trace, see _trace() */
+#define TRACE_OFF 0
+#define TRACE_TRANSFERS 1 /* starts and ends of transfers, and what goes wrong */
+#define TRACE_SEGMENTS 2 /* every segment and ack */
+#define TRACE_ALL 3 /* datagrams and writes too */
+
+/* events of the trace, indices of trace_events */
+#define TRACE_TRANSFER_BEGIN 0
+#define TRACE_TRANSFER_END 1
+#define TRACE_TIMEOUT 2
+#define TRACE_SEGMENT_RECEIVED 3
+#define TRACE_ACK_SENT 4
+#define TRACE_DISK_WRITE 5
+#define TRACE_DATAGRAM_RECEIVED 6
+#define TRACE_DOWNLOAD_SENT 7
+#define TRACE_SESSION_RESUMED 8
+#define SEGMENT_SWARM 0x100 /* download request of a swarm, see _answer_swarm_request() */
+#define SWARM_CHUNK_SIZE (1024 * 1024) /* grows for files of more chunks than
+the bits of a buffer */
+#define SWARM_JOIN -1 /* seq_no of a swarm request which joins the swarm */
+#define SWARM_MAX_FILES 16
+#define SWARM_MAX_PEERS 64
+#define SWARM_PEER_TIMEOUT 5 /* seconds after its last join a peer is forgotten */
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)
+#define UDP_MAX_NACKS 256 /* missing datagrams reported in one feedback */
+#define UDP_ACK_EVERY 16 /* datagrams taken in between two feedbacks */
+#define UDP_FEEDBACK_INTERVAL 5000 /* us, feedback is sent at least this often */
+#define UDP_IDLE_TIMEOUT 10000000 /* us without datagrams before giving up */
+#define UDP_LOG_INTERVAL 1000000 /* us between updates of the log */
+#define DATAGRAM_DATA 0
+#define DATAGRAM_RESENT 1
+#define DATAGRAM_PARITY 2
+#define FEC_GROUP_SIZE 16 /* max. no. of data blocks covered by one set of parity blocks */
+#define FEC_MAX_PARITY_INDEX (256 - FEC_GROUP_SIZE) /* parity blocks a group can have
+at all, see _fec_coefficient() */
+#define FEC_DECODE_FAILED -2 /* returned by _fec_decode() */
+#define MULTICAST_GROUP "239.255.60.60"
+#define MULTICAST_PORT 6063 /* distributions are taken in here */
+#define MULTICAST_MAX_NEEDS 256 /* groups reported in one report */
+#define MULTICAST_POLL_WAIT 1000 /* ms we sleep at most in between datagrams */
+#define DATAGRAM_ANNOUNCE 3 /* kinds of datagrams only a distribution has */
+#define DATAGRAM_POLL 4
+#define DATAGRAM_DONE 5
+#define REPORT_JOIN 0
+#define REPORT_STATUS 1
+#define LZ_MIN_MATCH 4
+
+/* types of the instructions which rebuild the new version of a file out of
+our old copy. Must be same as in the client. */
+#define DELTA_COPY 1
+#define DELTA_LITERAL 2
+#define DELTA_END 3
+#define DELTA_STRONG_SIZE 16
+#define DELTA_LITERAL_MAX 65536
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK 131072
+
+#define CHUNK_STORE "chunk_store" /* directory of chunks, named by their hash */
+#define CDC_MAX_CHUNK 65536
+
+#define S3_PART_SIZE (64 * MERKLE_LEAF_SIZE) /* of a multipart upload, where all
+but the last part must have 5MiB at least */
+#define S3_MAX_PARTS 10000 /* an upload may have, parts of larger files are larger */
+#define S3_PARTS_IN_FLIGHT 4 /* parts being uploaded at once, each in a buffer of its own */
+#define S3_MAX_UPLOADS 4 /* multipart uploads kept for clients which may resume them */
+#define S3_UPLOAD_ID_SIZE 160
+#define S3_ETAG_SIZE 72
+#define S3_RESPONSE_SIZE (512 * 1024) /* of the store's answer we read at most */
+#define S3_TIMEOUT 30 /* seconds the store may take to answer */
+#define S3_RETRIES 3 /* attempts at a request the store fails */
+#define S3_DEFAULT_REGION "us-east-1"
+
 struct segment {
 	int seq_no;
 	int ack_no;
+	int length;  /* no. of valid bytes in buffer */
+	int flags;   /* SEGMENT_* flags */
 	char filename[FILENAME_SIZE];
 	char filesize[FILESIZE_STRING];
 	char buffer[BUFFER_SIZE];
@@ -47,10 +213,551 @@ typedef struct log {
 	unsigned short percentage_completion;
 	unsigned int connection_count;
 	unsigned int timeout_count;
+	char upload_id[S3_UPLOAD_ID_SIZE]; /* of the unfinished multipart upload
+	of the file to the bucket, empty if there is none */
 } server_log;
 
+/* states of a download served by the event loop */
+#define DOWNLOAD_READING_REQUEST 0
+#define DOWNLOAD_SENDING_HEADER 1
+#define DOWNLOAD_SENDING_FILE 2
+#define DOWNLOAD_HANDSHAKE 3 /* with --tls, before the request */
+
+/* A download served by the event loop. The request is a segment with the
+name of the file and, in filesize, how many bytes of it the client has 
+already. The answer is a segment with the size of the file (ack_no 0 if it
+can't be served) and, in buffer, the offset from which the rest of the file
+follows. */
+#ifdef USE_KTLS
+/* traffic secrets of a TLS 1.3 connection, see _keep_tls_secret() */
+struct tls_secrets {
+	unsigned char client[EVP_MAX_MD_SIZE], server[EVP_MAX_MD_SIZE];
+	int client_length, server_length;
+};
+
+SSL_CTX * tls_context = NULL;  /* set up by --tls */
+#endif
+
+struct download {
+	int sock;
+	int fd;
+	int state;
+	struct segment request;
+	size_t request_received;
+	struct segment header;
+	size_t header_sent;
+	unsigned char * body;  /* sent after the header instead of the file */
+	long body_length, body_sent;
+	off_t offset;  /* next byte of the file to be sent */
+	long filesize; /* or where the range asked for ends */
+#ifdef USE_KTLS
+	SSL * ssl;  /* until the handshake is done */
+	struct tls_secrets secrets;
+#endif
+};
+
+/* where a peer of a swarm takes requests for chunks */
+struct swarm_peer_address {
+	struct in_addr addr;
+	int port;
+};
+
+/* The peers fetching a file, as known to us, the tracker of its swarm,
+and the SHA-256 of every chunk of the file, against which they check the 
+chunks they get from each other. */
+struct swarm {
+	char filename[FILENAME_SIZE];
+	long filesize;
+	time_t mtime;
+	long chunk_size;
+	int chunk_count;
+	unsigned char * hashes;
+	struct swarm_peer_address peers[SWARM_MAX_PEERS];
+	time_t last_seen[SWARM_MAX_PEERS];
+	int peer_count;
+};
+
+/* a query for hashes of some nodes of the server's hash tree. A query with
+count 0 ends the verification. */
+struct merkle_query {
+	int count;
+	int nodes[MERKLE_QUERY_MAX];
+};
+
+/* hash tree over the first `length` bytes of a file. Nodes are stored heap 
+ordered: root is node 1, children of node i are 2i and 2i+1 and the leaves
+start at index width. Leaves beyond leaf_count are left zeroed. */
+struct merkle_tree {
+	long length;
+	int leaf_count;
+	int width;
+	unsigned char (* nodes)[HASH_SIZE];
+};
+
+/* the buffer of a SEGMENT_HOLE segment: a range of the file which reads as
+zeros and takes no space on disk */
+struct hole_range {
+	long offset;
+	long length;
+};
+
+/* a block in a SEGMENT_FRAMED segment: this header, then length bytes of
+the block, compressed if the flags say so. The checksum is the crc32c of the
+block as it is in the file, so that it covers the decompression too. */
+struct frame {
+	int length;
+	int flags;     /* FRAME_* flags */
+	unsigned int checksum;
+};
+
+/* A bounded queue of ints which any no. of threads can push to and pop
+from without a lock (Vyukov's). Every cell carries a sequence no., which 
+tells a pusher whether the cell is free in this lap around the ring and a
+popper whether it is filled. */
+struct block_queue_cell {
+	unsigned long sequence;
+	int value;
+};
+
+struct block_queue {
+	struct block_queue_cell * cells;
+	unsigned long mask;
+	char padding_0[48];
+	unsigned long push_position;  /* each on its own cache line */
+	char padding_1[56];
+	unsigned long pop_position;
+	char padding_2[56];
+};
+
+/* a frame of the segment being decoded */
+struct frame_job {
+	struct frame frame;
+	unsigned char * data;
+	unsigned char * out;   /* where its block goes */
+	int out_length;
+	int result;            /* 1 if decoded, 0 if corrupt, -1 if malformed */
+};
+
+/* a decoded segment for the writer */
+struct pending_write {
+	int fd;                /* a dup() of that of the file, closed once written */
+	unsigned char * data;
+	long offset;
+	long length;
+};
+
+/* The stages of receiving framed segments, the mirror image of those of 
+the client's upload: the thread of the upload takes a segment off the 
+connection, the workers decompress and check its frames on as many cores as
+there are, with that thread helping, and the writer writes the decoded 
+segments in the order they came, while the next ones are received. Kept 
+from one upload to the next, as they take turns. */
+struct receive_pipeline {
+	unsigned char * payload;    /* the segment as received */
+	struct frame_job jobs[MAX_FRAMES];
+	struct block_queue queue;   /* frames to be decoded */
+	sem_t frames_queued;
+	int pending;                /* frames not decoded yet */
+	int worker_count;
+	pthread_t workers[PIPELINE_MAX_WORKERS], writer;
+	unsigned char * buffers[WRITE_QUEUE_DEPTH];  /* of the decoded segments, used in turn */
+	struct pending_write writes[WRITE_QUEUE_DEPTH];
+	unsigned long write_head, write_tail;  /* queued by the upload, written by the writer */
+	sem_t writes_queued;
+	int write_failed;           /* set by the writer, taken by _drain_writes() */
+};
+
+/* a datagram of the udp transport. seq_no numbers the blocks in the order
+they are sent, which isn't the order in the file on a resume. A parity 
+datagram covers group_size blocks, from seq_no and block on. */
+struct datagram {
+	int seq_no;
+	int block;      /* block of the file carried */
+	int total;      /* no. of data blocks of the transfer */
+	int length;
+	int kind;       /* DATAGRAM_* */
+	int group_size;
+	int parity_index;
+	long long sent_at;  /* sender's clock, echoed in the feedback */
+	char buffer[BUFFER_SIZE];
+};
+
+/* what we report to the sender of the udp transport */
+struct feedback {
+	int ack_no;     /* every seq_no below it has been received */
+	int highest;    /* highest seq_no received */
+	long long echo_sent_at;  /* sent_at of the latest datagram received */
+	int echo_seq;
+	int echo_delay; /* us that datagram waited for this feedback */
+	long delivered; /* no. of distinct datagrams received */
+	long lost;      /* no. of seq_nos up to highest whose first copy was lost */
+	int nack_count;
+	int nacks[UDP_MAX_NACKS];  /* seq_nos missing below highest */
+};
+
+/* the parity blocks received for a group of data blocks, kept until the
+group is complete. More than there are blocks in the group are no use. */
+struct fec_group {
+	int first_seq, first_block, size;
+	int parity_count;
+	unsigned char parity_index[FEC_GROUP_SIZE];
+	unsigned char * parity[FEC_GROUP_SIZE];
+};
+
+/* the buffer of a DATAGRAM_ANNOUNCE, which tells what a distribution 
+brings */
+struct multicast_file {
+	long filesize;
+	char filename[FILENAME_SIZE];
+};
+
+/* a group of blocks for which we need more parity blocks */
+struct repair_need {
+	int group;
+	int parity;
+};
+
+/* what we report to the sender of a distribution when polled */
+struct multicast_report {
+	int kind;       /* REPORT_* */
+	int round;      /* of the poll answered */
+	int missing;    /* no. of blocks we still lack */
+	int need_count;
+	struct repair_need needs[MULTICAST_MAX_NEEDS];
+};
+
+/* a distribution being taken in. A block goes by its own no., so seq_no 
+and block are the same in its datagrams. */
+struct multicast_transfer {
+	struct sockaddr_in sender;
+	char filename[FILENAME_SIZE];
+	int fd;
+	long filesize;
+	int total, missing;
+	long rebuilt;
+	unsigned char * received;
+	int * blocks;
+	struct fec_group ** groups;
+	long long last_datagram;
+};
+
+/* what a client on the same host tells about the file it uploads, so
+that we can copy it straight from its disk */
+struct local_source {
+	unsigned long dev;
+	unsigned long ino;
+	long size;
+	char path[LOCAL_PATH_SIZE];
+};
+
+/* the set of leaves hashed by one thread */
+struct hash_job {
+	int fd;
+	struct merkle_tree * tree;
+	int first_leaf;
+	int last_leaf;
+};
+
+/* the signature of one block of our copy of a file */
+struct delta_signature {
+	unsigned int weak;  /* rolling checksum */
+	unsigned char strong[DELTA_STRONG_SIZE];
+};
+
+/* sent ahead of the signatures */
+struct delta_header {
+	int block_size;
+	int block_count;
+};
+
+/* one instruction of the delta stream */
+struct delta_op {
+	int type;
+	int block;
+	int length;
+};
+
+/* a content defined chunk of a file, as offered by the client */
+struct chunk_ref {
+	unsigned char hash[HASH_SIZE];
+	int length;
+};
+
+/* the set of blocks whose signatures are computed by one thread */
+struct signature_job {
+	int fd;
+	int block_size;
+	long filesize;
+	struct delta_signature * signatures;
+	int first_block;
+	int last_block;
+};
+
+/* SHA-256 (FIPS 180-4). Written here so that the tool keeps needing nothing
+but libc and pthreads. */
+typedef struct {
+	unsigned int state[8];
+	unsigned long long bit_count;
+	unsigned char block[64];
+	unsigned int block_used;
+} sha256_ctx;
+
+const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void _sha256_transform(unsigned int * state, const unsigned char * block) {
+	unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	/* expand the 16 big endian words of the block into 64 words */
+	for(i = 0; i < 16; i++) {
+		w[i] = ((unsigned int)block[i * 4] << 24) | (block[i * 4 + 1] << 16) |
+			(block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+	for(i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] + 
+			(ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for(i = 0; i < 64; i++) {
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + 
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + 
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+};
+
+#if defined(__x86_64__)
+/* the SHA extensions of x86 do two rounds of SHA-256 in one instruction. This
+function is compiled for them whatever flags gcc is given, and is called only
+when the cpu has them. */
+__attribute__((target("sha,sse4.1")))
+void _sha256_blocks_shani(unsigned int * state, const unsigned char * data,
+	size_t block_count) {
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 
+		0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save, message, temp;
+	__m128i words[4];
+	int i;
+
+	/* the instructions want the state as ABEF and CDGH */
+	temp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+	state0 = _mm_alignr_epi8(temp, state1, 8);
+	state1 = _mm_blend_epi16(state1, temp, 0xF0);
+
+	while(block_count--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		/* 16 groups of 4 rounds. words[] holds the last 16 words of the
+		message schedule, which is extended 4 words at a time. */
+		for(i = 0; i < 16; i++) {
+			if(i < 4) {
+				words[i] = _mm_shuffle_epi8(
+					_mm_loadu_si128((const __m128i *)(data + 16 * i)), byte_swap);
+			}
+			message = _mm_add_epi32(words[i % 4], 
+				_mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			if(i >= 3 && i < 15) {
+				temp = _mm_alignr_epi8(words[i % 4], words[(i + 3) % 4], 4);
+				words[(i + 1) % 4] = _mm_add_epi32(words[(i + 1) % 4], temp);
+				words[(i + 1) % 4] = _mm_sha256msg2_epu32(words[(i + 1) % 4], 
+					words[i % 4]);
+			}
+			message = _mm_shuffle_epi32(message, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+			if(i >= 1 && i < 13) {
+				words[(i + 3) % 4] = _mm_sha256msg1_epu32(words[(i + 3) % 4], 
+					words[i % 4]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += 64;
+	}
+
+	/* back to ABCD and EFGH */
+	temp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(temp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, temp, 8);
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+};
+
+int _cpu_has_sha_extensions() {
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+		return 0;
+	}
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (ebx >> 29) & 1;  /* SHA bit */
+};
+#endif
+
+/* hashes whole 64 byte blocks, with the SHA extensions when the cpu has them */
+void _sha256_blocks(unsigned int * state, const unsigned char * data, 
+	size_t block_count) {
+#if defined(__x86_64__)
+	static int has_sha_extensions = -1;
+
+	if(has_sha_extensions == -1) {
+		has_sha_extensions = _cpu_has_sha_extensions();
+	}
+	if(has_sha_extensions) {
+		_sha256_blocks_shani(state, data, block_count);
+		return;
+	}
+#endif
+	while(block_count--) {
+		_sha256_transform(state, data);
+		data += 64;
+	}
+};
+
+void _sha256_init(sha256_ctx * ctx) {
+	ctx->state[0] = 0x6a09e667; ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372; ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f; ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab; ctx->state[7] = 0x5be0cd19;
+	ctx->bit_count = 0;
+	ctx->block_used = 0;
+};
+
+void _sha256_update(sha256_ctx * ctx, const unsigned char * data, size_t len) {
+	ctx->bit_count += (unsigned long long)len * 8;
+
+	/* fill up a partially filled block first */
+	while(len > 0 && ctx->block_used != 0) {
+		ctx->block[ctx->block_used++] = *data++;
+		len--;
+		if(ctx->block_used == 64) {
+			_sha256_transform(ctx->state, ctx->block);
+			ctx->block_used = 0;
+		}
+	}
+	/* then hash whole blocks straight out of the caller's buffer */
+	_sha256_blocks(ctx->state, data, len / 64);
+	data += len & ~(size_t)63;
+	len &= 63;
+	memcpy(ctx->block, data, len);
+	ctx->block_used = len;
+};
+
+void _sha256_final(sha256_ctx * ctx, unsigned char * digest) {
+	unsigned long long bit_count = ctx->bit_count;
+	int i;
+
+	/* pad with a single 1 bit, zeros and the message length in bits */
+	ctx->block[ctx->block_used++] = 0x80;
+	if(ctx->block_used > 56) {
+		memset(ctx->block + ctx->block_used, 0, 64 - ctx->block_used);
+		_sha256_transform(ctx->state, ctx->block);
+		ctx->block_used = 0;
+	}
+	memset(ctx->block + ctx->block_used, 0, 56 - ctx->block_used);
+	for(i = 0; i < 8; i++) {
+		ctx->block[63 - i] = bit_count >> (i * 8);
+	}
+	_sha256_transform(ctx->state, ctx->block);
+
+	for(i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+};
+
+void _sha256(const unsigned char * data, size_t len, unsigned char * digest) {
+	sha256_ctx ctx;
+	_sha256_init(&ctx);
+	_sha256_update(&ctx, data, len);
+	_sha256_final(&ctx, digest);
+};
+
+/* CRC-32C (Castagnoli), the checksum of a block in a frame. The cpu does it
+eight bytes at a time with SSE4.2, the table is for those without. */
+unsigned int crc32c_table[256];
+int crc32c_has_sse42 = 0;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int _crc32c_sse42(unsigned int crc, const unsigned char * data, size_t length) {
+	unsigned long long crc64 = crc, word;
+
+	for(; length >= 8; data += 8, length -= 8) {
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+	for(; length > 0; data++, length--) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+};
+#endif
+
+/* called before there are threads to checksum with */
+void _crc32c_init() {
+	unsigned int crc;
+	int i, bit;
+
+	for(i = 0; i < 256; i++) {
+		crc = i;
+		for(bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	crc32c_has_sse42 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+};
+
+unsigned int _crc32c(const unsigned char * data, size_t length) {
+	unsigned int crc = 0xffffffff;
+
+#if defined(__x86_64__)
+	if(crc32c_has_sse42) return ~_crc32c_sse42(crc, data, length);
+#endif
+	for(; length > 0; data++, length--) {
+		crc = crc32c_table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+};
+
 char * _get_current_date_time() {
-	char date_time[18];
+	static char date_time[18]; /* static, as we return it to the caller */
 
 	time_t time_now = time(NULL); /* get the no. of second since epoch in time_now */  
 	/* now get struct tm pointer from localtime based on seconds since epoch */
@@ -63,31 +770,37 @@ char * _get_current_date_time() {
 	return date_time;
 };
 
-/*A wrapper function to send log file to client */
-void sendlog(FILE * log, int sock_fd, int filesize) {
+/*A wrapper function to send log file to client. Returns 0 if the 
+connection failed. */
+int sendlog(FILE * log, int sock_fd, int filesize) {
 	char buffer[BUFFER_SIZE];
 	int read_bytes, send_bytes;
 	int remaining_bytes = filesize;
 	while(remaining_bytes > 0) {
 		read_bytes = fread(buffer, sizeof(char), sizeof(buffer), log);
-		send_bytes = send(sock_fd, buffer, read_bytes, 0);
+		send_bytes = send(sock_fd, buffer, read_bytes, MSG_NOSIGNAL);
 		if(send_bytes < 0) {
 			perror("Sending Log");
-			exit(EXIT_FAILURE);
+			return 0;
 		}
 
 		remaining_bytes -= read_bytes;
 	}
+	return 1;
 };
 
-/* A wrapper to receive log file from client*/
-void recvlog(FILE * log, int sock_fd, int filesize) {
+/* A wrapper to receive log file from client. Returns 0 if the connection
+failed before the whole log came. */
+int recvlog(FILE * log, int sock_fd, int filesize) {
 	char buffer[BUFFER_SIZE];
-	int wrote_bytes, recvd_bytes;
+	int wrote_bytes, recvd_bytes = 0;
 	int remaining_bytes = filesize;
 
 	while(remaining_bytes > 0) {
-		recvd_bytes = recv(sock_fd, buffer, sizeof(buffer), 0);
+		/* no more than the log, as what follows it may have come too */
+		recvd_bytes = recv(sock_fd, buffer, (remaining_bytes < (int)sizeof(buffer)) ? 
+			remaining_bytes : (int)sizeof(buffer), 0);
+		if(recvd_bytes <= 0) break;
 		wrote_bytes = fwrite(buffer, sizeof(char), recvd_bytes, log);
 
 		remaining_bytes -= wrote_bytes;
@@ -95,27 +808,214 @@ void recvlog(FILE * log, int sock_fd, int filesize) {
 
 	if(recvd_bytes < 0) {
 		perror("Receiving log");
+	}
+	return remaining_bytes <= 0;
+};
+
+/* whether a log has records of the layout we write, as its first line tells */
+int _is_current_log(FILE * fp) {
+	char line[BUFFER_SIZE];
+	int current;
+
+	fseek(fp, 0L, SEEK_SET);
+	current = fgets(line, sizeof(line), fp) != NULL && strstr(line, LOG_VERSION) != NULL;
+	fseek(fp, 0L, SEEK_SET);
+	return current;
+};
+
+/* Records of the logs of older builds, which wrote no version. Sizes had 11
+digits before sparse files were sent and names 72 bytes before subdirectories
+were synced. The builds which streamed into a bucket already wrote the 
+record we write now, upload id and all. */
+struct log_record_v0 {
+	char filename[72];
+	char filesize[11];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+};
+
+struct log_record_v0_long_sizes {
+	char filename[72];
+	char filesize[21];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+};
+
+struct log_record_v0_long_names {
+	char filename[256];
+	char filesize[21];
+	char start_time[18];
+	char end_time[18];
+	unsigned long bytes_transferred;
+	unsigned short percentage_completion;
+	unsigned int connection_count;
+	unsigned int timeout_count;
+};
+
+#define OLD_LOG_LAYOUTS 4
+
+/* Takes the fields of an old record into one of ours. Returns 0 if they 
+don't look like a record, which tells the layouts apart where their sizes 
+don't. */
+int _take_old_record(server_log * record, const char * filename, int filename_size, 
+	const char * filesize, int filesize_size, const char * start_time, 
+	const char * end_time, unsigned long bytes_transferred, 
+	unsigned short percentage_completion, unsigned int connection_count,
+	unsigned int timeout_count) {
+	if(filename[0] == '\0' || memchr(filename, '\0', filename_size) == NULL ||
+		memchr(filesize, '\0', filesize_size) == NULL || 
+		strspn(filesize, "0123456789") != strlen(filesize) ||
+		memchr(start_time, '\0', 18) == NULL || memchr(end_time, '\0', 18) == NULL ||
+		percentage_completion > 100) {
+		return 0;
+	}
+	memset(record, 0, sizeof(server_log));
+	strcpy(record->filename, filename);
+	strcpy(record->filesize, filesize);
+	strcpy(record->start_time, start_time);
+	strcpy(record->end_time, end_time);
+	record->bytes_transferred = bytes_transferred;
+	record->percentage_completion = percentage_completion;
+	record->connection_count = connection_count;
+	record->timeout_count = timeout_count;
+	return 1;
+};
+
+/* converts the old record at data, of the given layout, returning 0 if it
+isn't a record of that layout */
+int _convert_old_record(int layout, const unsigned char * data, server_log * record) {
+	struct log_record_v0 v0;
+	struct log_record_v0_long_sizes long_sizes;
+	struct log_record_v0_long_names long_names;
+	server_log current;
+
+	switch(layout) {
+		case 0:
+			memcpy(&current, data, sizeof(current));
+			if(memchr(current.upload_id, '\0', S3_UPLOAD_ID_SIZE) == NULL) return 0;
+			if(!_take_old_record(record, current.filename, sizeof(current.filename), 
+				current.filesize, sizeof(current.filesize), current.start_time,
+				current.end_time, current.bytes_transferred, 
+				current.percentage_completion, current.connection_count, 
+				current.timeout_count)) {
+				return 0;
+			}
+			strcpy(record->upload_id, current.upload_id);
+			return 1;
+		case 1:
+			memcpy(&long_names, data, sizeof(long_names));
+			return _take_old_record(record, long_names.filename, sizeof(long_names.filename), 
+				long_names.filesize, sizeof(long_names.filesize), long_names.start_time,
+				long_names.end_time, long_names.bytes_transferred, 
+				long_names.percentage_completion, long_names.connection_count, 
+				long_names.timeout_count);
+		case 2:
+			memcpy(&long_sizes, data, sizeof(long_sizes));
+			return _take_old_record(record, long_sizes.filename, sizeof(long_sizes.filename), 
+				long_sizes.filesize, sizeof(long_sizes.filesize), long_sizes.start_time,
+				long_sizes.end_time, long_sizes.bytes_transferred, 
+				long_sizes.percentage_completion, long_sizes.connection_count, 
+				long_sizes.timeout_count);
+		default:
+			memcpy(&v0, data, sizeof(v0));
+			return _take_old_record(record, v0.filename, sizeof(v0.filename), 
+				v0.filesize, sizeof(v0.filesize), v0.start_time, v0.end_time, 
+				v0.bytes_transferred, v0.percentage_completion, v0.connection_count, 
+				v0.timeout_count);
+	}
+};
+
+void _write_log_header(FILE * fp) {
+	fprintf(fp, "File(s) to be received: " LOG_VERSION "\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "---------------------------------------------------------");
+	fprintf(fp, "---------------------------------------------------------\n");
+	fprintf(fp, "Filename \t\t\t\t Filesize \t Start Time \t\t Bytes Transferred\t"); 
+	fprintf(fp, "%% Completed \t End Time \t\t No. of Connections \t No. of Timeouts");
+	fprintf(fp, "\n---------------------------------------------------------");
+	fprintf(fp, "---------------------------------------------------------\n");
+};
+
+/* Converts the log of an older build, which has no version, into a new 
+one, finding its layout by which of them its records fit. A log of a
+layout we don't know is only set aside, with a warning, as the uploads in
+it are then started afresh. The old log is kept beside the new one. */
+FILE * _migrate_old_log(FILE * fp) {
+	size_t sizes[OLD_LOG_LAYOUTS] = {sizeof(server_log), 
+		sizeof(struct log_record_v0_long_names), sizeof(struct log_record_v0_long_sizes),
+		sizeof(struct log_record_v0)};
+	unsigned char * data;
+	server_log * records;
+	long start, length, count = -1, i;
+	int layout, lines = 0, ch;
+
+	fseek(fp, 0L, SEEK_SET);
+	while(lines < FILE_RECORD_LINE_NUMBER - 1 && (ch = getc(fp)) != EOF) {
+		if(ch == '\n') lines++;
+	}
+	start = ftell(fp);
+	fseek(fp, 0L, SEEK_END);
+	length = ftell(fp) - start;
+	data = (unsigned char *)malloc(length + 1);
+	fseek(fp, start, SEEK_SET);
+	length = fread(data, 1, length, fp);
+	fclose(fp);
+
+	records = (server_log *)malloc((length / sizeof(struct log_record_v0) + 1) * 
+		sizeof(server_log));
+	for(layout = 0; layout < OLD_LOG_LAYOUTS && count < 0; layout++) {
+		if(length % sizes[layout] != 0) continue;
+		count = length / sizes[layout];
+		for(i = 0; i < count; i++) {
+			if(!_convert_old_record(layout, data + i * sizes[layout], &records[i])) {
+				count = -1;
+				break;
+			}
+		}
+	}
+	free(data);
+
+	rename(LOGFILE_NAME, LOGFILE_NAME ".old");
+	if(count < 0) {
+		printf("\n%s was written by an older fserver, in a layout we can't read. It was "
+			"kept as %s.old, and a new log is started.\n", LOGFILE_NAME, LOGFILE_NAME);
+		count = 0;
+	}
+	else {
+		printf("\nConverted %ld record(s) of %s, written by an older fserver. The old log "
+			"was kept as %s.old.\n", count, LOGFILE_NAME, LOGFILE_NAME);
+	}
+	fp = fopen(LOGFILE_NAME, "w+");
+	if(fp == NULL) {
+		perror(LOGFILE_NAME);
 		exit(EXIT_FAILURE);
 	}
+	_write_log_header(fp);
+	fwrite(records, sizeof(server_log), count, fp);
+	fflush(fp);
+	free(records);
+	return fp;
 };
 
 FILE * _initialise_log() {
 	FILE * fp = fopen(LOGFILE_NAME, "r+");  /*try reading the log file */
 	if(fp != NULL) {    /* if opened then return */
+		if(!_is_current_log(fp)) fp = _migrate_old_log(fp);
 		return fp;
 	}
     // else log file doesnot exist. Hence, create it.
 	fp = fopen(LOGFILE_NAME, "w+");  /* mode is w+. we want to read and write both */ 
 	
 	/* Now we initialise the content of log file */
-	fprintf(fp, "File(s) to be received:\n");
-	fprintf(fp, "\n");
-	fprintf(fp, "---------------------------------------------------------");
-	fprintf(fp, "---------------------------------------------------------\n");
-	fprintf(fp, "Filename \t\t\t\t Filesize \t Start Time \t\t Bytes Transferred\t"); 
-	fprintf(fp, "%% Completed \t End Time \t\t No. of Connections \t No. of Timeouts");
-	fprintf(fp, "\n---------------------------------------------------------");
-	fprintf(fp, "---------------------------------------------------------\n");
+	_write_log_header(fp);
 	fflush(fp);
 	return fp;
 };
@@ -139,95 +1039,914 @@ int recv_with_timeout(int sock_fd, struct segment *buffer, size_t size, int time
 	if(return_val == -1) return -1;
 	if(return_val == 0) return TIMEOUT_OCCURED;
 
-	return recv(sock_fd, buffer, size, 0);
+	/* MSG_WAITALL as a segment can arrive split across several tcp reads */
+	return recv(sock_fd, buffer, size, MSG_WAITALL);
 };
 
 /*utility function to get file size */
-int _get_file_size(FILE * fp) {
-	int size;
+long _get_file_size(FILE * fp) {
+	long size;
 	fseek(fp, 0L, SEEK_END);
 	size = ftell(fp);
 	fseek(fp, 0L, SEEK_SET);
 	return size;
 };
 
+/* A wrapper for send() which doesn't return until all of the data is sent.
+Returns 0 if the connection failed, which the next recv() on it finds too,
+so callers waiting for an answer don't have to check. */
+int send_all(int sock_fd, void * data, size_t size) {
+	char * position = data;
+	ssize_t sent_bytes;
 
-/*this utlitity function helps to move seek to aspecified line number*/
-void _goto_line_num_in_file(FILE * fp, int linenum) {
-	fseek(fp, 0, SEEK_SET);  /* reset the files seek to beginning */
-	int linecount = 1;
-	long char_count = 0;
-	char ch;
-	/* loop through the file content until we reach the desired line or EOF*/
-	while(linecount != linenum && ((ch = getc(fp)) != EOF)) {
-		char_count++;  /*keeps record of bytes being read so that we can seek 
-		to that position */
-		if(ch == '\n') {  /* if we get a newline character we've got a new line */
-			linecount++;
+	while(size > 0) {
+		sent_bytes = send(sock_fd, position, size, MSG_NOSIGNAL);
+		if(sent_bytes < 0) {
+			perror("Sending");
+			return 0;
 		}
-
+		position += sent_bytes;
+		size -= sent_bytes;
 	}
-	/*we come out of loop when we reach the sepcified line number or EOF */
-	fseek(fp, char_count, SEEK_SET); /* finally seek to the desired byte number 
-	which is the starting byte of our desired line number*/
+	return 1;
 };
 
+#ifdef USE_KTLS
+/* Keeps the traffic secrets of a TLS 1.3 connection, which OpenSSL hands 
+to its key log callback, so that the keys for the kernel can be derived 
+from them once the handshake is done. */
+void _keep_tls_secret(const SSL * ssl, const char * line) {
+	struct tls_secrets * secrets = (struct tls_secrets *)SSL_get_app_data(ssl);
+	char label[64], hex[2 * EVP_MAX_MD_SIZE + 1];
+	unsigned char * secret;
+	int * length, i;
 
-/* this functions helps to replace the content  of a specifed line number
- which a provided string or stream of characters */
-void _replace_line(FILE *fp, int linenum, char * new_content) {
-	fseek(fp, 0, SEEK_SET); /*seek to beginning of file*/
-	FILE * temp = fopen("tmp", "w"); /* create a temporary file*/
-	int linecount = 1;
-	char ch;
-	while((ch = getc(fp)) != EOF) {  /* we copy the entire content of original
-	file to this temp file, except for the line where replacement has to be done */
-		putc(ch, temp);
-		if(ch == '\n') {
-				linecount++;
-		}
-		if(linecount == linenum) { /* when we reach the desired line */
-			fprintf(temp, "%s", new_content); /* we put provided new content at 
-			this line */
-			while(((ch = getc(fp)) != '\n') && (ch != EOF)); /* and we skip all the 
-			bytes of this line in the original file*/
-			fseek(fp, -1, SEEK_CUR); /* we seek back one position so that we 
-			can also put the newline character in temp file and update newline variable
-			so that it can't match our desired line number in next iterations*/
-		}
+	if(secrets == NULL || sscanf(line, "%63s %*s %128s", label, hex) != 2) return;
+	if(strcmp(label, "CLIENT_TRAFFIC_SECRET_0") == 0) {
+		secret = secrets->client;
+		length = &secrets->client_length;
 	}
-	fclose(temp);
-	fclose(fp);
-	remove(LOGFILE_NAME);   /* delete the original file */
-	rename("tmp", LOGFILE_NAME); /* rename the temp file to name of original file. now
-	 this is our updated original file*/
-	fp = fopen(LOGFILE_NAME, "r+"); /*we reopen this updated original file 
-	so that we can further manipulate it */
-}
+	else if(strcmp(label, "SERVER_TRAFFIC_SECRET_0") == 0) {
+		secret = secrets->server;
+		length = &secrets->server_length;
+	}
+	else return;
 
-char * _get_line_as_string(FILE * file, int linenum) {
+	*length = strlen(hex) / 2;
+	for(i = 0; i < *length; i++) sscanf(hex + 2 * i, "%2hhx", &secret[i]);
+	OPENSSL_cleanse(hex, sizeof(hex));
+};
 
-	_goto_line_num_in_file(file, linenum);  /* bring sek to the specified linenum*/
-	
-	char * linestring;
-	char ch;
-	int line_length = 0; /* for storing number of character in line 2*/
-	while((ch = getc(file)) != '\n') { /* read line till the end of line */
-		line_length++;
-	} 
+/* HKDF-Expand-Label of TLS 1.3 with SHA-256 and no context, for no more 
+than one hash of output */
+void _tls13_expand_label(const unsigned char * secret, int secret_length, 
+	const char * label, unsigned char * out, int length) {
+	unsigned char info[64], block[EVP_MAX_MD_SIZE];
+	unsigned int block_length;
+	int label_length = strlen(label), n = 0;
+
+	info[n++] = length >> 8;
+	info[n++] = length & 0xff;
+	info[n++] = 6 + label_length;
+	memcpy(info + n, "tls13 ", 6);
+	n += 6;
+	memcpy(info + n, label, label_length);
+	n += label_length;
+	info[n++] = 0;  /* empty context */
+	info[n++] = 1;  /* the first block of HKDF-Expand is all we need */
+	HMAC(EVP_sha256(), secret, secret_length, info, n, block, &block_length);
+	memcpy(out, block, length);
+	OPENSSL_cleanse(block, sizeof(block));
+};
+
+/* puts the key of one direction into the kernel, record numbers from 0 */
+int _install_tls_key(int sock_fd, int direction, const unsigned char * secret, int length) {
+	struct tls12_crypto_info_aes_gcm_128 info;
+	unsigned char iv[TLS_CIPHER_AES_GCM_128_SALT_SIZE + TLS_CIPHER_AES_GCM_128_IV_SIZE];
+	int result;
+
+	memset(&info, 0, sizeof(info));
+	info.info.version = TLS_1_3_VERSION;
+	info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+	_tls13_expand_label(secret, length, "key", info.key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+	_tls13_expand_label(secret, length, "iv", iv, sizeof(iv));
+	memcpy(info.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+	memcpy(info.iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+
+	result = setsockopt(sock_fd, SOL_TLS, direction, &info, sizeof(info));
+	OPENSSL_cleanse(&info, sizeof(info));
+	OPENSSL_cleanse(iv, sizeof(iv));
+	return result;
+};
+
+/* Hands the connection over to kernel TLS once the handshake is done. The
+kernel then encrypts and decrypts every record with AES-GCM (AES-NI where 
+the cpu has it), and send(), recv() and sendfile() keep working on the 
+socket as they do in clear text. Returns 0 if the kernel can't. */
+int _enter_kernel_tls(int sock_fd, struct tls_secrets * secrets, int is_client) {
+	int ok;
+
+	if(secrets->client_length == 0 || secrets->server_length == 0) return 0;
+	ok = setsockopt(sock_fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 &&
+		_install_tls_key(sock_fd, TLS_TX, is_client ? secrets->client : secrets->server,
+			is_client ? secrets->client_length : secrets->server_length) == 0 &&
+		_install_tls_key(sock_fd, TLS_RX, is_client ? secrets->server : secrets->client,
+			is_client ? secrets->server_length : secrets->client_length) == 0;
+	OPENSSL_cleanse(secrets, sizeof(struct tls_secrets));
+	return ok;
+};
+
+/* Creates the context of our TLS connections, with our certificate and 
+its key. Only TLS 1.3 with AES-128-GCM is accepted, as the kernel takes 
+that over, and no session tickets are sent after the handshake, as the 
+kernel would take them for data. */
+void _create_tls_context(char * certificate, char * key) {
+	tls_context = SSL_CTX_new(TLS_server_method());
+	if(tls_context == NULL ||
+		!SSL_CTX_set_min_proto_version(tls_context, TLS1_3_VERSION) ||
+		!SSL_CTX_set_ciphersuites(tls_context, TLS_CIPHERSUITE) ||
+		!SSL_CTX_set_num_tickets(tls_context, 0) ||
+		SSL_CTX_use_certificate_chain_file(tls_context, certificate) != 1 ||
+		SSL_CTX_use_PrivateKey_file(tls_context, key, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(tls_context) != 1) {
+		ERR_print_errors_fp(stderr);
+		printf("\nCan't set up TLS with %s and %s.\n", certificate, key);
+		exit(EXIT_FAILURE);
+	}
+	SSL_CTX_clear_options(tls_context, SSL_OP_ENABLE_MIDDLEBOX_COMPAT);
+	SSL_CTX_set_keylog_callback(tls_context, _keep_tls_secret);
+};
+
+/* Does the TLS 1.3 handshake with a client which connected for an upload,
+in user space, and leaves the encryption of the connection to the kernel 
+from then on. Returns 0 if the connection can't be used. Nothing happens
+without --tls. */
+int _start_tls(int sock_fd) {
+	struct tls_secrets secrets = {0};
+	struct timeval timeout = {TLS_HANDSHAKE_TIMEOUT, 0}, none = {0, 0};
+	SSL * ssl;
+	int ok;
+
+	if(tls_context == NULL) return 1;
+	/* a client which doesn't go on mustn't hold the thread forever */
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	ssl = SSL_new(tls_context);
+	SSL_set_app_data(ssl, &secrets);
+	SSL_set_fd(ssl, sock_fd);
+	ok = SSL_accept(ssl) == 1;
+	if(!ok) {
+		printf("\nTLS handshake with the client failed.\n");
+	}
+	else if(!(ok = _enter_kernel_tls(sock_fd, &secrets, 0))) {
+		perror("Kernel TLS (is the tls module loaded?)");
+	}
+	/* the socket isn't closed with it */
+	SSL_free(ssl);
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+	return ok;
+};
+
+/* Moves on the handshake of a download, on its non-blocking socket. 
+Returns 1 once the kernel has taken over, 0 while the handshake waits for 
+the socket and -1 if it failed. */
+int _continue_tls_handshake(struct download * download) {
+	int result = SSL_accept(download->ssl), error;
+
+	if(result != 1) {
+		error = SSL_get_error(download->ssl, result);
+		if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+		printf("\nTLS handshake of a download failed.\n");
+		return -1;
+	}
+	if(!_enter_kernel_tls(download->sock, &download->secrets, 0)) {
+		perror("Kernel TLS (is the tls module loaded?)");
+		return -1;
+	}
+	SSL_free(download->ssl);
+	download->ssl = NULL;
+	return 1;
+};
+#else
+int _start_tls(int sock_fd) {
+	/* built without kernel TLS, connections are in clear text */
+	(void)sock_fd;
+	return 1;
+};
+#endif
+
+/* utility function which tells on how many threads the hashing of 
+a file should be spread */
+int _get_hashing_thread_count(int leaf_count) {
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(threads > MAX_HASH_THREADS) threads = MAX_HASH_THREADS;
+	if(threads > leaf_count) threads = leaf_count;
+	if(threads < 1) threads = 1;
+	return threads;
+};
+
+/* Returns where the hole of a sparse file which starts at `offset` ends,
+limited to `limit`. If there is data at `offset` that is `offset` itself.
+Filesystems without SEEK_DATA report the whole file as data. */
+long _get_hole_end(int fd, long offset, long limit) {
+	off_t data = lseek(fd, offset, SEEK_DATA);
+
+	if(data < 0 || data > limit) {
+		/* ENXIO means there is no data after offset at all */
+		return (data < 0 && errno != ENXIO) ? offset : limit;
+	}
+	return data;
+};
+
+/* thread routine which hashes a contiguous set of leaves of the tree */
+void * _hash_leaves(void * arg) {
+	struct hash_job * job = (struct hash_job *)arg;
+	struct merkle_tree * tree = job->tree;
+	unsigned char * leaf_data = (unsigned char *)malloc(MERKLE_LEAF_SIZE);
+	long offset, leaf_length;
+	ssize_t read_bytes, got;
+	unsigned char zero_hash[HASH_SIZE];
+	int leaf, have_zero_hash = 0;
+
+	for(leaf = job->first_leaf; leaf < job->last_leaf; leaf++) {
+		offset = (long)leaf * MERKLE_LEAF_SIZE;
+		leaf_length = tree->length - offset;
+		if(leaf_length > MERKLE_LEAF_SIZE) leaf_length = MERKLE_LEAF_SIZE;
+
+		/* a leaf inside a hole of a sparse file reads as zeros, and every 
+		full one of them has the same hash, so it is only computed once */
+		if(_get_hole_end(job->fd, offset, offset + leaf_length) == offset + leaf_length) {
+			if(leaf_length == MERKLE_LEAF_SIZE && have_zero_hash) {
+				memcpy(tree->nodes[tree->width + leaf], zero_hash, HASH_SIZE);
+				continue;
+			}
+			memset(leaf_data, 0, leaf_length);
+			_sha256(leaf_data, leaf_length, tree->nodes[tree->width + leaf]);
+			if(leaf_length == MERKLE_LEAF_SIZE) {
+				memcpy(zero_hash, tree->nodes[tree->width + leaf], HASH_SIZE);
+				have_zero_hash = 1;
+			}
+			continue;
+		}
+
+		/* pread() as all the threads share the same file descriptor. If
+		the file is shorter than expected we hash whatever is there and the 
+		leaf will simply not match. */
+		got = 0;
+		while(got < leaf_length) {
+			read_bytes = pread(job->fd, leaf_data + got, leaf_length - got,
+				offset + got);
+			if(read_bytes <= 0) break;
+			got += read_bytes;
+		}
+		_sha256(leaf_data, got, tree->nodes[tree->width + leaf]);
+	}
+
+	free(leaf_data);
+	return NULL;
+};
+
+/* builds the hash tree over the first `length` bytes of the file. Leaves are
+hashed in parallel on all cores, inner nodes are cheap and are done here. */
+void _build_merkle_tree(int fd, long length, struct merkle_tree * tree) {
+	pthread_t threads[MAX_HASH_THREADS];
+	struct hash_job jobs[MAX_HASH_THREADS];
+	unsigned char pair[2 * HASH_SIZE];
+	int thread_count, i, node;
+
+	tree->length = length;
+	tree->leaf_count = (length + MERKLE_LEAF_SIZE - 1) / MERKLE_LEAF_SIZE;
+	tree->width = 1;
+	while(tree->width < tree->leaf_count) tree->width *= 2;
+	tree->nodes = calloc(2 * tree->width, HASH_SIZE);
+	if(tree->nodes == NULL) {
+		perror("Hash tree");
+		exit(EXIT_FAILURE);
+	}
+
+	thread_count = _get_hashing_thread_count(tree->leaf_count);
+	for(i = 0; i < thread_count; i++) {
+		jobs[i].fd = fd;
+		jobs[i].tree = tree;
+		jobs[i].first_leaf = (long)tree->leaf_count * i / thread_count;
+		jobs[i].last_leaf = (long)tree->leaf_count * (i + 1) / thread_count;
+		if(pthread_create(&threads[i], NULL, _hash_leaves, &jobs[i]) != 0) {
+			perror("Hashing thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* every inner node is the hash of its two children */
+	for(node = tree->width - 1; node >= 1; node--) {
+		memcpy(pair, tree->nodes[2 * node], HASH_SIZE);
+		memcpy(pair + HASH_SIZE, tree->nodes[2 * node + 1], HASH_SIZE);
+		_sha256(pair, sizeof(pair), tree->nodes[node]);
+	}
+};
+
+/* rsync's rolling checksum of a block. Must be same as in the client. */
+unsigned int _weak_checksum(const unsigned char * data, int length) {
+	unsigned int a = 0, b = 0;
+	int i;
+
+	for(i = 0; i < length; i++) {
+		a += data[i];
+		b += (unsigned int)(length - i) * data[i];
+	}
+	return (a & 0xffff) | ((b & 0xffff) << 16);
+};
+
+/* the block size of the delta is about the square root of the file size, 
+like in rsync, which keeps both the signatures and the amount of data resent
+around a changed byte small */
+int _get_delta_block_size(long filesize) {
+	long block_size = DELTA_MIN_BLOCK;
+
+	while(block_size < DELTA_MAX_BLOCK && block_size * block_size < filesize) {
+		block_size += 8;
+	}
+	return block_size;
+};
+
+/* thread routine which computes the signatures of a set of blocks */
+void * _compute_signatures(void * arg) {
+	struct signature_job * job = (struct signature_job *)arg;
+	unsigned char * block_data = (unsigned char *)malloc(job->block_size);
+	unsigned char strong[HASH_SIZE];
+	long offset;
+	ssize_t read_bytes;
+	int block, length;
+
+	for(block = job->first_block; block < job->last_block; block++) {
+		offset = (long)block * job->block_size;
+		length = (job->filesize - offset < job->block_size) ? 
+			job->filesize - offset : job->block_size;
+		read_bytes = pread(job->fd, block_data, length, offset);
+		if(read_bytes < 0) read_bytes = 0;
+
+		job->signatures[block].weak = _weak_checksum(block_data, read_bytes);
+		_sha256(block_data, read_bytes, strong);
+		memcpy(job->signatures[block].strong, strong, DELTA_STRONG_SIZE);
+	}
+
+	free(block_data);
+	return NULL;
+};
+
+/* computes the signatures of every block of our copy on all cores and 
+sends them to the client */
+int _send_signatures(int sock_fd, int fd, long filesize) {
+	pthread_t threads[MAX_HASH_THREADS];
+	struct signature_job jobs[MAX_HASH_THREADS];
+	struct delta_header header;
+	int thread_count, i;
+
+	header.block_size = _get_delta_block_size(filesize);
+	header.block_count = (filesize + header.block_size - 1) / header.block_size;
+	struct delta_signature * signatures = 
+		malloc((header.block_count + 1) * sizeof(struct delta_signature));
+
+	thread_count = _get_hashing_thread_count(header.block_count);
+	for(i = 0; i < thread_count; i++) {
+		jobs[i].fd = fd;
+		jobs[i].block_size = header.block_size;
+		jobs[i].filesize = filesize;
+		jobs[i].signatures = signatures;
+		jobs[i].first_block = (long)header.block_count * i / thread_count;
+		jobs[i].last_block = (long)header.block_count * (i + 1) / thread_count;
+		if(pthread_create(&threads[i], NULL, _compute_signatures, &jobs[i]) != 0) {
+			perror("Hashing thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	send_all(sock_fd, &header, sizeof(header));
+	send_all(sock_fd, signatures, header.block_count * sizeof(struct delta_signature));
+	free(signatures);
+
+	return header.block_size;
+};
+
+/* Rebuilds the new version of the file from the delta sent by the client, 
+out of the blocks of our old copy and the literal bytes. The new version is
+written beside the old one and replaces it only if its hash matches the
+client's. Returns 1 on success. */
+int _receive_delta(int sock_fd, FILE * old_file, long old_size, int block_size,
+	char * filename, long new_size) {
+	char temp_name[FILENAME_SIZE + 8];
+	struct delta_op op;
+	sha256_ctx ctx;
+	unsigned char digest[HASH_SIZE], expected[HASH_SIZE];
+	int buffer_size = (block_size > DELTA_LITERAL_MAX) ? block_size : DELTA_LITERAL_MAX;
+	unsigned char * data = (unsigned char *)malloc(buffer_size);
+	int block_count = (old_size + block_size - 1) / block_size;
+	long written = 0, offset;
+	int length, i, ok = 0;
+
+	sprintf(temp_name, "%s.delta", filename);
+	FILE * new_file = fopen(temp_name, "w");
+	if(new_file == NULL) {
+		perror("Delta file");
+		free(data);
+		return 0;
+	}
+	_sha256_init(&ctx);
+
+	while(recv(sock_fd, &op, sizeof(op), MSG_WAITALL) == sizeof(op)) {
+		if(op.type == DELTA_COPY) {
+			if(op.block < 0 || op.length <= 0 || op.block + op.length > block_count) {
+				break;
+			}
+			for(i = op.block; i < op.block + op.length; i++) {
+				offset = (long)i * block_size;
+				length = (old_size - offset < block_size) ? old_size - offset : block_size;
+				if(pread(fileno(old_file), data, length, offset) != length) break;
+				fwrite(data, sizeof(char), length, new_file);
+				_sha256_update(&ctx, data, length);
+				written += length;
+			}
+			if(i != op.block + op.length) break;
+		}
+		else if(op.type == DELTA_LITERAL) {
+			if(op.length <= 0 || op.length > DELTA_LITERAL_MAX) break;
+			if(recv(sock_fd, data, op.length, MSG_WAITALL) != op.length) break;
+			fwrite(data, sizeof(char), op.length, new_file);
+			_sha256_update(&ctx, data, op.length);
+			written += op.length;
+		}
+		else if(op.type == DELTA_END) {
+			if(recv(sock_fd, expected, HASH_SIZE, MSG_WAITALL) != HASH_SIZE) break;
+			_sha256_final(&ctx, digest);
+			ok = (written == new_size) && memcmp(digest, expected, HASH_SIZE) == 0;
+			break;
+		}
+		else {
+			break;
+		}
+	}
+
+	fclose(new_file);
+	free(data);
+	if(ok) {
+		rename(temp_name, filename);
+	}
+	else {
+		remove(temp_name);
+	}
+	return ok;
+};
+
+/* path of a chunk in the store: chunk_store/<first byte>/<whole hash> in hex.
+The extra level keeps the directories from growing too large. */
+void _get_chunk_path(unsigned char * hash, char * path) {
+	char hex[2 * HASH_SIZE + 1];
+	int i;
+
+	for(i = 0; i < HASH_SIZE; i++) {
+		sprintf(hex + 2 * i, "%02x", hash[i]);
+	}
+	sprintf(path, "%s/%.2s/%s", CHUNK_STORE, hex, hex);
+};
+
+/* reads the part of a length of a compressed block above 15 */
+const unsigned char * _lz_read_length(const unsigned char * in, 
+	const unsigned char * end, int * length) {
+	unsigned char byte;
+
+	do {
+		if(in >= end) return NULL;
+		byte = *in++;
+		*length += byte;
+	} while(byte == 255);
+	return in;
+};
+
+/* Decompresses a block compressed by the client (LZ4 style sequences of a
+token, literals, a 2 byte offset and a match length). Every length and offset is checked,
+as the input comes from the network. Returns the decompressed size or -1. */
+int _lz_decompress(const unsigned char * src, int src_length, unsigned char * dst,
+	int dst_capacity) {
+	const unsigned char * ip = src, * end = src + src_length;
+	unsigned char * op = dst, * op_end = dst + dst_capacity;
+	int token, length, offset;
+
+	while(ip < end) {
+		token = *ip++;
+
+		length = token >> 4;
+		if(length == 15 && (ip = _lz_read_length(ip, end, &length)) == NULL) return -1;
+		if(length > end - ip || length > op_end - op) return -1;
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+
+		if(ip == end) break;  /* the last sequence has no match */
+
+		if(end - ip < 2) return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op - dst) return -1;
+
+		length = token & 15;
+		if(length == 15 && (ip = _lz_read_length(ip, end, &length)) == NULL) return -1;
+		length += LZ_MIN_MATCH;
+		if(length > op_end - op) return -1;
+		while(length-- > 0) {  /* byte by byte, as the match may overlap */
+			*op = *(op - offset);
+			op++;
+		}
+	}
+	return op - dst;
+};
+
+/* Turns a range of the file into a hole. Where the filesystem can't punch
+holes the range is written with zeros, which reads the same. Returns 0 if
+that fails. */
+int _punch_hole(int fd, long offset, long length) {
+	char zeros[BUFFER_SIZE] = {0};
+	long size = lseek(fd, 0, SEEK_END);
+	ssize_t wrote;
+
+	if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+		return 1;
+	}
+	/* beyond the end of the file there is nothing to clear, the final
+	ftruncate() leaves a hole there anyway */
+	if(offset + length > size) length = size - offset;
+	while(length > 0) {
+		wrote = pwrite(fd, zeros, (length > BUFFER_SIZE) ? BUFFER_SIZE : length, offset);
+		if(wrote <= 0) {
+			perror("Writing file");
+			return 0;
+		}
+		offset += wrote;
+		length -= wrote;
+	}
+	return 1;
+};
+
+/* copies `length` bytes from in_fd to out_fd inside the kernel, falling back
+to read()/write() where copy_file_range() isn't supported */
+int _copy_fd(int in_fd, int out_fd, long length) {
+	char buffer[BUFFER_SIZE];
+	ssize_t copied;
+
+	while(length > 0) {
+		copied = copy_file_range(in_fd, NULL, out_fd, NULL, length, 0);
+		if(copied <= 0) break;
+		length -= copied;
+	}
+	while(length > 0) {
+		copied = read(in_fd, buffer, (length > BUFFER_SIZE) ? BUFFER_SIZE : length);
+		if(copied <= 0 || write(out_fd, buffer, copied) != copied) return -1;
+		length -= copied;
+	}
+	return 0;
+};
+
+/* Finds the uid owning the client end of a connection from this host, by
+looking the client's socket up in /proc/net/tcp. Returns -1 if not found. */
+long _get_peer_uid(int sock_fd) {
+	struct sockaddr_in peer, own;
+	socklen_t len = sizeof(peer);
+	unsigned int local_addr, local_port, remote_addr, remote_port;
+	unsigned long uid;
+	char line[512];
+	long found = -1;
+
+	if(getpeername(sock_fd, (struct sockaddr *)&peer, &len) < 0) return -1;
+	len = sizeof(own);
+	if(getsockname(sock_fd, (struct sockaddr *)&own, &len) < 0) return -1;
+
+	FILE * tcp_table = fopen("/proc/net/tcp", "r");
+	if(tcp_table == NULL) return -1;
+	fgets(line, sizeof(line), tcp_table); /* skipping the header */
+	while(found < 0 && fgets(line, sizeof(line), tcp_table)) {
+		/* addresses are printed as the raw 32 bit value, ports in host order */
+		if(sscanf(line, "%*d: %x:%x %x:%x %*x %*x:%*x %*x:%*x %*x %lu",
+			&local_addr, &local_port, &remote_addr, &remote_port, &uid) != 5) {
+			continue;
+		}
+		if(local_addr == peer.sin_addr.s_addr && local_port == ntohs(peer.sin_port) &&
+			remote_addr == own.sin_addr.s_addr && remote_port == ntohs(own.sin_port)) {
+			found = uid;
+		}
+	}
+	fclose(tcp_table);
+	return found;
+};
+
+/* Opens the file a client on this host pointed us to. It has to be the very
+file the client described, and be owned by the user running the client, or
+else anybody could have us copy files they can't read themselves. */
+int _open_local_source(int sock_fd, struct local_source * source, long filesize) {
+	struct sockaddr_in peer, own;
+	socklen_t len = sizeof(peer);
+	struct stat file_stat;
+	long uid;
+	int fd;
+
+	if(getpeername(sock_fd, (struct sockaddr *)&peer, &len) < 0) return -1;
+	len = sizeof(own);
+	if(getsockname(sock_fd, (struct sockaddr *)&own, &len) < 0) return -1;
+	if(peer.sin_addr.s_addr != own.sin_addr.s_addr) return -1;
+
+	source->path[LOCAL_PATH_SIZE - 1] = '\0';
+	if(source->path[0] != '/' || source->size != filesize) return -1;
+	uid = _get_peer_uid(sock_fd);
+	if(uid < 0) return -1;
+
+	fd = open(source->path, O_RDONLY | O_NOFOLLOW);
+	if(fd < 0) return -1;
+	if(fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) ||
+		file_stat.st_dev != source->dev || file_stat.st_ino != source->ino ||
+		file_stat.st_size != filesize || file_stat.st_uid != (uid_t)uid) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+};
+
+/* Copies the file of a client on this host into place. It is cloned where
+the filesystem shares extents between files, else copied inside the kernel.
+Returns 1 on success. */
+int _copy_local_file(int source_fd, char * filename, long filesize) {
+	char temp_name[FILENAME_SIZE + 8];
+	int out_fd, copied = 0;
+
+	sprintf(temp_name, "%s.local", filename);
+	out_fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out_fd < 0) {
+		perror("File Creation");
+		return 0;
+	}
+	if(ioctl(out_fd, FICLONE, source_fd) == 0) {
+		printf("\nCloned %s from the client's copy.\n", filename);
+		copied = 1;
+	}
+	else if(_copy_fd(source_fd, out_fd, filesize) == 0) {
+		printf("\nCopied %s from the client's copy.\n", filename);
+		copied = 1;
+	}
+	if(copied && fsync(out_fd) < 0) copied = 0;
+	close(out_fd);
+
+	if(copied) {
+		rename(temp_name, filename);
+	}
+	else {
+		remove(temp_name);
+	}
+	return copied;
+};
+
+/* Receives the list of chunks of a file and answers with a bitmap of those 
+missing in the store, receives them into the store and then assembles the 
+file out of the store. Returns 1 on success. */
+int _receive_deduplicated(int sock_fd, char * filename, long filesize) {
+	char path[sizeof(CHUNK_STORE) + 2 * HASH_SIZE + 8];
+	char temp_path[sizeof(path) + 8];
+	char temp_name[FILENAME_SIZE + 8];
+	unsigned char digest[HASH_SIZE];
+	unsigned char * needed, * data;
+	struct chunk_ref * chunks;
+	struct stat chunk_stat;
+	int * requested; /* open addressing table of chunks already asked for */
+	int chunk_count, table_size = 1, i, slot, fd, out_fd, ok = 1;
+	long total = 0, reused = 0;
+
+	if(recv(sock_fd, &chunk_count, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+		chunk_count <= 0 || chunk_count > filesize) {
+		return 0;
+	}
+	chunks = malloc(chunk_count * sizeof(struct chunk_ref));
+	if(recv(sock_fd, chunks, chunk_count * sizeof(struct chunk_ref), MSG_WAITALL) !=
+		chunk_count * sizeof(struct chunk_ref)) {
+		free(chunks);
+		return 0;
+	}
+	for(i = 0; i < chunk_count; i++) {
+		if(chunks[i].length <= 0 || chunks[i].length > CDC_MAX_CHUNK) ok = 0;
+		total += chunks[i].length;
+	}
+	if(!ok || total != filesize) {
+		free(chunks);
+		return 0;
+	}
+
+	/* a chunk is needed if it isn't in the store and hasn't been asked 
+	for already, as a file may contain the same chunk several times */
+	mkdir(CHUNK_STORE, 0755);
+	while(table_size < 2 * chunk_count) table_size *= 2;
+	requested = (int *)malloc(table_size * sizeof(int));
+	memset(requested, -1, table_size * sizeof(int));
+	needed = (unsigned char *)calloc((chunk_count + 7) / 8, 1);
+
+	for(i = 0; i < chunk_count; i++) {
+		/* a stored chunk of another length than the one hashed is damaged,
+		and is asked for again */
+		_get_chunk_path(chunks[i].hash, path);
+		if(stat(path, &chunk_stat) == 0 && chunk_stat.st_size == chunks[i].length) {
+			reused += chunks[i].length;
+			continue;
+		}
+		memcpy(&slot, chunks[i].hash, sizeof(int));
+		slot &= table_size - 1;
+		while(requested[slot] != -1 && 
+			memcmp(chunks[requested[slot]].hash, chunks[i].hash, HASH_SIZE) != 0) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if(requested[slot] == -1) {
+			requested[slot] = i;
+			needed[i / 8] |= 1 << (i % 8);
+		}
+	}
+	send_all(sock_fd, needed, (chunk_count + 7) / 8);
+
+	/* receive the missing chunks. Each one is checked against its hash and 
+	is renamed into the store only once it is complete. */
+	data = (unsigned char *)malloc(CDC_MAX_CHUNK);
+	for(i = 0; i < chunk_count; i++) {
+		if(!(needed[i / 8] & (1 << (i % 8)))) continue;
+
+		if(recv(sock_fd, data, chunks[i].length, MSG_WAITALL) != chunks[i].length) {
+			ok = 0;
+			break;
+		}
+		_sha256(data, chunks[i].length, digest);
+		if(memcmp(digest, chunks[i].hash, HASH_SIZE) != 0) {
+			printf("\nReceived a chunk which doesn't match its hash.\n");
+			ok = 0;
+			break;
+		}
+
+		_get_chunk_path(chunks[i].hash, path);
+		sprintf(temp_path, "%.*s", (int)(strrchr(path, '/') - path), path);
+		mkdir(temp_path, 0755);
+		sprintf(temp_path, "%s.tmp", path);
+		fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0 || write(fd, data, chunks[i].length) != chunks[i].length) {
+			perror("Chunk store");
+			ok = 0;
+			break;
+		}
+		close(fd);
+		rename(temp_path, path);
+	}
+	free(data);
+
+	/* now every chunk is in the store and the file is put together */
+	if(ok) {
+		sprintf(temp_name, "%s.dedup", filename);
+		out_fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(out_fd < 0) {
+			perror("File Creation");
+			ok = 0;
+		}
+		for(i = 0; ok && i < chunk_count; i++) {
+			_get_chunk_path(chunks[i].hash, path);
+			fd = open(path, O_RDONLY);
+			if(fd < 0 || _copy_fd(fd, out_fd, chunks[i].length) < 0) {
+				perror("Assembling file");
+				ok = 0;
+			}
+			if(fd >= 0) close(fd);
+		}
+		if(out_fd >= 0) {
+			close(out_fd);
+			if(ok) {
+				rename(temp_name, filename);
+			}
+			else {
+				remove(temp_name);
+			}
+		}
+	}
+
+	if(ok) {
+		printf("\n%d chunks, %ld of %ld Bytes were already in the store.\n",
+			chunk_count, reused, filesize);
+	}
+	free(chunks);
+	free(requested);
+	free(needed);
+	return ok;
+};
+
+/* Answers the queries of the client, which walks down our hash tree to find 
+the parts of the file which don't match its own copy. Returns 0 if the 
+client went away meanwhile. */
+int _answer_merkle_queries(int sock_fd, struct merkle_tree * tree) {
+	struct merkle_query query;
+	unsigned char hashes[MERKLE_QUERY_MAX][HASH_SIZE];
+	int i, node;
+
+	while(1) {
+		if(recv(sock_fd, &query, sizeof(query), MSG_WAITALL) != sizeof(query)) {
+			printf("\nConnection lost while verifying the partial upload.\n");
+			return 0;
+		}
+		if(query.count <= 0) break; /* client has found what it wanted */
+		if(query.count > MERKLE_QUERY_MAX) query.count = MERKLE_QUERY_MAX;
+
+		for(i = 0; i < query.count; i++) {
+			node = query.nodes[i];
+			if(node >= 1 && node < 2 * tree->width) {
+				memcpy(hashes[i], tree->nodes[node], HASH_SIZE);
+			}
+			else {
+				memset(hashes[i], 0, HASH_SIZE);
+			}
+		}
+		send_all(sock_fd, hashes, query.count * HASH_SIZE);
+	}
+	return 1;
+};
+
+
+/*this utlitity function helps to move seek to aspecified line number*/
+void _goto_line_num_in_file(FILE * fp, int linenum) {
+	fseek(fp, 0, SEEK_SET);  /* reset the files seek to beginning */
+	int linecount = 1;
+	long char_count = 0;
+	int ch;
+	/* loop through the file content until we reach the desired line or EOF*/
+	while(linecount != linenum && ((ch = getc(fp)) != EOF)) {
+		char_count++;  /*keeps record of bytes being read so that we can seek 
+		to that position */
+		if(ch == '\n') {  /* if we get a newline character we've got a new line */
+			linecount++;
+		}
+
+	}
+	/*we come out of loop when we reach the sepcified line number or EOF */
+	fseek(fp, char_count, SEEK_SET); /* finally seek to the desired byte number 
+	which is the starting byte of our desired line number*/
+};
+
+
+/* this functions helps to replace the content  of a specifed line number
+ which a provided string or stream of characters. As the log file is 
+ replaced by a new one, the caller must use the returned file pointer. */
+FILE * _replace_line(FILE *fp, int linenum, char * new_content) {
+	fseek(fp, 0, SEEK_SET); /*seek to beginning of file*/
+	FILE * temp = fopen("tmp", "w"); /* create a temporary file*/
+	int linecount = 1;
+	int ch; /* an int, so that a 0xff byte in a record isn't mistaken for EOF */
+	while((ch = getc(fp)) != EOF) {  /* we copy the entire content of original
+	file to this temp file, except for the line where replacement has to be done */
+		putc(ch, temp);
+		if(ch == '\n') {
+				linecount++;
+		}
+		if(linecount == linenum) { /* when we reach the desired line */
+			fprintf(temp, "%s", new_content); /* we put provided new content at 
+			this line */
+			while(((ch = getc(fp)) != '\n') && (ch != EOF)); /* and we skip all the 
+			bytes of this line in the original file*/
+			fseek(fp, -1, SEEK_CUR); /* we seek back one position so that we 
+			can also put the newline character in temp file and update newline variable
+			so that it can't match our desired line number in next iterations*/
+		}
+	}
+	fclose(temp);
+	fclose(fp);
+	rename("tmp", LOGFILE_NAME); /* rename the temp file to name of original file,
+	which replaces it in one step, so that the downloads never miss the log. 
+	now this is our updated original file*/
+	return fopen(LOGFILE_NAME, "r+"); /*we reopen this updated original file 
+	so that we can further manipulate it */
+}
+
+char * _get_line_as_string(FILE * file, int linenum) {
+
+	_goto_line_num_in_file(file, linenum);  /* bring sek to the specified linenum*/
+	
+	char * linestring;
+	int ch;
+	int line_length = 0; /* for storing number of character in line 2*/
+	while((ch = getc(file)) != '\n') { /* read line till the end of line */
+		line_length++;
+	} 
 	/* now we have no. of character in the line. So we can allocate a memory
 	sufficient to hold this line and then store the line in a string */
 
-	linestring = (char *)malloc(line_length);
+	linestring = (char *)malloc(line_length + 1); /* one more for '\0' */
 	_goto_line_num_in_file(file, linenum);  /* we again position the seek to the
 	beginning of the specified */
-	fgets(linestring, line_length, file); /*we store line content into linestring*/
+	fgets(linestring, line_length + 1, file); /*we store line content into linestring*/
 
 	return linestring;
 }
 
 /* This function syncs the files-to-be-uploded data in server log with client log*/
-void _sync_uncommon_files_with_client_log(FILE * server_log, FILE * client_log) {
+FILE * _sync_uncommon_files_with_client_log(FILE * server_log, FILE * client_log) {
 
 	/* seek to line 2 of client log, because at this line files-to-be-uploaded list 
 	is recorded. then read the content of this line which will serve as new content
@@ -235,11 +1954,11 @@ void _sync_uncommon_files_with_client_log(FILE * server_log, FILE * client_log)
 	char * new_content = _get_line_as_string(client_log, 2);
 	/* we do the replacement of line 2 in server with the content 
 	extracted from line 2 of client log*/
-	_replace_line(server_log, 2, new_content);
+	return _replace_line(server_log, 2, new_content);
 };
 
 void _update_transfer_progress_in_log(server_log * log_entry, char * f_name,
-	unsigned int bytes_transferred, short percentage, FILE * log_file,
+	unsigned long bytes_transferred, short percentage, FILE * log_file,
 	short flag) {
 	
 	server_log temp;
@@ -259,6 +1978,7 @@ void _update_transfer_progress_in_log(server_log * log_entry, char * f_name,
 			log_entry->percentage_completion = temp.percentage_completion;
 			strcpy(log_entry->end_time, temp.end_time);
 			log_entry->timeout_count = temp.timeout_count;	
+			strcpy(log_entry->upload_id, temp.upload_id);
 
 			/* then we update particular entries bvased on flag*/
 			if(flag == UPDATE_LOG_TIMEOUT) {
@@ -268,14 +1988,34 @@ void _update_transfer_progress_in_log(server_log * log_entry, char * f_name,
 				log_entry->bytes_transferred = bytes_transferred;
 				log_entry->percentage_completion = percentage;
 				strcpy(log_entry->end_time, _get_current_date_time());	
+				log_entry->upload_id[0] = '\0';
 			}
 			else if (flag == UPDATE_LOG_PROGRESS){
+				/* 100 is left for the end of the file being acked, as
+				every byte of it can be acked and it still fail to be stored */
 				log_entry->bytes_transferred = bytes_transferred;
-				log_entry->percentage_completion = percentage;
+				log_entry->percentage_completion = (percentage < 100) ? percentage : 99;
 			}
 			else if(flag == UPDATE_LOG_CONNECTION_COUNT) {
 				log_entry->connection_count = temp.connection_count + 1;
 			}
+			else if(flag == UPDATE_LOG_NEW_VERSION) {
+				/* here bytes_transferred carries the new size of the file */
+				sprintf(log_entry->filesize, "%lu", bytes_transferred);
+				strcpy(log_entry->start_time, _get_current_date_time());
+				strcpy(log_entry->end_time, "\0");
+				log_entry->bytes_transferred = 0;
+				log_entry->percentage_completion = 0;
+				log_entry->upload_id[0] = '\0';
+			}
+			else if(flag == UPDATE_LOG_APPENDED) {
+				/* the file is complete again, at its new size, which is
+				carried by bytes_transferred */
+				sprintf(log_entry->filesize, "%lu", bytes_transferred);
+				log_entry->bytes_transferred = bytes_transferred;
+				log_entry->percentage_completion = 100;
+				strcpy(log_entry->end_time, _get_current_date_time());
+			}
 			
 			/* seek to the beginning of record */
 			fseek(log_file, -1 * sizeof(server_log), SEEK_CUR);
@@ -288,10 +2028,28 @@ void _update_transfer_progress_in_log(server_log * log_entry, char * f_name,
 	}
 };
 
-/* the function initialises all fields of server log structure with initial
-information about file being received*/
-short _initialise_log_entry_for_file(server_log * log_entry, char * f_name, 
-	char * f_size, FILE * log_file, long int * bytes_uploaded) {
+/* keeps the id of the multipart upload of a file to the bucket in its log
+record, where it is found again when the upload is resumed on a new
+connection, or after we were restarted */
+void _record_upload_id_in_log(FILE * log_file, char * f_name, char * upload_id) {
+	server_log temp;
+
+	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+	while(fread(&temp, sizeof(server_log), 1, log_file)) {
+		if(strcmp(temp.filename, f_name) == 0) {
+			strcpy(temp.upload_id, upload_id);
+			fseek(log_file, -1 * sizeof(server_log), SEEK_CUR);
+			fwrite(&temp, sizeof(server_log), 1, log_file);
+			fflush(log_file);
+			break;
+		}
+	}
+};
+
+/* the function initialises all fields of server log structure with initial
+information about file being received*/
+short _initialise_log_entry_for_file(server_log * log_entry, char * f_name, 
+	char * f_size, FILE * log_file, long int * bytes_uploaded) {
 
 	/*first we move to part from where structure entry has to start */
 	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
@@ -319,365 +2077,3926 @@ short _initialise_log_entry_for_file(server_log * log_entry, char * f_name,
 	log_entry->percentage_completion = 0;
 	log_entry->connection_count = 1;
 	log_entry->timeout_count = 0;
+	log_entry->upload_id[0] = '\0';
 
 	/* seek log file to the last */
 	fseek(log_file, 0, SEEK_END);
 	/* make the entry */
 	fwrite(log_entry, sizeof(server_log), 1, log_file);
+
+	return FRESH_UPLOAD;
+};
+
+/* an utility function to remove a substring from string. (Just one ocurrance) 
+used when we have to remove the successfully uploaded file from the list
+of files to be uploaded.*/
+char * _remove_from_string(char * string, char *substring) {
+	int len = strlen(substring);
+	char * temp; 
+
+	if(len > 0) {
+		temp = strstr(string, substring);
+
+		if(temp != NULL) {
+			memmove(temp, temp + len, strlen(len + temp) + 1);
+		}
+	}
+	return string;
+};
+
+FILE * _update_file_to_be_received_list(FILE * server_log, char * filename) {
+	/*we will first read line 2 as string and remove the 
+		current filename from this string. then we will replace line 2 of the 
+		server log file with this new string.*/
+	char * line = _get_line_as_string(server_log, 2);
+	char * entry = malloc(strlen(filename) + 4);
+	char * updated_line;
+
+	/* the list holds 'name'<TAB> entries, which are removed as a whole */
+	sprintf(entry, "'%s'\t", filename);
+	updated_line = _remove_from_string(line, entry);
+	free(entry);
+
+	server_log = _replace_line(server_log, 2, updated_line);
+	free(line);
+	return server_log;
+};
+
+/* files of our own in our directory, which no client may write or read */
+const char * own_files[] = {LOGFILE_NAME, RECEIVED_LOG, "tmp", TRACE_FILE_NAME, NULL};
+
+/* Files come with their path relative to the client's directory. A path
+must stay inside ours: no absolute paths and no ".." components. Nor may it
+lead to our own files, or into the chunk store, where a chunk is trusted to
+hold what its name says. */
+int _is_safe_path(const char * path) {
+	const char * component;
+	int i;
+
+	if(path[0] == '\0' || path[0] == '/') return 0;
+	while(strncmp(path, "./", 2) == 0) {
+		path += 2;
+		while(*path == '/') path++;
+	}
+	for(i = 0; own_files[i] != NULL; i++) {
+		if(strcmp(path, own_files[i]) == 0) return 0;
+	}
+	if(strncmp(path, CHUNK_STORE, strlen(CHUNK_STORE)) == 0 && 
+		(path[strlen(CHUNK_STORE)] == '/' || path[strlen(CHUNK_STORE)] == '\0')) {
+		return 0;
+	}
+	component = path;
+	while(component != NULL) {
+		if(strncmp(component, "..", 2) == 0 && 
+			(component[2] == '/' || component[2] == '\0')) {
+			return 0;
+		}
+		component = strchr(component, '/');
+		if(component != NULL) component++;
+	}
+	return 1;
+};
+
+/* creates the directories on the path of a file which don't exist yet.
+Returns 0 if one can't be created, e.g. as a file is in its place. */
+int _make_parent_dirs(const char * path) {
+	char dir[FILENAME_SIZE];
+	char * slash;
+
+	strcpy(dir, path);
+	for(slash = strchr(dir, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			perror("Creating directory");
+			return 0;
+		}
+		*slash = '/';
+	}
+	return 1;
+};
+
+void printlog(FILE * log_file) {
+	int ch;
+	int linenum = 1;
+	fseek(log_file, 0 ,SEEK_SET);
+
+	while((ch = getc(log_file)) != EOF) {
+		if(ch == '\n') {
+			linenum++;
+		}
+		printf("%c", ch);
+		if(linenum == FILE_RECORD_LINE_NUMBER) {
+			break;
+		}
+	}
+	server_log log_entry;
+	char * endtime;
+	while(fread((&log_entry), sizeof(server_log), 1, log_file)) {
+		if(strcmp(log_entry.end_time, "\0") == 0) {
+			endtime = "NA";
+		}
+		else {
+			endtime = log_entry.end_time;
+		}
+		printf("%-35s\t%-15s\t%-20s\t%-20lu\t%i%%\t%20s\t%20lu\t%20lu\n", 
+			log_entry.filename,
+			log_entry.filesize,
+			log_entry.start_time,
+			log_entry.bytes_transferred,
+			log_entry.percentage_completion,
+			endtime,
+			log_entry.connection_count,
+			log_entry.timeout_count);
+	}
+};
+
+/* prints a string as a JSON string */
+void _print_json_string(const char * string) {
+	putchar('"');
+	for(; *string; string++) {
+		if(*string == '"' || *string == '\\') printf("\\%c", *string);
+		else if((unsigned char)*string < 0x20) printf("\\u%04x", *string);
+		else putchar(*string);
+	}
+	putchar('"');
+};
+
+/* prints the 'name'<TAB> entries of the list at line 2 of the log as a 
+JSON array */
+void _print_json_file_list(FILE * log_file) {
+	char * line = _get_line_as_string(log_file, 2), * name, * end;
+	int first = 1;
+
+	putchar('[');
+	for(name = strchr(line, '\''); name != NULL && (end = strstr(name + 1, "'\t")) != NULL;
+		name = strchr(end + 2, '\'')) {
+		*end = '\0';
+		if(!first) printf(", ");
+		_print_json_string(name + 1);
+		first = 0;
+	}
+	putchar(']');
+	free(line);
+};
+
+/* Prints the log as JSON, for our monitoring: the files still to be received and 
+the record of every file. */
+void printlog_json(FILE * log_file) {
+	server_log log_entry;
+	int first = 1;
+
+	printf("{\"to_be_received\": ");
+	_print_json_file_list(log_file);
+	printf(", \"files\": [");
+	_goto_line_num_in_file(log_file, FILE_RECORD_LINE_NUMBER);
+	while(fread(&log_entry, sizeof(server_log), 1, log_file)) {
+		printf("%s\n  {\"filename\": ", first ? "" : ",");
+		_print_json_string(log_entry.filename);
+		printf(", \"filesize\": %ld, \"start_time\": ", atol(log_entry.filesize));
+		_print_json_string(log_entry.start_time);
+		printf(", \"end_time\": ");
+		if(log_entry.end_time[0] == '\0') printf("null");
+		else _print_json_string(log_entry.end_time);
+		printf(", \"bytes_transferred\": %lu, \"percentage_completed\": %u, "
+			"\"connections\": %u, \"timeouts\": %u", log_entry.bytes_transferred, 
+			log_entry.percentage_completion, log_entry.connection_count, 
+			log_entry.timeout_count);
+		printf(", \"upload_id\": ");
+		if(log_entry.upload_id[0] == '\0') printf("null");
+		else _print_json_string(log_entry.upload_id);
+		printf("}");
+		first = 0;
+	}
+	printf("\n]}\n");
+};
+
+/* Receives the bytes appended to a file we have completely and writes them
+behind our copy, in the order they are sent. They are on the disk before
+the client gets its final ack, which it takes as its checkpoint. Returns 1
+if the copy has grown to filesize, 0 if not and -1 on a malformed segment. */
+int _receive_appended(int sock_fd, FILE * file, long offset, long filesize) {
+	struct segment segment, ack = {0};
+	unsigned char block[BUFFER_SIZE], * data;
+	int length, fd = fileno(file);
+
+	while(recv_with_timeout(sock_fd, &segment, sizeof(segment), 30) > 0) {
+		if(segment.seq_no == END_OF_FILE_SEQ) {
+			if(offset != filesize) return 0;
+			if(fdatasync(fd) < 0) {
+				perror("Syncing file");
+				return 0;
+			}
+			return 1;
+		}
+
+		if(segment.length <= 0 || segment.length > BUFFER_SIZE) return -1;
+		data = (unsigned char *)segment.buffer;
+		length = segment.length;
+		if(segment.flags & SEGMENT_COMPRESSED) {
+			length = _lz_decompress(data, length, block, sizeof(block));
+			if(length < 0) return -1;
+			data = block;
+		}
+		if(offset + length > filesize) return -1;
+		if(pwrite(fd, data, length, offset) != length) {
+			perror("Writing file");
+			return 0;
+		}
+		offset += length;
+
+		ack.seq_no = segment.seq_no;
+		ack.ack_no = segment.seq_no + 1;
+		send_all(sock_fd, &ack, sizeof(ack));
+	}
+	return -1;
+};
+
+/* arithmetic in GF(2^8), with the polynomial 0x11d, for the reed-solomon
+parity of the udp transport */
+unsigned char gf_exp[512], gf_log[256];
+
+void _gf_init() {
+	static int initialised = 0;
+	int i, x = 1;
+
+	if(initialised) return;
+	for(i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if(x & 0x100) x ^= 0x11d;
+	}
+	initialised = 1;
+};
+
+unsigned char _gf_mul(unsigned char a, unsigned char b) {
+	if(a == 0 || b == 0) return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+};
+
+unsigned char _gf_inv(unsigned char a) {
+	return gf_exp[255 - gf_log[a]];
+};
+
+/* Coefficient of data block i of a group in its parity block j. They form a
+cauchy matrix, of which every square submatrix can be inverted, so that any
+as many parity blocks as there are blocks missing give those back. */
+unsigned char _fec_coefficient(int parity_index, int data_index) {
+	return _gf_inv((FEC_GROUP_SIZE + parity_index) ^ data_index);
+};
+
+#if defined(__x86_64__)
+/* PSHUFB looks up 16 bytes at once in a table of 16. A product in GF(2^8)
+is the sum of the products of the low and of the high nibble, so it takes
+two lookups in tables made for the coefficient. Returns the bytes done. */
+__attribute__((target("ssse3")))
+int _gf_mul_add_ssse3(unsigned char * dst, const unsigned char * src, 
+	unsigned char coef, int length) {
+	unsigned char low[16], high[16];
+	__m128i low_table, high_table, data, product;
+	__m128i mask = _mm_set1_epi8(0x0f);
+	int i;
+
+	for(i = 0; i < 16; i++) {
+		low[i] = _gf_mul(coef, i);
+		high[i] = _gf_mul(coef, i << 4);
+	}
+	low_table = _mm_loadu_si128((__m128i *)low);
+	high_table = _mm_loadu_si128((__m128i *)high);
+	for(i = 0; i + 16 <= length; i += 16) {
+		data = _mm_loadu_si128((__m128i *)(src + i));
+		product = _mm_xor_si128(
+			_mm_shuffle_epi8(low_table, _mm_and_si128(data, mask)),
+			_mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(data, 4), mask)));
+		_mm_storeu_si128((__m128i *)(dst + i), 
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(dst + i)), product));
+	}
+	return i;
+};
+
+int _cpu_has_ssse3() {
+	unsigned int eax, ebx, ecx, edx;
+
+	return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3);
+};
+#endif
+
+/* dst += coef * src in GF(2^8), with PSHUFB when the cpu has it */
+void _gf_mul_add(unsigned char * dst, const unsigned char * src, 
+	unsigned char coef, int length) {
+	int i = 0;
+
+	if(coef == 0) return;
+#if defined(__x86_64__)
+	static int has_ssse3 = -1;
+
+	if(has_ssse3 == -1) {
+		has_ssse3 = _cpu_has_ssse3();
+	}
+	if(has_ssse3) {
+		i = _gf_mul_add_ssse3(dst, src, coef, length);
+	}
+#endif
+	for(; i < length; i++) {
+		dst[i] ^= _gf_mul(coef, src[i]);
+	}
+};
+
+/* inverts the n x n matrix a, which is destroyed on the way, by gauss-jordan
+elimination. Returns 0 if it can't be inverted. */
+int _gf_invert_matrix(unsigned char * a, unsigned char * inverse, int n) {
+	int row, col, pivot, k;
+	unsigned char factor, temp;
+
+	memset(inverse, 0, n * n);
+	for(k = 0; k < n; k++) inverse[k * n + k] = 1;
+
+	for(col = 0; col < n; col++) {
+		for(pivot = col; pivot < n && a[pivot * n + col] == 0; pivot++);
+		if(pivot == n) return 0;
+		for(k = 0; k < n && pivot != col; k++) {
+			temp = a[pivot * n + k]; a[pivot * n + k] = a[col * n + k]; a[col * n + k] = temp;
+			temp = inverse[pivot * n + k]; inverse[pivot * n + k] = inverse[col * n + k]; 
+			inverse[col * n + k] = temp;
+		}
+		factor = _gf_inv(a[col * n + col]);
+		for(k = 0; k < n; k++) {
+			a[col * n + k] = _gf_mul(a[col * n + k], factor);
+			inverse[col * n + k] = _gf_mul(inverse[col * n + k], factor);
+		}
+		for(row = 0; row < n; row++) {
+			factor = a[row * n + col];
+			if(row == col || factor == 0) continue;
+			for(k = 0; k < n; k++) {
+				a[row * n + k] ^= _gf_mul(factor, a[col * n + k]);
+				inverse[row * n + k] ^= _gf_mul(factor, inverse[col * n + k]);
+			}
+		}
+	}
+	return 1;
+};
+
+/* keeps a parity block which came in for a group, creating the group */
+struct fec_group * _add_parity(struct fec_group ** groups, struct datagram * datagram) {
+	struct fec_group * group = groups[datagram->seq_no];
+	int i;
+
+	if(group == NULL) {
+		group = (struct fec_group *)calloc(1, sizeof(struct fec_group));
+		group->first_seq = datagram->seq_no;
+		group->first_block = datagram->block;
+		group->size = datagram->group_size;
+		groups[datagram->seq_no] = group;
+	}
+	if(group->first_block != datagram->block || group->size != datagram->group_size) {
+		return NULL;
+	}
+	for(i = 0; i < group->parity_count; i++) {
+		if(group->parity_index[i] == datagram->parity_index) return group;
+	}
+	if(group->parity_count == FEC_GROUP_SIZE) return group;
+	group->parity[group->parity_count] = (unsigned char *)malloc(BUFFER_SIZE);
+	memcpy(group->parity[group->parity_count], datagram->buffer, BUFFER_SIZE);
+	group->parity_index[group->parity_count++] = datagram->parity_index;
+	return group;
+};
+
+/* the group with parity blocks which a data block belongs to, if any */
+struct fec_group * _find_group(struct fec_group ** groups, int seq_no) {
+	int first;
+
+	for(first = seq_no; first >= 0 && first > seq_no - FEC_GROUP_SIZE; first--) {
+		if(groups[first] != NULL && groups[first]->first_seq + groups[first]->size > seq_no) {
+			return groups[first];
+		}
+	}
+	return NULL;
+};
+
+void _free_fec_group(struct fec_group ** groups, struct fec_group * group) {
+	int i;
+
+	groups[group->first_seq] = NULL;
+	for(i = 0; i < group->parity_count; i++) free(group->parity[i]);
+	free(group);
+};
+
+/* Rebuilds the missing blocks of a group once there are as many parity 
+blocks as blocks missing. The blocks received are read back from the file,
+their share taken out of the parity blocks, which leaves a system of 
+equations in the missing blocks alone. Returns the no. of blocks rebuilt,
+-1 if the group is still incomplete, or FEC_DECODE_FAILED if the file 
+can't be read or written. */
+int _fec_decode(struct fec_group * group, unsigned char * received, int * blocks,
+	int fd, long filesize) {
+	unsigned char block[BUFFER_SIZE], rebuilt[BUFFER_SIZE];
+	unsigned char matrix[FEC_GROUP_SIZE * FEC_GROUP_SIZE];
+	unsigned char inverse[FEC_GROUP_SIZE * FEC_GROUP_SIZE];
+	int missing[FEC_GROUP_SIZE], missing_count = 0, i, r, c, length;
+	long offset;
+
+	for(i = 0; i < group->size; i++) {
+		if(!received[group->first_seq + i]) missing[missing_count++] = i;
+	}
+	if(missing_count == 0) return 0;
+	if(missing_count > group->parity_count) return -1;
+
+	for(i = 0; i < group->size; i++) {
+		if(!received[group->first_seq + i]) continue;
+		length = pread(fd, block, BUFFER_SIZE, (long)(group->first_block + i) * BUFFER_SIZE);
+		if(length < 0) {
+			perror("Reading file");
+			return FEC_DECODE_FAILED;
+		}
+		for(r = 0; r < missing_count; r++) {
+			_gf_mul_add(group->parity[r], block, 
+				_fec_coefficient(group->parity_index[r], i), length);
+		}
+	}
+	for(r = 0; r < missing_count; r++) {
+		for(c = 0; c < missing_count; c++) {
+			matrix[r * missing_count + c] = 
+				_fec_coefficient(group->parity_index[r], missing[c]);
+		}
+	}
+	if(!_gf_invert_matrix(matrix, inverse, missing_count)) return -1;
+
+	for(c = 0; c < missing_count; c++) {
+		memset(rebuilt, 0, BUFFER_SIZE);
+		for(r = 0; r < missing_count; r++) {
+			_gf_mul_add(rebuilt, group->parity[r], inverse[c * missing_count + r], 
+				BUFFER_SIZE);
+		}
+		offset = (long)(group->first_block + missing[c]) * BUFFER_SIZE;
+		length = (filesize - offset > BUFFER_SIZE) ? BUFFER_SIZE : filesize - offset;
+		if(pwrite(fd, rebuilt, length, offset) != length) {
+			perror("Writing file");
+			return FEC_DECODE_FAILED;
+		}
+		received[group->first_seq + missing[c]] = 1;
+		blocks[group->first_seq + missing[c]] = group->first_block + missing[c];
+	}
+	return missing_count;
+};
+
+/* checks a datagram against the transfer before anything is taken from it */
+int _is_valid_datagram(struct datagram * datagram, int length, int total, long filesize) {
+	long offset = (long)datagram->block * BUFFER_SIZE;
+
+	if(length < (int)offsetof(struct datagram, buffer) || datagram->total <= 0 ||
+		(total > 0 && datagram->total != total) || datagram->seq_no < 0 ||
+		datagram->seq_no >= datagram->total || datagram->block < 0 || offset >= filesize ||
+		length != (int)offsetof(struct datagram, buffer) + datagram->length) {
+		return 0;
+	}
+	if(datagram->kind == DATAGRAM_PARITY) {
+		return datagram->group_size > 0 && datagram->group_size <= FEC_GROUP_SIZE &&
+			datagram->group_size <= datagram->total - datagram->seq_no &&
+			datagram->parity_index >= 0 && datagram->parity_index < FEC_MAX_PARITY_INDEX &&
+			offset + (long)(datagram->group_size - 1) * BUFFER_SIZE < filesize &&
+			datagram->length == BUFFER_SIZE;
+	}
+	return datagram->length == ((filesize - offset > BUFFER_SIZE) ? BUFFER_SIZE : filesize - offset);
+};
+
+/* microseconds on the monotonic clock */
+long long _now_us() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+};
+
+/* The trace of a process is a file which every thread tracing maps a ring
+of its own from, so that a record costs a few stores and nothing is lost
+if the process dies. The file describes its events, see trace-decode.c. */
+struct trace_record {
+	unsigned long long tsc;
+	int event;
+	int thread;
+	long a, b;  /* arguments, named by the event */
+};
+
+struct trace_event {
+	int level;  /* lowest verbosity the event is recorded at */
+	char name[TRACE_NAME_SIZE];
+	char a[TRACE_NAME_SIZE], b[TRACE_NAME_SIZE];  /* names of the arguments */
+};
+
+struct trace_header {
+	char magic[8];
+	double tsc_per_us;
+	unsigned long long start_tsc;
+	long long start_time;  /* us since the epoch, at start_tsc */
+	int ring_size, ring_count, event_count;
+	struct trace_event events[TRACE_MAX_EVENTS];
+};
+
+struct trace_ring {
+	unsigned long long head;  /* records ever written, only its thread writes it */
+	int thread;
+	int in_use;
+	char padding[48];  /* the head is kept off the cache line of another ring */
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+const struct trace_event trace_events[] = {
+	{TRACE_TRANSFERS, "transfer_begin", "filesize", ""},
+	{TRACE_TRANSFERS, "transfer_end", "completed", "bytes"},
+	{TRACE_TRANSFERS, "timeout", "seq", "rto"},
+	{TRACE_SEGMENTS, "segment_received", "seq", "length"},
+	{TRACE_SEGMENTS, "ack_sent", "seq", "ack"},
+	{TRACE_ALL, "disk_write", "offset", "us"},
+	{TRACE_ALL, "datagram_received", "seq", "length"},
+	{TRACE_ALL, "download_sent", "socket", "bytes"},
+	{TRACE_TRANSFERS, "session_resumed", "socket", "cut_socket"}
+};
+
+int trace_level = TRACE_OFF;
+struct trace_header * trace_file = NULL;  /* mapped in full, the file grows by a ring at a time */
+int trace_fd = -1;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t trace_key;
+__thread struct trace_ring * trace_ring = NULL;
+__thread int trace_detached = 0;  /* no ring was left for the thread */
+
+unsigned long long _read_tsc() {
+#if defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+};
+
+struct trace_ring * _get_trace_ring(int index) {
+	return (struct trace_ring *)((char *)trace_file + sizeof(struct trace_header) +
+		(long)index * sizeof(struct trace_ring));
+};
+
+/* the ring of a thread which ends is left to be taken over */
+void _release_trace_ring(void * ring) {
+	__atomic_store_n(&((struct trace_ring *)ring)->in_use, 0, __ATOMIC_RELEASE);
+};
+
+/* Gives the thread a ring: a new one while there are any, then the one 
+released longest ago. Only the first record of a thread comes here. */
+void _attach_trace_ring() {
+	struct trace_ring * ring, * oldest = NULL;
+	int i;
+
+	pthread_mutex_lock(&trace_lock);
+	if(trace_file->ring_count < TRACE_MAX_RINGS) {
+		if(ftruncate(trace_fd, sizeof(struct trace_header) + 
+			(long)(trace_file->ring_count + 1) * sizeof(struct trace_ring)) == 0) {
+			oldest = _get_trace_ring(trace_file->ring_count++);
+		}
+	}
+	else {
+		for(i = 0; i < TRACE_MAX_RINGS; i++) {
+			ring = _get_trace_ring(i);
+			if(!ring->in_use && (oldest == NULL || ring->head == 0 ||
+				ring->records[(ring->head - 1) % TRACE_RING_SIZE].tsc < 
+				oldest->records[(oldest->head - 1) % TRACE_RING_SIZE].tsc)) {
+				oldest = ring;
+			}
+		}
+	}
+	if(oldest != NULL) {
+		oldest->in_use = 1;
+		oldest->thread = syscall(SYS_gettid);
+		pthread_setspecific(trace_key, oldest);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	trace_ring = oldest;
+	trace_detached = (oldest == NULL);
+};
+
+void _write_trace_record(int event, long a, long b) {
+	struct trace_record * record;
+
+	if(trace_ring == NULL) {
+		if(trace_detached) return;
+		_attach_trace_ring();
+		if(trace_ring == NULL) return;
+	}
+	record = &trace_ring->records[trace_ring->head % TRACE_RING_SIZE];
+	record->tsc = _read_tsc();
+	record->event = event;
+	record->thread = trace_ring->thread;
+	record->a = a;
+	record->b = b;
+	/* a decoder reading the file meanwhile sees the record whole */
+	__atomic_store_n(&trace_ring->head, trace_ring->head + 1, __ATOMIC_RELEASE);
+};
+
+/* Records an event, if the verbosity asks for it. This is all a hot path 
+pays for an event which isn't recorded. */
+static inline void _trace(int event, long a, long b) {
+	if(trace_level >= trace_events[event].level) _write_trace_record(event, a, b);
+};
+
+/* Creates the trace file and starts recording the events of the level 
+and below. How fast the tsc runs is measured here, over a few ms. */
+void _start_trace(int level) {
+	long size = sizeof(struct trace_header) + (long)TRACE_MAX_RINGS * sizeof(struct trace_ring);
+	struct timespec pause = {0, TRACE_CALIBRATION_NS}, now;
+	unsigned long long tsc;
+	long long started;
+
+	trace_fd = open(TRACE_FILE_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(trace_fd < 0 || ftruncate(trace_fd, sizeof(struct trace_header)) < 0) {
+		perror("Trace");
+		exit(EXIT_FAILURE);
+	}
+	trace_file = (struct trace_header *)mmap(NULL, size, PROT_READ | PROT_WRITE, 
+		MAP_SHARED, trace_fd, 0);
+	if(trace_file == MAP_FAILED) {
+		perror("Trace");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(trace_file->magic, TRACE_MAGIC, sizeof(trace_file->magic));
+	trace_file->ring_size = TRACE_RING_SIZE;
+	trace_file->event_count = sizeof(trace_events) / sizeof(trace_events[0]);
+	memcpy(trace_file->events, trace_events, sizeof(trace_events));
+
+	started = _now_us();
+	tsc = _read_tsc();
+	nanosleep(&pause, NULL);
+	trace_file->tsc_per_us = (_read_tsc() - tsc) / (double)(_now_us() - started);
+	clock_gettime(CLOCK_REALTIME, &now);
+	trace_file->start_tsc = _read_tsc();
+	trace_file->start_time = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	pthread_key_create(&trace_key, _release_trace_ring);
+	trace_level = level;
+	printf("Tracing at level %d to %s\n", level, TRACE_FILE_NAME);
+};
+
+/* latencies, in buckets by powers of two of us, the last for the rest */
+struct latency_histogram {
+	unsigned long counts[LATENCY_BUCKETS + 1];
+	unsigned long count;
+	double sum;  /* seconds */
+};
+
+struct recent_transfer {
+	char filename[FILENAME_SIZE];
+	long bytes;
+	double seconds, stall_seconds;
+	int completed;
+};
+
+/* What is known of the transfer going on and of the ones before it, for 
+the metrics endpoint. Everything is guarded by the lock, as the endpoint 
+is served by a thread of its own. */
+struct transfer_metrics {
+	pthread_mutex_t lock;
+	int active;
+	char filename[FILENAME_SIZE];
+	long filesize, bytes;
+	long long started, last_progress, last_sample;  /* us */
+	long sample_bytes;
+	double throughput;       /* bytes per second, over the last sample */
+	long long stall_time;    /* us */
+	struct tcp_info tcp;     /* as last sampled */
+	int queued;              /* bytes in the queue of the socket */
+	struct latency_histogram disk_writes;
+	unsigned long transfers_completed, transfers_failed, bytes_total;
+	struct recent_transfer recent[RECENT_TRANSFERS];
+	int recent_count, next_recent;
+	int uploads_waiting;     /* for the upload going on to finish */
+	unsigned long sessions_resumed;
+	int downloads_active;
+	unsigned long downloads_total, download_bytes_total;
+};
+
+struct transfer_metrics metrics = {0}; /* its lock is set up first thing in main() */
+
+/* counts a latency into its bucket, the first above it */
+void _observe_latency(struct latency_histogram * histogram, long long us) {
+	int bucket = 0;
+
+	while(bucket < LATENCY_BUCKETS && us > (1LL << bucket)) bucket++;
+	histogram->counts[bucket]++;
+	histogram->count++;
+	histogram->sum += us / 1000000.0;
+};
+
+/* times a write to the disk which started at `started` us */
+void _time_disk_write(long long started) {
+	long long now = _now_us();
+
+	pthread_mutex_lock(&metrics.lock);
+	_observe_latency(&metrics.disk_writes, now - started);
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* ends the transfer going on, which is kept among the recent ones */
+void _end_transfer(int completed) {
+	long long now = _now_us();
+	struct recent_transfer * recent;
+
+	pthread_mutex_lock(&metrics.lock);
+	if(metrics.active) {
+		_trace(TRACE_TRANSFER_END, completed, metrics.bytes);
+		metrics.active = 0;
+		if(completed) metrics.transfers_completed++;
+		else metrics.transfers_failed++;
+		recent = &metrics.recent[metrics.next_recent];
+		metrics.next_recent = (metrics.next_recent + 1) % RECENT_TRANSFERS;
+		if(metrics.recent_count < RECENT_TRANSFERS) metrics.recent_count++;
+		strcpy(recent->filename, metrics.filename);
+		recent->bytes = metrics.bytes;
+		recent->seconds = (now - metrics.started) / 1000000.0;
+		recent->stall_seconds = metrics.stall_time / 1000000.0;
+		recent->completed = completed;
+	}
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* Starts the metrics of a transfer. One left active by a transfer which 
+gave up halfway is counted as failed, by _end_transfer(), which looks 
+at active under the lock. */
+void _begin_transfer(char * filename, long filesize) {
+	_end_transfer(0);
+	_trace(TRACE_TRANSFER_BEGIN, filesize, 0);
+	pthread_mutex_lock(&metrics.lock);
+	metrics.active = 1;
+	strcpy(metrics.filename, filename);
+	metrics.filesize = filesize;
+	metrics.bytes = metrics.sample_bytes = 0;
+	metrics.started = metrics.last_progress = metrics.last_sample = _now_us();
+	metrics.throughput = 0;
+	metrics.stall_time = 0;
+	memset(&metrics.tcp, 0, sizeof(metrics.tcp));
+	metrics.queued = 0;
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* Counts bytes of the transfer going on. A gap since the last progress 
+longer than STALL_THRESHOLD counts as stalled. Every METRICS_SAMPLE_INTERVAL
+the throughput is worked out, and what tcp knows of the connection and the
+bytes in its queue are sampled, unless there is no connection (-1). */
+void _count_transfer(int sock_fd, long bytes) {
+	long long now = _now_us();
+	socklen_t len = sizeof(metrics.tcp);
+
+	pthread_mutex_lock(&metrics.lock);
+	if(now - metrics.last_progress > STALL_THRESHOLD) {
+		metrics.stall_time += now - metrics.last_progress;
+	}
+	metrics.last_progress = now;
+	metrics.bytes += bytes;
+	metrics.bytes_total += bytes;
+	metrics.sample_bytes += bytes;
+	if(now - metrics.last_sample >= METRICS_SAMPLE_INTERVAL) {
+		metrics.throughput = metrics.sample_bytes * 1000000.0 / (now - metrics.last_sample);
+		metrics.sample_bytes = 0;
+		metrics.last_sample = now;
+		if(sock_fd >= 0) {
+			getsockopt(sock_fd, IPPROTO_TCP, TCP_INFO, &metrics.tcp, &len);
+			ioctl(sock_fd, SOCKET_QUEUE_IOCTL, &metrics.queued);
+		}
+	}
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* writes a label value, escaped as the text format wants it */
+void _write_label_value(FILE * out, const char * value) {
+	for(; *value; value++) {
+		if(*value == '\\' || *value == '"') fprintf(out, "\\%c", *value);
+		else if(*value == '\n') fprintf(out, "\\n");
+		else fputc(*value, out);
+	}
+};
+
+/* writes the HELP and TYPE lines of a metric */
+void _write_metric_header(FILE * out, const char * name, const char * type, const char * help) {
+	fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", 
+		name, help, name, type);
+};
+
+/* writes a sample of a metric of the transfer going on */
+void _write_transfer_metric(FILE * out, const char * name, const char * type, 
+	const char * help, double value) {
+	_write_metric_header(out, name, type, help);
+	fprintf(out, METRICS_PREFIX "%s{file=\"", name);
+	_write_label_value(out, metrics.filename);
+	fprintf(out, "\"} %.9g\n", value);
+};
+
+void _write_histogram(FILE * out, const char * name, const char * help, 
+	struct latency_histogram * histogram) {
+	unsigned long cumulative = 0;
+	int bucket;
+
+	_write_metric_header(out, name, "histogram", help);
+	for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		cumulative += histogram->counts[bucket];
+		fprintf(out, METRICS_PREFIX "%s_bucket{le=\"%.9g\"} %lu\n", name, 
+			(1LL << bucket) / 1000000.0, cumulative);
+	}
+	fprintf(out, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %lu\n", name, histogram->count);
+	fprintf(out, METRICS_PREFIX "%s_sum %.9g\n" METRICS_PREFIX "%s_count %lu\n", 
+		name, histogram->sum, name, histogram->count);
+};
+
+/* Writes the metrics which both sides have, in the Prometheus text format,
+with the lock held: the transfer going on, if any, with what tcp knows of
+its connection, the recent transfers and the latency of the disk writes. */
+void _write_transfer_metrics(FILE * out) {
+	int i;
+	struct recent_transfer * recent;
+
+	_write_metric_header(out, "transfers_total", "counter", "Transfers ended, by result.");
+	fprintf(out, METRICS_PREFIX "transfers_total{result=\"completed\"} %lu\n", 
+		metrics.transfers_completed);
+	fprintf(out, METRICS_PREFIX "transfers_total{result=\"failed\"} %lu\n", 
+		metrics.transfers_failed);
+	_write_metric_header(out, "transfer_bytes_total", "counter", "Bytes of files transferred.");
+	fprintf(out, METRICS_PREFIX "transfer_bytes_total %lu\n", metrics.bytes_total);
+	_write_metric_header(out, "transfer_active", "gauge", "Whether a transfer is going on.");
+	fprintf(out, METRICS_PREFIX "transfer_active %d\n", metrics.active);
+
+	if(metrics.active) {
+		_write_transfer_metric(out, "transfer_size_bytes", "gauge", 
+			"Size of the file being transferred.", metrics.filesize);
+		_write_transfer_metric(out, "transfer_bytes", "gauge", 
+			"Bytes of the file transferred so far.", metrics.bytes);
+		_write_transfer_metric(out, "transfer_seconds", "gauge", 
+			"Time since the transfer started.", (_now_us() - metrics.started) / 1000000.0);
+		_write_transfer_metric(out, "transfer_throughput_bytes_per_second", "gauge", 
+			"Throughput over the last sample.", metrics.throughput);
+		_write_transfer_metric(out, "transfer_stall_seconds", "gauge", 
+			"Time the transfer made no progress.", metrics.stall_time / 1000000.0);
+		_write_transfer_metric(out, "tcp_rtt_seconds", "gauge", 
+			"Smoothed rtt of the connection.", metrics.tcp.tcpi_rtt / 1000000.0);
+		_write_transfer_metric(out, "tcp_rtt_variance_seconds", "gauge", 
+			"Variance of the rtt of the connection.", metrics.tcp.tcpi_rttvar / 1000000.0);
+		_write_transfer_metric(out, "tcp_cwnd_segments", "gauge", 
+			"Congestion window of the connection.", metrics.tcp.tcpi_snd_cwnd);
+		_write_transfer_metric(out, "tcp_retransmits_total", "counter", 
+			"Segments retransmitted on the connection.", metrics.tcp.tcpi_total_retrans);
+		_write_transfer_metric(out, "tcp_delivery_rate_bytes_per_second", "gauge", 
+			"Delivery rate tcp measured last.", metrics.tcp.tcpi_delivery_rate);
+		_write_transfer_metric(out, "socket_queue_bytes", "gauge", 
+			SOCKET_QUEUE_HELP, metrics.queued);
+	}
+
+	_write_metric_header(out, "recent_transfer_seconds", "gauge", 
+		"How long each of the recent transfers took.");
+	for(i = 0; i < metrics.recent_count; i++) {
+		recent = &metrics.recent[i];
+		fprintf(out, METRICS_PREFIX "recent_transfer_seconds{file=\"");
+		_write_label_value(out, recent->filename);
+		fprintf(out, "\",result=\"%s\"} %.6f\n", recent->completed ? "completed" : "failed", 
+			recent->seconds);
+	}
+	_write_metric_header(out, "recent_transfer_bytes", "gauge", 
+		"Bytes each of the recent transfers moved.");
+	for(i = 0; i < metrics.recent_count; i++) {
+		recent = &metrics.recent[i];
+		fprintf(out, METRICS_PREFIX "recent_transfer_bytes{file=\"");
+		_write_label_value(out, recent->filename);
+		fprintf(out, "\",result=\"%s\"} %ld\n", recent->completed ? "completed" : "failed", 
+			recent->bytes);
+	}
+	_write_metric_header(out, "recent_transfer_stall_seconds", "gauge", 
+		"Time each of the recent transfers made no progress.");
+	for(i = 0; i < metrics.recent_count; i++) {
+		recent = &metrics.recent[i];
+		fprintf(out, METRICS_PREFIX "recent_transfer_stall_seconds{file=\"");
+		_write_label_value(out, recent->filename);
+		fprintf(out, "\",result=\"%s\"} %.6f\n", recent->completed ? "completed" : "failed", 
+			recent->stall_seconds);
+	}
+	_write_histogram(out, "disk_write_seconds", "Latency of the writes of received data.", 
+		&metrics.disk_writes);
+};
+
+/* writes all our metrics, with the lock held */
+void _write_metrics(FILE * out) {
+	_write_transfer_metrics(out);
+	_write_metric_header(out, "uploads_waiting", "gauge", 
+		"Uploads waiting for the one going on to finish.");
+	fprintf(out, METRICS_PREFIX "uploads_waiting %d\n", metrics.uploads_waiting);
+	_write_metric_header(out, "sessions_resumed_total", "counter", 
+		"Sessions clients picked up again on a new connection.");
+	fprintf(out, METRICS_PREFIX "sessions_resumed_total %lu\n", metrics.sessions_resumed);
+	_write_metric_header(out, "downloads_active", "gauge", "Downloads being served.");
+	fprintf(out, METRICS_PREFIX "downloads_active %d\n", metrics.downloads_active);
+	_write_metric_header(out, "downloads_total", "counter", "Downloads and swarm requests taken.");
+	fprintf(out, METRICS_PREFIX "downloads_total %lu\n", metrics.downloads_total);
+	_write_metric_header(out, "download_bytes_total", "counter", "Bytes of files served.");
+	fprintf(out, METRICS_PREFIX "download_bytes_total %lu\n", metrics.download_bytes_total);
+};
+
+/* Serves the metrics over http to whoever asks, on a connection each. 
+The request itself doesn't matter. */
+void * _serve_metrics(void * arg) {
+	int listen_sock = (int)(long)arg, sock_fd;
+	struct timeval timeout = {1, 0};
+	char request[4096], * body;
+	char header[128];
+	size_t length;
+	FILE * out;
+
+	while((sock_fd = accept(listen_sock, NULL, NULL)) >= 0) {
+		setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		recv(sock_fd, request, sizeof(request), 0);
+
+		out = open_memstream(&body, &length);
+		pthread_mutex_lock(&metrics.lock);
+		_write_metrics(out);
+		pthread_mutex_unlock(&metrics.lock);
+		fclose(out);
+
+		sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", length);
+		send(sock_fd, header, strlen(header), MSG_NOSIGNAL);
+		send(sock_fd, body, length, MSG_NOSIGNAL);
+		free(body);
+		close(sock_fd);
+	}
+	return NULL;
+};
+
+/* starts serving the metrics on a port of this host only */
+void _start_metrics_endpoint(int port) {
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int listen_sock = socket(AF_INET, SOCK_STREAM, 0), yes = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if(listen_sock < 0 || bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listen_sock, 8) < 0) {
+		perror("Metrics endpoint");
+		exit(EXIT_FAILURE);
+	}
+	pthread_create(&thread, NULL, _serve_metrics, (void *)(long)listen_sock);
+	pthread_detach(thread);
+	printf("Metrics on http://127.0.0.1:%d/metrics\n", port);
+};
+
+
+/* Opens the udp socket on which the data of a file is taken in, on our
+address of the connection. Its port is written into port_string. */
+int _open_udp_socket(int sock_fd, char * port_string) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int buffer_size = UDP_SOCKET_BUFFER;
+
+	int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(udp_sock < 0) {
+		perror("Udp socket");
+		return -1;
+	}
+	setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+	getsockname(sock_fd, (struct sockaddr *)&addr, &len);
+	addr.sin_port = 0; /* any free port */
+	len = sizeof(addr);
+	if(bind(udp_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		getsockname(udp_sock, (struct sockaddr *)&addr, &len) < 0) {
+		perror("Udp bind");
+		close(udp_sock);
+		return -1;
+	}
+	sprintf(port_string, "%d", ntohs(addr.sin_port));
+	return udp_sock;
+};
+
+/* Reports to the sender what has been received and what is missing. When
+more is missing than fits, the next feedback goes on from where this one
+stopped, which is kept in nack_cursor. */
+void _send_feedback(int udp_sock, struct feedback * fb, unsigned char * received,
+	long long echo_arrival, int * nack_cursor) {
+	int seq_no = (*nack_cursor > fb->ack_no) ? *nack_cursor : fb->ack_no;
+
+	fb->nack_count = 0;
+	for(; seq_no < fb->highest && fb->nack_count < UDP_MAX_NACKS; seq_no++) {
+		if(!received[seq_no]) fb->nacks[fb->nack_count++] = seq_no;
+	}
+	*nack_cursor = (seq_no < fb->highest) ? seq_no : 0;
+	fb->echo_delay = _now_us() - echo_arrival;
+	/* the socket is connected to the sender, an error just loses the feedback */
+	send(udp_sock, fb, offsetof(struct feedback, nacks) + fb->nack_count * sizeof(int), 0);
+};
+
+/* Takes in the datagrams of a file sent over udp and writes them in place,
+reporting back every few datagrams. Lost blocks are rebuilt from parity 
+blocks where the client sends them. Once all have arrived, the client is
+told over the connection. Returns 1 then, or 0 if the client went away or
+the file can't be written. */
+int _receive_over_udp(int sock_fd, int udp_sock, int fd, long filesize, 
+	char * filename, FILE * log_file, unsigned long * bytes_transferred) {
+	struct datagram datagram;
+	struct feedback fb = {0};
+	struct segment result = {0};
+	struct sockaddr_in client_addr, from;
+	socklen_t len = sizeof(client_addr);
+	struct pollfd fds[2];
+	struct timespec wait;
+	server_log log_entry;
+	unsigned char * received = NULL;
+	struct fec_group ** groups = NULL, * group;
+	int * blocks = NULL, total = -1, unreported = 0, length, nack_cursor = 0, i;
+	long long now, last_datagram, last_feedback, last_log, echo_arrival = 0, write_started;
+	long offset, first_copies = 0, rebuilt, rebuilt_total = 0;
+	int done = 0, failed = 0;
+
+	/* datagrams are taken only from the address of the client */
+	getpeername(sock_fd, (struct sockaddr *)&client_addr, &len);
+	fds[0].fd = udp_sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = sock_fd;
+	fds[1].events = POLLIN;
+	fb.highest = -1;
+	_gf_init();
+	last_datagram = last_feedback = last_log = _now_us();
+
+	while(!done) {
+		wait.tv_sec = 0;
+		wait.tv_nsec = UDP_FEEDBACK_INTERVAL * 1000;
+		if(ppoll(fds, 2, &wait, NULL) < 0) break;
+		if(fds[1].revents) {
+			/* the client says nothing on the connection before we are done,
+			so it has closed or failed */
+			break;
+		}
+		now = _now_us();
+
+		while((length = recvfrom(udp_sock, &datagram, sizeof(datagram), MSG_DONTWAIT,
+			(struct sockaddr *)&from, &len)) > 0) {
+			len = sizeof(from);
+			if(from.sin_addr.s_addr != client_addr.sin_addr.s_addr ||
+				!_is_valid_datagram(&datagram, length, total, filesize)) {
+				continue;
+			}
+			if(total < 0) {
+				/* the first datagram tells how many there are and where the
+				feedback goes */
+				total = datagram.total;
+				received = (unsigned char *)calloc(total, 1);
+				blocks = (int *)malloc(total * sizeof(int));
+				groups = (struct fec_group **)calloc(total, sizeof(struct fec_group *));
+				connect(udp_sock, (struct sockaddr *)&from, sizeof(from));
+			}
+			last_datagram = now;
+
+			if(datagram.kind == DATAGRAM_PARITY) {
+				group = _add_parity(groups, &datagram);
+			}
+			else {
+				if(!received[datagram.seq_no]) {
+					offset = (long)datagram.block * BUFFER_SIZE;
+					write_started = _now_us();
+					if(pwrite(fd, datagram.buffer, datagram.length, offset) != datagram.length) {
+						perror("Writing file");
+						failed = 1;
+						break;
+					}
+					_time_disk_write(write_started);
+					_trace(TRACE_DATAGRAM_RECEIVED, datagram.seq_no, datagram.length);
+					_count_transfer(-1, datagram.length);
+					received[datagram.seq_no] = 1;
+					blocks[datagram.seq_no] = datagram.block;
+					fb.delivered++;
+					if(datagram.kind == DATAGRAM_DATA) first_copies++;
+				}
+				if(datagram.seq_no > fb.highest) fb.highest = datagram.seq_no;
+				fb.echo_seq = datagram.seq_no;
+				fb.echo_sent_at = datagram.sent_at;
+				echo_arrival = now;
+				group = _find_group(groups, datagram.seq_no);
+			}
+
+			if(group != NULL && (rebuilt = _fec_decode(group, received, blocks, 
+				fd, filesize)) == FEC_DECODE_FAILED) {
+				failed = 1;
+				break;
+			}
+			if(group != NULL && rebuilt >= 0) {
+				/* the group is complete, possibly thanks to its parity */
+				fb.delivered += rebuilt;
+				rebuilt_total += rebuilt;
+				if(group->first_seq + group->size - 1 > fb.highest) {
+					fb.highest = group->first_seq + group->size - 1;
+				}
+				_free_fec_group(groups, group);
+			}
+			while(fb.ack_no < total && received[fb.ack_no]) fb.ack_no++;
+			fb.lost = fb.highest + 1 - first_copies;
+			if(++unreported >= UDP_ACK_EVERY) {
+				_send_feedback(udp_sock, &fb, received, echo_arrival, &nack_cursor);
+				unreported = 0;
+				last_feedback = now;
+			}
+		}
+
+		if(failed) break;
+		if(total < 0) {
+			if(now - last_datagram > UDP_IDLE_TIMEOUT) break;
+			continue;
+		}
+		if(fb.ack_no == total) {
+			done = 1;
+		}
+		if(done || now - last_feedback >= UDP_FEEDBACK_INTERVAL) {
+			_send_feedback(udp_sock, &fb, received, echo_arrival, &nack_cursor);
+			unreported = 0;
+			last_feedback = now;
+		}
+		if(now - last_datagram > UDP_IDLE_TIMEOUT) break;
+
+		if(fb.ack_no > 0 && (done || now - last_log > UDP_LOG_INTERVAL)) {
+			/* every block of the plan up to the last of the received prefix is
+			in place, and the blocks before it outside the plan were verified */
+			offset = ((long)blocks[fb.ack_no - 1] + 1) * BUFFER_SIZE;
+			if(offset > filesize) offset = filesize;
+			if(offset > (long)*bytes_transferred) {
+				*bytes_transferred = offset;
+				_update_transfer_progress_in_log(&log_entry, filename, *bytes_transferred,
+					(*bytes_transferred / (float)filesize) * 100, log_file, 
+					UPDATE_LOG_PROGRESS);
+			}
+			last_log = now;
+		}
+	}
+
+	if(done) {
+		printf("\nReceived %d blocks over udp, %ld rebuilt from parity.\n", 
+			total, rebuilt_total);
+		result.seq_no = END_OF_FILE_SEQ;
+		result.ack_no = total;
+		send_all(sock_fd, &result, sizeof(result));
+	}
+	for(i = 0; i < total; i++) {
+		if(groups[i] != NULL) _free_fec_group(groups, groups[i]);
+	}
+	free(groups);
+	free(received);
+	free(blocks);
+	return done;
+};
+
+/* Joins the group on which distributions are sent, on the interface given
+or on one the kernel picks. Other receivers on this host may listen too. */
+int _open_multicast_socket(struct in_addr interface) {
+	struct sockaddr_in addr;
+	struct ip_mreq membership;
+	int sock, yes = 1, buffer_size = UDP_SOCKET_BUFFER;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock < 0) {
+		perror("Udp socket");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+	/* bound to the group, so that nothing else sent to the port comes in */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(MULTICAST_PORT);
+	inet_pton(AF_INET, MULTICAST_GROUP, &addr.sin_addr);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("Multicast bind");
+		exit(EXIT_FAILURE);
+	}
+	membership.imr_multiaddr = addr.sin_addr;
+	membership.imr_interface = interface;
+	if(setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+		perror("Joining multicast group");
+		exit(EXIT_FAILURE);
+	}
+	return sock;
+};
+
+/* Tells the sender of a distribution how many more parity blocks each 
+incomplete group needs: the blocks it lacks, less the parity blocks we
+hold for it already. */
+void _send_report(int sock, struct multicast_transfer * transfer, int kind, int round) {
+	struct multicast_report report;
+	int first, seq_no, missing;
+
+	report.kind = kind;
+	report.round = round;
+	report.missing = transfer->missing;
+	report.need_count = 0;
+	for(first = 0; transfer->missing > 0 && first < transfer->total && 
+		report.need_count < MULTICAST_MAX_NEEDS; first += FEC_GROUP_SIZE) {
+		missing = 0;
+		for(seq_no = first; seq_no < first + FEC_GROUP_SIZE && seq_no < transfer->total; seq_no++) {
+			if(!transfer->received[seq_no]) missing++;
+		}
+		if(transfer->groups[first] != NULL) missing -= transfer->groups[first]->parity_count;
+		if(missing > 0) {
+			report.needs[report.need_count].group = first / FEC_GROUP_SIZE;
+			report.needs[report.need_count++].parity = missing;
+		}
+	}
+	/* a lost report is made up for by the next poll */
+	sendto(sock, &report, offsetof(struct multicast_report, needs) + 
+		report.need_count * sizeof(struct repair_need), 0, 
+		(struct sockaddr *)&transfer->sender, sizeof(transfer->sender));
+};
+
+/* Sets out to take in the file an announcement tells about, recording it
+in our log as a new version. Returns 0 if we won't have it. */
+int _start_multicast_transfer(struct multicast_transfer * transfer, struct datagram * datagram,
+	int length, struct sockaddr_in * from, FILE * log_file) {
+	struct multicast_file * file = (struct multicast_file *)datagram->buffer;
+	server_log log_entry;
+	char filesize[FILESIZE_STRING], address[INET_ADDRSTRLEN];
+	long amount_uploaded;
+
+	if(length != (int)offsetof(struct datagram, buffer) + (int)sizeof(struct multicast_file) ||
+		datagram->length != sizeof(struct multicast_file) || file->filesize <= 0 ||
+		datagram->total != (file->filesize + BUFFER_SIZE - 1) / BUFFER_SIZE) {
+		return 0;
+	}
+	file->filename[FILENAME_SIZE - 1] = '\0';
+	if(!_is_safe_path(file->filename)) {
+		printf("\nRefusing to write outside of this directory: %s\n", file->filename);
+		return 0;
+	}
+	if(!_make_parent_dirs(file->filename)) return 0;
+	transfer->fd = open(file->filename, O_RDWR | O_CREAT, 0644);
+	if(transfer->fd < 0) {
+		perror("File Creation");
+		return 0;
+	}
+	/* an older, longer version of the file may have been here */
+	if(ftruncate(transfer->fd, file->filesize) < 0) {
+		perror("Truncating file");
+	}
+
+	transfer->sender = *from;
+	strcpy(transfer->filename, file->filename);
+	transfer->filesize = file->filesize;
+	transfer->total = transfer->missing = datagram->total;
+	transfer->rebuilt = 0;
+	transfer->received = (unsigned char *)calloc(transfer->total, 1);
+	transfer->blocks = (int *)malloc(transfer->total * sizeof(int));
+	transfer->groups = (struct fec_group **)calloc(transfer->total, sizeof(struct fec_group *));
+
+	sprintf(filesize, "%ld", file->filesize);
+	if(_initialise_log_entry_for_file(&log_entry, file->filename, filesize, log_file, 
+		&amount_uploaded) == REATTEMPT_UPLOAD) {
+		_update_transfer_progress_in_log(&log_entry, file->filename, 
+			file->filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+	}
+	fflush(log_file);
+
+	inet_ntop(AF_INET, &from->sin_addr, address, INET_ADDRSTRLEN);
+	printf("\nReceiving %s, %ld B, from %s over multicast\n", file->filename, 
+		file->filesize, address);
+	return 1;
+};
+
+/* writes a block of a distribution in place, or keeps a parity block, and
+rebuilds the group it belongs to if it can */
+void _take_multicast_block(struct multicast_transfer * transfer, struct datagram * datagram) {
+	struct fec_group * group;
+	long rebuilt;
+
+	if(datagram->kind == DATAGRAM_PARITY) {
+		group = _add_parity(transfer->groups, datagram);
+	}
+	else {
+		if(transfer->received[datagram->seq_no]) return;
+		if(pwrite(transfer->fd, datagram->buffer, datagram->length, 
+			(long)datagram->block * BUFFER_SIZE) != datagram->length) {
+			perror("Writing file");
+			exit(EXIT_FAILURE);
+		}
+		transfer->received[datagram->seq_no] = 1;
+		transfer->blocks[datagram->seq_no] = datagram->block;
+		transfer->missing--;
+		group = transfer->groups[datagram->seq_no - datagram->seq_no % FEC_GROUP_SIZE];
+	}
+	if(group != NULL && (rebuilt = _fec_decode(group, transfer->received, 
+		transfer->blocks, transfer->fd, transfer->filesize)) == FEC_DECODE_FAILED) {
+		exit(EXIT_FAILURE);
+	}
+	if(group != NULL && rebuilt >= 0) {
+		transfer->missing -= rebuilt;
+		transfer->rebuilt += rebuilt;
+		_free_fec_group(transfer->groups, group);
+	}
+};
+
+void _end_multicast_transfer(struct multicast_transfer * transfer) {
+	int i;
+
+	for(i = 0; i < transfer->total; i++) {
+		if(transfer->groups[i] != NULL) _free_fec_group(transfer->groups, transfer->groups[i]);
+	}
+	free(transfer->groups);
+	free(transfer->received);
+	free(transfer->blocks);
+	close(transfer->fd);
+	transfer->total = 0;
+};
+
+/* checks a block or parity block of a distribution, of which the groups
+start at every FEC_GROUP_SIZE blocks */
+int _is_valid_multicast_block(struct multicast_transfer * transfer, 
+	struct datagram * datagram, int length) {
+	if(!_is_valid_datagram(datagram, length, transfer->total, transfer->filesize) ||
+		datagram->seq_no != datagram->block) {
+		return 0;
+	}
+	if(datagram->kind == DATAGRAM_PARITY) {
+		return datagram->seq_no % FEC_GROUP_SIZE == 0 && datagram->group_size == 
+			((transfer->total - datagram->seq_no > FEC_GROUP_SIZE) ? 
+			FEC_GROUP_SIZE : transfer->total - datagram->seq_no);
+	}
+	return datagram->kind == DATAGRAM_DATA;
+};
+
+/* Takes in the files distributed over multicast, one distribution after
+the other, for as long as we run. We answer the polls of the sender with
+what we still need, until it says the distribution is over. */
+void _receive_multicast(FILE ** log_file_ptr, struct in_addr interface) {
+	FILE * log_file = *log_file_ptr;
+	struct multicast_transfer transfer = {0};
+	struct sockaddr_in from, finished = {0};
+	socklen_t len = sizeof(from);
+	struct datagram datagram;
+	struct pollfd pfd;
+	server_log log_entry;
+	int sock = _open_multicast_socket(interface), length, missing;
+	long long now;
+
+	/* reports go out of a port of our own, as every receiver on the host
+	shares the port of the group */
+	int report_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(report_sock < 0) {
+		perror("Udp socket");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Listening for distributions on %s:%d\n", MULTICAST_GROUP, MULTICAST_PORT);
+	fflush(stdout);
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	_gf_init();
+
+	while(1) {
+		poll(&pfd, 1, MULTICAST_POLL_WAIT);
+		now = _now_us();
+
+		while((length = recvfrom(sock, &datagram, sizeof(datagram), MSG_DONTWAIT,
+			(struct sockaddr *)&from, &len)) > 0) {
+			len = sizeof(from);
+			if(transfer.total == 0) {
+				/* the sender we are done with may still be heard a while */
+				if(datagram.kind == DATAGRAM_ANNOUNCE && 
+					(from.sin_addr.s_addr != finished.sin_addr.s_addr ||
+					from.sin_port != finished.sin_port)) {
+					if(_start_multicast_transfer(&transfer, &datagram, length, &from, log_file)) {
+						transfer.last_datagram = now;
+						_send_report(report_sock, &transfer, REPORT_JOIN, 0);
+					}
+					else {
+						finished = from;
+					}
+				}
+				continue;
+			}
+			if(from.sin_addr.s_addr != transfer.sender.sin_addr.s_addr ||
+				from.sin_port != transfer.sender.sin_port) {
+				continue;
+			}
+			transfer.last_datagram = now;
+
+			if(datagram.kind == DATAGRAM_POLL) {
+				_send_report(report_sock, &transfer, REPORT_STATUS, datagram.seq_no);
+			}
+			else if(datagram.kind == DATAGRAM_DONE) {
+				if(transfer.missing > 0) {
+					printf("\nDistribution of %s ended with %d blocks missing.\n", 
+						transfer.filename, transfer.missing);
+					_update_transfer_progress_in_log(&log_entry, transfer.filename, 
+						0, 0, log_file, UPDATE_LOG_TIMEOUT);
+					fflush(log_file);
+				}
+				finished = transfer.sender;
+				_end_multicast_transfer(&transfer);
+			}
+			else if(_is_valid_multicast_block(&transfer, &datagram, length)) {
+				missing = transfer.missing;
+				_take_multicast_block(&transfer, &datagram);
+				if(missing > 0 && transfer.missing == 0) {
+					fsync(transfer.fd);
+					_update_transfer_progress_in_log(&log_entry, transfer.filename, 
+						transfer.filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+					fflush(log_file);
+					printf("\nReceived %s, %ld blocks rebuilt from parity.\n", 
+						transfer.filename, transfer.rebuilt);
+				}
+			}
+		}
+
+		if(transfer.total > 0 && now - transfer.last_datagram > UDP_IDLE_TIMEOUT) {
+			if(transfer.missing > 0) {
+				printf("\nThe sender of %s went silent.\n", transfer.filename);
+				_update_transfer_progress_in_log(&log_entry, transfer.filename, 
+					0, 0, log_file, UPDATE_LOG_TIMEOUT);
+				fflush(log_file);
+			}
+			finished = transfer.sender;
+			_end_multicast_transfer(&transfer);
+		}
+		fflush(stdout);
+	}
+	*log_file_ptr = log_file;
+};
+
+/* the next server of the chain, when we forward what we receive. Uploads
+take turns, so one connection to it serves them all. */
+struct downstream {
+	int enabled;
+	struct sockaddr_in addr;
+	int sock;        /* -1 until connected */
+	int active;      /* the file being received is being forwarded */
+	int failed;      /* the file being received couldn't be forwarded */
+	long ack_bytes_due;  /* of the acks to the segments forwarded */
+} downstream = {0, {0}, -1, 0, 0, 0};
+
+void _drop_downstream() {
+	if(downstream.sock >= 0) close(downstream.sock);
+	downstream.sock = -1;
+	downstream.active = 0;
+	downstream.failed = 1;
+};
+
+/* Connects to the next server, exchanging logs with it as a client does.
+Ours tells it the files still to come. */
+int _connect_downstream(FILE * log_file) {
+	char buffer[BUFFER_SIZE] = {0};
+	int logfile_size, downstream_log_size;
+	FILE * downstream_log;
+
+	if(downstream.sock >= 0) return 1;
+	downstream.sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(downstream.sock < 0 || connect(downstream.sock, 
+		(struct sockaddr *)&downstream.addr, sizeof(downstream.addr)) < 0) {
+		perror("Connecting to the next server");
+		_drop_downstream();
+		return 0;
+	}
+	/* its log is of no use to us, it goes to a file which vanishes */
+	downstream_log = tmpfile();
+	if(recv(downstream.sock, buffer, sizeof(buffer), MSG_WAITALL) != sizeof(buffer) ||
+		downstream_log == NULL) {
+		printf("\nNext server didn't answer.\n");
+		if(downstream_log != NULL) fclose(downstream_log);
+		_drop_downstream();
+		return 0;
+	}
+	downstream_log_size = atoi(buffer);
+	logfile_size = _get_file_size(log_file);
+	sprintf(buffer, "%d", logfile_size);
+	send(downstream.sock, buffer, sizeof(buffer), MSG_NOSIGNAL);
+	if(!recvlog(downstream_log, downstream.sock, downstream_log_size) ||
+		!sendlog(log_file, downstream.sock, logfile_size)) {
+		printf("\nNext server didn't answer.\n");
+		fclose(downstream_log);
+		_drop_downstream();
+		return 0;
+	}
+	fclose(downstream_log);
+	return 1;
+};
+
+/* Starts forwarding a file to the next server, which takes it as a
+replica: always whole, from the start. Returns whether it is forwarded. */
+int _forward_begin(FILE * log_file, char * filename, long filesize) {
+	struct segment segment = {0};
+
+	downstream.active = downstream.failed = 0;
+	downstream.ack_bytes_due = 0;
+	if(!downstream.enabled) return 0;
+	if(!_connect_downstream(log_file)) return 0;
+
+	strcpy(segment.filename, filename);
+	sprintf(segment.filesize, "%ld", filesize);
+	segment.flags = SEGMENT_REPLICA;
+	if(send(downstream.sock, &segment, sizeof(segment), MSG_NOSIGNAL) != sizeof(segment) ||
+		recv_with_timeout(downstream.sock, &segment, sizeof(segment), 12) != sizeof(segment)) {
+		printf("\nNext server didn't take %s.\n", filename);
+		_drop_downstream();
+		return 0;
+	}
+	downstream.active = 1;
+	return 1;
+};
+
+/* Passes a segment on to the next server as soon as we have it, without
+waiting for its ack, so that the servers of the chain receive the file at
+the same time. The acks are read as they come, only to keep them from 
+filling up the connection. */
+void _forward_segment(struct segment * segment) {
+	static char acks[sizeof(struct segment)];
+	ssize_t done;
+
+	if(!downstream.active) return;
+	if(send(downstream.sock, segment, sizeof(struct segment), MSG_NOSIGNAL) != 
+		sizeof(struct segment)) {
+		printf("\nLost the next server.\n");
+		_drop_downstream();
+		return;
+	}
+	downstream.ack_bytes_due += sizeof(struct segment);
+	while(downstream.ack_bytes_due > 0 && (done = recv(downstream.sock, acks, 
+		(downstream.ack_bytes_due > (long)sizeof(acks)) ? sizeof(acks) : downstream.ack_bytes_due,
+		MSG_DONTWAIT)) != 0) {
+		if(done < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+			break;
+		}
+		downstream.ack_bytes_due -= done;
+	}
+	if(downstream.ack_bytes_due > 0) {
+		printf("\nLost the next server.\n");
+		_drop_downstream();
+	}
+};
+
+/* Makes room in the receive buffer of an upload for a long segment and
+what follows, so that the client's tuned block fits into the window. The 
+kernel tunes the buffer on its own, which setting it stops, so it is only
+ever set to make it larger. */
+void _fit_receive_buffer(int sock_fd, int length) {
+	int current;
+	socklen_t len = sizeof(current);
+
+	/* the kernel keeps twice what it is asked for, half of it for its own use */
+	if(getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &current, &len) == 0 && current < 2 * length) {
+		setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &length, sizeof(length));
+	}
+};
+
+/* forwards bytes of a file we have in memory, from offset, a multiple of 
+BUFFER_SIZE, in segments */
+void _forward_bytes(unsigned char * data, long length, long offset) {
+	struct segment segment = {0};
+	long done;
+
+	for(done = 0; done < length && downstream.active; done += BUFFER_SIZE) {
+		segment.seq_no = (offset + done) / BUFFER_SIZE;
+		segment.length = (length - done > BUFFER_SIZE) ? BUFFER_SIZE : length - done;
+		memcpy(segment.buffer, data + done, segment.length);
+		_forward_segment(&segment);
+	}
+};
+
+/* forwards the first length bytes of a file from our disk */
+void _forward_from_disk(int fd, long length) {
+	struct segment segment = {0};
+	long offset;
+
+	for(offset = 0; offset < length && downstream.active; offset += BUFFER_SIZE) {
+		segment.seq_no = offset / BUFFER_SIZE;
+		segment.length = pread(fd, segment.buffer, 
+			(length - offset > BUFFER_SIZE) ? BUFFER_SIZE : length - offset, offset);
+		if(segment.length < 0) {
+			perror("Reading file");
+			exit(EXIT_FAILURE);
+		}
+		_forward_segment(&segment);
+	}
+};
+
+/* Ends the file at the next server, which acks it once every server down
+the chain has it on disk. Returns whether the file is durable down the 
+chain, which it trivially is if we forward nothing. */
+int _forward_end() {
+	struct segment segment = {0};
+	int length;
+
+	if(!downstream.enabled) return 1;
+	if(!downstream.active) return 0;
+	segment.seq_no = END_OF_FILE_SEQ;
+	if(send(downstream.sock, &segment, sizeof(segment), MSG_NOSIGNAL) != sizeof(segment)) {
+		_drop_downstream();
+		return 0;
+	}
+	while(downstream.ack_bytes_due > 0) {
+		length = (downstream.ack_bytes_due > (long)sizeof(segment)) ? 
+			sizeof(segment) : downstream.ack_bytes_due;
+		if(recv_with_timeout(downstream.sock, &segment, length, DURABLE_ACK_TIMEOUT) != length) {
+			_drop_downstream();
+			return 0;
+		}
+		downstream.ack_bytes_due -= length;
+	}
+	if(recv_with_timeout(downstream.sock, &segment, sizeof(segment), 
+		DURABLE_ACK_TIMEOUT) != sizeof(segment) || segment.seq_no != END_OF_FILE_SEQ || 
+		segment.ack_no != 1) {
+		printf("\nNext server didn't store the file.\n");
+		_drop_downstream();
+		return 0;
+	}
+	downstream.active = 0;
+	return 1;
+};
+
+/* forwards a file we have completely, for uploads which don't arrive as
+plain segments (delta, chunks, local copy, appends) */
+int _replicate_file(FILE * log_file, char * filename, long filesize) {
+	int fd, durable;
+
+	if(!downstream.enabled) return 1;
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		perror("File");
+		return 0;
+	}
+	fsync(fd);
+	if(_forward_begin(log_file, filename, filesize)) {
+		_forward_from_disk(fd, filesize);
+	}
+	durable = _forward_end();
+	close(fd);
+	return durable;
+};
+
+/* The bucket of an S3 compatible object store, which files go to instead
+of our directory when we are given one. It is spoken to over plain http, 
+with requests signed by version 4 of AWS's signatures, so it is meant to be
+on a network we trust. */
+struct bucket {
+	int enabled;
+	struct sockaddr_in addr;
+	char host[128];  /* address[:port], as the store is asked for it */
+	char name[64];
+	char access_key[128];
+	char secret_key[128];
+	char region[32];
+} bucket = {0};
+
+/* A multipart upload of a file to the bucket. The file has to come in 
+order, and every part is uploaded by a thread of its own as soon as it is
+full, while the next one is being filled. Nothing of it goes to our disk. */
+struct bucket_upload {
+	char filename[FILENAME_SIZE];  /* the key of its object */
+	char upload_id[S3_UPLOAD_ID_SIZE];
+	long filesize;
+	long part_size;
+	int part_count;
+	long received;         /* bytes of the file taken in so far */
+	unsigned char * part;  /* the part being filled, NULL until its first byte */
+	char (* etags)[S3_ETAG_SIZE];  /* of the parts uploaded, empty for the others */
+	int committed;         /* parts uploaded in a row from the first */
+	int in_flight;         /* parts being uploaded */
+	int failed;            /* a part couldn't be uploaded */
+	long long used;        /* us, when bytes were last taken in */
+};
+
+/* a full part, handed to the thread which uploads it */
+struct part_job {
+	struct bucket_upload * upload;
+	int number;  /* from 1 */
+	unsigned char * data;
+	long length;
+};
+
+/* uploads of clients which may come back to resume them, as the part
+being filled is only in memory */
+struct bucket_upload * bucket_uploads[S3_MAX_UPLOADS];
+int parts_in_flight = 0;
+pthread_mutex_t bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t part_done = PTHREAD_COND_INITIALIZER;
+
+/* HMAC-SHA256 (RFC 2104), on our own SHA-256 */
+void _hmac_sha256(const unsigned char * key, size_t key_length, 
+	const unsigned char * data, size_t length, unsigned char * mac) {
+	unsigned char pad[64], inner[HASH_SIZE];
+	sha256_ctx ctx;
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	if(key_length > sizeof(pad)) _sha256(key, key_length, pad);
+	else memcpy(pad, key, key_length);
+	for(i = 0; i < 64; i++) pad[i] ^= 0x36;
+	_sha256_init(&ctx);
+	_sha256_update(&ctx, pad, sizeof(pad));
+	_sha256_update(&ctx, data, length);
+	_sha256_final(&ctx, inner);
+	for(i = 0; i < 64; i++) pad[i] ^= 0x36 ^ 0x5c;
+	_sha256_init(&ctx);
+	_sha256_update(&ctx, pad, sizeof(pad));
+	_sha256_update(&ctx, inner, HASH_SIZE);
+	_sha256_final(&ctx, mac);
+};
+
+void _to_hex(const unsigned char * data, int length, char * hex) {
+	int i;
+
+	for(i = 0; i < length; i++) sprintf(hex + 2 * i, "%02x", data[i]);
+};
+
+/* percent-encodes a string as the signatures want it, keeping the slashes
+of a path */
+void _uri_encode(const char * string, char * encoded, int keep_slash) {
+	unsigned char c;
+
+	for(; *string; string++) {
+		c = *string;
+		if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+			strchr("-._~", c) != NULL || (keep_slash && c == '/')) {
+			*encoded++ = c;
+		}
+		else {
+			encoded += sprintf(encoded, "%%%02X", c);
+		}
+	}
+	*encoded = '\0';
+};
+
+/* Signs a request from its canonical form, by version 4 of AWS's 
+signatures. The key is derived from the secret for the day of date, which
+is of the form 20130524T000000Z, and for our region. */
+void _sign_request(const char * canonical_request, const char * date, char * signature) {
+	char string_to_sign[256], secret[160];
+	unsigned char hash[HASH_SIZE], key[HASH_SIZE];
+
+	_sha256((const unsigned char *)canonical_request, strlen(canonical_request), hash);
+	sprintf(string_to_sign, "AWS4-HMAC-SHA256\n%s\n%.8s/%s/s3/aws4_request\n", 
+		date, date, bucket.region);
+	_to_hex(hash, HASH_SIZE, string_to_sign + strlen(string_to_sign));
+
+	sprintf(secret, "AWS4%s", bucket.secret_key);
+	_hmac_sha256((unsigned char *)secret, strlen(secret), (const unsigned char *)date, 8, key);
+	_hmac_sha256(key, HASH_SIZE, (unsigned char *)bucket.region, strlen(bucket.region), key);
+	_hmac_sha256(key, HASH_SIZE, (unsigned char *)"s3", 2, key);
+	_hmac_sha256(key, HASH_SIZE, (unsigned char *)"aws4_request", 12, key);
+	_hmac_sha256(key, HASH_SIZE, (unsigned char *)string_to_sign, strlen(string_to_sign), hash);
+	_to_hex(hash, HASH_SIZE, signature);
+};
+
+/* Sends a request, on a connection of its own, and reads the answer. Its
+body goes to response if that isn't NULL, up to S3_RESPONSE_SIZE, and its
+ETag to etag. Returns the status of the answer, 0 if none came. */
+int _exchange_with_bucket(const char * header, const unsigned char * body, long length,
+	char * response, char * etag) {
+	struct timeval timeout = {S3_TIMEOUT, 0};
+	char * answer, * end, * field;
+	long done, got;
+	int sock, status = 0;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(sock < 0) return 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if(connect(sock, (struct sockaddr *)&bucket.addr, sizeof(bucket.addr)) < 0 ||
+		send(sock, header, strlen(header), MSG_NOSIGNAL | (length > 0 ? MSG_MORE : 0)) != 
+		(ssize_t)strlen(header)) {
+		close(sock);
+		return 0;
+	}
+	for(done = 0; done < length; done += got) {
+		got = send(sock, body + done, length - done, MSG_NOSIGNAL);
+		if(got <= 0) {
+			close(sock);
+			return 0;
+		}
+	}
+
+	/* the store closes the connection after its answer */
+	answer = (char *)malloc(S3_RESPONSE_SIZE + 1);
+	for(done = 0; done < S3_RESPONSE_SIZE; done += got) {
+		got = recv(sock, answer + done, S3_RESPONSE_SIZE - done, 0);
+		if(got <= 0) break;
+	}
+	answer[done] = '\0';
+	close(sock);
+
+	end = strstr(answer, "\r\n\r\n");
+	if(end != NULL && sscanf(answer, "HTTP/%*s %d", &status) == 1) {
+		*end = '\0';
+		field = strcasestr(answer, "\r\nETag:");
+		if(etag != NULL && field != NULL) {
+			for(field += 7; *field == ' '; field++);
+			sprintf(etag, "%.*s", (int)(strcspn(field, "\r") < S3_ETAG_SIZE ? 
+				strcspn(field, "\r") : S3_ETAG_SIZE - 1), field);
+		}
+		if(response != NULL) strcpy(response, end + 4);
+	}
+	free(answer);
+	return status;
+};
+
+/* Sends a request to the bucket, about the object of key. query is in its
+canonical form, with the names in order and the values encoded. Requests 
+which the store fails or doesn't answer are tried again. Returns the status
+of the answer, 0 if none came or the request doesn't fit our buffers. */
+int _request_bucket(const char * method, const char * key, const char * query,
+	const unsigned char * body, long length, char * response, char * etag) {
+	char encoded_key[3 * FILENAME_SIZE], path[sizeof(encoded_key) + 80], 
+		header[sizeof(path) + 2048], canonical[sizeof(header)], date[20], 
+		payload_hash[2 * HASH_SIZE + 1], signature[2 * HASH_SIZE + 1];
+	unsigned char hash[HASH_SIZE];
+	time_t now = time(NULL);
+	struct tm utc;
+	int attempt, status = 0;
+
+	if(strlen(key) >= FILENAME_SIZE) {
+		printf("\nThe name %s is too long for the bucket.\n", key);
+		return 0;
+	}
+	_uri_encode(key, encoded_key, 1);
+	if(snprintf(path, sizeof(path), "/%s/%s", bucket.name, encoded_key) >= (int)sizeof(path)) {
+		printf("\nThe name %s is too long for the bucket.\n", key);
+		return 0;
+	}
+	_sha256(body, length, hash);
+	_to_hex(hash, HASH_SIZE, payload_hash);
+	gmtime_r(&now, &utc);
+	strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &utc);
+
+	if(snprintf(canonical, sizeof(canonical), "%s\n%s\n%s\nhost:%s\nx-amz-content-sha256:%s\n"
+		"x-amz-date:%s\n\nhost;x-amz-content-sha256;x-amz-date\n%s", method, path, query, 
+		bucket.host, payload_hash, date, payload_hash) >= (int)sizeof(canonical)) {
+		printf("\nThe request %s %s is too long for the bucket.\n", method, path);
+		return 0;
+	}
+	_sign_request(canonical, date, signature);
+	if(snprintf(header, sizeof(header), "%s %s%s%s HTTP/1.1\r\nHost: %s\r\n"
+		"x-amz-content-sha256: %s\r\nx-amz-date: %s\r\nAuthorization: AWS4-HMAC-SHA256 "
+		"Credential=%s/%.8s/%s/s3/aws4_request, SignedHeaders=host;x-amz-content-sha256;"
+		"x-amz-date, Signature=%s\r\nContent-Length: %ld\r\nConnection: close\r\n\r\n", 
+		method, path, query[0] ? "?" : "", query, bucket.host, payload_hash, date, 
+		bucket.access_key, date, bucket.region, signature, length) >= (int)sizeof(header)) {
+		printf("\nThe request %s %s is too long for the bucket.\n", method, path);
+		return 0;
+	}
+
+	for(attempt = 0; attempt < S3_RETRIES; attempt++) {
+		if(attempt > 0) sleep(1 << (attempt - 1));
+		status = _exchange_with_bucket(header, body, length, response, etag);
+		if(status > 0 && status < 500) break;
+	}
+	if(status != 200) printf("\nBucket answered %s %s with %d.\n", method, path, status);
+	return status;
+};
+
+/* the text of the first element of a tag in xml, "" if there is none or 
+it doesn't fit in size, as a cut id or ETag would only be refused later. 
+The quotes of an ETag come escaped. */
+char * _xml_value(const char * xml, const char * tag, char * value, int size) {
+	char open[64], * start, * end, * entity, * text;
+
+	snprintf(open, sizeof(open), "<%s>", tag);
+	value[0] = '\0';
+	start = strstr(xml, open);
+	if(start == NULL) return value;
+	start += strlen(open);
+	end = strchr(start, '<');
+	if(end == NULL) return value;
+	text = strndup(start, end - start);
+	while((entity = strstr(text, "&quot;")) != NULL || (entity = strstr(text, "&#34;")) != NULL) {
+		*entity = '"';
+		memmove(entity + 1, strchr(entity, ';') + 1, strlen(strchr(entity, ';') + 1) + 1);
+	}
+	if((int)strlen(text) < size) strcpy(value, text);
+	else printf("\nThe bucket's %s is longer than we can keep.\n", tag);
+	free(text);
+	return value;
+};
+
+/* Parts of a file, which grow for files which would have more than an 
+upload may have. Their size has to follow from the size of the file, as an
+upload is resumed by it. */
+long _get_part_size(long filesize) {
+	long part_size = S3_PART_SIZE;
+
+	while((filesize + part_size - 1) / part_size > S3_MAX_PARTS) part_size *= 2;
+	return part_size;
+};
+
+void * _upload_part(void * arg) {
+	struct part_job * job = (struct part_job *)arg;
+	struct bucket_upload * upload = job->upload;
+	char query[3 * S3_UPLOAD_ID_SIZE + 32], etag[S3_ETAG_SIZE] = "";
+	int status;
+
+	sprintf(query, "partNumber=%d&uploadId=", job->number);
+	_uri_encode(upload->upload_id, query + strlen(query), 0);
+	status = _request_bucket("PUT", upload->filename, query, job->data, job->length, 
+		NULL, etag);
+
+	pthread_mutex_lock(&bucket_lock);
+	if(status == 200 && etag[0] != '\0') {
+		strcpy(upload->etags[job->number - 1], etag);
+		while(upload->committed < upload->part_count && 
+			upload->etags[upload->committed][0] != '\0') {
+			upload->committed++;
+		}
+	}
+	else {
+		printf("\nCouldn't upload part %d of %s to the bucket.\n", job->number, 
+			upload->filename);
+		upload->failed = 1;
+	}
+	upload->in_flight--;
+	parts_in_flight--;
+	pthread_cond_broadcast(&part_done);
+	pthread_mutex_unlock(&bucket_lock);
+
+	free(job->data);
+	free(job);
+	return NULL;
+};
+
+/* Hands the part just filled to a thread which uploads it. We wait for a
+place among the parts in flight, and the client waits for its ack 
+meanwhile, which bounds the memory an upload takes. */
+void _ship_part(struct bucket_upload * upload) {
+	struct part_job * job = (struct part_job *)malloc(sizeof(struct part_job));
+	pthread_t thread;
+
+	job->upload = upload;
+	job->number = (upload->received - 1) / upload->part_size + 1;
+	job->data = upload->part;
+	job->length = upload->received - (long)(job->number - 1) * upload->part_size;
+	upload->part = NULL;
+
+	pthread_mutex_lock(&bucket_lock);
+	while(parts_in_flight >= S3_PARTS_IN_FLIGHT) {
+		pthread_cond_wait(&part_done, &bucket_lock);
+	}
+	parts_in_flight++;
+	upload->in_flight++;
+	pthread_mutex_unlock(&bucket_lock);
+	if(pthread_create(&thread, NULL, _upload_part, job) != 0) {
+		perror("Part upload thread");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+};
+
+/* Takes in bytes of the file at offset, zeros if data is NULL. They must
+follow what we have, but what we have already is skipped, as a client which
+lost its connection sends its last segment again. Returns 0 if a part 
+couldn't be uploaded, -1 if the bytes leave a gap. */
+int _bucket_take(struct bucket_upload * upload, long offset, unsigned char * data, 
+	long length) {
+	long in_part, count;
+
+	if(offset > upload->received || offset + length > upload->filesize) return -1;
+	if(offset + length <= upload->received) return !__atomic_load_n(&upload->failed, __ATOMIC_RELAXED);
+	if(data != NULL) data += upload->received - offset;
+	length -= upload->received - offset;
+
+	upload->used = _now_us();
+	while(length > 0) {
+		if(upload->part == NULL) {
+			upload->part = (unsigned char *)malloc(upload->part_size);
+			if(upload->part == NULL) {
+				perror("Part buffer");
+				exit(EXIT_FAILURE);
+			}
+		}
+		in_part = upload->received % upload->part_size;
+		count = (length < upload->part_size - in_part) ? length : upload->part_size - in_part;
+		if(data != NULL) {
+			memcpy(upload->part + in_part, data, count);
+			data += count;
+		}
+		else {
+			memset(upload->part + in_part, 0, count);
+		}
+		upload->received += count;
+		length -= count;
+		if(upload->received % upload->part_size == 0 || upload->received == upload->filesize) {
+			_ship_part(upload);
+		}
+	}
+	return !__atomic_load_n(&upload->failed, __ATOMIC_RELAXED);
+};
+
+/* Lets an upload go, once its parts in flight are done. What it had in
+memory is lost, while the upload stays open in the bucket, to be resumed by
+its id from the parts which got there. */
+void _drop_bucket_upload(struct bucket_upload * upload) {
+	int i;
+
+	pthread_mutex_lock(&bucket_lock);
+	while(upload->in_flight > 0) {
+		pthread_cond_wait(&part_done, &bucket_lock);
+	}
+	pthread_mutex_unlock(&bucket_lock);
+	for(i = 0; i < S3_MAX_UPLOADS; i++) {
+		if(bucket_uploads[i] == upload) bucket_uploads[i] = NULL;
+	}
+	free(upload->part);
+	free(upload->etags);
+	free(upload);
+};
+
+struct bucket_upload * _find_bucket_upload(char * filename) {
+	int i;
+
+	for(i = 0; i < S3_MAX_UPLOADS; i++) {
+		if(bucket_uploads[i] != NULL && strcmp(bucket_uploads[i]->filename, filename) == 0) {
+			return bucket_uploads[i];
+		}
+	}
+	return NULL;
+};
+
+/* keeps an upload for its client, in place of the one left longest */
+void _keep_bucket_upload(struct bucket_upload * upload) {
+	int i, oldest = 0;
+
+	upload->used = _now_us();
+	for(i = 0; i < S3_MAX_UPLOADS; i++) {
+		if(bucket_uploads[i] == NULL) {
+			bucket_uploads[i] = upload;
+			return;
+		}
+		if(bucket_uploads[i]->used < bucket_uploads[oldest]->used) oldest = i;
+	}
+	_drop_bucket_upload(bucket_uploads[oldest]);
+	bucket_uploads[oldest] = upload;
+};
+
+/* Finds the parts the bucket has of an upload. It goes on after those of
+them in a row from the first which have their full size. Returns 0 if the 
+bucket doesn't know the upload. */
+int _list_parts(struct bucket_upload * upload) {
+	char * response = (char *)malloc(S3_RESPONSE_SIZE + 1), * part;
+	char query[3 * S3_UPLOAD_ID_SIZE + 48], id[3 * S3_UPLOAD_ID_SIZE], value[S3_ETAG_SIZE];
+	int marker = 0, number;
+	long size;
+
+	_uri_encode(upload->upload_id, id, 0);
+	do {
+		/* a thousand parts at most come in one answer */
+		sprintf(query, "part-number-marker=%d&uploadId=%s", marker, id);
+		if(_request_bucket("GET", upload->filename, query, (unsigned char *)"", 0, 
+			response, NULL) != 200) {
+			free(response);
+			return 0;
+		}
+		for(part = strstr(response, "<Part>"); part != NULL; part = strstr(part + 1, "<Part>")) {
+			number = atoi(_xml_value(part, "PartNumber", value, sizeof(value)));
+			size = atol(_xml_value(part, "Size", value, sizeof(value)));
+			if(number < 1 || number > upload->part_count || size != ((number < upload->part_count) ?
+				upload->part_size : upload->filesize - (upload->part_count - 1) * upload->part_size)) {
+				continue;
+			}
+			_xml_value(part, "ETag", upload->etags[number - 1], S3_ETAG_SIZE);
+		}
+		marker = atoi(_xml_value(response, "NextPartNumberMarker", value, sizeof(value)));
+	} while(strcmp(_xml_value(response, "IsTruncated", value, sizeof(value)), "true") == 0 &&
+		marker > 0);
+	free(response);
+
+	/* parts after a missing one are uploaded again */
+	while(upload->committed < upload->part_count && upload->etags[upload->committed][0] != '\0') {
+		upload->committed++;
+	}
+	memset(upload->etags + upload->committed, 0, 
+		(upload->part_count - upload->committed) * S3_ETAG_SIZE);
+	upload->received = (upload->committed == upload->part_count) ? upload->filesize :
+		upload->committed * upload->part_size;
+	return 1;
+};
+
+/* Starts the upload of a file to the bucket. One an earlier connection 
+left unfinished is picked up by the id kept in the log record of the file,
+if it is of this version. Returns NULL if the bucket can't be reached. */
+struct bucket_upload * _start_bucket_upload(char * filename, long filesize, 
+	server_log * log_entry, int reattempt, FILE * log_file) {
+	struct bucket_upload * upload = (struct bucket_upload *)calloc(1, sizeof(struct bucket_upload));
+	char query[3 * S3_UPLOAD_ID_SIZE + 16], * response;
+	server_log entry;
+
+	strcpy(upload->filename, filename);
+	upload->filesize = filesize;
+	upload->part_size = _get_part_size(filesize);
+	upload->part_count = (filesize + upload->part_size - 1) / upload->part_size;
+	upload->etags = calloc(upload->part_count, S3_ETAG_SIZE);
+
+	if(reattempt && log_entry->upload_id[0] != '\0') {
+		strcpy(upload->upload_id, log_entry->upload_id);
+		if(atol(log_entry->filesize) == filesize && _list_parts(upload)) {
+			printf("\nResuming the upload of %s to the bucket at part %d of %d.\n", 
+				filename, upload->committed + 1, upload->part_count);
+			_keep_bucket_upload(upload);
+			return upload;
+		}
+		/* it was of another version of the file */
+		strcpy(query, "uploadId=");
+		_uri_encode(upload->upload_id, query + strlen(query), 0);
+		_request_bucket("DELETE", filename, query, (unsigned char *)"", 0, NULL, NULL);
+	}
+	if(reattempt) {
+		_update_transfer_progress_in_log(&entry, filename, 
+			filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+	}
+
+	response = (char *)malloc(S3_RESPONSE_SIZE + 1);
+	if(_request_bucket("POST", filename, "uploads=", (unsigned char *)"", 0, response, 
+		NULL) != 200 || _xml_value(response, "UploadId", upload->upload_id, 
+		S3_UPLOAD_ID_SIZE)[0] == '\0') {
+		printf("\nCouldn't start the upload of %s to the bucket.\n", filename);
+		free(response);
+		free(upload->etags);
+		free(upload);
+		return NULL;
+	}
+	free(response);
+	_record_upload_id_in_log(log_file, filename, upload->upload_id);
+	_keep_bucket_upload(upload);
+	return upload;
+};
+
+/* Puts the object together from its parts, once they are all uploaded. The
+upload is let go either way. Returns whether the file is in the bucket. */
+int _finish_bucket_upload(struct bucket_upload * upload) {
+	char query[3 * S3_UPLOAD_ID_SIZE + 16], * xml, * response;
+	int i, length, stored = 0;
+
+	pthread_mutex_lock(&bucket_lock);
+	while(upload->in_flight > 0) {
+		pthread_cond_wait(&part_done, &bucket_lock);
+	}
+	pthread_mutex_unlock(&bucket_lock);
+
+	if(upload->received == upload->filesize && upload->committed == upload->part_count) {
+		xml = (char *)malloc(upload->part_count * (S3_ETAG_SIZE + 64) + 64);
+		response = (char *)malloc(S3_RESPONSE_SIZE + 1);
+		length = sprintf(xml, "<CompleteMultipartUpload>");
+		for(i = 0; i < upload->part_count; i++) {
+			length += sprintf(xml + length, "<Part><PartNumber>%d</PartNumber>"
+				"<ETag>%s</ETag></Part>", i + 1, upload->etags[i]);
+		}
+		length += sprintf(xml + length, "</CompleteMultipartUpload>");
+		strcpy(query, "uploadId=");
+		_uri_encode(upload->upload_id, query + strlen(query), 0);
+		/* the store may fail it after its status is sent */
+		stored = _request_bucket("POST", upload->filename, query, (unsigned char *)xml, 
+			length, response, NULL) == 200 && strstr(response, "<Error>") == NULL;
+		free(response);
+		free(xml);
+	}
+	_drop_bucket_upload(upload);
+	return stored;
+};
+
+/* takes the bucket from http://address[:port]/bucket, and its keys from 
+the environment, as AWS's tools do */
+void _configure_bucket(char * url) {
+	char address[sizeof(bucket.host)], * slash, * colon;
+	char * access_key = getenv("AWS_ACCESS_KEY_ID"), * secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+	char * region = getenv("AWS_REGION");
+
+	if(strncmp(url, "http://", 7) == 0) url += 7;
+	slash = strchr(url, '/');
+	if(slash != NULL && slash[strlen(slash) - 1] == '/') slash[strlen(slash) - 1] = '\0';
+	if(slash == NULL || slash[1] == '\0' || strchr(slash + 1, '/') != NULL || 
+		slash - url >= (long)sizeof(bucket.host) || strlen(slash + 1) >= sizeof(bucket.name)) {
+		printf("\nThe bucket is given as http://address[:port]/bucket\n");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(bucket.host, "%.*s", (int)(slash - url), url);
+	strcpy(bucket.name, slash + 1);
+
+	strcpy(address, bucket.host);
+	bucket.addr.sin_family = AF_INET;
+	bucket.addr.sin_port = htons(80);
+	colon = strchr(address, ':');
+	if(colon != NULL) {
+		*colon = '\0';
+		bucket.addr.sin_port = htons(atoi(colon + 1));
+	}
+	if(inet_pton(AF_INET, address, &bucket.addr.sin_addr) != 1) {
+		printf("\nNot an IPv4 address: %s\n", address);
+		exit(EXIT_FAILURE);
+	}
+	if(access_key == NULL || secret_key == NULL || 
+		strlen(access_key) >= sizeof(bucket.access_key) || 
+		strlen(secret_key) >= sizeof(bucket.secret_key)) {
+		printf("\nThe keys of the bucket are taken from AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY.\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(bucket.access_key, access_key);
+	strcpy(bucket.secret_key, secret_key);
+	snprintf(bucket.region, sizeof(bucket.region), "%s", 
+		(region != NULL && region[0] != '\0') ? region : S3_DEFAULT_REGION);
+	bucket.enabled = 1;
+};
+
+struct receive_pipeline * receive_pipeline = NULL;
+
+void _init_block_queue(struct block_queue * queue, unsigned long size) {
+	unsigned long i;
+
+	queue->cells = (struct block_queue_cell *)malloc(size * sizeof(struct block_queue_cell));
+	for(i = 0; i < size; i++) queue->cells[i].sequence = i;
+	queue->mask = size - 1;
+	queue->push_position = queue->pop_position = 0;
+};
+
+/* returns 0 if the queue is full */
+int _push_to_queue(struct block_queue * queue, int value) {
+	unsigned long position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+	struct block_queue_cell * cell;
+	long lap;
+
+	while(1) {
+		cell = &queue->cells[position & queue->mask];
+		lap = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position);
+		if(lap == 0) {
+			if(__atomic_compare_exchange_n(&queue->push_position, &position, position + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		}
+		else if(lap < 0) {
+			return 0;
+		}
+		else {
+			position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+		}
+	}
+	cell->value = value;
+	__atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+	return 1;
+};
+
+/* returns 0 if the queue is empty */
+int _pop_from_queue(struct block_queue * queue, int * value) {
+	unsigned long position = __atomic_load_n(&queue->pop_position, __ATOMIC_RELAXED);
+	struct block_queue_cell * cell;
+	long lap;
+
+	while(1) {
+		cell = &queue->cells[position & queue->mask];
+		lap = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (position + 1));
+		if(lap == 0) {
+			if(__atomic_compare_exchange_n(&queue->pop_position, &position, position + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		}
+		else if(lap < 0) {
+			return 0;
+		}
+		else {
+			position = __atomic_load_n(&queue->pop_position, __ATOMIC_RELAXED);
+		}
+	}
+	*value = cell->value;
+	__atomic_store_n(&cell->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+	return 1;
+};
+
+void _decode_frame(struct frame_job * job) {
+	if(job->frame.flags & FRAME_COMPRESSED) {
+		job->out_length = _lz_decompress(job->data, job->frame.length, job->out, BUFFER_SIZE);
+	}
+	else {
+		memcpy(job->out, job->data, job->frame.length);
+		job->out_length = job->frame.length;
+	}
+	if(job->out_length < 0) job->result = -1;
+	else job->result = (_crc32c(job->out, job->out_length) == job->frame.checksum);
+};
+
+/* A worker of the decode stage. The pipeline lives as long as the server
+does, so an idle worker sleeps on the semaphore rather than poll. */
+void * _decode_frames_worker(void * arg) {
+	struct receive_pipeline * pipeline = arg;
+	int index;
+
+	while(1) {
+		while(sem_wait(&pipeline->frames_queued) != 0);
+		while(!_pop_from_queue(&pipeline->queue, &index)) sched_yield();
+		_decode_frame(&pipeline->jobs[index]);
+		__atomic_sub_fetch(&pipeline->pending, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+};
+
+/* The write stage, which writes the decoded segments in the order they
+were queued. Every write has an fd of its own, so that the file can be
+closed before its last writes are done. */
+void * _write_decoded(void * arg) {
+	struct receive_pipeline * pipeline = arg;
+	struct pending_write * write;
+	long long started;
+	ssize_t written;
+
+	while(1) {
+		while(sem_wait(&pipeline->writes_queued) != 0);
+		write = &pipeline->writes[pipeline->write_tail % WRITE_QUEUE_DEPTH];
+		started = _now_us();
+		written = pwrite(write->fd, write->data, write->length, write->offset);
+		if(written != write->length) {
+			/* the segment is acked already, so it is the end of the 
+			upload which fails */
+			if(written < 0) perror("Writing file");
+			else printf("\nWrote only %ld of %ld bytes at %ld.\n", (long)written, 
+				write->length, write->offset);
+			__atomic_store_n(&pipeline->write_failed, 1, __ATOMIC_RELEASE);
+		}
+		_time_disk_write(started);
+		_trace(TRACE_DISK_WRITE, write->offset, _now_us() - started);
+		close(write->fd);
+		__atomic_store_n(&pipeline->write_tail, pipeline->write_tail + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+};
+
+/* started on the first framed segment, with a worker for every core but
+the one the upload runs on */
+struct receive_pipeline * _start_receive_pipeline() {
+	struct receive_pipeline * pipeline = 
+		(struct receive_pipeline *)calloc(1, sizeof(struct receive_pipeline));
+	int i;
+
+	_crc32c_init();
+	pipeline->payload = (unsigned char *)malloc(FRAMED_SEGMENT_MAX);
+	for(i = 0; i < WRITE_QUEUE_DEPTH; i++) {
+		pipeline->buffers[i] = (unsigned char *)malloc(LONG_SEGMENT_MAX);
+	}
+	_init_block_queue(&pipeline->queue, MAX_FRAMES);
+	sem_init(&pipeline->frames_queued, 0, 0);
+	sem_init(&pipeline->writes_queued, 0, 0);
+
+	pipeline->worker_count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if(pipeline->worker_count > PIPELINE_MAX_WORKERS) pipeline->worker_count = PIPELINE_MAX_WORKERS;
+	for(i = 0; i < pipeline->worker_count; i++) {
+		if(pthread_create(&pipeline->workers[i], NULL, _decode_frames_worker, pipeline) != 0) {
+			perror("Starting decode worker");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(pipeline->workers[i]);
+	}
+	if(pthread_create(&pipeline->writer, NULL, _write_decoded, pipeline) != 0) {
+		perror("Starting writer");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(pipeline->writer);
+	return pipeline;
+};
+
+/* Decodes the length bytes of frames in the payload into out, the workers 
+taking a frame each and this thread helping rather than waiting. Returns
+the bytes decoded, -1 if the frames are malformed and FRAMES_CORRUPT if a 
+block doesn't match its checksum. */
+long _decode_frames(struct receive_pipeline * pipeline, long length, unsigned char * out) {
+	struct frame_job * job;
+	long position = 0;
+	int count = 0, i, index;
+
+	while(position < length) {
+		if(count == MAX_FRAMES || length - position < (long)sizeof(struct frame)) return -1;
+		job = &pipeline->jobs[count];
+		memcpy(&job->frame, pipeline->payload + position, sizeof(struct frame));
+		position += sizeof(struct frame);
+		if(job->frame.length < 0 || job->frame.length > BUFFER_SIZE || 
+			job->frame.length > length - position) return -1;
+		job->data = pipeline->payload + position;
+		job->out = out + (long)count * BUFFER_SIZE;
+		position += job->frame.length;
+		count++;
+	}
+	if(count == 0) return -1;
+
+	__atomic_store_n(&pipeline->pending, count, __ATOMIC_RELAXED);
+	for(i = 0; i < count; i++) {
+		_push_to_queue(&pipeline->queue, i);
+		sem_post(&pipeline->frames_queued);
+	}
+	while(__atomic_load_n(&pipeline->pending, __ATOMIC_ACQUIRE) > 0) {
+		if(sem_trywait(&pipeline->frames_queued) == 0) {
+			while(!_pop_from_queue(&pipeline->queue, &index)) sched_yield();
+			_decode_frame(&pipeline->jobs[index]);
+			__atomic_sub_fetch(&pipeline->pending, 1, __ATOMIC_RELEASE);
+		}
+		else {
+			sched_yield();
+		}
+	}
+
+	/* only the last block of the segment may be short */
+	for(i = 0; i < count; i++) {
+		job = &pipeline->jobs[i];
+		if(job->result < 0 || (job->result && i < count - 1 && job->out_length != BUFFER_SIZE)) {
+			return -1;
+		}
+	}
+	for(i = 0; i < count; i++) {
+		if(!pipeline->jobs[i].result) return FRAMES_CORRUPT;
+	}
+	return (long)(count - 1) * BUFFER_SIZE + pipeline->jobs[count - 1].out_length;
+};
+
+/* the buffer the next decoded segment goes to, once the writer is done 
+with what was in it */
+unsigned char * _next_write_buffer(struct receive_pipeline * pipeline) {
+	while(pipeline->write_head - __atomic_load_n(&pipeline->write_tail, __ATOMIC_ACQUIRE) >=
+		WRITE_QUEUE_DEPTH) {
+		sched_yield();
+	}
+	return pipeline->buffers[pipeline->write_head % WRITE_QUEUE_DEPTH];
+};
+
+/* hands the segment decoded into the next write buffer to the writer */
+void _queue_write(struct receive_pipeline * pipeline, int fd, long offset, long length) {
+	struct pending_write * write = &pipeline->writes[pipeline->write_head % WRITE_QUEUE_DEPTH];
+
+	write->fd = dup(fd);
+	write->data = pipeline->buffers[pipeline->write_head % WRITE_QUEUE_DEPTH];
+	write->offset = offset;
+	write->length = length;
+	__atomic_store_n(&pipeline->write_head, pipeline->write_head + 1, __ATOMIC_RELEASE);
+	sem_post(&pipeline->writes_queued);
+};
+
+/* Waits for the writer to write everything queued. Returns 0 if a write
+has failed since the last time, which the file it was of can't be acked 
+as stored with. */
+int _drain_writes(struct receive_pipeline * pipeline) {
+	struct timespec pause = {0, 100000};
+
+	while(__atomic_load_n(&pipeline->write_tail, __ATOMIC_ACQUIRE) != pipeline->write_head) {
+		nanosleep(&pause, NULL);
+	}
+	return !__atomic_exchange_n(&pipeline->write_failed, 0, __ATOMIC_ACQ_REL);
+};
+
+/* Receives one file from a client, after the logs have been exchanged.
+Returns whether the file was received completely, or CONNECTION_CLOSED if
+the client has closed the connection instead of sending another file. */
+int _receive_file(int connected_client_sock, FILE ** log_file_ptr) {
+	FILE * recvd_file, * log_file = *log_file_ptr;
+
+	//for received file stats
+	long filesize;
+	char filename[FILENAME_SIZE];
+
+	//declaring the structure for segment and recvd segment
+	struct segment server_segment = {0};
+	struct segment recvd_segment = {0};
+
+	//Retransmission timeout value
+	short RTO;   /* initial value will be 3 sec which will be doubled each retry */
+	short retry;   /* sender will retry sending acc to this value */
+
+	int recvd_bytes;
+	long wrote_bytes = 0;  /* bytes of the file covered by the last segment */
+	struct hole_range hole;
+	unsigned char block[BUFFER_SIZE], * data;  /* a data segment after decompression */
+	int data_length;
+	long long write_started;
+	struct bucket_upload * upload = NULL;  /* when the file goes to the bucket */
+	int taken;
+	/* the data of long segments, kept for the next uploads, which take turns */
+	static unsigned char * long_block = NULL;
+
+	//start receiving from client
+	//first, receive filename and filesize
+	recvd_bytes = recv(connected_client_sock, (struct segment *)&recvd_segment,
+		sizeof(struct segment), MSG_WAITALL);
+
+	if(recvd_bytes > 0) {
+		printf("File to be received: %s \n",recvd_segment.filename);
+		printf("Size: %s B \n",recvd_segment.filesize);
+	}	
+
+	// if we haven't received anything yet, the connection might be closed
+	if(recvd_bytes == 0) {
+		printf("\nConnection closed by client.\n");
+		return CONNECTION_CLOSED;
+	}
+	else if(recvd_bytes < 0) {  /* else if value is negative, there's some error */
+		perror("Receiving file metadata");
+		return CONNECTION_CLOSED;
+	}
+
+	/* whatever we read of our files from here on must have the writes of
+	the last upload in it. One which failed was of an upload which didn't 
+	end, which its resume verifies. */
+	if(receive_pipeline != NULL) _drain_writes(receive_pipeline);
+
+	/* We have received filesize as char buffer from socket.
+		So we convert it to int and store. */
+	filesize = atol(recvd_segment.filesize);
+
+	recvd_segment.filename[FILENAME_SIZE - 1] = '\0';
+	strcpy(filename, recvd_segment.filename); /* just storing for convenience */
+	if(!_is_safe_path(filename)) {
+		printf("\nRefusing to write outside of this directory: %s\n", filename);
+		return CONNECTION_CLOSED;
+	}
+	if(!bucket.enabled && !_make_parent_dirs(filename)) {
+		printf("\nCan't create the directories of %s. Dropping the client.\n", filename);
+		return CONNECTION_CLOSED;
+	}
+
+	/*variable to decide upto when we have to receive and progress */
+	if(filesize == 0) {
+		printf("\nCouldn't receive data properly. Dropping the client.\n");
+		return CONNECTION_CLOSED;
+	}
+	/* ended by _serve_client(), whichever way we return */
+	_begin_transfer(filename, filesize);
+
+	//now start writing the file. It is opened for update and not for append,
+	// as resent segments must land at their own place in the file.
+	if(bucket.enabled) {
+		/* nothing is written here when the file goes to the bucket, the
+		stream only stands in for the file on the ways out */
+		recvd_file = fopen("/dev/null", "r+");
+	}
+	else {
+		recvd_file = fopen(recvd_segment.filename, "r+");
+		if(recvd_file == NULL) {
+			recvd_file = fopen(recvd_segment.filename, "w+");
+		}
+	}
+	if(recvd_file == NULL) {
+		perror("File Creation");
+		printf("\nDropping the client.\n");
+		return CONNECTION_CLOSED;
+	}
+	
+	/* these are few variables being used in loop for collecting
+	qunatitative data about transfer and also control the loop*/
+	unsigned long bytes_transferred = 0;
+	unsigned short percentage = 0;
+	short completed = 0;
+
+	server_log initial_log_entry, log_entry;   /* creating instances of 
+	server log for initialising and updating*/
+	/* we now initialise the server_log_entry for the provided file transfer */
+
+	long int amount_uploaded = -1; /* it contains the bytes transferred from the 
+	log file in case, this is an re-attempt to upload */
+	short init_result = _initialise_log_entry_for_file(&initial_log_entry, 
+		filename, recvd_segment.filesize, log_file, &amount_uploaded);
+
+	if(recvd_segment.flags & SEGMENT_APPEND) {
+		/* client follows a growing file. We take the new bytes only if our
+		copy is exactly what it shipped so far, otherwise it falls back to 
+		a normal upload. */
+		long size_on_disk = _get_file_size(recvd_file);
+
+		if(!bucket.enabled && init_result == REATTEMPT_UPLOAD && 
+			initial_log_entry.percentage_completion == 100 &&
+			size_on_disk == atol(initial_log_entry.filesize) && 
+			size_on_disk < filesize) {
+			server_segment.flags = SEGMENT_APPEND;
+			sprintf(server_segment.filesize, "%ld", size_on_disk);
+			send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+			completed = _receive_appended(connected_client_sock, recvd_file, 
+				size_on_disk, filesize);
+			if(completed < 0) {
+				printf("\nReceived a malformed segment. Dropping the client.\n");
+				fclose(recvd_file);
+				return CONNECTION_CLOSED;
+			}
+			if(completed) {
+				printf("\nAppended %ld Bytes to %s\n", filesize - size_on_disk, filename);
+				_update_transfer_progress_in_log(&log_entry, filename, 
+					filesize, 100, log_file, UPDATE_LOG_APPENDED);
+				fflush(log_file);
+			}
+		}
+		else {
+			printf("\nCan't append to %s, our copy differs.\n", filename);
+		}
+
+		/* the final ack is the client's checkpoint. The next server gets
+		the whole file again. */
+		server_segment.seq_no = END_OF_FILE_SEQ;
+		server_segment.ack_no = completed && _replicate_file(log_file, filename, filesize);
+		send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+		fclose(recvd_file);
+		*log_file_ptr = log_file;
+		return completed;
+	}
+
+	if(bucket.enabled) {
+		/* objects in a bucket can't be read back or written in place, so
+		whatever the client offers, the file comes as a plain upload */
+		recvd_segment.flags &= ~(SEGMENT_LOCAL | SEGMENT_REPLICA | SEGMENT_DELTA | 
+			SEGMENT_DEDUP | SEGMENT_UDP);
+	}
+
+	if(recvd_segment.flags & SEGMENT_LOCAL) {
+		/* client runs on this host and we can read its file ourselves.
+		If we can't, the upload goes on over the connection as asked for
+		by the other flags. */
+		int source_fd = _open_local_source(connected_client_sock, 
+			(struct local_source *)recvd_segment.buffer, filesize);
+		if(source_fd >= 0) {
+			server_segment.flags = SEGMENT_LOCAL;
+			send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+			fclose(recvd_file);
+			completed = _copy_local_file(source_fd, filename, filesize);
+			close(source_fd);
+
+			server_segment.seq_no = END_OF_FILE_SEQ;
+			server_segment.ack_no = completed && _replicate_file(log_file, filename, filesize);
+			send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+			if(completed) {
+				_update_transfer_progress_in_log(&log_entry, filename, 
+					filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+				_update_transfer_progress_in_log(&log_entry, filename, 
+					filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+				log_file = _update_file_to_be_received_list(log_file, filename);
+			}
+			else {
+				printf("\nCouldn't copy the file from the client's copy.\n");
+			}
+
+			*log_file_ptr = log_file;
+			return completed;
+		}
+		printf("\nCan't read the client's copy of %s, receiving it instead.\n", filename);
+	}
+
+	short replica = (recvd_segment.flags & SEGMENT_REPLICA) != 0;
+	if(replica) {
+		/* the server before us in a chain forwards the file as it gets it,
+		always whole, so whatever we have of it is written over */
+		if(init_result == REATTEMPT_UPLOAD) {
+			_update_transfer_progress_in_log(&log_entry, filename, 
+				filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+		}
+		init_result = FRESH_UPLOAD;
+	}
+
+	if(init_result == REATTEMPT_UPLOAD) { /* If it is an reattempt then we need to
+	make some arrangements*/
+		if(amount_uploaded == -1) {
+			printf("\nSome error ocurred. Dropping the client.\n");
+			fclose(recvd_file);
+			return CONNECTION_CLOSED;
+		}
+
+		/* we can't claim more than what is really there on the disk */
+		long size_on_disk = bucket.enabled ? filesize : _get_file_size(recvd_file);
+		if(amount_uploaded > size_on_disk) amount_uploaded = size_on_disk;
+		if(amount_uploaded > filesize) amount_uploaded = filesize;
+
+		bytes_transferred = amount_uploaded;
+
+		if((recvd_segment.flags & SEGMENT_DELTA) && 
+			initial_log_entry.percentage_completion == 100) {
+			/* client has changed a file we have completely. We send it the
+			signatures of our copy and rebuild the new version from the delta*/
+			printf("\nReceiving the changes made to %s\n", filename);
+			server_segment.flags = SEGMENT_DELTA;
+			sprintf(server_segment.filesize, "%ld", size_on_disk);
+			send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+			int block_size = _send_signatures(connected_client_sock, 
+				fileno(recvd_file), size_on_disk);
+			completed = _receive_delta(connected_client_sock, recvd_file, 
+				size_on_disk, block_size, filename, filesize);
+
+			/* tell the client whether its delta could be applied, and has 
+			reached the rest of the chain */
+			server_segment.seq_no = END_OF_FILE_SEQ;
+			server_segment.ack_no = completed && _replicate_file(log_file, filename, filesize);
+			send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+			if(completed) {
+				printf("\nFile received successfully.\n");
+				_update_transfer_progress_in_log(&log_entry, filename, 
+					filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+				_update_transfer_progress_in_log(&log_entry, filename, 
+					filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+				log_file = _update_file_to_be_received_list(log_file, filename);
+			}
+			else {
+				printf("\nCouldn't rebuild the file from the delta.\n");
+			}
+
+			fclose(recvd_file);
+			*log_file_ptr = log_file;
+			return completed;
+		}
+	}
+
+	if(recvd_segment.flags & SEGMENT_DEDUP) {
+		/* client sends the file as chunks, of which we take only the ones
+		missing in our chunk store */
+		printf("\nReceiving %s through the chunk store\n", filename);
+		server_segment.flags = SEGMENT_DEDUP;
+		send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+		fclose(recvd_file);
+		completed = _receive_deduplicated(connected_client_sock, filename, filesize);
+
+		server_segment.seq_no = END_OF_FILE_SEQ;
+		server_segment.ack_no = completed && _replicate_file(log_file, filename, filesize);
+		send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+		if(completed) {
+			printf("\nFile received successfully.\n");
+			_update_transfer_progress_in_log(&log_entry, filename, 
+				filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+			_update_transfer_progress_in_log(&log_entry, filename, 
+				filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+			log_file = _update_file_to_be_received_list(log_file, filename);
+		}
+		else {
+			printf("\nCouldn't assemble the file from its chunks.\n");
+		}
+
+		*log_file_ptr = log_file;
+		return completed;
+	}
+
+	if(recvd_segment.flags & SEGMENT_DELTA) {
+		/* a changed file, but we have no complete copy to take a delta
+		against. It is received as a plain upload over whatever we have. */
+		_update_transfer_progress_in_log(&log_entry, filename, 
+			filesize, 0, log_file, UPDATE_LOG_NEW_VERSION);
+	}
+
+	int udp_sock = -1;
+	if(recvd_segment.flags & SEGMENT_UDP) {
+		/* the data is to come over udp, to a port of its own */
+		udp_sock = _open_udp_socket(connected_client_sock, server_segment.buffer);
+		if(udp_sock >= 0) server_segment.flags = SEGMENT_UDP;
+	}
+
+	if(bucket.enabled && (recvd_segment.flags & SEGMENT_RESUMED)) {
+		/* the client goes on with the upload it lost its connection in, 
+		which we still have if we kept what it sent since the last part */
+		upload = _find_bucket_upload(filename);
+		if(upload != NULL && upload->filesize == filesize && !upload->failed) {
+			bytes_transferred = upload->received;
+		}
+		else if(init_result != REATTEMPT_UPLOAD || initial_log_entry.percentage_completion != 100 ||
+			initial_log_entry.upload_id[0] != '\0' || atol(initial_log_entry.filesize) != filesize) {
+			/* the client has to start over, and is told so by the flag.
+			It is then told what we have, from the parts in the bucket. */
+			printf("\nLost what wasn't in a part yet of %s, the client starts over.\n", filename);
+			server_segment.flags = SEGMENT_RESUMED;
+			send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+			fclose(recvd_file);
+			return 0;
+		}
+		/* otherwise it is in the bucket, and the client only missed our
+		final ack */
+		else upload = NULL;
+	}
+	else if(bucket.enabled) {
+		/* Parts can't be read back to be verified. The client is told 
+		by the flag to take what we have as it is, which is whole parts. */
+		upload = _find_bucket_upload(filename);
+		if(upload != NULL) _drop_bucket_upload(upload);
+		upload = _start_bucket_upload(filename, filesize, &initial_log_entry, 
+			init_result == REATTEMPT_UPLOAD, log_file);
+		if(upload == NULL) {
+			printf("\nDropping the client.\n");
+			fclose(recvd_file);
+			return CONNECTION_CLOSED;
+		}
+		bytes_transferred = upload->received;
+		if(bytes_transferred > 0) server_segment.flags = SEGMENT_RESUMED;
+	}
+
+	/* tell the client how much of the file we have. If it is something, 
+	the client verifies it against its own copy through our hash tree. */
+	sprintf(server_segment.filesize, "%lu", bytes_transferred);
+	send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+
+	if(bucket.enabled) {
+		if(bytes_transferred > 0) {
+			printf("\nResuming %s after %lu Bytes in the bucket.\n", filename, bytes_transferred);
+		}
+	}
+	else if(recvd_segment.flags & SEGMENT_RESUMED) {
+		/* the client lost its connection in the middle of this upload and 
+		goes on from what it knows was acked, there's nothing to verify */
+		printf("\nResuming %s at the client's last acked segment.\n", filename);
+	}
+	else if(bytes_transferred > 0) {
+		struct merkle_tree tree;
+		printf("\nVerifying %lu Bytes already received ...\n", bytes_transferred);
+		_build_merkle_tree(fileno(recvd_file), bytes_transferred, &tree);
+		if(!_answer_merkle_queries(connected_client_sock, &tree)) {
+			free(tree.nodes);
+			fclose(recvd_file);
+			return CONNECTION_CLOSED;
+		}
+		free(tree.nodes);
+	}
+
+	if(udp_sock >= 0) {
+		/* all data comes over udp. The connection only carries the end
+		of the file, as for any other upload. */
+		int received = _receive_over_udp(connected_client_sock, udp_sock, 
+			fileno(recvd_file), filesize, filename, log_file, &bytes_transferred);
+		close(udp_sock);
+		if(!received) {
+			printf("\nUdp transfer failed. Dropping the client.\n");
+			fclose(recvd_file);
+			return CONNECTION_CLOSED;
+		}
+	}
+
+	/* the segments are passed on to the next server as they come, after
+	the part of the file we had already, or got over udp */
+	if(_forward_begin(log_file, filename, filesize)) {
+		fflush(recvd_file);
+		_forward_from_disk(fileno(recvd_file), bytes_transferred);
+	}
+
+	recvd_bytes = 1; /* setting just to start the loop */
+	while(!completed && recvd_bytes > 0) {
+		retry = 3;
+		RTO = 3;
+		while(retry > 0) {   /*we will try resending 3 times in case of failure */
+			recvd_bytes = recv_with_timeout(connected_client_sock, 
+				(struct segment *)&recvd_segment, 
+				sizeof(struct segment), RTO);
+
+			if(recvd_bytes == 0) {
+				printf("\nConnection closed by client.\n");
+				break;
+			}
+			else if(recvd_bytes == -1) {
+				perror("Timeout");
+				fclose(recvd_file);
+				return CONNECTION_CLOSED;
+			}
+			else if(recvd_bytes == TIMEOUT_OCCURED) {
+				printf("\nTimeout ocurred. Retrying ...\n");
+				_trace(TRACE_TIMEOUT, server_segment.ack_no, RTO);
+				retry--;
+				RTO *= 2; 
+
+				/*as the timeout has ocurred we will update the corresponding
+				record in log file*/
+				_update_transfer_progress_in_log(&log_entry, filename, 
+						0, 0, log_file, UPDATE_LOG_TIMEOUT);
+				/* we provide the timeout argument of the function as 1 
+				so that function gets to know only timeout has to be updated */
+			}
+			else if(recvd_segment.seq_no == END_OF_FILE_SEQ && bucket.enabled) {
+				/* the object appears in the bucket once it is put 
+				together from the parts */
+				completed = (upload == NULL) || _finish_bucket_upload(upload);
+				upload = NULL;
+				server_segment.seq_no = END_OF_FILE_SEQ;
+				server_segment.ack_no = completed;
+				send_all(connected_client_sock, &server_segment, 
+					sizeof(struct segment));
+				if(!completed) {
+					printf("\nCouldn't put %s together in the bucket.\n", filename);
+					fclose(recvd_file);
+					*log_file_ptr = log_file;
+					return 0;
+				}
+				break;
+			}
+			else if(recvd_segment.seq_no == END_OF_FILE_SEQ) {
+				/* client has sent everything it had planned. The file
+				might have shrunk since an earlier attempt, so cut it to size.
+				It is only stored if all its writes went through, those of
+				the writer included. */
+				completed = (fflush(recvd_file) == 0);
+				if(receive_pipeline != NULL && !_drain_writes(receive_pipeline)) {
+					completed = 0;
+				}
+				if(ftruncate(fileno(recvd_file), filesize) < 0) {
+					perror("Truncating file");
+					completed = 0;
+				}
+
+				/* in a chain, the file is acked once it is on the disk of
+				every server down to the last */
+				if(downstream.enabled || replica) {
+					fsync(fileno(recvd_file));
+				}
+				server_segment.seq_no = END_OF_FILE_SEQ;
+				server_segment.ack_no = _forward_end();
+				if(!server_segment.ack_no) {
+					printf("\nCouldn't forward %s to the next server.\n", filename);
+				}
+				if(!completed) {
+					printf("\nCouldn't write all of %s. Its upload has failed.\n", filename);
+					server_segment.ack_no = 0;
+				}
+				send_all(connected_client_sock, &server_segment, 
+					sizeof(struct segment));
+				break;
+			}
+			else {  /*else we have got some data */
+				/* The client decides which segment comes next, as on a
+				resume it repairs the corrupt ranges before continuing with 
+				the tail. Writes are positional, so a retransmitted segment 
+				is simply written again at the same place. */
+				long offset = (long)recvd_segment.seq_no * BUFFER_SIZE;
+
+				if(recvd_segment.length < 0 || (recvd_segment.length > BUFFER_SIZE && 
+					!(recvd_segment.flags & (SEGMENT_LONG | SEGMENT_FRAMED)))) {
+					printf("\nReceived a malformed segment. Dropping the client.\n");
+					fclose(recvd_file);
+					return CONNECTION_CLOSED;
+				}
+
+				data = (unsigned char *)recvd_segment.buffer;
+				data_length = recvd_segment.length;
+				if(recvd_segment.flags & SEGMENT_LONG) {
+					/* the data follows, in a block as large as the client's
+					tuning found best for the path */
+					if(data_length > LONG_SEGMENT_MAX || offset + data_length > filesize) {
+						printf("\nReceived a malformed long segment. Dropping the client.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					if(long_block == NULL) {
+						long_block = (unsigned char *)malloc(LONG_SEGMENT_MAX);
+					}
+					_fit_receive_buffer(connected_client_sock, data_length);
+					if(recv_with_timeout(connected_client_sock, (struct segment *)long_block,
+						data_length, RTO) != data_length) {
+						printf("\nLost the client in a long segment.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					data = long_block;
+				}
+				else if(recvd_segment.flags & SEGMENT_FRAMED) {
+					/* blocks framed by the client's pipeline, decoded by
+					ours and written while we go on with the next segment */
+					if(data_length > (long)FRAMED_SEGMENT_MAX) {
+						printf("\nReceived a malformed framed segment. Dropping the client.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					if(receive_pipeline == NULL) {
+						receive_pipeline = _start_receive_pipeline();
+					}
+					_fit_receive_buffer(connected_client_sock, data_length);
+					if(recv_with_timeout(connected_client_sock, 
+						(struct segment *)receive_pipeline->payload, data_length, RTO) != data_length) {
+						printf("\nLost the client in a framed segment.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					data = _next_write_buffer(receive_pipeline);
+					data_length = _decode_frames(receive_pipeline, data_length, data);
+					if(data_length == FRAMES_CORRUPT) {
+						/* acked with the segment's own seq, for the client
+						to send it again */
+						printf("\nA block of segment %d doesn't match its checksum.\n",
+							recvd_segment.seq_no);
+						server_segment.seq_no = server_segment.ack_no = recvd_segment.seq_no;
+						send_all(connected_client_sock, &server_segment, sizeof(struct segment));
+						break;
+					}
+					if(data_length < 0 || offset + data_length > filesize) {
+						printf("\nReceived a malformed framed segment. Dropping the client.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					/* what stdio has of the earlier segments goes first */
+					fflush(recvd_file);
+					if(!bucket.enabled) {
+						_queue_write(receive_pipeline, fileno(recvd_file), offset, data_length);
+					}
+					wrote_bytes = data_length;
+				}
+				else if(recvd_segment.flags & SEGMENT_HOLE) {
+					/* a hole of the client's sparse file, which we recreate
+					instead of writing its zeros */
+					memcpy(&hole, recvd_segment.buffer, sizeof(hole));
+					if(recvd_segment.length != sizeof(hole) || hole.offset != offset ||
+						hole.length <= 0 || hole.length > filesize - offset) {
+						printf("\nReceived a malformed hole segment. Dropping the client.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					fflush(recvd_file);
+					if(!bucket.enabled && 
+						!_punch_hole(fileno(recvd_file), hole.offset, hole.length)) {
+						printf("\nCan't write the hole. Dropping the client.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					wrote_bytes = hole.length;
+				}
+				else if(recvd_segment.flags & SEGMENT_COMPRESSED) {
+					data_length = _lz_decompress(data, data_length, 
+						block, sizeof(block));
+					if(data_length < 0) {
+						printf("\nReceived a malformed compressed segment. Dropping the client.\n");
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+					data = block;
+				}
+
+				if(bucket.enabled) {
+					/* in order, as parts are uploaded as they fill up */
+					if(!(recvd_segment.flags & (SEGMENT_HOLE | SEGMENT_FRAMED))) {
+						wrote_bytes = data_length;
+					}
+					taken = (upload == NULL) ? -1 : _bucket_take(upload, offset, 
+						(recvd_segment.flags & SEGMENT_HOLE) ? NULL : data, wrote_bytes);
+					if(taken <= 0) {
+						printf(taken < 0 ? "\nSegment %d doesn't follow what we have. Dropping the client.\n" :
+							"\nCouldn't upload segment %d to the bucket. Dropping the client.\n",
+							recvd_segment.seq_no);
+						/* the client starts over from the parts which got there */
+						if(upload != NULL) _drop_bucket_upload(upload);
+						fclose(recvd_file);
+						return CONNECTION_CLOSED;
+					}
+				}
+				else if(!(recvd_segment.flags & (SEGMENT_HOLE | SEGMENT_FRAMED))) {
+					//seeking the file at right position
+					fseek(recvd_file, offset, SEEK_SET);
+
+					//write to file and increment acknowledgement no.
+					write_started = _now_us();
+					wrote_bytes = fwrite(data, sizeof(char), data_length, recvd_file);
+					_time_disk_write(write_started);
+					_trace(TRACE_DISK_WRITE, offset, _now_us() - write_started);
+				}
+				_count_transfer(connected_client_sock, wrote_bytes);
+
+				if(recvd_segment.flags & (SEGMENT_LONG | SEGMENT_FRAMED)) {
+					_forward_bytes(data, data_length, offset);
+				}
+				else {
+					_forward_segment(&recvd_segment);
+				}
+
+				/* current seq is received and we want the next one*/
+				server_segment.seq_no = recvd_segment.seq_no; 
+				server_segment.ack_no = recvd_segment.seq_no + 1;
+				if(recvd_segment.flags & (SEGMENT_LONG | SEGMENT_FRAMED)) {
+					server_segment.ack_no = recvd_segment.seq_no + 
+						(data_length + BUFFER_SIZE - 1) / BUFFER_SIZE;
+				}
+				_trace(TRACE_SEGMENT_RECEIVED, recvd_segment.seq_no, recvd_segment.length);
+
+				/* as new segment has been written to file, we will update
+				the records in corresponding log file. bytes_transferred is the
+				length of the prefix of the file we have, which is what a 
+				resume starts from. */
+				if(offset + wrote_bytes > bytes_transferred) {
+					bytes_transferred = offset + wrote_bytes;
+				}
+				if((unsigned short)((bytes_transferred/(float)filesize)*100) != percentage) {
+					/* progress is shown by the percent, segments are 
+					only traced */
+					percentage = (bytes_transferred/(float)filesize)*100;
+					printf("\nReceived %lu Bytes\n", bytes_transferred);
+				}
+				if(upload != NULL) {
+					/* of a file in the bucket, only the parts there outlast us */
+					long committed = (long)__atomic_load_n(&upload->committed, 
+						__ATOMIC_RELAXED) * upload->part_size;
+					if(committed > filesize) committed = filesize;
+					_update_transfer_progress_in_log(&log_entry, filename, 
+						committed, (committed/(float)filesize)*100, log_file, 
+						UPDATE_LOG_PROGRESS);
+				}
+				else {
+					_update_transfer_progress_in_log(&log_entry, filename, 
+						bytes_transferred, percentage, log_file, 
+						UPDATE_LOG_PROGRESS);
+				}
+
+				//now send the acknowledgement with proper ack_no
+				send_all(connected_client_sock, (void *)&server_segment, 
+					sizeof(struct segment));
+				_trace(TRACE_ACK_SENT, server_segment.seq_no, server_segment.ack_no);
+				
+				break; /* now no need to retry for this segment */
+			}
+		}
+
+		if(retry == 0) {
+			printf("\nConnection Lost\n");
+			fclose(recvd_file);
+			return CONNECTION_CLOSED;
+		}
+	}
+	if(completed){
+		printf("\nFile received successfully.\n");
+
+		/* update the log record on completion of file transfer */
+		_update_transfer_progress_in_log(&log_entry, filename, 
+						filesize, 100, log_file, UPDATE_LOG_COMPLETED);
+
+		/* now, we also need to remove the file entry from line 2 as the
+		list should contain the files which are not completely received*/
+		log_file = _update_file_to_be_received_list(log_file, filename);
+	}
+
+	fclose(recvd_file);
+	*log_file_ptr = log_file;
+	return completed;
+};
+
+/* A session stands for a client whose logs we have, across its 
+connections: a client which loses its connection comes back with the token
+of its session, which spares the exchange of the logs. Sessions are kept 
+until their slots are needed for new ones. */
+struct session {
+	char token[SESSION_TOKEN_LENGTH + 1];
+	int sock;             /* of the connection serving it, -1 if none */
+	long long last_used;  /* us */
+};
+
+struct session sessions[MAX_SESSIONS];
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a token nobody can guess, in hex */
+void _new_session_token(char * token) {
+	unsigned char random[SESSION_TOKEN_LENGTH / 2];
+	int fd = open("/dev/urandom", O_RDONLY), i;
+
+	if(fd < 0 || read(fd, random, sizeof(random)) != sizeof(random)) {
+		perror("Session token");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	for(i = 0; i < (int)sizeof(random); i++) {
+		sprintf(token + 2 * i, "%02x", random[i]);
+	}
+};
+
+/* index of the session of a token, or -1. The session lock is held. */
+int _find_session(const char * token) {
+	int i;
+
+	for(i = 0; i < MAX_SESSIONS; i++) {
+		if(sessions[i].token[0] && strcmp(sessions[i].token, token) == 0) return i;
+	}
+	return -1;
+};
+
+/* Hands the session of a token over to a new connection. Its old one is 
+cut, as when a client has found its connection lost, we may well not have 
+yet: the thread serving it would keep its turn until its timeouts. Returns 
+0 if we don't know the token. */
+int _take_over_session(const char * token, int sock_fd) {
+	int i, cut = -1;
+
+	pthread_mutex_lock(&session_lock);
+	i = _find_session(token);
+	if(i >= 0) {
+		if(sessions[i].sock >= 0 && sessions[i].sock != sock_fd) {
+			cut = sessions[i].sock;
+			shutdown(cut, SHUT_RDWR);
+		}
+		sessions[i].sock = sock_fd;
+		sessions[i].last_used = _now_us();
+	}
+	pthread_mutex_unlock(&session_lock);
+	if(cut >= 0) _trace(TRACE_SESSION_RESUMED, sock_fd, cut);
+	return i >= 0;
+};
+
+/* keeps a session whose logs were just exchanged, in a free slot or that
+of the session unused for longest */
+void _add_session(const char * token, int sock_fd) {
+	int i, slot = -1;
+
+	pthread_mutex_lock(&session_lock);
+	for(i = 0; i < MAX_SESSIONS; i++) {
+		if(sessions[i].token[0] == '\0') {
+			slot = i;
+			break;
+		}
+		if(sessions[i].sock < 0 && (slot < 0 || sessions[i].last_used < sessions[slot].last_used)) {
+			slot = i;
+		}
+	}
+	if(slot >= 0) {
+		strcpy(sessions[slot].token, token);
+		sessions[slot].sock = sock_fd;
+		sessions[slot].last_used = _now_us();
+	}
+	pthread_mutex_unlock(&session_lock);
+};
+
+/* the connection of a session is done with, unless the session has moved
+on to another one already */
+void _end_session(const char * token, int sock_fd) {
+	int i;
+
+	pthread_mutex_lock(&session_lock);
+	i = _find_session(token);
+	if(i >= 0 && sessions[i].sock == sock_fd) {
+		sessions[i].sock = -1;
+		sessions[i].last_used = _now_us();
+	}
+	pthread_mutex_unlock(&session_lock);
+};
+
+/* Looks whether a client waiting for its turn is resuming a session, 
+which it tells before reading our greeting. Returns 1 if so. */
+int _peek_resume_request(int sock_fd) {
+	char buffer[BUFFER_SIZE];
+
+	if(recv(sock_fd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT) != sizeof(buffer) ||
+		strncmp(buffer, "RESUME ", 7) != 0) {
+		return 0;
+	}
+	buffer[7 + SESSION_TOKEN_LENGTH] = '\0';
+	_take_over_session(buffer + 7, sock_fd);
+	return 1;
+};
+
+/* the log, which the upload threads take turns on */
+pthread_mutex_t upload_lock = PTHREAD_MUTEX_INITIALIZER;
+FILE * shared_log_file;
+
+/* Waits for the turn of uploads, which every upload takes for the exchange
+of the logs and then for every file, as they all update the same log. A
+client resuming its session may be waiting behind its own old connection,
+which is cut as soon as we see that, if `peek` is set. */
+void _take_upload_turn(int sock_fd, int peek) {
+	struct timespec until;
+
+	pthread_mutex_lock(&metrics.lock);
+	metrics.uploads_waiting++;
+	pthread_mutex_unlock(&metrics.lock);
+	while(1) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += SESSION_PEEK_INTERVAL * 1000;
+		if(until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		if(pthread_mutex_timedlock(&upload_lock, &until) == 0) break;
+		if(peek) peek = !_peek_resume_request(sock_fd);
+	}
+	pthread_mutex_lock(&metrics.lock);
+	metrics.uploads_waiting--;
+	pthread_mutex_unlock(&metrics.lock);
+};
+
+/* Waits, without the turn, until the client sends its next file. A client
+with --watch or --follow may keep its connection open for hours between 
+two files. Returns 0 once the connection is closed. */
+int _wait_for_next_file(int sock_fd) {
+	char byte;
+	int peeked;
+
+	do {
+		peeked = recv(sock_fd, &byte, 1, MSG_PEEK);
+	} while(peeked < 0 && errno == EINTR);
+	return peeked > 0;
+};
+
+/* Serves a connected client: exchanges the logs, then receives files until
+the client closes the connection. A client may keep the connection open and
+send files as they change. */
+void _serve_client(int connected_client_sock, FILE ** log_file_ptr) {
+	FILE * temp_log = NULL;
+	char buffer[BUFFER_SIZE] = {0};
+	char token[SESSION_TOKEN_LENGTH + 1];
+	int logfile_size, temp_log_file_size, result, resumed = 0;
+
+	/* We will first send the size of log file and also receive the logfile size
+	from other side. This will be our protocol to stop receiving once the whole 
+	filesize has been received. 
+	MAJOR BUG HERE: recv in recvlog function was waiting
+	for a data which was already received. And there is no way to tell recv that when
+	to stop waiting for receive without the filesize. */
+
+	/*sending logfile size, with the token the session gets once the logs
+	are exchanged. Clients which don't know of sessions only read the size. */
+	_take_upload_turn(connected_client_sock, 1);
+	_new_session_token(token);
+	logfile_size = _get_file_size(*log_file_ptr);
+	sprintf(buffer, "%d %s", logfile_size, token);
+	send(connected_client_sock, buffer, sizeof(buffer), MSG_NOSIGNAL);
+	
+	/*Recieving log file size of client, or the token of the session it resumes */
+	if(recv(connected_client_sock, buffer, sizeof(buffer), MSG_WAITALL) != sizeof(buffer)) {
+		printf("\nConnection closed by client.\n");
+		pthread_mutex_unlock(&upload_lock);
+		return;
+	}
+	if(strncmp(buffer, "RESUME ", 7) == 0) {
+		buffer[7 + SESSION_TOKEN_LENGTH] = '\0';
+		resumed = _take_over_session(buffer + 7, connected_client_sock);
+		if(resumed) {
+			strcpy(token, buffer + 7);
+			pthread_mutex_lock(&metrics.lock);
+			metrics.sessions_resumed++;
+			pthread_mutex_unlock(&metrics.lock);
+			printf("\nClient resumed its session.\n");
+		}
+		/* if we don't know the session, as we were restarted since, the
+		client exchanges the logs as on a new connection */
+		strcpy(buffer, resumed ? "RESUMED" : "NEW");
+		send(connected_client_sock, buffer, sizeof(buffer), MSG_NOSIGNAL);
+		if(!resumed && recv(connected_client_sock, buffer, sizeof(buffer), MSG_WAITALL) != 
+			sizeof(buffer)) {
+			printf("\nConnection closed by client.\n");
+			pthread_mutex_unlock(&upload_lock);
+			return;
+		}
+	}
+
+	if(!resumed) {
+		/* Once connected we first exchange the log files. Received log file 
+		from client is saved as temp.txt */
+		temp_log = fopen(RECEIVED_LOG, "w+"); /* w+ mode as we need to read too*/
+		if(temp_log == NULL) {
+			perror("Client log");
+			pthread_mutex_unlock(&upload_lock);
+			return;
+		}
+		temp_log_file_size = atoi(buffer);
+
+		/*Now sending the log file and also receiving from the client*/
+		if(!sendlog(*log_file_ptr, connected_client_sock, logfile_size) ||
+			!recvlog(temp_log, connected_client_sock, temp_log_file_size)) {
+			printf("\nConnection closed by client.\n");
+			fclose(temp_log);
+			pthread_mutex_unlock(&upload_lock);
+			return;
+		}
+
+		/*Server now syncs the info about file to be uploaded by client.
+		Server gets the information of files waiting to be uploaded in client
+		directory via this function only, by reading and synching with the
+		client log, which was just received.*/
+		*log_file_ptr = _sync_uncommon_files_with_client_log(*log_file_ptr, temp_log);
+		_add_session(token, connected_client_sock);
+	}
+
+	if(temp_log != NULL) fclose(temp_log);
+	pthread_mutex_unlock(&upload_lock);
+
+	/* the turn is given up between files, so that a client keeping its 
+	connection open doesn't hold up the others */
+	while(_wait_for_next_file(connected_client_sock)) {
+		_take_upload_turn(connected_client_sock, 0);
+		result = _receive_file(connected_client_sock, log_file_ptr);
+		_end_transfer(result == 1);
+		pthread_mutex_unlock(&upload_lock);
+		fflush(stdout);
+		if(result == CONNECTION_CLOSED) break;
+	}
+	_end_session(token, connected_client_sock);
+};
+
+/* tells whether we have received a file completely, from our log. The log
+is opened anew, as an upload may be updating it in another thread. */
+int _is_received_completely(char * filename) {
+	FILE * log = fopen(LOGFILE_NAME, "r");
+	server_log log_entry;
+	int complete = 0;
+
+	if(log == NULL) return 0;
+	_goto_line_num_in_file(log, FILE_RECORD_LINE_NUMBER);
+	while(fread(&log_entry, sizeof(server_log), 1, log)) {
+		if(strcmp(log_entry.filename, filename) == 0) {
+			complete = (log_entry.percentage_completion == 100);
+			break;
+		}
+	}
+	fclose(log);
+	return complete;
+};
+
+/* the swarms we track, which the event loop alone looks after */
+struct swarm swarms[SWARM_MAX_FILES];
+int swarm_count = 0, next_swarm_slot = 0;
+
+/* Size of the chunks a file is split into for a swarm. A peer's bitmap of 
+them has to fit into the buffer of a segment. */
+long _get_swarm_chunk_size(long filesize) {
+	long chunk_count = (filesize + SWARM_CHUNK_SIZE - 1) / SWARM_CHUNK_SIZE;
+	long bits = BUFFER_SIZE * 8;
+
+	return SWARM_CHUNK_SIZE * ((chunk_count + bits - 1) / bits > 1 ? 
+		(chunk_count + bits - 1) / bits : 1);
 };
 
-/* an utility function to remove a substring from string. (Just one ocurrance) 
-used when we have to remove the successfully uploaded file from the list
-of files to be uploaded.*/
-char * _remove_from_string(char * string, char *substring) {
-	int len = strlen(substring);
-	char * temp; 
+/* The swarm of a file, started if there is none yet. A file which has 
+been changed since its chunks were hashed starts a new swarm. */
+struct swarm * _find_swarm(char * filename, int fd) {
+	struct swarm * swarm = NULL;
+	struct stat file_stat;
+	unsigned char * chunk;
+	long length;
+	int i;
 
-	if(len > 0) {
-		temp = strstr(string, substring);
+	fstat(fd, &file_stat);
+	for(i = 0; i < swarm_count; i++) {
+		if(strcmp(swarms[i].filename, filename) == 0) swarm = &swarms[i];
+	}
+	if(swarm != NULL && swarm->filesize == file_stat.st_size && 
+		swarm->mtime == file_stat.st_mtime) {
+		return swarm;
+	}
+	if(swarm == NULL) {
+		/* the oldest swarm gives way when there are too many */
+		if(swarm_count < SWARM_MAX_FILES) {
+			swarm = &swarms[swarm_count++];
+		}
+		else {
+			swarm = &swarms[next_swarm_slot];
+			next_swarm_slot = (next_swarm_slot + 1) % SWARM_MAX_FILES;
+		}
+	}
+	free(swarm->hashes);
+	memset(swarm, 0, sizeof(struct swarm));
+	strcpy(swarm->filename, filename);
+	swarm->filesize = file_stat.st_size;
+	swarm->mtime = file_stat.st_mtime;
+	swarm->chunk_size = _get_swarm_chunk_size(swarm->filesize);
+	swarm->chunk_count = (swarm->filesize + swarm->chunk_size - 1) / swarm->chunk_size;
+	swarm->hashes = (unsigned char *)malloc(swarm->chunk_count * HASH_SIZE + 1);
 
-		if(temp != NULL) {
-			memmove(temp, temp + len, strlen(len + temp) + 1);
+	chunk = (unsigned char *)malloc(swarm->chunk_size);
+	for(i = 0; i < swarm->chunk_count; i++) {
+		length = pread(fd, chunk, swarm->chunk_size, (long)i * swarm->chunk_size);
+		if(length < 0) {
+			perror("Reading file");
+			exit(EXIT_FAILURE);
 		}
+		_sha256(chunk, length, swarm->hashes + i * HASH_SIZE);
 	}
-	return string;
+	free(chunk);
+	return swarm;
 };
 
-void _update_file_to_be_received_list(FILE * server_log, char * filename) {
-	/*we will first read line 2 as string and remove the 
-		current filename from this string. then we will replace line 2 of the 
-		server log file with this new string.*/
-	char * line = _get_line_as_string(server_log, 2);
-	char * updated_line = _remove_from_string(line, filename);
+/* Answers a request of a peer of a swarm, which either joins the swarm or
+asks for a chunk. A join is answered with the other peers, in the buffer
+of the header, followed by the hashes of the chunks if the peer asks for 
+them with ack_no 1. The peer says in its buffer on which port it serves 
+chunks, and is forgotten if it doesn't join again now and then. */
+void _answer_swarm_request(struct download * download) {
+	struct segment * request = &download->request;
+	struct swarm * swarm = _find_swarm(request->filename, download->fd);
+	struct swarm_peer_address peer, * listed = (struct swarm_peer_address *)download->header.buffer;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	time_t now = time(NULL);
+	int i;
 
-	_replace_line(server_log, 2, updated_line);	
-};
+	sprintf(download->header.filesize, "%ld", swarm->filesize);
+	download->header.seq_no = request->seq_no;
+	download->offset = download->filesize = 0;
 
-void printlog(FILE * log_file) {
-	char ch;
-	int linenum = 1;
-	fseek(log_file, 0 ,SEEK_SET);
+	if(request->seq_no == SWARM_JOIN) {
+		getpeername(download->sock, (struct sockaddr *)&addr, &len);
+		request->buffer[BUFFER_SIZE - 1] = '\0';
+		peer.addr = addr.sin_addr;
+		peer.port = atoi(request->buffer);
 
-	while((ch = getc(log_file)) != EOF) {
-		if(ch == '\n') {
-			linenum++;
+		for(i = 0; i < swarm->peer_count; i++) {
+			if(swarm->peers[i].addr.s_addr == peer.addr.s_addr && 
+				swarm->peers[i].port == peer.port) {
+				break;
+			}
 		}
-		printf("%c", ch);
-		if(linenum == FILE_RECORD_LINE_NUMBER) {
-			break;
+		if(i == swarm->peer_count && swarm->peer_count < SWARM_MAX_PEERS) {
+			swarm->peers[swarm->peer_count++] = peer;
 		}
-	}
-	server_log log_entry;
-	char * endtime;
-	while(fread((&log_entry), sizeof(server_log), 1, log_file)) {
-		if(strcmp(log_entry.end_time, "\0") == 0) {
-			endtime = "NA";
+		if(i < swarm->peer_count) swarm->last_seen[i] = now;
+
+		for(i = 0; i < swarm->peer_count; i++) {
+			if(now - swarm->last_seen[i] > SWARM_PEER_TIMEOUT) {
+				/* the last one takes its place */
+				swarm->peer_count--;
+				swarm->peers[i] = swarm->peers[swarm->peer_count];
+				swarm->last_seen[i] = swarm->last_seen[swarm->peer_count];
+				i--;
+				continue;
+			}
+			if((swarm->peers[i].addr.s_addr != peer.addr.s_addr || 
+				swarm->peers[i].port != peer.port) && 
+				(download->header.length + 1) * (int)sizeof(peer) <= BUFFER_SIZE) {
+				listed[download->header.length++] = swarm->peers[i];
+			}
 		}
-		else {
-			endtime = log_entry.end_time;
+		download->header.ack_no = 1;
+		if(request->ack_no == 1) {
+			/* copied, as the swarm may be started anew meanwhile */
+			download->body_length = swarm->chunk_count * HASH_SIZE;
+			download->body = (unsigned char *)malloc(download->body_length);
+			memcpy(download->body, swarm->hashes, download->body_length);
 		}
-		printf("%-35s\t%-15s\t%-20s\t%-20lu\t%i%%\t%20s\t%20lu\t%20lu\n", 
-			log_entry.filename,
-			log_entry.filesize,
-			log_entry.start_time,
-			log_entry.bytes_transferred,
-			log_entry.percentage_completion,
-			endtime,
-			log_entry.connection_count,
-			log_entry.timeout_count);
+		return;
 	}
+
+	if(request->seq_no < 0 || request->seq_no >= swarm->chunk_count) return;
+	download->header.ack_no = 1;
+	download->offset = (long)request->seq_no * swarm->chunk_size;
+	download->filesize = (download->offset + swarm->chunk_size < swarm->filesize) ? 
+		download->offset + swarm->chunk_size : swarm->filesize;
+	download->header.length = download->filesize - download->offset;
 };
 
-int main(int argc, char * argv[]) {
-	int server_sock, connected_client_sock;
-	struct sockaddr_in server_addr, client_addr;
-	int size_server_addr = sizeof(server_addr);
+/* Handles the request of a download, once it has been read: the header 
+which answers it tells the size of the file, or ack_no 0 if we can't serve
+it. Only files received completely are served. */
+void _answer_download_request(struct download * download) {
+	struct segment * request = &download->request;
+	struct stat file_stat;
+	long resumed_size, resumed_mtime;
 
-	//for received file stats
-	int filesize;
-	char buffer[BUFFER_SIZE] = {0};
-	char filename[FILENAME_SIZE];
+	memset(&download->header, 0, sizeof(struct segment));
+	request->filename[FILENAME_SIZE - 1] = '\0';
+	strcpy(download->header.filename, request->filename);
+	download->state = DOWNLOAD_SENDING_HEADER;
 
-	//declaring the structure for segment and recvd segment
-	struct segment server_segment = {0};
-	struct segment recvd_segment = {0};
+	if(!_is_safe_path(request->filename) || 
+		!_is_received_completely(request->filename) ||
+		(download->fd = open(request->filename, O_RDONLY)) < 0) {
+		printf("\nCan't serve %s for download.\n", request->filename);
+		return;
+	}
+	if(request->flags & SEGMENT_SWARM) {
+		_answer_swarm_request(download);
+		return;
+	}
+	fstat(download->fd, &file_stat);
+	download->filesize = file_stat.st_size;
+	/* the client asks for the bytes after those it has already, and tells
+	the size and modification time of the copy it had them from. If ours
+	has been replaced since, it gets the whole file again. */
+	download->offset = atol(request->filesize);
+	request->buffer[BUFFER_SIZE - 1] = '\0';
+	if(download->offset < 0 || download->offset > download->filesize ||
+		sscanf(request->buffer, "%ld %ld", &resumed_size, &resumed_mtime) != 2 ||
+		resumed_size != file_stat.st_size || resumed_mtime != file_stat.st_mtime) {
+		download->offset = 0;
+	}
 
-	//File pointer to open a file to write the data received from stream
-	FILE * recvd_file, * log_file;
+	download->header.ack_no = 1;
+	sprintf(download->header.filesize, "%ld", download->filesize);
+	sprintf(download->header.buffer, "%ld %ld", (long)download->offset, (long)file_stat.st_mtime);
+	printf("\nServing %s from %ld Bytes\n", request->filename, (long)download->offset);
+};
 
-	//Retransmission timeout value
-	short RTO;   /* initial value will be 3 sec which will be doubled each retry */
-	short retry;   /* sender will retry sending acc to this value */
+/* Moves a download on as far as its socket lets it without blocking. 
+Returns 0 when the download is finished or has failed. */
+int _progress_download(struct download * download) {
+	ssize_t done;
 
-	//resetting the both address structure to zero
-	memset(&server_addr, 0, size_server_addr);
-	memset(&client_addr, 0, sizeof(client_addr));
+#ifdef USE_KTLS
+	if(download->state == DOWNLOAD_HANDSHAKE) {
+		done = _continue_tls_handshake(download);
+		if(done <= 0) return done == 0;
+		download->state = DOWNLOAD_READING_REQUEST;
+	}
+#endif
+	if(download->state == DOWNLOAD_READING_REQUEST) {
+		while(download->request_received < sizeof(struct segment)) {
+			done = recv(download->sock, (char *)&download->request + download->request_received,
+				sizeof(struct segment) - download->request_received, 0);
+			if(done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+			if(done <= 0) return 0;
+			download->request_received += done;
+		}
+		_answer_download_request(download);
+	}
 
-	int recvd_bytes, remaining_file, wrote_bytes;
-	int logfile_size, temp_log_file_size;
+	if(download->state == DOWNLOAD_SENDING_HEADER) {
+		while(download->header_sent < sizeof(struct segment)) {
+			done = send(download->sock, (char *)&download->header + download->header_sent,
+				sizeof(struct segment) - download->header_sent, MSG_NOSIGNAL);
+			if(done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+			if(done <= 0) return 0;
+			download->header_sent += done;
+		}
+		if(download->header.ack_no == 0) return 0;
+		download->state = DOWNLOAD_SENDING_FILE;
+	}
 
-	log_file = _initialise_log(); /* create log file if Doesn't exist and return*/
+	while(download->body_sent < download->body_length) {
+		done = send(download->sock, download->body + download->body_sent,
+			download->body_length - download->body_sent, MSG_NOSIGNAL);
+		if(done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+		if(done <= 0) return 0;
+		download->body_sent += done;
+	}
 
-	/* if command line has some argument process that */
-	if(argc > 1) {
-		if(strcmp("--log",argv[1]) == 0) { 
-		/*if --log flag is used show logs on STDOUT.*/
-			printlog(log_file);
-			exit(EXIT_SUCCESS);
-		}
+	/* the file goes from the page cache to the socket without being 
+	copied through our memory */
+	while(download->offset < download->filesize) {
+		done = sendfile(download->sock, download->fd, &download->offset, 
+			download->filesize - download->offset);
+		if(done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+		if(done <= 0) return 0;
+		_trace(TRACE_DOWNLOAD_SENT, download->sock, done);
+		pthread_mutex_lock(&metrics.lock);
+		metrics.download_bytes_total += done;
+		pthread_mutex_unlock(&metrics.lock);
 	}
+	if(!(download->request.flags & SEGMENT_SWARM)) {
+		printf("\nDownload of %s completed.\n", download->request.filename);
+	}
+	return 0;
+};
+
+void _close_download(int epoll_fd, struct download * download) {
+	pthread_mutex_lock(&metrics.lock);
+	metrics.downloads_active--;
+	pthread_mutex_unlock(&metrics.lock);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, download->sock, NULL);
+	close(download->sock);
+	if(download->fd >= 0) close(download->fd);
+#ifdef USE_KTLS
+	if(download->ssl != NULL) SSL_free(download->ssl);
+#endif
+	free(download->body);
+	free(download);
+};
+
+/* an upload connection is served in a thread of its own, so that the event
+loop keeps serving downloads meanwhile */
+void * _upload_thread(void * arg) {
+	int connected_client_sock = (int)(long)arg;
+
+	if(!_start_tls(connected_client_sock)) {
+		close(connected_client_sock);
+		return NULL;
+	}
+	_serve_client(connected_client_sock, &shared_log_file);
+	close(connected_client_sock);
+	printf("\nServer is listening for connection ...\n");
+	fflush(stdout);
+	return NULL;
+};
 
+/* creates a listening socket on a port */
+int _listen_on(int port, int backlog) {
+	struct sockaddr_in server_addr;
+	int server_sock, yes = 1;
 
+	memset(&server_addr, 0, sizeof(server_addr));
 	server_sock = socket(AF_INET, SOCK_STREAM, 0);
 	if(server_sock < 0) {
 		perror("Socket error");
 		exit(EXIT_FAILURE);
 	}
 
-	fflush(stdout);  /* We are flushing it so that we can immediately print 
-	on any file, as socket will be buffering anything written to files,
-	 and not print until it gets a connection.*/
-
 	server_addr.sin_family = PF_INET;
 	server_addr.sin_addr.s_addr = INADDR_ANY;
-	server_addr.sin_port = htons(PORT);
+	server_addr.sin_port = htons(port);
 
-	int yes = 1;
 	if(setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
 		perror("Bind Settings");
 		exit(EXIT_FAILURE);
 	}
-
-	int bind_res = bind(server_sock, (struct sockaddr_in *) &server_addr,
-		 size_server_addr);
-	if(bind_res < 0) {
+	if(bind(server_sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
 		perror("Bind");
 		exit(EXIT_FAILURE);
 	}
-
-	if(listen(server_sock, BACKLOG) < 0) {
+	if(listen(server_sock, backlog) < 0) {
 		perror("Listening");
 		exit(EXIT_FAILURE);
 	}
+	return server_sock;
+};
 
-	printf("Server Binded on port %d \n", PORT);
-	printf("\nServer is listening for connection ...\n");
+int main(int argc, char * argv[]) {
+	int server_sock, download_sock, connected_client_sock;
+	struct sockaddr_in client_addr;
+	socklen_t size_client_addr = sizeof(client_addr);
+	struct epoll_event event, events[MAX_EVENTS];
+	struct download * download;
+	pthread_t upload_thread;
+	int epoll_fd, event_count, i;
 
-	fflush(stdout);
-	connected_client_sock = accept(server_sock, (struct sockaddr_in *) &client_addr,
-		(socklen_t *) &size_server_addr);
-	if(connected_client_sock < 0) {
-		perror("Connection");
-		exit(EXIT_FAILURE);
-	}
+	pthread_mutex_init(&metrics.lock, NULL);
+	//resetting the address structure to zero
+	memset(&client_addr, 0, sizeof(client_addr));
 
-	//getting the ip address and port of client
-	char client_ip[INET_ADDRSTRLEN];
-	if(inet_ntop(AF_INET, &client_addr.sin_addr,
-	 client_ip, INET_ADDRSTRLEN) == NULL) {
-	 	perror("Address transalation");
-	 	exit(EXIT_FAILURE);
-	}
+	shared_log_file = _initialise_log(); /* create log file if Doesn't exist and return*/
 
-	int client_port = ntohs(client_addr.sin_port);
+	/* if command line has some argument process that */
+	int port = PORT, metrics_port = 0, trace = TRACE_OFF, arg;
+	short show_log = 0, json = 0, multicast = 0;
+	struct in_addr interface = {INADDR_ANY};
+	char * colon;
 
-	printf("\nServer is connected to: %s at port %u\n", client_ip, client_port);
+	for(arg = 1; arg < argc; arg++) {
+		if(strcmp("--log",argv[arg]) == 0) { 
+			show_log = 1;
+		}
+		else if(strcmp("--json", argv[arg]) == 0) {
+			json = 1;
+		}
+		else if(strcmp("--metrics", argv[arg]) == 0 && arg + 1 < argc) {
+			metrics_port = atoi(argv[++arg]);
+			if(metrics_port <= 0 || metrics_port > 65535) {
+				printf("\nNot a port: %s\n", argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--trace", argv[arg]) == 0 && arg + 1 < argc) {
+			trace = atoi(argv[++arg]);
+			if(trace < TRACE_OFF || trace > TRACE_ALL) {
+				printf("\nThe trace level is %d to %d.\n", TRACE_OFF, TRACE_ALL);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--multicast", argv[arg]) == 0) {
+			multicast = 1;
+			if(arg + 1 < argc && strncmp(argv[arg + 1], "--", 2) != 0 &&
+				inet_pton(AF_INET, argv[++arg], &interface) != 1) {
+				printf("\nNot an IPv4 address: %s\n", argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(strcmp("--port", argv[arg]) == 0 && arg + 1 < argc) {
+			/* downloads are served on the port after it */
+			port = atoi(argv[++arg]);
+		}
+		else if(strcmp("--forward", argv[arg]) == 0 && arg + 1 < argc) {
+			/* address[:port] of the next server of a chain */
+			arg++;
+			downstream.addr.sin_family = AF_INET;
+			downstream.addr.sin_port = htons(PORT);
+			colon = strchr(argv[arg], ':');
+			if(colon != NULL) {
+				*colon = '\0';
+				downstream.addr.sin_port = htons(atoi(colon + 1));
+			}
+			if(inet_pton(AF_INET, argv[arg], &downstream.addr.sin_addr) != 1) {
+				printf("\nNot an IPv4 address: %s\n", argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+			downstream.enabled = 1;
+			/* the next server going away must not take us down with it */
+			signal(SIGPIPE, SIG_IGN);
+		}
+		else if(strcmp("--s3", argv[arg]) == 0 && arg + 1 < argc) {
+			/* files go to a bucket instead of this directory */
+			_configure_bucket(argv[++arg]);
+		}
+		else if(strcmp("--tls", argv[arg]) == 0 && arg + 2 < argc) {
+			/* certificate and key, both PEM */
+#ifdef USE_KTLS
+			_create_tls_context(argv[arg + 1], argv[arg + 2]);
+			arg += 2;
+#else
+			printf("\nfserver was built without kernel TLS, build it with -DUSE_KTLS -lssl -lcrypto.\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+		else {
+			printf("\nUSAGE: ./fserver [--metrics port] [--trace level] [--port port] [--forward address[:port] | --s3 http://address[:port]/bucket] [--tls certificate key] | --multicast [interface address] | --log [--json]\n\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	/* Once connected we first exchange the log files. Received log file 
-	from client is saved as temp.txt */
-	FILE * temp_log = fopen(RECEIVED_LOG, "w+"); /* w+ mode as we need to read too*/
-	if(temp_log == NULL) {
-		printf("File error");
+	if(bucket.enabled && (downstream.enabled || multicast)) {
+		printf("\nFiles going to a bucket can't be forwarded, or taken in from a multicast.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	/* We will first send the size of log file and also receive the logfile size
-	from other side. This will be our protocol to stop receiving once the whole 
-	filesize has been received. 
-	MAJOR BUG HERE: recv in recvlog function was waiting
-	for a data which was already received. And there is no way to tell recv that when
-	to stop waiting for receive without the filesize. */
-
-	/*sending logfile size*/
-	logfile_size = _get_file_size(log_file);
-	sprintf(buffer, "%d", logfile_size);
-	send(connected_client_sock, buffer, sizeof(buffer), 0);
-	
-	/*Recieving log file size of client*/
-	recv(connected_client_sock, buffer, sizeof(buffer), 0);
-	temp_log_file_size = atoi(buffer);
-
-	/*Now sending the log file and also receiving from the client*/
-	sendlog(log_file, connected_client_sock, logfile_size);
-	recvlog(temp_log, connected_client_sock, temp_log_file_size);
-
-	/*Server now syncs the info about file to be uploaded by client.
-	Server gets the information of files waiting to be uploaded in client
-	directory via this function only, by reading and synching with the
-	client log, which was just received.*/
-	_sync_uncommon_files_with_client_log(log_file, temp_log);
-
-	//start receiving from client
-	//first, receive filename and filesize
-	recvd_bytes = recv(connected_client_sock, (struct segment *)&recvd_segment,
-		sizeof(struct segment), 0);
-
-	if(recvd_bytes > 0) {
-		printf("File to be received: %s \n",recvd_segment.filename);
-		printf("Size: %s B \n",recvd_segment.filesize);
-	}	
-
-	// if we haven't received anything yet, the connection might be closed
-	if(recvd_bytes == 0) {
-		printf("\nConnection closed by client.\n");
+	if(show_log) {
+		/*if --log flag is used show logs on STDOUT.*/
+		if(json) printlog_json(shared_log_file);
+		else printlog(shared_log_file);
 		exit(EXIT_SUCCESS);
 	}
-	else if(recvd_bytes < 0) {  /* else if value is negative, there's some error */
-		perror("Receiving file metadata");
-		exit(EXIT_FAILURE);
+	if(metrics_port > 0) {
+		_start_metrics_endpoint(metrics_port);
 	}
-
-	//now start writing the file
-	recvd_file = fopen(recvd_segment.filename, "a");
-	if(recvd_file == NULL) {
-		perror("File Creation");
-		exit(EXIT_FAILURE);
+	if(trace > TRACE_OFF) {
+		_start_trace(trace);
+	}
+	if(multicast) {
+		/* only distributions are taken in, so that several receivers
+		may run on one host */
+		_receive_multicast(&shared_log_file, interface);
 	}
 
-	/* We have received filesize as char buffer from socket.
-		So we convert it to int and store. */
-	filesize = atoi(recvd_segment.filesize);
+	fflush(stdout);  /* We are flushing it so that we can immediately print 
+	on any file, as socket will be buffering anything written to files,
+	 and not print until it gets a connection.*/
 
-	strcpy(filename, recvd_segment.filename); /* just storing for convenience */
+	server_sock = _listen_on(port, BACKLOG);
+	download_sock = _listen_on(port + DOWNLOAD_PORT - PORT, DOWNLOAD_BACKLOG);
+	fcntl(download_sock, F_SETFL, O_NONBLOCK);
 
-	/*variable to decide upto when we have to receive and progress */
-	if(filesize == 0) {
-		printf("\nCouldn't receive data properly. Exiting.\n");
-		exit(EXIT_FAILURE);
+	printf("Server Binded on port %d, downloads on port %d \n", port, port + DOWNLOAD_PORT - PORT);
+	if(bucket.enabled) {
+		printf("Files go to bucket %s at %s\n", bucket.name, bucket.host);
 	}
-	
-	/* these are few variables being used in loop for collecting
-	qunatitative data about transfer and also control the loop*/
-	remaining_file = filesize;
-	unsigned long bytes_transferred = 0;
-	unsigned short percentage = 0;
-
-	server_log initial_log_entry, log_entry;   /* creating instances of 
-	server log for initialising and updating*/
-	/* we now initialise the server_log_entry for the provided file transfer */
+	printf("\nServer is listening for connection ...\n");
+	fflush(stdout);
 
-	long int amount_uploaded = -1; /* it contains the bytes transferred from the 
-	log file in case, this is an re-attempt to upload */
-	short init_result = _initialise_log_entry_for_file(&initial_log_entry, 
-		filename, recvd_segment.filesize, log_file, &amount_uploaded);
+	/* One event loop serves every download. The listening sockets are told
+	apart from the downloads by the pointer kept with their events. */
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd < 0) {
+		perror("epoll");
+		exit(EXIT_FAILURE);
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = &server_sock;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &event);
+	event.data.ptr = &download_sock;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, download_sock, &event);
 
-	if(init_result == REATTEMPT_UPLOAD) { /* If it is an reattempt then we need to
-	make some arrangements*/
-		if(amount_uploaded == -1) {
-			printf("\nSome error ocurred. Exiting.\n");
+	while(1) {
+		event_count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if(event_count < 0) {
+			if(errno == EINTR) continue;
+			perror("epoll");
 			exit(EXIT_FAILURE);
 		}
 
-		bytes_transferred = amount_uploaded;
-		remaining_file = filesize - bytes_transferred;
-
-		server_segment.ack_no = (amount_uploaded/BUFFER_SIZE);
-	}
-
-
-	while(remaining_file > 0 && recvd_bytes > 0) {
-		retry = 3;
-		RTO = 3;
-		while(retry > 0) {   /*we will try resending 3 times in case of failure */
-			recvd_bytes = recv_with_timeout(connected_client_sock, 
-				(struct segment *)&recvd_segment, 
-				sizeof(struct segment), RTO);
+		for(i = 0; i < event_count; i++) {
+			if(events[i].data.ptr == &server_sock) {
+				connected_client_sock = accept(server_sock, 
+					(struct sockaddr *) &client_addr, &size_client_addr);
+				if(connected_client_sock < 0) {
+					perror("Connection");
+					continue;
+				}
 
-			if(recvd_bytes == 0) {
-				printf("\nConnection closed by client.\n");
-				break;
-			}
-			else if(recvd_bytes == -1) {
-				perror("Timeout");
-				exit(EXIT_FAILURE);
-			}
-			else if(recvd_bytes == TIMEOUT_OCCURED) {
-				printf("\nTimeout ocurred. Retrying ...\n");
-				retry--;
-				RTO *= 2; 
+				//getting the ip address and port of client
+				char client_ip[INET_ADDRSTRLEN];
+				inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+				printf("\nServer is connected to: %s at port %u\n", client_ip, 
+					ntohs(client_addr.sin_port));
 
-				/*as the timeout has ocurred we will update the corresponding
-				record in log file*/
-				_update_transfer_progress_in_log(&log_entry, filename, 
-						0, 0, log_file, UPDATE_LOG_TIMEOUT);
-				/* we provide the timeout argument of the function as 1 
-				so that function gets to know only timeout has to be updated */
+				if(pthread_create(&upload_thread, NULL, _upload_thread, 
+					(void *)(long)connected_client_sock) != 0) {
+					perror("Upload thread");
+					close(connected_client_sock);
+					continue;
+				}
+				pthread_detach(upload_thread);
 			}
-			else {  /*else we have got some data */
-				// if the segment received was being expected by the server
-
-				if(recvd_segment.seq_no == server_segment.ack_no) {
-					//seeking the file at right position
-					fseek(recvd_file, ((recvd_segment.seq_no)*BUFFER_SIZE), SEEK_SET);
+			else if(events[i].data.ptr == &download_sock) {
+				while((connected_client_sock = accept4(download_sock, NULL, NULL, 
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					download = calloc(1, sizeof(struct download));
+					download->sock = connected_client_sock;
+					pthread_mutex_lock(&metrics.lock);
+					metrics.downloads_active++;
+					metrics.downloads_total++;
+					pthread_mutex_unlock(&metrics.lock);
+					download->fd = -1;
+					download->state = DOWNLOAD_READING_REQUEST;
+#ifdef USE_KTLS
+					if(tls_context != NULL) {
+						download->ssl = SSL_new(tls_context);
+						SSL_set_app_data(download->ssl, &download->secrets);
+						SSL_set_fd(download->ssl, connected_client_sock);
+						download->state = DOWNLOAD_HANDSHAKE;
+					}
+#endif
 
-					//write to file and increment acknowledgement no.
-					wrote_bytes = fwrite(recvd_segment.buffer, sizeof(char),
-						sizeof(recvd_segment.buffer), recvd_file);
-
-					/* now we want next sequence */
-					server_segment.ack_no = recvd_segment.seq_no + 1;
-					/* current seq is received */
-					server_segment.seq_no = recvd_segment.seq_no; 
-					printf("\nReceived Sequence No: %d", recvd_segment.seq_no);
-
-					//we now calculate how much of file is left to be received
-					remaining_file = remaining_file - wrote_bytes;
-
-					/* as new segment has been written to file, we will update
-					the records in corresponding log file*/
-					//TODO
-					bytes_transferred += wrote_bytes;
-					percentage = (bytes_transferred/(float)filesize)*100;
-					_update_transfer_progress_in_log(&log_entry, filename, 
-						bytes_transferred, percentage, log_file, 
-						UPDATE_LOG_PROGRESS);
+					/* edge triggered: we are told when the socket becomes 
+					readable or writable again after we have hit EAGAIN */
+					event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+					event.data.ptr = download;
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connected_client_sock, &event);
+					if(!_progress_download(download)) {
+						_close_download(epoll_fd, download);
+					}
 				}
-
-				//now send the acknowledgement with proper ack_no
-				if(remaining_file > 0) {
-					send(connected_client_sock, (void *)&server_segment, 
-						sizeof(struct segment), 0);
-					printf("\nSending Acknowledgement no: %d\n",
-						 server_segment.ack_no);	
+			}
+			else {
+				download = (struct download *)events[i].data.ptr;
+				if((events[i].events & (EPOLLERR | EPOLLHUP)) || 
+					!_progress_download(download)) {
+					_close_download(epoll_fd, download);
 				}
-				
-				break; /* now no need to retry for this segment */
 			}
+			fflush(stdout);
 		}
-
-		if(retry == 0) {
-			printf("\nConnection Lost\n");
-			exit(EXIT_FAILURE);
-		}
-
-		
-		printf("\nReceived %d Bytes\n", bytes_transferred);
-	}
-	if(remaining_file <= 0){
-		printf("\nFile received successfully.\n");
-
-		/* update the log record on completion of file transfer */
-		_update_transfer_progress_in_log(&log_entry, filename, 
-						filesize, 100, log_file, UPDATE_LOG_COMPLETED);
-
-		/* now, we also need to remove the file entry from line 2 as the
-		list should contain the files which are not completely received*/
-		_update_file_to_be_received_list(log_file, filename);
 	}
 
-	fclose(recvd_file);
 	close(server_sock);
-	close(connected_client_sock);
-
+	close(download_sock);
 	return 0;
-}
\ No newline at end of file
+}
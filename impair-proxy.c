@@ -0,0 +1,617 @@
+/*------------Impairing proxy for the file sync tool-----------------*/
+/*------------Source code: impair-proxy.c---------------------------*/
+
+/*
+Compile with:
+gcc -o impair-proxy impair-proxy.c -pthread -lm
+
+The proxy sits between fclient and fserver on one host and makes the path
+between them look like a real network: it delays, jitters, loses and
+reorders what passes, and caps the bandwidth. It takes the ports fclient
+connects to, 6060 and 6061, and hands everything to a server run on other
+ports and reached on another loopback address:
+
+./fserver --port 7060
+./impair-proxy [--delay ms] [--jitter ms] [--loss %] [--reorder %]
+	[--rate Mbit/s] [--queue KB] [--seed n] [--to address[:port]]
+./fclient --no-local file
+
+Every impairment applies to each direction on its own, so the rtt is twice
+the delay. Uploads over udp are impaired too: the server opens their
+socket on the address we reach it on, where we find it in /proc/net/udp
+before the server's answer telling its port goes on to the client, and we
+take the same port on the client's side.
+
+Datagrams are really lost and reordered. A tcp connection can't lose or
+reorder bytes, as tcp on either side of us repairs that, so loss is played
+by delaying what was lost as tcp would take to recover it: one rtt for a
+fast retransmit, or a tail loss probe if nothing follows it to show the
+loss. Nor is the congestion window of the endpoints cut on a loss, so tcp
+comes out of a lossy profile better than it would on a real path.
+
+Each connection, or udp port, ends with a line of JSON on stdout counting
+what passed and what was done to it, for bench-impaired.sh.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+
+#define PORT 6060 /* what fclient connects to */
+#define DOWNLOAD_PORT 6061
+#define LISTEN_IP "127.0.0.1"
+#define SERVER_IP "127.0.0.2" /* loopback address the server is reached on */
+#define SERVER_PORT 7060 /* downloads on the port after it, as fserver has them */
+#define CHUNK_SIZE 16384 /* bytes of a tcp connection read at once */
+#define DATAGRAM_SIZE 65536
+#define TCP_PACKET_SIZE 1448 /* payload of a packet on the path, losses are per packet */
+#define TLP_MIN_US 10000 /* shortest wait of tcp's tail loss probe */
+#define DEFAULT_QUEUE_KB 1024 /* bytes the capped link may have waiting to go */
+#define MAX_QUEUED (64 * 1024 * 1024) /* bytes held in one direction at most */
+#define UDP_RELAY_IDLE 10 /* seconds without datagrams after which a udp port is let go */
+#define MAX_UDP_RELAYS 64
+
+struct impairment {
+	long long delay;   /* us, one way */
+	long long jitter;  /* us, what the delay varies by either way */
+	double loss;       /* probability of losing a packet */
+	double reorder;    /* probability of holding a datagram back */
+	double rate;       /* bytes per us, 0 for no cap */
+	long queue;        /* bytes waiting for the capped link, at most */
+	unsigned long long seed;
+};
+
+/* what one direction of a flow has had done to it */
+struct pipe_stats {
+	long bytes, chunks, lost, dropped, reordered;
+};
+
+/* something read and waiting for its time to be sent on */
+struct chunk {
+	struct chunk * next;
+	long long release;  /* us, on the monotonic clock */
+	int length;         /* 0 for the end of a tcp connection */
+	char data[];
+};
+
+/* One direction of a flow. A reader thread stamps what comes in with the
+time it may leave and a writer thread sends it on at that time. When the 
+queue of the capped link is full, a tcp reader stops reading, which slows
+down the sender as a full link would, and datagrams are dropped. */
+struct pipe {
+	int in_fd, out_fd;
+	int udp;
+	struct sockaddr_in * to;  /* where datagrams go if out_fd isn't connected */
+	struct chunk * head, * tail;
+	long queued;
+	long long last_release, link_free;
+	int closed, broken;
+	unsigned long long random;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct pipe_stats stats;
+	struct flow * flow;
+};
+
+/* both directions of a tcp connection or of a udp port */
+struct flow {
+	char kind[4];
+	int port;
+	struct pipe up, down;   /* to the server, and back to the client */
+	struct sockaddr_in client_addr;  /* of a udp flow, once it has sent */
+	int client_known;
+	int pipes_left;
+	pthread_mutex_t lock;
+};
+
+struct impairment impairment = {0, 0, 0, 0, 0, DEFAULT_QUEUE_KB * 1024, 1};
+struct sockaddr_in listen_addr, server_addr;
+int server_port = SERVER_PORT;
+int udp_relays[MAX_UDP_RELAYS];  /* server ports being relayed */
+pthread_mutex_t relays_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long long flow_count = 0;
+
+long long _now_us() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+};
+
+/* xorshift, so that a seed replays the same impairments */
+double _random(struct pipe * pipe) {
+	pipe->random ^= pipe->random << 13;
+	pipe->random ^= pipe->random >> 7;
+	pipe->random ^= pipe->random << 17;
+	return (pipe->random >> 11) * (1.0 / 9007199254740992.0);
+};
+
+long long _jittered_delay(struct pipe * pipe) {
+	long long delay = impairment.delay;
+
+	if(impairment.jitter > 0) {
+		delay += (long long)((_random(pipe) * 2 - 1) * impairment.jitter);
+	}
+	return delay > 0 ? delay : 0;
+};
+
+/* bytes waiting for the capped link */
+long _link_backlog(struct pipe * pipe, long long now) {
+	if(impairment.rate <= 0 || pipe->link_free <= now) return 0;
+	return (long)((pipe->link_free - now) * impairment.rate);
+};
+
+/* when the bytes come out of the link of the capped rate */
+long long _pass_link(struct pipe * pipe, long long now, int length) {
+	long long start = pipe->link_free > now ? pipe->link_free : now;
+
+	if(impairment.rate <= 0) return now;
+	pipe->link_free = start + (long long)(length / impairment.rate);
+	return pipe->link_free;
+};
+
+void _init_pipe(struct pipe * pipe, struct flow * flow, int in_fd, int out_fd, int udp) {
+	pthread_condattr_t attr;
+
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->in_fd = in_fd;
+	pipe->out_fd = out_fd;
+	pipe->udp = udp;
+	pipe->flow = flow;
+	pipe->random = impairment.seed * 2654435761ULL + __atomic_add_fetch(&flow_count, 1, __ATOMIC_RELAXED) * 40503ULL +
+		(pipe == &flow->down);
+	if(pipe->random == 0) pipe->random = 1;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pipe->changed, &attr);
+	pthread_condattr_destroy(&attr);
+};
+
+/* Queues a chunk in order of its release. Tcp chunks never overtake each
+other, datagrams may. */
+void _enqueue(struct pipe * pipe, struct chunk * chunk) {
+	struct chunk ** position = &pipe->head;
+
+	pthread_mutex_lock(&pipe->lock);
+	if(!pipe->udp) {
+		if(chunk->release < pipe->last_release) chunk->release = pipe->last_release;
+		pipe->last_release = chunk->release;
+		position = pipe->tail ? &pipe->tail->next : &pipe->head;
+	}
+	else {
+		while(*position != NULL && (*position)->release <= chunk->release) {
+			position = &(*position)->next;
+		}
+	}
+	chunk->next = *position;
+	*position = chunk;
+	if(chunk->next == NULL) pipe->tail = chunk;
+	pipe->queued += chunk->length;
+	pthread_cond_broadcast(&pipe->changed);
+	pthread_mutex_unlock(&pipe->lock);
+};
+
+struct chunk * _new_chunk(int length) {
+	struct chunk * chunk = (struct chunk *)malloc(sizeof(struct chunk) + length);
+
+	chunk->length = length;
+	chunk->next = NULL;
+	return chunk;
+};
+
+/* prints what a flow had done to it, once both directions have ended */
+void _end_pipe(struct pipe * pipe) {
+	struct flow * flow = pipe->flow;
+	struct pipe_stats * s;
+	int left, i;
+
+	pthread_mutex_lock(&flow->lock);
+	left = --flow->pipes_left;
+	pthread_mutex_unlock(&flow->lock);
+	if(left > 0) return;
+
+	pthread_mutex_lock(&output_lock);
+	printf("{\"flow\": \"%s\", \"port\": %d", flow->kind, flow->port);
+	for(i = 0; i < 2; i++) {
+		s = i ? &flow->down.stats : &flow->up.stats;
+		printf(", \"%s\": {\"bytes\": %ld, \"chunks\": %ld, \"lost\": %ld, "
+			"\"dropped\": %ld, \"reordered\": %ld}", i ? "down" : "up",
+			s->bytes, s->chunks, s->lost, s->dropped, s->reordered);
+	}
+	printf("}\n");
+	fflush(stdout);
+	pthread_mutex_unlock(&output_lock);
+
+	if(flow->up.udp) {
+		pthread_mutex_lock(&relays_lock);
+		for(i = 0; i < MAX_UDP_RELAYS; i++) {
+			if(udp_relays[i] == flow->port) udp_relays[i] = 0;
+		}
+		pthread_mutex_unlock(&relays_lock);
+	}
+	close(flow->up.in_fd);
+	close(flow->up.out_fd);
+	free(flow);
+};
+
+/* sends the chunks of a pipe on as their time comes */
+void * _write_pipe(void * arg) {
+	struct pipe * pipe = (struct pipe *)arg;
+	struct chunk * chunk;
+	struct timespec until;
+	int done = 0, sent;
+
+	while(!done) {
+		pthread_mutex_lock(&pipe->lock);
+		while(1) {
+			chunk = pipe->head;
+			if(chunk == NULL) {
+				if(pipe->closed) break;
+				pthread_cond_wait(&pipe->changed, &pipe->lock);
+				continue;
+			}
+			if(chunk->release <= _now_us()) break;
+			until.tv_sec = chunk->release / 1000000;
+			until.tv_nsec = (chunk->release % 1000000) * 1000;
+			pthread_cond_timedwait(&pipe->changed, &pipe->lock, &until);
+		}
+		if(chunk != NULL) {
+			pipe->head = chunk->next;
+			if(pipe->head == NULL) pipe->tail = NULL;
+			pipe->queued -= chunk->length;
+			pthread_cond_broadcast(&pipe->changed);
+		}
+		pthread_mutex_unlock(&pipe->lock);
+
+		if(chunk == NULL) break;  /* a udp flow which went idle */
+		if(chunk->length == 0) {
+			/* the end of a tcp connection is passed on once the bytes
+			before it are */
+			shutdown(pipe->out_fd, SHUT_WR);
+			done = 1;
+		}
+		else if(pipe->udp) {
+			if(pipe->to != NULL) {
+				sendto(pipe->out_fd, chunk->data, chunk->length, 0,
+					(struct sockaddr *)pipe->to, sizeof(*pipe->to));
+			}
+			else {
+				send(pipe->out_fd, chunk->data, chunk->length, 0);
+			}
+		}
+		else if(!pipe->broken) {
+			for(sent = 0; sent < chunk->length; ) {
+				int n = send(pipe->out_fd, chunk->data + sent, chunk->length - sent, MSG_NOSIGNAL);
+				if(n <= 0) {
+					/* nobody to send to any more, the reader is woken by
+					shutting down what it reads */
+					pipe->broken = 1;
+					shutdown(pipe->in_fd, SHUT_RDWR);
+					break;
+				}
+				sent += n;
+			}
+		}
+		free(chunk);
+	}
+	_end_pipe(pipe);
+	return NULL;
+};
+
+void _scan_udp_sockets();
+
+/* reads a tcp connection, see struct pipe */
+void * _read_tcp_pipe(void * arg) {
+	struct pipe * pipe = (struct pipe *)arg;
+	struct chunk * chunk;
+	long long now, release, rtt = 2 * impairment.delay;
+	int length, packets, waiting;
+
+	long backlog;
+
+	while(1) {
+		backlog = _link_backlog(pipe, _now_us());
+		if(backlog > impairment.queue) {
+			usleep((backlog - impairment.queue) / impairment.rate);
+		}
+		pthread_mutex_lock(&pipe->lock);
+		while(pipe->queued > MAX_QUEUED) {
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+		}
+		pthread_mutex_unlock(&pipe->lock);
+
+		chunk = _new_chunk(CHUNK_SIZE);
+		length = recv(pipe->in_fd, chunk->data, CHUNK_SIZE, 0);
+		if(length <= 0) break;
+		now = _now_us();
+		if(pipe == &pipe->flow->down) {
+			/* the server may have just opened a udp port, which has to be
+			relayed before the client hears of it */
+			_scan_udp_sockets();
+		}
+
+		chunk->length = length;
+		release = _pass_link(pipe, now, length) + _jittered_delay(pipe);
+		packets = (length + TCP_PACKET_SIZE - 1) / TCP_PACKET_SIZE;
+		if(impairment.loss > 0 && _random(pipe) < 1 - pow(1 - impairment.loss, packets)) {
+			/* The sender finds out by the acks of what follows, or by a
+			probe if nothing does */
+			waiting = 0;
+			ioctl(pipe->in_fd, FIONREAD, &waiting);
+			release += rtt;
+			if(waiting == 0) release += (2 * rtt > TLP_MIN_US) ? 2 * rtt : TLP_MIN_US;
+			pipe->stats.lost++;
+		}
+		chunk->release = release;
+		pipe->stats.bytes += length;
+		pipe->stats.chunks++;
+		_enqueue(pipe, chunk);
+	}
+	free(chunk);
+
+	/* the end goes after what was read */
+	chunk = _new_chunk(0);
+	chunk->release = _now_us() + impairment.delay;
+	_enqueue(pipe, chunk);
+	pthread_mutex_lock(&pipe->lock);
+	pipe->closed = 1;
+	pthread_cond_broadcast(&pipe->changed);
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+};
+
+/* reads the datagrams of a udp port, see struct pipe */
+void * _read_udp_pipe(void * arg) {
+	struct pipe * pipe = (struct pipe *)arg;
+	struct flow * flow = pipe->flow;
+	struct pollfd pfd = {pipe->in_fd, POLLIN, 0};
+	struct sockaddr_in from;
+	socklen_t len;
+	struct chunk * chunk = _new_chunk(DATAGRAM_SIZE);
+	long long now, release;
+	int length;
+
+	while(poll(&pfd, 1, UDP_RELAY_IDLE * 1000) > 0) {
+		len = sizeof(from);
+		length = recvfrom(pipe->in_fd, chunk->data, DATAGRAM_SIZE, 0,
+			(struct sockaddr *)&from, &len);
+		if(length < 0) continue;  /* the other side isn't there yet, or any more */
+		now = _now_us();
+		if(pipe == &flow->up && !flow->client_known) {
+			pthread_mutex_lock(&flow->lock);
+			flow->client_addr = from;
+			flow->client_known = 1;
+			pthread_mutex_unlock(&flow->lock);
+		}
+		if(pipe == &flow->down && !flow->client_known) continue;
+
+		pipe->stats.chunks++;
+		pipe->stats.bytes += length;
+		if(_random(pipe) < impairment.loss) {
+			pipe->stats.lost++;
+			continue;
+		}
+		if(_link_backlog(pipe, now) + length > impairment.queue || 
+			pipe->queued + length > MAX_QUEUED) {
+			pipe->stats.dropped++;
+			continue;
+		}
+		release = _pass_link(pipe, now, length) + _jittered_delay(pipe);
+		if(impairment.reorder > 0 && _random(pipe) < impairment.reorder) {
+			/* held back long enough to be overtaken */
+			release += impairment.jitter + 1000;
+			pipe->stats.reordered++;
+		}
+		chunk->length = length;
+		chunk->release = release;
+		_enqueue(pipe, chunk);
+		chunk = _new_chunk(DATAGRAM_SIZE);
+	}
+	free(chunk);
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->closed = 1;
+	pthread_cond_broadcast(&pipe->changed);
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+};
+
+/* runs the threads of both directions of a flow */
+void _start_flow(struct flow * flow, void * (* reader)(void *)) {
+	pthread_t thread;
+	struct pipe * pipes[2] = {&flow->up, &flow->down};
+	int i;
+
+	flow->pipes_left = 2;
+	pthread_mutex_init(&flow->lock, NULL);
+	for(i = 0; i < 2; i++) {
+		pthread_create(&thread, NULL, reader, pipes[i]);
+		pthread_detach(thread);
+		pthread_create(&thread, NULL, _write_pipe, pipes[i]);
+		pthread_detach(thread);
+	}
+};
+
+/* Relays a udp port the server opened: datagrams from the client come to
+the same port on our side, and the server's go back from it. */
+void _relay_udp_port(int port) {
+	struct flow * flow = (struct flow *)calloc(1, sizeof(struct flow));
+	struct sockaddr_in addr = listen_addr, to = server_addr;
+	int client_side = socket(AF_INET, SOCK_DGRAM, 0);
+	int server_side = socket(AF_INET, SOCK_DGRAM, 0);
+	int buffer_size = 4 * 1024 * 1024;
+
+	addr.sin_port = htons(port);
+	to.sin_port = htons(port);
+	if(client_side < 0 || server_side < 0 ||
+		bind(client_side, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		connect(server_side, (struct sockaddr *)&to, sizeof(to)) < 0) {
+		perror("Udp relay");
+		close(client_side);
+		close(server_side);
+		free(flow);
+		return;
+	}
+	setsockopt(client_side, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+	setsockopt(server_side, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+	strcpy(flow->kind, "udp");
+	flow->port = port;
+	_init_pipe(&flow->up, flow, client_side, server_side, 1);
+	_init_pipe(&flow->down, flow, server_side, client_side, 1);
+	flow->down.to = &flow->client_addr;
+	_start_flow(flow, _read_udp_pipe);
+};
+
+/* Looks for udp sockets of the server which aren't relayed yet. fserver
+opens them on the address of the connection they belong to. */
+void _scan_udp_sockets() {
+	FILE * fp = fopen("/proc/net/udp", "r");
+	char line[256];
+	unsigned int address, port;
+	int i, free_slot, known;
+
+	if(fp == NULL) return;
+	pthread_mutex_lock(&relays_lock);
+	while(fgets(line, sizeof(line), fp)) {
+		if(sscanf(line, " %*d: %x:%x", &address, &port) != 2 ||
+			address != server_addr.sin_addr.s_addr) {
+			continue;
+		}
+		known = 0;
+		free_slot = -1;
+		for(i = 0; i < MAX_UDP_RELAYS; i++) {
+			if(udp_relays[i] == (int)port) known = 1;
+			if(udp_relays[i] == 0 && free_slot < 0) free_slot = i;
+		}
+		if(!known && free_slot >= 0) {
+			udp_relays[free_slot] = port;
+			_relay_udp_port(port);
+		}
+	}
+	pthread_mutex_unlock(&relays_lock);
+	fclose(fp);
+};
+
+/* takes the connections of a port and opens one to the server for each */
+void * _accept_flows(void * arg) {
+	int port = (int)(long)arg, listen_sock, client_sock, server_sock, yes = 1;
+	struct sockaddr_in addr = listen_addr, to = server_addr;
+	struct flow * flow;
+
+	addr.sin_port = htons(port);
+	to.sin_port = htons(server_port + port - PORT);
+	listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if(listen_sock < 0 || bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listen_sock, 16) < 0) {
+		perror("Listening");
+		exit(EXIT_FAILURE);
+	}
+
+	while((client_sock = accept(listen_sock, NULL, NULL)) >= 0) {
+		server_sock = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(server_sock, (struct sockaddr *)&to, sizeof(to)) < 0) {
+			perror("Connecting to the server");
+			close(server_sock);
+			close(client_sock);
+			continue;
+		}
+		/* what is due goes out at once, the endpoints do their own nagle */
+		setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		setsockopt(server_sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		flow = (struct flow *)calloc(1, sizeof(struct flow));
+		strcpy(flow->kind, "tcp");
+		flow->port = port;
+		_init_pipe(&flow->up, flow, client_sock, server_sock, 0);
+		_init_pipe(&flow->down, flow, server_sock, client_sock, 0);
+		_start_flow(flow, _read_tcp_pipe);
+	}
+	perror("Accepting");
+	exit(EXIT_FAILURE);
+};
+
+int main(int argc, char * argv[]) {
+	pthread_t thread;
+	char * colon;
+	int arg;
+
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	listen_addr.sin_family = AF_INET;
+	inet_pton(AF_INET, LISTEN_IP, &listen_addr.sin_addr);
+	server_addr = listen_addr;
+	inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+
+	for(arg = 1; arg < argc; arg++) {
+		if(arg + 1 >= argc) {
+			arg = argc;  /* a flag without its value */
+			break;
+		}
+		if(strcmp("--delay", argv[arg]) == 0) {
+			impairment.delay = atof(argv[++arg]) * 1000;
+		}
+		else if(strcmp("--jitter", argv[arg]) == 0) {
+			impairment.jitter = atof(argv[++arg]) * 1000;
+		}
+		else if(strcmp("--loss", argv[arg]) == 0) {
+			impairment.loss = atof(argv[++arg]) / 100;
+		}
+		else if(strcmp("--reorder", argv[arg]) == 0) {
+			impairment.reorder = atof(argv[++arg]) / 100;
+		}
+		else if(strcmp("--rate", argv[arg]) == 0) {
+			impairment.rate = atof(argv[++arg]) / 8;  /* Mbit/s to bytes per us */
+		}
+		else if(strcmp("--queue", argv[arg]) == 0) {
+			impairment.queue = atol(argv[++arg]) * 1024;
+		}
+		else if(strcmp("--seed", argv[arg]) == 0) {
+			impairment.seed = strtoull(argv[++arg], NULL, 10);
+		}
+		else if(strcmp("--to", argv[arg]) == 0) {
+			arg++;
+			colon = strchr(argv[arg], ':');
+			if(colon != NULL) {
+				*colon = '\0';
+				server_port = atoi(colon + 1);
+			}
+			if(inet_pton(AF_INET, argv[arg], &server_addr.sin_addr) != 1) {
+				printf("\nNot an IPv4 address: %s\n", argv[arg]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else break;
+	}
+	if(arg < argc || impairment.loss < 0 || impairment.loss > 1 || impairment.rate < 0 ||
+		impairment.queue <= 0) {
+		printf("\nUSAGE: ./impair-proxy [--delay ms] [--jitter ms] [--loss %%] [--reorder %%] "
+			"[--rate Mbit/s] [--queue KB] [--seed n] [--to address[:port]]\n\n");
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "Proxy on %s:%d and %d to %s:%d and %d, delay %.1f ms, jitter %.1f ms, "
+		"loss %.2f%%, reorder %.2f%%, rate %.0f Mbit/s\n", LISTEN_IP, PORT, DOWNLOAD_PORT,
+		inet_ntoa(server_addr.sin_addr), server_port, server_port + 1,
+		impairment.delay / 1000.0, impairment.jitter / 1000.0, impairment.loss * 100,
+		impairment.reorder * 100, impairment.rate * 8);
+
+	pthread_create(&thread, NULL, _accept_flows, (void *)(long)DOWNLOAD_PORT);
+	pthread_detach(thread);
+	_accept_flows((void *)(long)PORT);
+	return 0;
+};
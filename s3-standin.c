@@ -0,0 +1,796 @@
+/*------------Stand-in object store for the file sync tool-----------*/
+/*------------Source code: s3-standin.c-----------------------------*/
+
+/*
+Compile with:
+gcc -o s3-standin s3-standin.c -pthread
+
+fserver --s3 streams the files it receives into a bucket of an S3
+compatible object store, by multipart uploads. This stands in for such a
+store on one host, for testing: it takes the requests of a multipart 
+upload, checks their signatures against the keys in AWS_ACCESS_KEY_ID and
+AWS_SECRET_ACCESS_KEY, as fserver is given them, and keeps the objects as
+files, under a directory of their bucket:
+
+./s3-standin [--port port] [--dir directory] [--fail-every n] [--page n]
+AWS_ACCESS_KEY_ID=... AWS_SECRET_ACCESS_KEY=... ./fserver --s3 http://127.0.0.1:9000/files
+
+The parts of an unfinished upload are kept in .uploads of the directory.
+--fail-every fails every nth part with an error of the store, which fserver
+has to try again, and --page lists the parts of an upload that many at a
+time instead of a thousand. Every request is printed with its status.
+Only what fserver asks for is served; an object once complete is read as
+the file it is kept in.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define PORT 9000
+#define STORE_DIR "bucket_store"
+#define UPLOADS_DIR ".uploads" /* in the directory, a directory per unfinished upload */
+#define HEADER_SIZE 16384 /* of a request, at most */
+#define MAX_BODY (1024L * 1024 * 1024)
+#define MAX_PARTS 10000
+#define LIST_PAGE 1000 /* parts listed in one answer */
+#define PATH_SIZE 1024
+#define HASH_SIZE 32
+
+/* SHA-256 (FIPS 180-4). Written here so that the tool keeps needing nothing
+but libc and pthreads. */
+typedef struct {
+	unsigned int state[8];
+	unsigned long long bit_count;
+	unsigned char block[64];
+	unsigned int block_used;
+} sha256_ctx;
+
+const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void _sha256_transform(unsigned int * state, const unsigned char * block) {
+	unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	/* expand the 16 big endian words of the block into 64 words */
+	for(i = 0; i < 16; i++) {
+		w[i] = ((unsigned int)block[i * 4] << 24) | (block[i * 4 + 1] << 16) |
+			(block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+	for(i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] + 
+			(ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for(i = 0; i < 64; i++) {
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + 
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + 
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+};
+
+void _sha256_init(sha256_ctx * ctx) {
+	ctx->state[0] = 0x6a09e667; ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372; ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f; ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab; ctx->state[7] = 0x5be0cd19;
+	ctx->bit_count = 0;
+	ctx->block_used = 0;
+};
+
+void _sha256_update(sha256_ctx * ctx, const unsigned char * data, size_t len) {
+	ctx->bit_count += (unsigned long long)len * 8;
+
+	/* fill up a partially filled block first */
+	while(len > 0 && ctx->block_used != 0) {
+		ctx->block[ctx->block_used++] = *data++;
+		len--;
+		if(ctx->block_used == 64) {
+			_sha256_transform(ctx->state, ctx->block);
+			ctx->block_used = 0;
+		}
+	}
+	/* then hash whole blocks straight out of the caller's buffer */
+	while(len >= 64) {
+		_sha256_transform(ctx->state, data);
+		data += 64;
+		len -= 64;
+	}
+	memcpy(ctx->block, data, len);
+	ctx->block_used = len;
+};
+
+void _sha256_final(sha256_ctx * ctx, unsigned char * digest) {
+	unsigned long long bit_count = ctx->bit_count;
+	int i;
+
+	/* pad with a single 1 bit, zeros and the message length in bits */
+	ctx->block[ctx->block_used++] = 0x80;
+	if(ctx->block_used > 56) {
+		memset(ctx->block + ctx->block_used, 0, 64 - ctx->block_used);
+		_sha256_transform(ctx->state, ctx->block);
+		ctx->block_used = 0;
+	}
+	memset(ctx->block + ctx->block_used, 0, 56 - ctx->block_used);
+	for(i = 0; i < 8; i++) {
+		ctx->block[63 - i] = bit_count >> (i * 8);
+	}
+	_sha256_transform(ctx->state, ctx->block);
+
+	for(i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+};
+
+void _sha256(const unsigned char * data, size_t len, unsigned char * digest) {
+	sha256_ctx ctx;
+	_sha256_init(&ctx);
+	_sha256_update(&ctx, data, len);
+	_sha256_final(&ctx, digest);
+};
+
+
+char store_dir[PATH_SIZE / 2] = STORE_DIR;
+char access_key[128], secret_key[128];
+int fail_every = 0, list_page = LIST_PAGE;
+long parts_taken = 0;  /* for --fail-every */
+pthread_mutex_t parts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a request as it came, the path and query still encoded as they were signed */
+struct request {
+	char method[8];
+	char path[PATH_SIZE];
+	char query[PATH_SIZE];
+	char header[HEADER_SIZE + 1];  /* the header lines, from the \r\n ending the request line */
+	unsigned char * body;
+	long length;
+};
+
+void _hmac_sha256(const unsigned char * key, size_t key_length, 
+	const unsigned char * data, size_t length, unsigned char * mac) {
+	unsigned char pad[64], inner[HASH_SIZE];
+	sha256_ctx ctx;
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	if(key_length > sizeof(pad)) _sha256(key, key_length, pad);
+	else memcpy(pad, key, key_length);
+	for(i = 0; i < 64; i++) pad[i] ^= 0x36;
+	_sha256_init(&ctx);
+	_sha256_update(&ctx, pad, sizeof(pad));
+	_sha256_update(&ctx, data, length);
+	_sha256_final(&ctx, inner);
+	for(i = 0; i < 64; i++) pad[i] ^= 0x36 ^ 0x5c;
+	_sha256_init(&ctx);
+	_sha256_update(&ctx, pad, sizeof(pad));
+	_sha256_update(&ctx, inner, HASH_SIZE);
+	_sha256_final(&ctx, mac);
+};
+
+void _to_hex(const unsigned char * data, int length, char * hex) {
+	int i;
+
+	for(i = 0; i < length; i++) sprintf(hex + 2 * i, "%02x", data[i]);
+};
+
+void _uri_encode(const char * string, char * encoded, int keep_slash) {
+	unsigned char c;
+
+	for(; *string; string++) {
+		c = *string;
+		if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+			strchr("-._~", c) != NULL || (keep_slash && c == '/')) {
+			*encoded++ = c;
+		}
+		else {
+			encoded += sprintf(encoded, "%%%02X", c);
+		}
+	}
+	*encoded = '\0';
+};
+
+void _uri_decode(const char * string, char * decoded, int length) {
+	unsigned int c;
+
+	for(; length > 0 && *string; length--) {
+		if(*string == '%' && sscanf(string + 1, "%2x", &c) == 1) {
+			*decoded++ = c;
+			string += 3;
+		}
+		else {
+			*decoded++ = *string++;
+		}
+	}
+	*decoded = '\0';
+};
+
+/* the value of a header, trimmed, "" if the request hasn't got it */
+char * _header_value(struct request * request, const char * name, char * value, int size) {
+	char field[64], * start;
+	int length;
+
+	sprintf(field, "\r\n%s:", name);
+	value[0] = '\0';
+	start = strcasestr(request->header, field);
+	if(start == NULL) return value;
+	for(start += strlen(field); *start == ' ' || *start == '\t'; start++);
+	length = strcspn(start, "\r");
+	while(length > 0 && (start[length - 1] == ' ' || start[length - 1] == '\t')) length--;
+	if(length >= size) length = size - 1;
+	sprintf(value, "%.*s", length, start);
+	return value;
+};
+
+/* the decoded value of a parameter of the query, NULL if it isn't there */
+char * _query_value(struct request * request, const char * name, char * value, int size) {
+	char * parameter = request->query, * end;
+	int length = strlen(name);
+
+	while(*parameter) {
+		end = parameter + strcspn(parameter, "&");
+		if(strncmp(parameter, name, length) == 0 && 
+			(parameter[length] == '=' || parameter + length == end)) {
+			value[0] = '\0';
+			if(parameter[length] == '=') {
+				_uri_decode(parameter + length + 1, value, 
+					(end - parameter - length - 1 < size - 1) ? end - parameter - length - 1 : size - 1);
+			}
+			return value;
+		}
+		parameter = (*end == '&') ? end + 1 : end;
+	}
+	return NULL;
+};
+
+int _compare_strings(const void * a, const void * b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+};
+
+/* the query as it is signed: every parameter encoded and with its =, in 
+the order of their names */
+void _canonical_query(const char * query, char * canonical) {
+	char copy[PATH_SIZE], decoded[PATH_SIZE], * parameters[64], * parameter, * save, * equals;
+	int count = 0, i;
+
+	strcpy(copy, query);
+	for(parameter = strtok_r(copy, "&", &save); parameter != NULL && count < 64;
+		parameter = strtok_r(NULL, "&", &save)) {
+		parameters[count] = (char *)malloc(3 * PATH_SIZE);
+		equals = strchr(parameter, '=');
+		if(equals != NULL) *equals = '\0';
+		_uri_decode(parameter, decoded, PATH_SIZE - 1);
+		_uri_encode(decoded, parameters[count], 0);
+		strcat(parameters[count], "=");
+		if(equals != NULL) {
+			_uri_decode(equals + 1, decoded, PATH_SIZE - 1);
+			_uri_encode(decoded, parameters[count] + strlen(parameters[count]), 0);
+		}
+		count++;
+	}
+	qsort(parameters, count, sizeof(char *), _compare_strings);
+	canonical[0] = '\0';
+	for(i = 0; i < count; i++) {
+		if(i > 0) strcat(canonical, "&");
+		strcat(canonical, parameters[i]);
+		free(parameters[i]);
+	}
+};
+
+/* Checks the signature of a request, by version 4 of AWS's signatures, 
+and that the body is what was signed. Returns the code of the error if it
+doesn't hold, NULL if it does. */
+const char * _check_signature(struct request * request) {
+	char authorization[1024], credential[256], signed_headers[512], signature[2 * HASH_SIZE + 1];
+	char canonical[3 * HEADER_SIZE], query[3 * PATH_SIZE], value[1024], payload_hash[128];
+	char date[32], scope[256], string_to_sign[512], * name, * save, * slash;
+	char secret[160], expected[2 * HASH_SIZE + 1];
+	unsigned char hash[HASH_SIZE], key[HASH_SIZE];
+
+	_header_value(request, "Authorization", authorization, sizeof(authorization));
+	if(sscanf(authorization, "AWS4-HMAC-SHA256 Credential=%255[^,], SignedHeaders=%511[^,], "
+		"Signature=%64s", credential, signed_headers, signature) != 3) {
+		return "AccessDenied";
+	}
+	slash = strchr(credential, '/');
+	if(slash == NULL || (size_t)(slash - credential) != strlen(access_key) || 
+		strncmp(credential, access_key, slash - credential) != 0) {
+		return "InvalidAccessKeyId";
+	}
+	strcpy(scope, slash + 1);
+
+	_header_value(request, "x-amz-content-sha256", payload_hash, sizeof(payload_hash));
+	if(strcmp(payload_hash, "UNSIGNED-PAYLOAD") != 0) {
+		_sha256(request->body, request->length, hash);
+		_to_hex(hash, HASH_SIZE, expected);
+		if(strcmp(expected, payload_hash) != 0) return "XAmzContentSHA256Mismatch";
+	}
+
+	_canonical_query(request->query, query);
+	sprintf(canonical, "%s\n%s\n%s\n", request->method, request->path, query);
+	strcpy(value, signed_headers);
+	for(name = strtok_r(value, ";", &save); name != NULL; name = strtok_r(NULL, ";", &save)) {
+		char header_value[1024];
+		sprintf(canonical + strlen(canonical), "%s:%s\n", name, 
+			_header_value(request, name, header_value, sizeof(header_value)));
+	}
+	sprintf(canonical + strlen(canonical), "\n%s\n%s", signed_headers, payload_hash);
+
+	_header_value(request, "x-amz-date", date, sizeof(date));
+	_sha256((unsigned char *)canonical, strlen(canonical), hash);
+	sprintf(string_to_sign, "AWS4-HMAC-SHA256\n%s\n%s\n", date, scope);
+	_to_hex(hash, HASH_SIZE, string_to_sign + strlen(string_to_sign));
+
+	/* the scope is day/region/service/aws4_request, and the key is derived 
+	along it */
+	sprintf(secret, "AWS4%s", secret_key);
+	strcpy(value, scope);
+	name = strtok_r(value, "/", &save);
+	_hmac_sha256((unsigned char *)secret, strlen(secret), (unsigned char *)name, strlen(name), key);
+	while((name = strtok_r(NULL, "/", &save)) != NULL) {
+		_hmac_sha256(key, HASH_SIZE, (unsigned char *)name, strlen(name), key);
+	}
+	_hmac_sha256(key, HASH_SIZE, (unsigned char *)string_to_sign, strlen(string_to_sign), hash);
+	_to_hex(hash, HASH_SIZE, expected);
+	return strcmp(expected, signature) == 0 ? NULL : "SignatureDoesNotMatch";
+};
+
+/* sends an answer, with Connection: close as the only request of the
+connection is done */
+void _respond(int sock, int status, const char * headers, const char * body) {
+	char header[1024];
+	const char * reason = (status == 200) ? "OK" : (status == 204) ? "No Content" :
+		(status == 400) ? "Bad Request" : (status == 403) ? "Forbidden" : 
+		(status == 404) ? "Not Found" : (status == 500) ? "Internal Server Error" : 
+		"Not Implemented";
+	int length = body ? strlen(body) : 0;
+
+	snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\n%sContent-Length: %d\r\n"
+		"Connection: close\r\n\r\n", status, reason, headers ? headers : "", length);
+	send(sock, header, strlen(header), MSG_NOSIGNAL | MSG_MORE);
+	if(length > 0) send(sock, body, length, MSG_NOSIGNAL);
+};
+
+int _respond_error(int sock, int status, const char * code) {
+	char body[256];
+
+	sprintf(body, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Error><Code>%s</Code></Error>", code);
+	_respond(sock, status, "Content-Type: application/xml\r\n", body);
+	return status;
+};
+
+/* a directory and the directories above it */
+void _make_dirs(const char * path) {
+	char partial[PATH_SIZE], * slash;
+
+	strcpy(partial, path);
+	for(slash = strchr(partial + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(partial, 0755);
+		*slash = '/';
+	}
+	mkdir(partial, 0755);
+};
+
+/* the directory of an upload, if its id is one of ours */
+int _upload_dir(const char * id, char * dir) {
+	if(id == NULL || strlen(id) != 32 || strspn(id, "0123456789abcdef") != 32) return 0;
+	sprintf(dir, "%s/%s/%s", store_dir, UPLOADS_DIR, id);
+	return access(dir, F_OK) == 0;
+};
+
+int _write_file(const char * path, const void * data, long length) {
+	char temp[PATH_SIZE + 8];
+	long written = 0, count;
+	int fd;
+
+	sprintf(temp, "%s.tmp", path);
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) return 0;
+	while(written < length && (count = write(fd, (char *)data + written, length - written)) > 0) {
+		written += count;
+	}
+	close(fd);
+	return written == length && rename(temp, path) == 0;
+};
+
+/* a small file, read whole into value */
+int _read_file(const char * path, char * value, int size) {
+	int fd = open(path, O_RDONLY), length;
+
+	if(fd < 0) return 0;
+	length = read(fd, value, size - 1);
+	close(fd);
+	if(length < 0) return 0;
+	value[length] = '\0';
+	return 1;
+};
+
+int _compare_numbers(const void * a, const void * b) {
+	return *(const int *)a - *(const int *)b;
+};
+
+/* numbers of the parts of an upload, in order */
+int _list_part_numbers(const char * dir, int * numbers) {
+	DIR * listing = opendir(dir);
+	struct dirent * entry;
+	int count = 0;
+
+	if(listing == NULL) return 0;
+	while((entry = readdir(listing)) != NULL && count < MAX_PARTS) {
+		if(strspn(entry->d_name, "0123456789") == strlen(entry->d_name) && entry->d_name[0] != '\0') {
+			numbers[count++] = atoi(entry->d_name);
+		}
+	}
+	closedir(listing);
+	qsort(numbers, count, sizeof(int), _compare_numbers);
+	return count;
+};
+
+/* removes an upload with its parts */
+void _remove_upload(const char * dir) {
+	DIR * listing = opendir(dir);
+	struct dirent * entry;
+	char path[PATH_SIZE + 300];
+
+	if(listing == NULL) return;
+	while((entry = readdir(listing)) != NULL) {
+		if(entry->d_name[0] == '.') continue;
+		sprintf(path, "%s/%s", dir, entry->d_name);
+		unlink(path);
+	}
+	closedir(listing);
+	rmdir(dir);
+};
+
+int _create_upload(int sock, const char * object) {
+	unsigned char random[16];
+	char id[33], dir[PATH_SIZE], path[PATH_SIZE + 8], body[PATH_SIZE + 256];
+	int fd = open("/dev/urandom", O_RDONLY);
+
+	if(fd < 0 || read(fd, random, sizeof(random)) != sizeof(random)) {
+		if(fd >= 0) close(fd);
+		return _respond_error(sock, 500, "InternalError");
+	}
+	close(fd);
+	_to_hex(random, sizeof(random), id);
+	sprintf(dir, "%s/%s/%s", store_dir, UPLOADS_DIR, id);
+	_make_dirs(dir);
+	sprintf(path, "%s/key", dir);
+	if(!_write_file(path, object, strlen(object))) return _respond_error(sock, 500, "InternalError");
+
+	sprintf(body, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<InitiateMultipartUploadResult>"
+		"<UploadId>%s</UploadId></InitiateMultipartUploadResult>", id);
+	_respond(sock, 200, "Content-Type: application/xml\r\n", body);
+	return 200;
+};
+
+int _upload_part(int sock, struct request * request, const char * dir, int number) {
+	char path[PATH_SIZE + 16], etag[2 * HASH_SIZE + 8], header[128];
+	unsigned char hash[HASH_SIZE];
+	int fail;
+
+	if(number < 1 || number > MAX_PARTS) return _respond_error(sock, 400, "InvalidArgument");
+	pthread_mutex_lock(&parts_lock);
+	fail = fail_every > 0 && ++parts_taken % fail_every == 0;
+	pthread_mutex_unlock(&parts_lock);
+	if(fail) return _respond_error(sock, 500, "InternalError");
+
+	/* the etag is kept beside the part, it is listed before the part is */
+	_sha256(request->body, request->length, hash);
+	etag[0] = '"';
+	_to_hex(hash, 16, etag + 1);
+	strcat(etag, "\"");
+	sprintf(path, "%s/%d.etag", dir, number);
+	if(!_write_file(path, etag, strlen(etag))) return _respond_error(sock, 500, "InternalError");
+	sprintf(path, "%s/%d", dir, number);
+	if(!_write_file(path, request->body, request->length)) return _respond_error(sock, 500, "InternalError");
+
+	sprintf(header, "ETag: %s\r\n", etag);
+	_respond(sock, 200, header, NULL);
+	return 200;
+};
+
+int _list_parts(int sock, struct request * request, const char * dir) {
+	static __thread int numbers[MAX_PARTS];
+	char path[PATH_SIZE + 16], etag[128], value[32], * body;
+	int count, i, listed = 0, marker = 0, length;
+	struct stat part;
+
+	if(_query_value(request, "part-number-marker", value, sizeof(value)) != NULL) {
+		marker = atoi(value);
+	}
+	count = _list_part_numbers(dir, numbers);
+	body = (char *)malloc(256 + (long)list_page * 256);
+	length = sprintf(body, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<ListPartsResult>");
+	for(i = 0; i < count && listed < list_page; i++) {
+		if(numbers[i] <= marker) continue;
+		sprintf(path, "%s/%d.etag", dir, numbers[i]);
+		if(!_read_file(path, etag, sizeof(etag))) continue;
+		sprintf(path, "%s/%d", dir, numbers[i]);
+		if(stat(path, &part) < 0) continue;
+		/* the quotes of the etag go escaped, as S3 has them */
+		length += sprintf(body + length, "<Part><PartNumber>%d</PartNumber>"
+			"<ETag>&quot;%.*s&quot;</ETag><Size>%ld</Size></Part>", numbers[i],
+			(int)strlen(etag) - 2, etag + 1, (long)part.st_size);
+		listed++;
+		marker = numbers[i];
+	}
+	for(; i < count && numbers[i] <= marker; i++);
+	length += sprintf(body + length, "<IsTruncated>%s</IsTruncated><NextPartNumberMarker>%d"
+		"</NextPartNumberMarker></ListPartsResult>", i < count ? "true" : "false", marker);
+	_respond(sock, 200, "Content-Type: application/xml\r\n", body);
+	free(body);
+	return 200;
+};
+
+/* Puts the object together from the parts named by the request, in their
+order, after checking their etags and that all but the last are large 
+enough, as S3 does. */
+int _complete_upload(int sock, struct request * request, const char * dir, const char * object) {
+	char path[PATH_SIZE + 16], target[2 * PATH_SIZE], temp[2 * PATH_SIZE + 8], etag[128];
+	char body[PATH_SIZE + 256], * part, * start, * end, * slash;
+	unsigned char buffer[65536];
+	int number, previous = 0, in, out, count, parts = 0;
+	struct stat part_stat;
+
+	request->body[request->length] = '\0';
+	/* every part must be there before anything is written */
+	for(part = strstr((char *)request->body, "<Part>"); part != NULL; part = strstr(part + 1, "<Part>")) {
+		start = strstr(part, "<PartNumber>");
+		number = start ? atoi(start + 12) : 0;
+		start = strstr(part, "<ETag>");
+		end = start ? strstr(start, "</ETag>") : NULL;
+		sprintf(path, "%s/%d.etag", dir, number);
+		if(number <= previous || end == NULL || !_read_file(path, etag, sizeof(etag)) ||
+			strlen(etag) != (size_t)(end - start - 6) || strncmp(etag, start + 6, end - start - 6) != 0) {
+			return _respond_error(sock, 400, "InvalidPart");
+		}
+		sprintf(path, "%s/%d", dir, previous);
+		if(previous > 0 && (stat(path, &part_stat) < 0 || part_stat.st_size < 5 * 1024 * 1024)) {
+			return _respond_error(sock, 400, "EntityTooSmall");
+		}
+		previous = number;
+		parts++;
+	}
+	if(parts == 0) return _respond_error(sock, 400, "MalformedXML");
+
+	sprintf(target, "%s/%s", store_dir, object);
+	slash = strrchr(target, '/');
+	*slash = '\0';
+	_make_dirs(target);
+	*slash = '/';
+	sprintf(temp, "%s.tmp", target);
+	out = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out < 0) return _respond_error(sock, 500, "InternalError");
+	for(part = strstr((char *)request->body, "<Part>"); part != NULL; part = strstr(part + 1, "<Part>")) {
+		sprintf(path, "%s/%d", dir, atoi(strstr(part, "<PartNumber>") + 12));
+		in = open(path, O_RDONLY);
+		while(in >= 0 && (count = read(in, buffer, sizeof(buffer))) > 0) {
+			if(write(out, buffer, count) != count) count = -1;
+		}
+		if(in < 0 || count < 0) {
+			if(in >= 0) close(in);
+			close(out);
+			unlink(temp);
+			return _respond_error(sock, 500, "InternalError");
+		}
+		close(in);
+	}
+	close(out);
+	if(rename(temp, target) < 0) return _respond_error(sock, 500, "InternalError");
+	_remove_upload(dir);
+
+	sprintf(body, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<CompleteMultipartUploadResult>"
+		"<ETag>&quot;%s-%d&quot;</ETag></CompleteMultipartUploadResult>", strrchr(dir, '/') + 1, parts);
+	_respond(sock, 200, "Content-Type: application/xml\r\n", body);
+	return 200;
+};
+
+/* Reads a request, with its body. Returns 0 if there is none, or it's 
+too large for us. */
+int _read_request(int sock, struct request * request) {
+	char * end, target[2 * PATH_SIZE], length[32], * question;
+	long got = 0, count, header_length;
+
+	while((end = strstr(request->header, "\r\n\r\n")) == NULL && got < HEADER_SIZE) {
+		count = recv(sock, request->header + got, HEADER_SIZE - got, 0);
+		if(count <= 0) return 0;
+		got += count;
+		request->header[got] = '\0';
+	}
+	if(end == NULL || sscanf(request->header, "%7s %2047s", request->method, target) != 2) return 0;
+	header_length = end + 4 - request->header;
+
+	question = strchr(target, '?');
+	if(question != NULL) *question = '\0';
+	if(strlen(target) >= PATH_SIZE || (question && strlen(question + 1) >= PATH_SIZE)) return 0;
+	strcpy(request->path, target);
+	strcpy(request->query, question ? question + 1 : "");
+
+	request->length = atol(_header_value(request, "Content-Length", length, sizeof(length)));
+	if(request->length < 0 || request->length > MAX_BODY) return 0;
+	request->body = (unsigned char *)malloc(request->length + 1);
+	count = got - header_length;
+	if(count > request->length) count = request->length;
+	memcpy(request->body, request->header + header_length, count);
+	for(got = count; got < request->length; got += count) {
+		count = recv(sock, request->body + got, request->length - got, 0);
+		if(count <= 0) return 0;
+	}
+	/* the header lines start at the end of the request line */
+	memmove(request->header, strstr(request->header, "\r\n"), 
+		end + 2 - strstr(request->header, "\r\n"));
+	request->header[end + 2 - strstr(request->header, "\r\n")] = '\0';
+	return 1;
+};
+
+/* serves a request about an upload we have */
+int _serve_upload(int sock, struct request * request, const char * dir, const char * object) {
+	char path[PATH_SIZE + 8], key[PATH_SIZE], value[32];
+
+	/* an upload is of one object */
+	sprintf(path, "%s/key", dir);
+	if(!_read_file(path, key, sizeof(key)) || strcmp(key, object) != 0) {
+		return _respond_error(sock, 404, "NoSuchUpload");
+	}
+	if(strcmp(request->method, "PUT") == 0 && 
+		_query_value(request, "partNumber", value, sizeof(value)) != NULL) {
+		return _upload_part(sock, request, dir, atoi(value));
+	}
+	if(strcmp(request->method, "GET") == 0) {
+		return _list_parts(sock, request, dir);
+	}
+	if(strcmp(request->method, "POST") == 0) {
+		return _complete_upload(sock, request, dir, object);
+	}
+	if(strcmp(request->method, "DELETE") == 0) {
+		_remove_upload(dir);
+		_respond(sock, 204, NULL, NULL);
+		return 204;
+	}
+	return _respond_error(sock, 501, "NotImplemented");
+};
+
+/* serves the one request of a connection */
+void * _serve_request(void * arg) {
+	int sock = (int)(long)arg, status;
+	struct request * request = (struct request *)calloc(1, sizeof(struct request));
+	char object[PATH_SIZE], id[64], value[32], dir[PATH_SIZE];
+	const char * error;
+
+	if(!_read_request(sock, request)) {
+		close(sock);
+		free(request->body);
+		free(request);
+		return NULL;
+	}
+
+	/* /bucket/key, kept as bucket/key under the directory */
+	_uri_decode(request->path + 1, object, sizeof(object) - 1);
+	if(request->path[0] != '/' || strchr(object, '/') == NULL || strstr(object, "..") != NULL ||
+		strstr(object, "//") != NULL || object[strlen(object) - 1] == '/' ||
+		strncmp(object, UPLOADS_DIR, strlen(UPLOADS_DIR)) == 0) {
+		status = _respond_error(sock, 400, "InvalidURI");
+	}
+	else if((error = _check_signature(request)) != NULL) {
+		status = _respond_error(sock, 403, error);
+	}
+	else if(strcmp(request->method, "POST") == 0 && 
+		_query_value(request, "uploads", value, sizeof(value)) != NULL) {
+		status = _create_upload(sock, object);
+	}
+	else if(_query_value(request, "uploadId", id, sizeof(id)) == NULL) {
+		status = _respond_error(sock, 501, "NotImplemented");
+	}
+	else if(!_upload_dir(id, dir)) {
+		status = _respond_error(sock, 404, "NoSuchUpload");
+	}
+	else {
+		status = _serve_upload(sock, request, dir, object);
+	}
+	printf("%s %s%s%s %d\n", request->method, request->path, request->query[0] ? "?" : "", 
+		request->query, status);
+	fflush(stdout);
+
+	close(sock);
+	free(request->body);
+	free(request);
+	return NULL;
+};
+
+int main(int argc, char * argv[]) {
+	struct sockaddr_in addr;
+	pthread_t thread;
+	char * access = getenv("AWS_ACCESS_KEY_ID"), * secret = getenv("AWS_SECRET_ACCESS_KEY");
+	int port = PORT, sock, client, arg, on = 1;
+
+	for(arg = 1; arg + 1 < argc; arg++) {
+		if(strcmp("--port", argv[arg]) == 0) {
+			port = atoi(argv[++arg]);
+		}
+		else if(strcmp("--dir", argv[arg]) == 0) {
+			snprintf(store_dir, sizeof(store_dir), "%s", argv[++arg]);
+		}
+		else if(strcmp("--fail-every", argv[arg]) == 0) {
+			fail_every = atoi(argv[++arg]);
+		}
+		else if(strcmp("--page", argv[arg]) == 0) {
+			list_page = atoi(argv[++arg]);
+		}
+		else break;
+	}
+	if(arg < argc || list_page < 1 || list_page > LIST_PAGE) {
+		printf("\nUSAGE: ./s3-standin [--port port] [--dir directory] [--fail-every n] [--page n]\n\n");
+		exit(EXIT_FAILURE);
+	}
+	if(access == NULL || secret == NULL || strlen(access) >= sizeof(access_key) || 
+		strlen(secret) >= sizeof(secret_key)) {
+		printf("\nThe keys are taken from AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY.\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(access_key, access);
+	strcpy(secret_key, secret);
+	_make_dirs(store_dir);
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+		perror("Listening");
+		exit(EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	printf("Store on port %d, buckets in %s\n", port, store_dir);
+	fflush(stdout);
+
+	while(1) {
+		client = accept(sock, NULL, NULL);
+		if(client < 0) continue;
+		if(pthread_create(&thread, NULL, _serve_request, (void *)(long)client) != 0) {
+			close(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return 0;
+};
@@ -0,0 +1,75 @@
+#!/bin/bash
+# Runs a swarm of N peers fetching one file over the loopback interface,
+# each peer in a directory of its own, and tells how long it took and how
+# much of it the server sent. Without the swarm the server would send N
+# times the file.
+#
+# usage: ./swarm-harness.sh [peers] [size in MB] [timeout in seconds]
+
+PEERS=${1:-8}
+SIZE_MB=${2:-32}
+TIMEOUT=${3:-300}
+
+DIR=$(mktemp -d)
+SRC=$(cd "$(dirname "$0")" && pwd)
+PIDS=
+
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+mkdir -p "$DIR/seed" "$DIR/server"
+gcc -O2 -o "$DIR/server/fserver" "$SRC/file-server.c" -pthread || exit 1
+gcc -O2 -o "$DIR/fclient" "$SRC/file-client.c" -pthread || exit 1
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$DIR/seed/swarm.bin"
+
+(cd "$DIR/server" && exec ./fserver > /dev/null 2>&1) &
+PIDS=$!
+sleep 0.3
+if ! (cd "$DIR/seed" && timeout $TIMEOUT "$DIR/fclient" swarm.bin > /dev/null 2>&1) ||
+	! cmp -s "$DIR/seed/swarm.bin" "$DIR/server/swarm.bin"; then
+	echo "Couldn't upload the file to the server."
+	exit 1
+fi
+
+# the peers stay in the swarm once done, so that the others can still use them
+start=$(date +%s%N)
+for i in $(seq 1 $PEERS); do
+	mkdir -p "$DIR/peer$i"
+	(cd "$DIR/peer$i" && exec "$DIR/fclient" --swarm --seed swarm.bin > out.txt 2>&1) &
+	PIDS="$PIDS $!"
+done
+
+deadline=$(($(date +%s) + TIMEOUT))
+while [ $(grep -l "receiving Completed" "$DIR"/peer*/out.txt 2>/dev/null | wc -l) -lt $PEERS ]; do
+	if [ $(date +%s) -ge $deadline ]; then
+		echo "Not every peer got the file within $TIMEOUT s."
+		exit 1
+	fi
+	sleep 0.1
+done
+end=$(date +%s%N)
+
+failed=0
+for i in $(seq 1 $PEERS); do
+	cmp -s "$DIR/seed/swarm.bin" "$DIR/peer$i/swarm.bin" || failed=$((failed + 1))
+done
+from_server=$(sed -n 's/.* \([0-9]*\) Bytes from the server.*/\1/p' "$DIR"/peer*/out.txt |
+	awk '{ s += $1 } END { print s }')
+from_peers=$(sed -n 's/.*, \([0-9]*\) from peers.*/\1/p' "$DIR"/peer*/out.txt |
+	awk '{ s += $1 } END { print s }')
+
+awk -v ns=$((end - start)) -v n=$PEERS -v mb=$SIZE_MB -v server=$from_server \
+	-v peers=$from_peers 'BEGIN {
+	s = ns / 1e9
+	printf "%d peers got %d MB each in %.2f s, %.2f MB/s in all\n", n, mb, s, n * mb / s
+	printf "server sent %.2f MB (%.2f times the file), peers sent each other %.2f MB\n",
+		server / 1048576, server / (mb * 1048576), peers / 1048576
+}'
+if [ $failed -gt 0 ]; then
+	echo "$failed peers got a file which differs."
+	exit 1
+fi
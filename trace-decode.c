@@ -0,0 +1,235 @@
+/*------------Decoder of the traces of the file sync tool------------*/
+/*------------Source code: trace-decode.c----------------------------*/
+
+/*
+Compile with:
+gcc -o trace-decode trace-decode.c
+
+fserver and fclient write a trace when run with --trace <level>, to
+fserver_trace and fclient_trace in their directories. This renders the
+records of one or more traces as text, merged in the order they were
+recorded, so that the trace of a client and of its server can be read
+side by side:
+
+./trace-decode [--summary] [--event name] trace ...
+
+--event keeps only the events of that name, --summary only counts the events
+of every trace. The traces describe their own events, so a decoder doesn't
+have to be built for a given version of the programs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAGIC "FTRACE1"
+#define TRACE_MAX_EVENTS 16
+#define TRACE_NAME_SIZE 24
+#define MAX_TRACES 16
+#define SAME_CLOCK_US 2000 /* error of the start of a trace timed by another's clock,
+up to which both are taken to share the tsc */
+
+/* as fserver and fclient write them */
+struct trace_record {
+	unsigned long long tsc;
+	int event;
+	int thread;
+	long a, b;
+};
+
+struct trace_event {
+	int level;
+	char name[TRACE_NAME_SIZE];
+	char a[TRACE_NAME_SIZE], b[TRACE_NAME_SIZE];
+};
+
+struct trace_header {
+	char magic[8];
+	double tsc_per_us;
+	unsigned long long start_tsc;
+	long long start_time;
+	int ring_size, ring_count, event_count;
+	struct trace_event events[TRACE_MAX_EVENTS];
+};
+
+struct trace_ring {
+	unsigned long long head;
+	int thread;
+	int in_use;
+	char padding[48];
+	/* followed by ring_size records */
+};
+
+struct trace {
+	char * name;  /* of the file, which tells the records of traces apart */
+	struct trace_header header;
+	long counts[TRACE_MAX_EVENTS];
+	struct trace * clock;  /* trace whose calibration of the tsc is used */
+};
+
+/* a record with the trace it belongs to and its time */
+struct decoded_record {
+	struct trace_record record;
+	struct trace * trace;
+	long long time;  /* us since the epoch */
+};
+
+struct decoded_record * decoded = NULL;
+long decoded_count = 0, decoded_capacity = 0;
+
+/* Reads the records still in the rings of a trace. A ring holds the last
+ring_size records of its thread, in the order they were written from head. */
+int _read_trace(struct trace * trace) {
+	FILE * fp = fopen(trace->name, "r");
+	struct trace_ring ring;
+	struct trace_record * records;
+	unsigned long long first, i;
+	int r;
+
+	if(fp == NULL) {
+		perror(trace->name);
+		return 0;
+	}
+	if(fread(&trace->header, sizeof(trace->header), 1, fp) != 1 ||
+		memcmp(trace->header.magic, TRACE_MAGIC, sizeof(trace->header.magic)) != 0 ||
+		trace->header.event_count > TRACE_MAX_EVENTS || trace->header.ring_size <= 0) {
+		printf("%s isn't a trace.\n", trace->name);
+		fclose(fp);
+		return 0;
+	}
+
+	records = (struct trace_record *)malloc(trace->header.ring_size * sizeof(struct trace_record));
+	for(r = 0; r < trace->header.ring_count; r++) {
+		if(fread(&ring, sizeof(ring), 1, fp) != 1 ||
+			fread(records, sizeof(struct trace_record), trace->header.ring_size, fp) !=
+			(size_t)trace->header.ring_size) {
+			/* the process was killed before it could close the trace */
+			break;
+		}
+		first = (ring.head > (unsigned long long)trace->header.ring_size) ?
+			ring.head - trace->header.ring_size : 0;
+		for(i = first; i < ring.head; i++) {
+			struct trace_record * record = &records[i % trace->header.ring_size];
+
+			if(record->event < 0 || record->event >= trace->header.event_count) continue;
+			if(decoded_count == decoded_capacity) {
+				decoded_capacity = decoded_capacity ? decoded_capacity * 2 : 65536;
+				decoded = (struct decoded_record *)realloc(decoded,
+					decoded_capacity * sizeof(struct decoded_record));
+			}
+			decoded[decoded_count].record = *record;
+			decoded[decoded_count].trace = trace;
+			decoded_count++;
+			trace->counts[record->event]++;
+		}
+	}
+	free(records);
+	fclose(fp);
+	return 1;
+};
+
+/* what the clock of a trace makes of a tsc */
+long long _tsc_to_time(struct trace * clock, unsigned long long tsc) {
+	return clock->header.start_time + (long long)(((double)tsc - clock->header.start_tsc) /
+		clock->header.tsc_per_us);
+};
+
+/* Every process measures how fast the tsc runs on its own, and the small
+errors of that add up over a trace. Traces of one host share the counter,
+so they are all timed by the calibration of the first of them, which keeps
+what they recorded in the order it happened. */
+void _share_clocks(struct trace * traces, int trace_count) {
+	int i, j;
+
+	for(i = 0; i < trace_count; i++) {
+		traces[i].clock = &traces[i];
+		for(j = 0; j < i; j++) {
+			if(traces[j].clock == &traces[j] &&
+				llabs(_tsc_to_time(&traces[j], traces[i].header.start_tsc) - 
+				traces[i].header.start_time) < SAME_CLOCK_US) {
+				traces[i].clock = &traces[j];
+				break;
+			}
+		}
+	}
+};
+
+int _compare_records(const void * first, const void * second) {
+	const struct decoded_record * a = first, * b = second;
+
+	if(a->time != b->time) return a->time < b->time ? -1 : 1;
+	if(a->record.tsc != b->record.tsc) return a->record.tsc < b->record.tsc ? -1 : 1;
+	return 0;
+};
+
+void _print_record(struct decoded_record * decoded_record, long long previous) {
+	struct trace_event * event = &decoded_record->trace->header.events[decoded_record->record.event];
+	time_t seconds = decoded_record->time / 1000000;
+	char clock[16];
+
+	strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&seconds));
+	printf("%s.%06lld %+9lldus %-16s %7d  %-18s", clock, decoded_record->time % 1000000,
+		decoded_record->time - previous, decoded_record->trace->name,
+		decoded_record->record.thread, event->name);
+	if(event->a[0]) printf(" %s=%ld", event->a, decoded_record->record.a);
+	if(event->b[0]) printf(" %s=%ld", event->b, decoded_record->record.b);
+	printf("\n");
+};
+
+int main(int argc, char * argv[]) {
+	struct trace traces[MAX_TRACES];
+	int trace_count = 0, summary = 0, arg, i, e;
+	char * only = NULL;
+	long long previous;
+	long n;
+
+	memset(traces, 0, sizeof(traces));
+	for(arg = 1; arg < argc; arg++) {
+		if(strcmp("--summary", argv[arg]) == 0) {
+			summary = 1;
+		}
+		else if(strcmp("--event", argv[arg]) == 0 && arg + 1 < argc) {
+			only = argv[++arg];
+		}
+		else if(trace_count < MAX_TRACES) {
+			traces[trace_count++].name = argv[arg];
+		}
+	}
+	if(trace_count == 0) {
+		printf("\nUSAGE: ./trace-decode [--summary] [--event name] trace ...\n\n");
+		exit(EXIT_SUCCESS);
+	}
+
+	for(i = 0; i < trace_count; i++) {
+		if(!_read_trace(&traces[i])) exit(EXIT_FAILURE);
+	}
+	_share_clocks(traces, trace_count);
+	for(n = 0; n < decoded_count; n++) {
+		decoded[n].time = _tsc_to_time(decoded[n].trace->clock, decoded[n].record.tsc);
+	}
+
+	if(summary) {
+		for(i = 0; i < trace_count; i++) {
+			printf("%s: %d thread(s), %.0f tsc ticks per us\n", traces[i].name,
+				traces[i].header.ring_count, traces[i].header.tsc_per_us);
+			for(e = 0; e < traces[i].header.event_count; e++) {
+				printf("  %-18s %ld\n", traces[i].header.events[e].name, traces[i].counts[e]);
+			}
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	qsort(decoded, decoded_count, sizeof(struct decoded_record), _compare_records);
+	previous = decoded_count > 0 ? decoded[0].time : 0;
+	for(n = 0; n < decoded_count; n++) {
+		if(only != NULL && strcmp(only,
+			decoded[n].trace->header.events[decoded[n].record.event].name) != 0) {
+			continue;
+		}
+		_print_record(&decoded[n], previous);
+		previous = decoded[n].time;
+	}
+	free(decoded);
+	return 0;
+};